@@ -3,6 +3,7 @@
 
 #include "agent/conconn.hh"
 #include "io/stream.hh"
+#include "share/localsock.hh"
 #include "socket.hh"
 #include "sync/injectee.hh"
 #include "utils/log.hh"
@@ -30,6 +31,10 @@ public:
 
   virtual fat_bool_t uninstall_agent_platform();
 
+  virtual fat_bool_t on_connected();
+
+  virtual void on_lpc_flags_read();
+
   fat_bool_t connect(blob_t data_in, blob_t data_out, int *last_error_out);
 
   static WindowsConsoleAgent *get() { return instance_; }
@@ -44,10 +49,21 @@ private:
   lpc::PatchingInterceptor interceptor_;
   lpc::PatchingInterceptor *interceptor() { return &interceptor_; }
 
+  // Opens the pipes and shared memory the launcher created for us.
+  fat_bool_t connect_pipes(connect_data_t *connect_data, int *last_error_out);
+
+  // Connects to the backend daemon given in the connect data.
+  fat_bool_t connect_daemon(connect_data_t *connect_data);
+
   def_ref_t<InStream> agent_in_;
-  InStream *agent_in() { return *agent_in_; }
   def_ref_t<OutStream> agent_out_;
-  OutStream *agent_out() { return *agent_out_; }
+  // The connection to the backend daemon if there is one, in which case it's
+  // used in place of the pipes.
+  def_ref_t<InOutStream> daemon_;
+  InStream *agent_in() { return daemon_.is_null() ? *agent_in_ : *daemon_; }
+  OutStream *agent_out() { return daemon_.is_null() ? *agent_out_ : *daemon_; }
+
+  SharedRingTransport shared_transport_;
 
   static WindowsConsoleAgent *instance() { return instance_; }
   static WindowsConsoleAgent *instance_;
@@ -80,6 +96,12 @@ fat_bool_t WindowsConsoleAgent::install_agent_platform() {
   return interceptor()->install();
 }
 
+void WindowsConsoleAgent::on_lpc_flags_read() {
+  // Whether unknown messages can be rejected early depends on the flags so
+  // this has to follow them when they're re-read after installing.
+  interceptor()->set_fast_reject(!wants_unknown_messages());
+}
+
 fat_bool_t WindowsConsoleAgent::uninstall_agent_platform() {
   return interceptor()->uninstall();
 }
@@ -93,6 +115,52 @@ fat_bool_t WindowsConsoleAgent::connect(blob_t data_in, blob_t data_out,
   if (connect_data->magic != kConnectDataMagic)
     return F_FALSE;
 
+  if (connect_data->daemon_address[0] != '\0') {
+    F_TRY(connect_daemon(connect_data));
+  } else {
+    F_TRY(connect_pipes(connect_data, last_error_out));
+  }
+
+  options()->read_all();
+  platform_ = ConsolePlatform::new_native();
+  // The adaptor has to be there as soon as the patches are but it only gets
+  // a connector once we've connected to the owner, see on_connected.
+  adaptor_ = new (kDefaultAlloc) ConsoleAdaptor(NULL);
+  set_lazy_connect((connect_data->flags & connect_data_t::cfLazyConnect) != 0);
+  return install_agent(agent_in(), agent_out(), *platform_);
+}
+
+fat_bool_t WindowsConsoleAgent::on_connected() {
+  PrpcConsoleConnector *connector = new (kDefaultAlloc) PrpcConsoleConnector(
+      owner()->socket(), owner()->input());
+  connector_ = connector;
+  if (!options()->multiplex()) {
+    // The log ships entries through the same connection from a thread of its
+    // own.
+    connector->share_socket(owner_mutex());
+    connector->set_transport(transport());
+  }
+  F_TRY(connector->configure(options(), multiplexer()));
+  if (use_fast_path())
+    connector->enable_fast_path();
+  if (use_numeric_selectors())
+    connector->enable_numeric_selectors();
+  if (write_credits() > 0)
+    F_TRY(connector->enable_write_credits(write_credits()));
+  if (use_write_streaming())
+    connector->enable_write_streaming(options()->stream_chunk_bytes());
+  if (use_utf8_wire())
+    connector->enable_utf8_wire();
+  if (use_compact_values())
+    connector->enable_compact_values();
+  adaptor()->set_connector(connector);
+  if (transport() != NULL)
+    adaptor()->set_state_page(transport()->state_page());
+  return F_TRUE;
+}
+
+fat_bool_t WindowsConsoleAgent::connect_pipes(connect_data_t *connect_data,
+    int *last_error_out) {
   // Create a connection to the parent process so we can pass back error and
   // status messages.
   handle_t parent_process = OpenProcess(PROCESS_DUP_HANDLE, false,
@@ -118,14 +186,33 @@ fat_bool_t WindowsConsoleAgent::connect(blob_t data_in, blob_t data_out,
   }
   agent_out_ = tclib::InOutStream::from_raw_handle(agent_out_handle);
 
-  platform_ = ConsolePlatform::new_native();
-  F_TRY(install_agent(agent_in(), agent_out(), *platform_));
+  // The shared memory is an optimization so if it can't be opened we just
+  // carry on without it.
+  if (connect_data->shared_memory_size > 0) {
+    // Don't trust the name to be terminated.
+    connect_data->shared_memory_name[sizeof(connect_data->shared_memory_name) - 1] = '\0';
+    if (shared_transport_.open(connect_data->shared_memory_name,
+        connect_data->shared_memory_size)) {
+      set_transport(&shared_transport_);
+    } else {
+      WARN("Failed to open shared memory; using pipes only");
+    }
+  }
 
-  connector_ = PrpcConsoleConnector::create(owner()->socket(), owner()->input());
-  adaptor_ = new (kDefaultAlloc) ConsoleAdaptor(*connector_);
   return F_TRUE;
 }
 
+fat_bool_t WindowsConsoleAgent::connect_daemon(connect_data_t *connect_data) {
+  // Don't trust the address to be terminated.
+  connect_data->daemon_address[sizeof(connect_data->daemon_address) - 1] = '\0';
+  daemon_hello_t hello;
+  struct_zero_fill(hello);
+  hello.magic = daemon_hello_t::kMagic;
+  hello.session_id = connect_data->session_id;
+  return LocalSocket::connect(connect_data->daemon_address,
+      tclib::Blob(&hello, sizeof(hello)), &daemon_);
+}
+
 bool APIENTRY DllMain(module_t module, dword_t reason, void *) {
   switch (reason) {
     case DLL_PROCESS_ATTACH:
@@ -3,6 +3,7 @@
 
 #include "agent.hh"
 #include "agent/conconn.hh"
+#include "agent/logbuf.hh"
 #include "async/promise-inl.hh"
 #include "binpatch.hh"
 #include "confront.hh"
@@ -11,16 +12,18 @@
 #include "utils/log.hh"
 
 BEGIN_C_INCLUDES
+#include "utils/log.h"
 #include "utils/string-inl.h"
 END_C_INCLUDES
 
+#include <string.h>
+
 using namespace conprx;
 using namespace plankton;
 using namespace tclib;
 
-// Set to true to make the message handler print any messages it doesn't
-// understand.
-static const bool kDumpUnknownMessages = false;
+// Set to true to make the message handler suspend on messages it doesn't
+// understand. Dumping them is controlled by the DumpUnknownLpcs option.
 static const bool kSuspendOnUnknownConsoleMessages = false;
 static const bool kSuspendOnUnknownOtherMessages = false;
 
@@ -54,20 +57,211 @@ void LogEntry::init(plankton::Seed payload, plankton::Factory *factory) {
       new_c_string(timestamp));
 }
 
+// Returns a number that orders log levels by severity.
+static int log_level_rank(log_level_t level) {
+  switch (level) {
+    case llInfo: return 1;
+    case llWarning: return 2;
+    case llError: return 3;
+    case llFatal: return 4;
+    default: return 0;
+  }
+}
+
+StreamingLog::StreamingLog()
+  : out_(NULL)
+  , multiplexer_(NULL)
+  , out_mutex_(NULL)
+  , use_compact_values_(false)
+  , min_level_(llInfo)
+  , is_shipping_(false)
+  , is_stopping_(false)
+  , use_batches_(false)
+  , has_work_(Drawbridge::dsRaised)
+  , shipper_(new_callback(&StreamingLog::run_shipping, this))
+  , has_sent_(false) { }
+
+StreamingLog::~StreamingLog() {
+  F_LOG_FALSE(stop_shipping());
+}
+
 fat_bool_t StreamingLog::record(log_entry_t *entry) {
+  // Filtering here means entries the owner doesn't want cost a comparison,
+  // not a copy and a message.
+  int rank = log_level_rank(entry->level);
+  if (rank >= log_level_rank(min_level_)) {
+    buffer_.append(entry, LogBuffer::now_nanos());
+    if (rank >= log_level_rank(llWarning) || buffer_.pending_count() >= kBatchSize)
+      flush();
+  }
+  return propagate(entry);
+}
+
+fat_bool_t StreamingLog::start_shipping(bool use_batches) {
+  use_batches_ = use_batches;
+  F_TRY(F_BOOL(has_work_.initialize()));
+  F_TRY(F_BOOL(shipper_.start()));
+  is_shipping_ = true;
+  return F_TRUE;
+}
+
+void StreamingLog::flush() {
+  if (is_shipping_)
+    has_work_.lower();
+}
+
+fat_bool_t StreamingLog::stop_shipping() {
+  if (!is_shipping_)
+    return F_TRUE;
+  is_stopping_ = true;
+  has_work_.lower();
+  opaque_t result = o0();
+  F_TRY(F_BOOL(shipper_.join(&result)));
+  is_shipping_ = false;
+  return o2f(result);
+}
+
+opaque_t StreamingLog::run_shipping() {
+  while (true) {
+    // Raise before shipping such that entries that become ready after we've
+    // looked lower it again and we don't miss them.
+    has_work_.raise();
+    ship_ready();
+    if (is_stopping_)
+      break;
+    has_work_.pass();
+  }
+  // Multiplexed requests have already been waited for. Otherwise whoever
+  // holds the mutex may be reading responses too so this holds it while it
+  // checks and reads.
+  fat_bool_t result = F_TRUE;
+  if (multiplexer_ == NULL) {
+    out_mutex_->lock();
+    while (has_sent_ && !last_sent_->is_settled()) {
+      result = out_->input()->process_next_instruction(NULL);
+      if (!result)
+        break;
+    }
+    out_mutex_->unlock();
+  }
+  return f2o(result);
+}
+
+void StreamingLog::ship_ready() {
+  // Failing to ship can't be logged without ending up back in record so the
+  // entries are left for the next round to try again.
+  if (!buffer_.try_begin_drain())
+    return;
+  if (use_batches_) {
+    ship_batch();
+  } else {
+    ship_singly();
+  }
+  buffer_.end_drain();
+}
+
+void StreamingLog::ship_batch() {
+  size_t count = buffer_.ready_count();
+  uint64_t dropped = buffer_.take_dropped_count();
+  if (count == 0 && dropped == 0)
+    return;
+  size_t size = CompactLogBatch::kHeaderSize;
+  CompactLogBatch::entry_t entry;
+  for (size_t i = 0; i < count; i++) {
+    buffer_.peek(i, &entry);
+    size += CompactLogBatch::entry_size(&entry);
+  }
+  tclib::Blob encoded = allocator_default_malloc(size);
+  if (encoded.start() == NULL) {
+    // Give up on these rather than let them block the buffer.
+    buffer_.release(count);
+    return;
+  }
+  CompactWriter writer(static_cast<uint8_t*>(encoded.start()));
+  CompactLogBatch::write_header(static_cast<uint32_t>(count), dropped, &writer);
+  for (size_t i = 0; i < count; i++) {
+    buffer_.peek(i, &entry);
+    CompactLogBatch::write_entry(&entry, &writer);
+  }
+  buffer_.release(count);
+  Variant batch = Variant::blob(encoded.start(), static_cast<uint32_t>(size));
+  rpc::OutgoingRequest req(Variant::null(), "log_batch", 1, &batch);
+  send_without_waiting(&req);
+  allocator_default_free(encoded);
+}
+
+void StreamingLog::ship_singly() {
+  size_t count = buffer_.ready_count();
+  char timestamp[CompactLogBatch::kMaxTimestampSize];
+  CompactLogBatch::entry_t entry;
+  for (size_t i = 0; i < count; i++) {
+    buffer_.peek(i, &entry);
+    CompactLogBatch::format_timestamp(entry.timestamp_nanos, timestamp,
+        sizeof(timestamp));
+    log_entry_t raw;
+    log_entry_default_init(&raw, entry.level, entry.file, entry.line,
+        new_string(entry.message, entry.message_size), new_c_string(timestamp));
+    send_entry(&raw);
+  }
+  buffer_.release(count);
+  // Owners that don't understand batches have nowhere to put the drop count
+  // so it's reported as an entry of its own.
+  uint64_t dropped = buffer_.take_dropped_count();
+  if (dropped > 0) {
+    static const char kPrefix[] = "Log entries dropped: ";
+    char message[sizeof(kPrefix) + 20];
+    memcpy(message, kPrefix, sizeof(kPrefix) - 1);
+    size_t length = sizeof(kPrefix) - 1;
+    char digits[20];
+    size_t digit_count = 0;
+    do {
+      digits[digit_count++] = static_cast<char>('0' + (dropped % 10));
+      dropped /= 10;
+    } while (dropped > 0);
+    while (digit_count > 0)
+      message[length++] = digits[--digit_count];
+    log_entry_t raw;
+    log_entry_default_init(&raw, llWarning, __FILE__, __LINE__,
+        new_string(message, length), string_empty());
+    send_entry(&raw);
+  }
+}
+
+void StreamingLog::send_entry(log_entry_t *entry) {
   LogEntry entry_data(entry);
-  NativeVariant entry_var(&entry_data);
+  WireValue<LogEntry> entry_wire(&entry_data, use_compact_values_);
+  Variant entry_var = entry_wire.variant();
   rpc::OutgoingRequest req(Variant::null(), "log", 1, &entry_var);
-  rpc::IncomingResponse resp = out_->socket()->send_request(&req);
-  while (!resp->is_settled())
-    out_->input()->process_next_instruction(NULL);
-  return propagate(entry);
+  send_without_waiting(&req);
+}
+
+void StreamingLog::send_without_waiting(rpc::OutgoingRequest *request) {
+  if (multiplexer_ == NULL) {
+    out_mutex_->lock();
+    last_sent_ = out_->socket()->send_request(request);
+    has_sent_ = true;
+    out_mutex_->unlock();
+  } else if (multiplexer_->send(request, rlBulk, &last_sent_)) {
+    has_sent_ = true;
+  }
 }
 
 ConsoleAgent::ConsoleAgent()
   : agent_in_(NULL)
   , agent_out_(NULL)
-  , platform_(NULL) { }
+  , platform_(NULL)
+  , transport_(NULL)
+  , use_fast_path_(false)
+  , use_numeric_selectors_(false)
+  , write_credits_(0)
+  , use_write_streaming_(false)
+  , use_utf8_wire_(false)
+  , use_compact_values_(false)
+  , is_lazy_connect_(false)
+  , is_connected_(false)
+  , has_connect_failed_(false) {
+  read_lpc_flags();
+}
 
 const char *ConsoleAgent::get_lpc_name(ulong_t number) {
   switch (number) {
@@ -82,19 +276,14 @@ const char *ConsoleAgent::get_lpc_name(ulong_t number) {
 
 NtStatus ConsoleAgent::on_message(lpc::Message *request) {
   switch (request->api_number()) {
-    // The messages we want to handle.
+    // The messages we want to handle. Tracing, delegating, and suspending are
+    // all off for most messages so together they cost a single branch.
 #define __EMIT_CASE__(Name, name, NUM, FLAGS)                                  \
-    case lm##Name: {                                                           \
-      typedef lfBa FLAGS (lpc::BaseMessage, lpc::ConsoleMessage) MessageType;  \
-      MessageType *conc_request = static_cast<MessageType*>(request);          \
-      lfSp FLAGS (NativeThread::sleep(Duration::seconds(30)),);                \
-      lfTr FLAGS (trace_before(#name, request),);                              \
-      NtStatus result = lfDa FLAGS (                                           \
-          request->call_native_backend(),                                      \
-          adaptor()->name(conc_request, &conc_request->data()->payload.name)); \
-      lfTr FLAGS (trace_after(#name, request, result),);                       \
-      return result;                                                           \
-    }
+    case lm##Name:                                                             \
+      if (lpc_flags_[li##Name] != 0)                                           \
+        return on_flagged_message(#name, lpc_flags_[li##Name], request,        \
+            &ConsoleAgent::handle_##name);                                     \
+      return handle_##name(request);
   FOR_EACH_LPC_TO_INTERCEPT(__EMIT_CASE__)
 #undef __EMIT_CASE__
     // The messages we know about but don't want to handle.
@@ -104,7 +293,7 @@ NtStatus ConsoleAgent::on_message(lpc::Message *request) {
       return request->call_native_backend();
     // Unknown messages.
     default: {
-      if (kDumpUnknownMessages) {
+      if (dump_unknown_messages_) {
         lpc::Interceptor::Disable disable(request->interceptor());
         request->dump(FileSystem::native()->std_out());
       }
@@ -119,6 +308,65 @@ NtStatus ConsoleAgent::on_message(lpc::Message *request) {
   }
 }
 
+#define __DEFINE_LPC_HANDLER__(Name, name, NUM, FLAGS)                         \
+NtStatus ConsoleAgent::handle_##name(lpc::Message *request) {                  \
+  typedef lfBa FLAGS (lpc::BaseMessage, lpc::ConsoleMessage) MessageType;      \
+  MessageType *conc_request = static_cast<MessageType*>(request);              \
+  /* Only calls that reach the backend need the connection. */                 \
+  if (lfPa FLAGS (false, true) && !is_connected_ && !ensure_connected())       \
+    return request->call_native_backend();                                     \
+  return adaptor()->name(conc_request, &conc_request->data()->payload.name);   \
+}
+FOR_EACH_LPC_TO_INTERCEPT(__DEFINE_LPC_HANDLER__)
+#undef __DEFINE_LPC_HANDLER__
+
+NtStatus ConsoleAgent::on_flagged_message(const char *name, uint8_t flags,
+    lpc::Message *request, lpc_handler_t handler) {
+  if ((flags & rfSuspend) != 0)
+    NativeThread::sleep(Duration::seconds(30));
+  if ((flags & rfTrace) != 0)
+    trace_before(name, request);
+  NtStatus result = ((flags & rfDelegate) != 0)
+      ? request->call_native_backend()
+      : (this->*handler)(request);
+  if ((flags & rfTrace) != 0)
+    trace_after(name, request, result);
+  return result;
+}
+
+bool ConsoleAgent::wants_unknown_messages() {
+  return dump_unknown_messages_
+      || kSuspendOnUnknownConsoleMessages
+      || kSuspendOnUnknownOtherMessages;
+}
+
+// Each message's flags are bits in a 32-bit mask so there can't be more
+// messages than that; this fails to compile if there are.
+typedef char lpc_index_fits_in_mask_t[(ConsoleAgent::liCount <= 32) ? 1 : -1];
+
+// Returns the given flag if it's on by default or the bit at the given index
+// is set in the mask, otherwise 0.
+static uint8_t get_lpc_flag(bool is_default, uint32_t mask, size_t index,
+    uint8_t flag) {
+  return (is_default || ((mask >> index) & 1) != 0) ? flag : 0;
+}
+
+void ConsoleAgent::read_lpc_flags() {
+  uint32_t trace = options()->trace_lpcs();
+  uint32_t delegate = options()->delegate_lpcs();
+  uint32_t suspend = options()->suspend_lpcs();
+  // The flag columns give the defaults which the options can add to.
+#define __READ_LPC_FLAGS__(Name, name, NUM, FLAGS)                             \
+  lpc_flags_[li##Name] = static_cast<uint8_t>(                                 \
+        get_lpc_flag(lfTr FLAGS (true, false), trace, li##Name, rfTrace)       \
+      | get_lpc_flag(lfDa FLAGS (true, false), delegate, li##Name, rfDelegate) \
+      | get_lpc_flag(lfSp FLAGS (true, false), suspend, li##Name, rfSuspend));
+  FOR_EACH_LPC_TO_INTERCEPT(__READ_LPC_FLAGS__)
+#undef __READ_LPC_FLAGS__
+  dump_unknown_messages_ = options()->dump_unknown_lpcs();
+  on_lpc_flags_read();
+}
+
 void ConsoleAgent::trace_before(const char *name, lpc::Message *message) {
   OutStream *out = FileSystem::native()->std_err();
   out->printf("--- before %s ---\n", name);
@@ -136,19 +384,86 @@ fat_bool_t ConsoleAgent::install_agent(tclib::InStream *agent_in,
   agent_in_ = agent_in;
   agent_out_ = agent_out;
   platform_ = platform;
-  owner_ = new (kDefaultAlloc) rpc::StreamServiceConnector(agent_in, agent_out);
+  read_lpc_flags();
+  F_TRY(F_BOOL(connect_mutex_.initialize()));
+  F_TRY(F_BOOL(owner_mutex_.initialize()));
+  log()->set_min_level(options()->verbose_logging() ? llInfo : llWarning);
+  log()->ensure_installed();
+  F_TRY(install_agent_platform());
+  if (is_lazy_connect_)
+    return F_TRUE;
+  return ensure_connected();
+}
+
+fat_bool_t ConsoleAgent::ensure_connected() {
+  if (is_connected_)
+    return F_TRUE;
+  connect_mutex_.lock();
+  // Another thread may have connected, or failed to, while we were waiting
+  // for the mutex. Once connecting has failed we don't try again, the owner
+  // isn't going to become any more reachable.
+  fat_bool_t result = F_TRUE;
+  if (!is_connected_) {
+    result = has_connect_failed_ ? F_FALSE : connect_owner();
+    if (result) {
+      is_connected_ = true;
+    } else {
+      has_connect_failed_ = true;
+    }
+  }
+  connect_mutex_.unlock();
+  return result;
+}
+
+fat_bool_t ConsoleAgent::open_owner() {
+  owner_ = new (kDefaultAlloc) rpc::StreamServiceConnector(agent_in_, agent_out_);
   owner_->set_default_type_registry(ConsoleTypes::registry());
   if (!owner()->init(empty_callback()))
     return F_FALSE;
-  log()->set_destination(owner());
-  log()->ensure_installed();
-  F_TRY(install_agent_platform());
-  F_TRY(send_is_ready());
+  // Once there's a multiplexer it is the only thing that touches the socket
+  // so it has to be there before anything is sent.
+  if (options()->multiplex()) {
+    multiplexer_ = new (kDefaultAlloc) RequestMultiplexer(owner()->socket(),
+        owner()->input());
+    multiplexer()->set_input_stream(agent_in_);
+    F_TRY(multiplexer()->start());
+  }
+  log()->set_destination(owner(), *multiplexer_, owner_mutex());
   return F_TRUE;
 }
 
+fat_bool_t ConsoleAgent::connect_owner() {
+  F_TRY(open_owner());
+  F_TRY(send_is_ready());
+  return on_connected();
+}
+
 fat_bool_t ConsoleAgent::uninstall_agent() {
-  send_is_done();
+  // Writes may be held back by the connector so make sure they get through
+  // before telling the owner we're done.
+  if (is_connected_ && adaptor() != NULL) {
+    response_t<bool_t> flushed = adaptor()->flush();
+    if (flushed.has_error())
+      WARN("Failed to flush pending requests: %i", flushed.error_code());
+  }
+  // An agent that never needed the owner still lets it know it's done, it
+  // just doesn't bother saying it's ready first. It also ships what it has
+  // logged, which has been held back until now; the owner hasn't said what
+  // it understands so the entries go one at a time in the plain encoding.
+  bool has_owner = !owner_.is_null();
+  if (!has_owner && !has_connect_failed_) {
+    if (open_owner()) {
+      has_owner = true;
+      if (!log()->start_shipping(false))
+        WARN("Failed to start shipping log entries");
+    } else {
+      WARN("Failed to connect to the owner");
+    }
+  }
+  if (!log()->stop_shipping())
+    WARN("Failed to ship log entries");
+  if (has_owner)
+    send_is_done();
   F_TRY(uninstall_agent_platform());
   log()->ensure_uninstalled();
   if (agent_in_ != NULL)
@@ -169,8 +484,44 @@ fat_bool_t ConsoleAgent::send_is_ready() {
   Handle stderr_handle(platform()->get_std_handle(kStdErrorHandle));
   NativeVariant stderr_var(&stderr_handle);
   req.set_argument("stderr", stderr_var);
+  // The rings assume one caller at a time so a multiplexing agent doesn't use
+  // them, it only reads the state page.
+  if (transport() != NULL && !options()->multiplex())
+    req.set_argument("shared_memory", Variant::yes());
+  if (options()->fast_path())
+    req.set_argument("fast_path", Variant::yes());
+  if (options()->numeric_selectors())
+    req.set_argument("numeric_selectors", Variant::yes());
+  if (options()->write_credits())
+    req.set_argument("write_credits", Variant::yes());
+  if (options()->stream_chunk_bytes() > 0)
+    req.set_argument("stream_writes", Variant::yes());
+  if (options()->utf8_wire())
+    req.set_argument("utf8_wire", Variant::yes());
+  if (options()->compact_values())
+    req.set_argument("compact_values", Variant::yes());
+  req.set_argument("log_batches", Variant::yes());
   rpc::IncomingResponse resp;
-  return send_request(&req, &resp);
+  F_TRY(send_request(&req, &resp));
+  // Owners that don't know about optional features respond with null.
+  Map features = resp->peek_value(Variant::null());
+  use_fast_path_ = features.is_map() && features["fast_path"].bool_value();
+  use_numeric_selectors_ = features.is_map()
+      && features["numeric_selectors"].bool_value();
+  Variant credits = features.is_map() ? features["write_credits"] : Variant::null();
+  write_credits_ = credits.is_integer()
+      ? static_cast<uint32_t>(credits.integer_value())
+      : 0;
+  use_write_streaming_ = features.is_map() && features["stream_writes"].bool_value();
+  use_utf8_wire_ = features.is_map() && features["utf8_wire"].bool_value();
+  use_compact_values_ = features.is_map() && features["compact_values"].bool_value();
+  if (use_compact_values_)
+    log()->enable_compact_values();
+  // Anything logged while getting here has been held back until now.
+  F_TRY(log()->start_shipping(features.is_map()
+      && features["log_batches"].bool_value()));
+  log()->flush();
+  return F_TRUE;
 }
 
 fat_bool_t ConsoleAgent::send_is_done() {
@@ -181,9 +532,19 @@ fat_bool_t ConsoleAgent::send_is_done() {
 
 fat_bool_t ConsoleAgent::send_request(rpc::OutgoingRequest *request,
     rpc::IncomingResponse *resp_out) {
-  rpc::IncomingResponse resp = owner()->socket()->send_request(request);
-  while (!resp->is_settled())
-    F_TRY(owner()->input()->process_next_instruction(NULL));
+  rpc::IncomingResponse resp;
+  if (multiplexer_.is_null()) {
+    // The log may be shipping entries at the same time.
+    owner_mutex()->lock();
+    resp = owner()->socket()->send_request(request);
+    fat_bool_t processed = F_TRUE;
+    while (processed && !resp->is_settled())
+      processed = owner()->input()->process_next_instruction(NULL);
+    owner_mutex()->unlock();
+    F_TRY(processed);
+  } else if (!multiplexer()->send(request, rlInteractive, &resp)) {
+    return F_FALSE;
+  }
   if (resp->is_rejected())
     return F_FALSE;
   *resp_out = resp;
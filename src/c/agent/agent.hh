@@ -55,11 +55,78 @@
 ///      out immediately. The default is true.
 ///    * `VerboseLogging`/`CONSOLE_AGENT_VERBOSE_LOGGING`: log what the agent
 ///      does, both successfully and on failures. The default is to log only
-///      on failures.
+///      on failures; less severe entries aren't sent to the owner at all.
+///    * `CoalesceWrites`/`CONSOLE_AGENT_COALESCE_WRITES`: merge consecutive
+///      writes to the same handle into a single message to the backend. The
+///      default is to send each write immediately.
+///    * `CoalesceMaxBytes`/`CONSOLE_AGENT_COALESCE_MAX_BYTES`: how many bytes
+///      of writes to hold back before sending them. The default is 4096.
+///    * `CoalesceMaxDelayMs`/`CONSOLE_AGENT_COALESCE_MAX_DELAY_MS`: the longest
+///      time, in milliseconds, a write may be held back. 0 means that writes
+///      are only sent when the buffer fills up or another call is made. The
+///      default is 10.
+///    * `PipelineRequests`/`CONSOLE_AGENT_PIPELINE_REQUESTS`: don't wait for
+///      the backend's response to calls whose result is rarely used, like
+///      setting the title and writing. Failures are reported on the next call
+///      to the same handle or the next call that does wait. The default is
+///      to wait for every call.
+///    * `PipelineMaxInFlight`/`CONSOLE_AGENT_PIPELINE_MAX_IN_FLIGHT`: how many
+///      pipelined calls may be waiting for a response. The default is 32.
+///    * `FastPath`/`CONSOLE_AGENT_FAST_PATH`: send the most frequent calls
+///      using a fixed-layout binary encoding rather than the general one, if
+///      the backend supports it. See {{share/fastpath.hh}}. The default is to
+///      use the general encoding.
+///    * `NumericSelectors`/`CONSOLE_AGENT_NUMERIC_SELECTORS`: identify the
+///      method to call by its api number rather than its name, if the backend
+///      supports it. The default is to use names.
+///    * `Multiplex`/`CONSOLE_AGENT_MULTIPLEX`: allow console calls from any
+///      number of threads to be in flight at the same time by sending them,
+///      and the log, through dedicated threads. This replaces coalescing,
+///      pipelining, and the shared memory rings, which all assume one caller
+///      at a time. The default is to let calls take turns.
+///    * `WriteCredits`/`CONSOLE_AGENT_WRITE_CREDITS`: limit the bytes of
+///      writes that can be on their way to the backend at a time to what the
+///      backend grants, blocking when they run out. This only makes a
+///      difference when calls don't wait for each other, that is when
+///      pipelining or multiplexing. The default is to not ask for credits.
+///    * `BulkFrameMaxBytes`/`CONSOLE_AGENT_BULK_FRAME_MAX_BYTES`: when
+///      multiplexing, writes larger than this many bytes are sent in
+///      frames of at most this size through a separate bulk lane such that
+///      they don't hold up other threads' calls until they're done. `0` sends
+///      writes in one piece. The default is 16384.
+///    * `StreamChunkBytes`/`CONSOLE_AGENT_STREAM_CHUNK_BYTES`: writes larger
+///      than this many bytes are streamed to the backend in chunks of at most
+///      this size which it writes as they arrive, so a huge write neither has
+///      to be held in full on either side nor wait to be sent in full before
+///      any of it appears. `0` sends writes in one piece. The default is 0.
+///    * `Utf8Wire`/`CONSOLE_AGENT_UTF8_WIRE`: send wide text to the backend,
+///      and have it sent back, as utf-8 rather than utf-16. Most console text
+///      is ascii so this about halves the bytes. The default is to use
+///      utf-16.
+///    * `CompactValues`/`CONSOLE_AGENT_COMPACT_VALUES`: send handles,
+///      coordinates, screen buffer info and the other protocol value types as
+///      fixed-layout blobs rather than plankton seeds, which are smaller and
+///      decode without allocating. The default is to send seeds.
+///    * `TraceLpcs`/`CONSOLE_AGENT_TRACE_LPCS`: intercepted messages to dump
+///      to stderr before and after handling them. Like the two options below
+///      this is a bit mask where bit n stands for the n'th message in
+///      `FOR_EACH_LPC_TO_INTERCEPT` in {{share/protocol.hh}}, so for instance
+///      `256` is `GetConsoleCP`. Messages whose flag column sets the flag
+///      have it regardless. The default is none.
+///    * `DelegateLpcs`/`CONSOLE_AGENT_DELEGATE_LPCS`: intercepted messages to
+///      pass to the native console rather than the backend. The default is
+///      none.
+///    * `SuspendLpcs`/`CONSOLE_AGENT_SUSPEND_LPCS`: intercepted messages to
+///      sleep for 30 seconds before handling, to give a debugger time to
+///      attach. The default is none.
+///    * `DumpUnknownLpcs`/`CONSOLE_AGENT_DUMP_UNKNOWN_LPCS`: dump messages the
+///      agent doesn't know about to stdout. The default is not to.
 ///
 /// Setting a registry option to integer `0` disables the option, `1` enables
 /// it. Setting an environment variable to the string `"0"` disables an option,
-/// `"1"` enables it.
+/// `"1"` enables it. Numeric options are set to a dword in the registry and a
+/// decimal string in the environment. The full list of options lives in
+/// {{options.hh}}.
 ///
 /// ## Blacklist
 ///
@@ -72,11 +139,18 @@
 #ifndef _CONPRX_AGENT_AGENT_HH
 #define _CONPRX_AGENT_AGENT_HH
 
+#include "agent/conconn.hh"
 #include "binpatch.hh"
 #include "confront.hh"
 #include "io/stream.hh"
+#include "logbuf.hh"
 #include "lpc.hh"
+#include "options.hh"
 #include "rpc.hh"
+#include "share/shmring.hh"
+#include "sync/drawbridge.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
 #include "utils/fatbool.hh"
 #include "utils/log.hh"
 #include "utils/types.hh"
@@ -85,18 +159,90 @@ namespace conprx {
 
 using plankton::rpc::StreamServiceConnector;
 
-class Options;
-
-// Log that streams messages onto an output stream before passing log handling
-// on to the enclosing log.
+// Log that ships entries to the owner before passing log handling on to the
+// enclosing log. Logging doesn't wait for the owner, or touch the connection
+// to it at all: entries at or above the minimum level are copied into a
+// buffer and a thread of the log's own sends them in batches when enough
+// have accumulated or one is a warning or worse, without waiting for the
+// response. Entries that are logged before shipping has started are held
+// back until it does. When the agent multiplexes, entries go through its
+// multiplexer like every other request to the owner, in the bulk lane so
+// they don't hold up console calls. Otherwise the shipping thread holds the
+// mutex everything else that uses the connection holds while it sends.
 class StreamingLog : public tclib::Log {
 public:
-  StreamingLog() : out_(NULL) { }
+  StreamingLog();
+  ~StreamingLog();
   virtual fat_bool_t record(log_entry_t *entry);
-  void set_destination(StreamServiceConnector *out) { out_ = out; }
+  void set_destination(StreamServiceConnector *out, RequestMultiplexer *multiplexer,
+      tclib::NativeMutex *out_mutex) {
+    out_ = out;
+    multiplexer_ = multiplexer;
+    out_mutex_ = out_mutex;
+  }
+
+  // Makes entries be sent in their compact encoding. Only call this if the
+  // owner has said it understands compact values.
+  void enable_compact_values() { use_compact_values_ = true; }
+
+  // Entries below this level are only passed on, not shipped. The default is
+  // to ship everything.
+  void set_min_level(log_level_t value) { min_level_ = value; }
+
+  // Starts the thread that sends entries to the destination, in batches if
+  // the owner has said it understands them, otherwise as one log message per
+  // entry.
+  fat_bool_t start_shipping(bool use_batches);
+
+  // Makes the shipping thread send the entries that are ready. Doesn't block.
+  void flush();
+
+  // Sends the entries that are still waiting, blocks until the owner has
+  // received them, and stops the shipping thread. Does nothing if shipping
+  // hasn't started.
+  fat_bool_t stop_shipping();
+
+  // How many entries to let accumulate before sending them.
+  static const size_t kBatchSize = 32;
 
 private:
+  // Main loop of the shipping thread.
+  opaque_t run_shipping();
+
+  // Sends the entries that are ready.
+  void ship_ready();
+
+  // Sends the entries that are ready as one log_batch message.
+  void ship_batch();
+
+  // Sends the entries that are ready as individual log messages.
+  void ship_singly();
+
+  // Sends the given entry as a log message.
+  void send_entry(log_entry_t *entry);
+
+  // Sends the request without waiting for the response, unless it has to go
+  // through the multiplexer in which case the demux thread is the one that
+  // reads the response so this waits for it to.
+  void send_without_waiting(plankton::rpc::OutgoingRequest *request);
+
   StreamServiceConnector *out_;
+  RequestMultiplexer *multiplexer_;
+  // Held while using out_ directly, which is also where last_sent_ is
+  // updated.
+  tclib::NativeMutex *out_mutex_;
+  bool use_compact_values_;
+  log_level_t min_level_;
+  volatile bool is_shipping_;
+  volatile bool is_stopping_;
+  bool use_batches_;
+  LogBuffer buffer_;
+  // Lowered when there are entries for the shipping thread to send.
+  tclib::Drawbridge has_work_;
+  tclib::NativeThread shipper_;
+  // The most recent message sent, which flush waits for.
+  plankton::rpc::IncomingResponse last_sent_;
+  bool has_sent_;
 };
 
 // Controls the injection of the console agent.
@@ -122,6 +268,20 @@ public:
   // Remove this agent.
   fat_bool_t uninstall_agent();
 
+  // Makes installing the agent only install the patches and leave connecting
+  // to the owner until the first message that has to reach the backend, so
+  // processes that never use the console don't pay for it. The owner must
+  // not wait for the agent to be ready before letting the process run. Must
+  // be called before the agent is installed.
+  void set_lazy_connect(bool value) { is_lazy_connect_ = value; }
+
+  // Connects to the owner and says we're ready unless that has already
+  // happened. Safe to call from any thread.
+  fat_bool_t ensure_connected();
+
+  // Returns true once the agent has connected to the owner.
+  bool is_connected() { return is_connected_; }
+
   // Send a request back to the owner and wait for a response.
   fat_bool_t send_request(plankton::rpc::OutgoingRequest *request,
       plankton::rpc::IncomingResponse *response_out);
@@ -134,10 +294,64 @@ public:
   // report an error or not.
   NtStatus on_message(lpc::Message *request);
 
+  // Returns true if on_message does anything with messages it doesn't
+  // intercept other than pass them to the native backend, in which case the
+  // interceptor mustn't pass them through before they get here.
+  bool wants_unknown_messages();
+
+  // Updates the per-message flags from the options. This happens when the
+  // agent is installed; call it again if the options change after that.
+  // Either way the platform gets to react through on_lpc_flags_read.
+  void read_lpc_flags();
+
   StreamServiceConnector *owner() { return *owner_; }
 
+  // Returns the multiplexer all requests to the owner go through if the
+  // agent multiplexes, otherwise NULL. Only valid once the agent has opened
+  // the connection to the owner.
+  RequestMultiplexer *multiplexer() { return *multiplexer_; }
+
+  // Returns the mutex that must be held while using the connection to the
+  // owner directly, which is everything but the multiplexer.
+  tclib::NativeMutex *owner_mutex() { return &owner_mutex_; }
+
   virtual ConsoleAdaptor *adaptor() { return NULL; }
 
+  // The options that control this agent's behavior.
+  Options *options() { return &options_; }
+
+  // Sets the shared memory transport to announce to the owner. Must be called
+  // before the agent is installed.
+  void set_transport(SharedRingTransport *transport) { transport_ = transport; }
+
+  // Returns the shared memory transport or NULL if there is none.
+  SharedRingTransport *transport() { return transport_; }
+
+  // Returns true if the agent asked to use the fast path and the owner agreed.
+  // Only valid after the agent has been installed.
+  bool use_fast_path() { return use_fast_path_; }
+
+  // Returns true if the agent asked to use numeric selectors and the owner
+  // agreed. Only valid after the agent has been installed.
+  bool use_numeric_selectors() { return use_numeric_selectors_; }
+
+  // Returns the number of bytes of writes the owner allows to be outstanding
+  // at a time, or 0 if it doesn't limit them. Only valid after the agent has
+  // been installed.
+  uint32_t write_credits() { return write_credits_; }
+
+  // Returns true if the agent asked to stream large writes and the owner
+  // agreed. Only valid after the agent has been installed.
+  bool use_write_streaming() { return use_write_streaming_; }
+
+  // Returns true if the agent asked to send wide text as utf-8 and the owner
+  // agreed. Only valid after the agent has been installed.
+  bool use_utf8_wire() { return use_utf8_wire_; }
+
+  // Returns true if the agent asked to send compact values and the owner
+  // agreed. Only valid after the agent has been installed.
+  bool use_compact_values() { return use_compact_values_; }
+
   enum lpc_method_key_t {
     lmFirst
 #define __GEN_KEY_ENUM__(Name, name, NUM, FLAGS) , lm##Name = (NUM)
@@ -145,6 +359,26 @@ public:
 #undef __GEN_KEY_ENUM__
   };
 
+  // The position of each intercepted message in FOR_EACH_LPC_TO_INTERCEPT,
+  // which is also its bit in the per-message options.
+  enum lpc_index_t {
+    liFirst = -1
+#define __GEN_INDEX_ENUM__(Name, name, NUM, FLAGS) , li##Name
+    FOR_EACH_LPC_TO_INTERCEPT(__GEN_INDEX_ENUM__)
+#undef __GEN_INDEX_ENUM__
+    , liCount
+  };
+
+  // The flags that can be set at runtime for each intercepted message.
+  enum lpc_flag_t {
+    // Dump the message before and after handling it.
+    rfTrace = 0x1,
+    // Pass the message to the native backend rather than the adaptor.
+    rfDelegate = 0x2,
+    // Sleep before handling the message.
+    rfSuspend = 0x4
+  };
+
 protected:
   // Perform the platform-specific part of the agent installation.
   virtual fat_bool_t install_agent_platform() = 0;
@@ -152,7 +386,22 @@ protected:
   // Perform the platform-specific part of the agent uninstall.
   virtual fat_bool_t uninstall_agent_platform() = 0;
 
+  // Called once the agent has connected to the owner and they've agreed on
+  // which features to use, to set up whatever talks to the owner.
+  virtual fat_bool_t on_connected() { return F_TRUE; }
+
+  // Called each time the flags have been read from the options, to update
+  // anything the platform derives from them. During construction this is
+  // always the default which does nothing.
+  virtual void on_lpc_flags_read() { }
+
 private:
+  // Opens the connection to the owner without saying anything over it.
+  fat_bool_t open_owner();
+
+  // Opens the connection and says we're ready.
+  fat_bool_t connect_owner();
+
   // Send the is-ready message to the owner.
   fat_bool_t send_is_ready();
 
@@ -162,8 +411,26 @@ private:
   void trace_before(const char *name, lpc::Message *message);
   void trace_after(const char *name, lpc::Message *message, NtStatus status);
 
+  // The handlers for the intercepted messages, for when no flags are set.
+  typedef NtStatus (ConsoleAgent::*lpc_handler_t)(lpc::Message *request);
+#define __DECLARE_LPC_HANDLER__(Name, name, NUM, FLAGS)                        \
+  NtStatus handle_##name(lpc::Message *request);
+  FOR_EACH_LPC_TO_INTERCEPT(__DECLARE_LPC_HANDLER__)
+#undef __DECLARE_LPC_HANDLER__
+
+  // Handles a message that has some of the lpc_flag_t flags set, using the
+  // given handler unless it's being delegated.
+  NtStatus on_flagged_message(const char *name, uint8_t flags,
+      lpc::Message *request, lpc_handler_t handler);
+
   // A connection to the owner of the agent.
   tclib::def_ref_t<StreamServiceConnector> owner_;
+  // Declared after the owner so its threads are stopped before the owner
+  // goes away.
+  tclib::def_ref_t<RequestMultiplexer> multiplexer_;
+  // The log ships entries from a thread of its own so anything that uses the
+  // connection other than through the multiplexer holds this.
+  tclib::NativeMutex owner_mutex_;
   tclib::InStream *agent_in_;
   tclib::OutStream *agent_out_;
 
@@ -172,6 +439,23 @@ private:
 
   StreamingLog *log() { return &log_; }
   StreamingLog log_;
+
+  Options options_;
+  // The lpc_flag_t flags of each intercepted message, by lpc_index_t.
+  uint8_t lpc_flags_[liCount];
+  bool dump_unknown_messages_;
+  SharedRingTransport *transport_;
+  bool use_fast_path_;
+  bool use_numeric_selectors_;
+  uint32_t write_credits_;
+  bool use_write_streaming_;
+  bool use_utf8_wire_;
+  bool use_compact_values_;
+  bool is_lazy_connect_;
+  // Held while connecting so only one thread does it.
+  tclib::NativeMutex connect_mutex_;
+  volatile bool is_connected_;
+  bool has_connect_failed_;
 };
 
 } // namespace conprx
@@ -8,6 +8,7 @@
 #include "async/promise-inl.hh"
 #include "conconn.hh"
 #include "marshal-inl.hh"
+#include "options.hh"
 #include "plankton-inl.hh"
 #include "utils/misc-inl.h"
 #include "utils/string.hh"
@@ -20,6 +21,30 @@ using namespace conprx;
 using namespace plankton;
 using namespace tclib;
 
+// Atomically replaces *ptr with value if it is expected. Returns true if it
+// was replaced.
+template <typename T>
+static inline bool compare_and_swap(T *volatile *ptr, T *expected, T *value) {
+#ifdef IS_MSVC
+  return InterlockedCompareExchangePointer(
+      reinterpret_cast<void *volatile*>(ptr), value, expected) == expected;
+#else
+  return __atomic_compare_exchange_n(ptr, &expected, value, false,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#endif
+}
+
+// Atomically replaces *ptr with value, returning the previous value.
+template <typename T>
+static inline T *exchange(T *volatile *ptr, T *value) {
+#ifdef IS_MSVC
+  return static_cast<T*>(InterlockedExchangePointer(
+      reinterpret_cast<void *volatile*>(ptr), value));
+#else
+  return __atomic_exchange_n(ptr, value, __ATOMIC_ACQUIRE);
+#endif
+}
+
 // Validates the given message, including the assumption that the message's
 // payload is of the given type.
 template <typename P>
@@ -46,10 +71,21 @@ static NtStatus validate_message(lpc::Message *req, P *payload) {
     return __status__;                                                         \
 } while (false)
 
+bool ConsoleAdaptor::read_local_state(console_state_t *state_out) {
+  return (state_page_ != NULL)
+      && !connector()->has_pending_requests()
+      && state_page_->read(state_out);
+}
+
 NtStatus ConsoleAdaptor::get_console_cp(lpc::ConsoleMessage *req,
     lpc::get_console_cp_m *payload) {
   VALIDATE_MESSAGE_OR_BAIL(req, payload);
-  response_t<uint32_t> resp = connector()->get_console_cp(payload->is_output);
+  console_state_t state;
+  response_t<uint32_t> resp = read_local_state(&state)
+      ? response_t<uint32_t>::of(payload->is_output
+          ? state.output_codepage
+          : state.input_codepage)
+      : connector()->get_console_cp(payload->is_output);
   req->set_return_value(NtStatus::from_response(resp));
   payload->code_page_id = (resp.has_error() ? 0 : resp.value());
   return NtStatus::success();
@@ -79,13 +115,32 @@ NtStatus ConsoleAdaptor::get_console_title(lpc::ConsoleMessage *req,
   VALIDATE_MESSAGE_OR_BAIL(req, payload);
   void *start = req->xform().remote_to_local(payload->title);
   tclib::Blob scratch(start, payload->size_in_bytes_in);
-  response_t<uint32_t> resp = connector()->get_console_title(scratch, payload->is_unicode);
-  req->set_return_value(NtStatus::from_response(resp));
   size_t char_size = StringUtils::char_size(payload->is_unicode);
+  console_state_t state;
+  response_t<uint32_t> resp;
+  if (read_local_state(&state)
+      && is_title_result_empty(&state, scratch.size(), payload->is_unicode)) {
+    // Length probes and empty titles only get a terminator.
+    if (scratch.size() >= char_size)
+      tclib::Blob(start, char_size).fill(0);
+    resp = response_t<uint32_t>::of(0);
+  } else {
+    resp = connector()->get_console_title(scratch, payload->is_unicode);
+  }
+  req->set_return_value(NtStatus::from_response(resp));
   payload->length_in_chars_out = static_cast<uint32_t>(resp.value() / char_size);
   return NtStatus::success();
 }
 
+bool ConsoleAdaptor::is_title_result_empty(console_state_t *state,
+    size_t buffer_size, bool is_unicode) {
+  // The backend doesn't return any of the title if the buffer can't hold all
+  // of it in ansi mode or if it's empty in unicode mode.
+  return (state->title_length == 0)
+      || (buffer_size == 0)
+      || (!is_unicode && buffer_size < state->title_length);
+}
+
 NtStatus ConsoleAdaptor::set_console_mode(lpc::ConsoleMessage *req,
     lpc::set_console_mode_m *payload) {
   VALIDATE_MESSAGE_OR_BAIL(req, payload);
@@ -119,8 +174,7 @@ NtStatus ConsoleAdaptor::get_console_screen_buffer_info(lpc::ConsoleMessage *req
   VALIDATE_MESSAGE_OR_BAIL(req, payload);
   console_screen_buffer_infoex_t info;
   struct_zero_fill(info);
-  response_t<bool_t> resp = connector()->get_console_screen_buffer_info(
-      payload->output, &info);
+  response_t<bool_t> resp = get_console_screen_buffer_info(payload->output, &info);
   req->set_return_value(NtStatus::from_response(resp));
   payload->size = info.dwSize;
   payload->cursor_position = info.dwCursorPosition;
@@ -136,6 +190,19 @@ NtStatus ConsoleAdaptor::get_console_screen_buffer_info(lpc::ConsoleMessage *req
   return NtStatus::success();
 }
 
+response_t<bool_t> ConsoleAdaptor::get_console_screen_buffer_info(Handle output,
+    console_screen_buffer_infoex_t *info_out) {
+  console_state_t state;
+  if (read_local_state(&state)) {
+    console_handle_state_t *handle = ConsoleStatePage::find_handle(&state, output);
+    if (handle != NULL && handle->has_screen_buffer_info) {
+      *info_out = handle->screen_buffer_info;
+      return response_t<bool_t>::yes();
+    }
+  }
+  return connector()->get_console_screen_buffer_info(output, info_out);
+}
+
 NtStatus ConsoleAdaptor::write_console(lpc::ConsoleMessage *req,
     lpc::write_console_m *payload) {
   VALIDATE_MESSAGE_OR_BAIL(req, payload);
@@ -203,6 +270,41 @@ response_t<int64_t> ConsoleAdaptor::poke(int64_t value) {
   return connector()->poke(value);
 }
 
+response_t<bool_t> ConsoleAdaptor::flush() {
+  return connector()->flush();
+}
+
+WriteCoalescer::WriteCoalescer()
+  : size_(0)
+  , is_unicode_(false) { }
+
+WriteCoalescer::~WriteCoalescer() {
+  if (is_enabled())
+    allocator_default_free(memory_);
+}
+
+bool WriteCoalescer::initialize(size_t capacity) {
+  CHECK_FALSE("coalescer initialized twice", is_enabled());
+  memory_ = allocator_default_malloc(capacity);
+  return is_enabled();
+}
+
+bool WriteCoalescer::accepts(Handle output, size_t size, bool is_unicode) {
+  if (!is_enabled())
+    return false;
+  if (!is_empty() && (output.id() != output_.id() || is_unicode != is_unicode_))
+    return false;
+  return size <= (capacity() - size_);
+}
+
+void WriteCoalescer::append(Handle output, tclib::Blob data, bool is_unicode) {
+  output_ = output;
+  is_unicode_ = is_unicode;
+  byte_t *dest = static_cast<byte_t*>(memory_.start()) + size_;
+  blob_copy_to(data, tclib::Blob(dest, data.size()));
+  size_ += data.size();
+}
+
 // Specializations of this class defines the default conversions for various
 // types.
 template <typename T>
@@ -221,19 +323,601 @@ DECLARE_CONVERTER(bool_t, variant.bool_value());
 DECLARE_CONVERTER(uint32_t, static_cast<uint32_t>(variant.integer_value()));
 DECLARE_CONVERTER(Variant, variant);
 
+MultiplexedRequest::MultiplexedRequest(rpc::OutgoingRequest *request,
+    request_lane_t lane)
+  : request_(request)
+  , lane_(lane)
+  , done_(Drawbridge::dsRaised)
+  , has_failed_(false)
+  , next_(NULL) { }
+
+void RequestQueue::push(MultiplexedRequest *request) {
+  MultiplexedRequest *top;
+  do {
+    top = top_;
+    request->next_ = top;
+  } while (!compare_and_swap(&top_, top, request));
+}
+
+MultiplexedRequest *RequestQueue::take_all() {
+  MultiplexedRequest *current = exchange<MultiplexedRequest>(&top_, NULL);
+  MultiplexedRequest *reversed = NULL;
+  while (current != NULL) {
+    MultiplexedRequest *next = current->next_;
+    current->next_ = reversed;
+    reversed = current;
+    current = next;
+  }
+  return reversed;
+}
+
+RequestMultiplexer::RequestMultiplexer(rpc::MessageSocket *socket, InputSocket *in)
+  : socket_(socket)
+  , in_(in)
+  , stream_(NULL)
+  , bulk_waiting_first_(NULL)
+  , bulk_waiting_last_(NULL)
+  , has_work_(Drawbridge::dsRaised)
+  , has_sent_(Drawbridge::dsRaised)
+  , mux_(new_callback(&RequestMultiplexer::run_mux, this))
+  , demux_(new_callback(&RequestMultiplexer::run_demux, this))
+  , is_mux_waiting_(false)
+  , in_flight_first_(NULL)
+  , in_flight_last_(NULL)
+  , is_bulk_in_flight_(false)
+  , has_failed_(false)
+  , is_stopping_(false)
+  , is_started_(false) { }
+
+RequestMultiplexer::~RequestMultiplexer() {
+  if (!is_started_)
+    return;
+  is_stopping_ = true;
+  // If responses are still outstanding the demux thread may be blocked
+  // waiting for one that isn't coming, and the mux thread waiting for it to
+  // let go of the socket. Closing the stream makes the read fail which fails
+  // the outstanding requests and lets both threads stop.
+  mutex_.lock();
+  bool is_reading = (in_flight_first_ != NULL);
+  mutex_.unlock();
+  if (is_reading && stream_ != NULL && !stream_->close())
+    WARN("Failed to close the multiplexer's input stream");
+  has_work_.lower();
+  has_sent_.lower();
+  opaque_t result = o0();
+  F_LOG_FALSE(demux_.join(&result));
+  F_LOG_FALSE(mux_.join(&result));
+}
+
+fat_bool_t RequestMultiplexer::start() {
+  F_TRY(F_BOOL(mutex_.initialize()));
+  F_TRY(F_BOOL(socket_mutex_.initialize()));
+  F_TRY(F_BOOL(has_work_.initialize()));
+  F_TRY(F_BOOL(has_sent_.initialize()));
+  F_TRY(F_BOOL(mux_.start()));
+  F_TRY(F_BOOL(demux_.start()));
+  is_started_ = true;
+  return F_TRUE;
+}
+
+bool RequestMultiplexer::send(rpc::OutgoingRequest *request,
+    request_lane_t lane, rpc::IncomingResponse *response_out) {
+  MultiplexedRequest entry(request, lane);
+  if (!entry.initialize())
+    return false;
+  queue(lane)->push(&entry);
+  has_work_.lower();
+  if (!entry.done_.pass() || entry.has_failed_)
+    return false;
+  *response_out = entry.response_;
+  return true;
+}
+
+opaque_t RequestMultiplexer::run_mux() {
+  while (true) {
+    // Raise before checking for work such that a request submitted after the
+    // check lowers it again and we don't miss it.
+    has_work_.raise();
+    send_submitted(queue(rlInteractive)->take_all());
+    defer_bulk(queue(rlBulk)->take_all());
+    send_next_bulk();
+    if (is_stopping_)
+      break;
+    has_work_.pass();
+  }
+  return o0();
+}
+
+opaque_t RequestMultiplexer::run_demux() {
+  while (true) {
+    // Same as the mux thread: raise first so a send after the check isn't
+    // missed.
+    has_sent_.raise();
+    mutex_.lock();
+    bool is_idle = (in_flight_first_ == NULL);
+    mutex_.unlock();
+    if (is_idle) {
+      if (is_stopping_)
+        break;
+      has_sent_.pass();
+      continue;
+    }
+    if (is_mux_waiting_) {
+      // Let the mux thread send before reading again, otherwise it could be
+      // kept waiting for as long as responses keep coming.
+      has_sent_.pass();
+      continue;
+    }
+    // The mux thread can't send while this blocks; requests submitted in the
+    // meantime are sent when the response arrives.
+    socket_mutex_.lock();
+    bool has_read = in()->process_next_instruction(NULL);
+    socket_mutex_.unlock();
+    mutex_.lock();
+    if (has_read) {
+      complete_settled();
+    } else {
+      // There's no telling which, if any, responses are still coming so fail
+      // everything from here on.
+      has_failed_ = true;
+      fail_in_flight();
+    }
+    mutex_.unlock();
+  }
+  return o0();
+}
+
+void RequestMultiplexer::send_submitted(MultiplexedRequest *submitted) {
+  if (submitted == NULL)
+    return;
+  lock_socket_for_sending();
+  mutex_.lock();
+  while (submitted != NULL) {
+    MultiplexedRequest *request = submitted;
+    submitted = request->next_;
+    send_one(request);
+  }
+  mutex_.unlock();
+  socket_mutex_.unlock();
+  has_sent_.lower();
+}
+
+void RequestMultiplexer::lock_socket_for_sending() {
+  is_mux_waiting_ = true;
+  socket_mutex_.lock();
+  is_mux_waiting_ = false;
+}
+
+void RequestMultiplexer::send_one(MultiplexedRequest *request) {
+  request->next_ = NULL;
+  if (has_failed_) {
+    request->has_failed_ = true;
+    request->done_.lower();
+    return;
+  }
+  request->response_ = socket()->send_request(request->request_);
+  if (in_flight_last_ == NULL) {
+    in_flight_first_ = request;
+  } else {
+    in_flight_last_->next_ = request;
+  }
+  in_flight_last_ = request;
+}
+
+void RequestMultiplexer::defer_bulk(MultiplexedRequest *submitted) {
+  if (submitted == NULL)
+    return;
+  if (bulk_waiting_last_ == NULL) {
+    bulk_waiting_first_ = submitted;
+  } else {
+    bulk_waiting_last_->next_ = submitted;
+  }
+  MultiplexedRequest *last = submitted;
+  while (last->next_ != NULL)
+    last = last->next_;
+  bulk_waiting_last_ = last;
+}
+
+void RequestMultiplexer::send_next_bulk() {
+  if (bulk_waiting_first_ == NULL)
+    return;
+  lock_socket_for_sending();
+  mutex_.lock();
+  if (has_failed_) {
+    // Fail everything that's waiting.
+    while (bulk_waiting_first_ != NULL) {
+      MultiplexedRequest *next = bulk_waiting_first_;
+      bulk_waiting_first_ = next->next_;
+      send_one(next);
+    }
+    bulk_waiting_last_ = NULL;
+  } else if (!is_bulk_in_flight_) {
+    MultiplexedRequest *next = bulk_waiting_first_;
+    bulk_waiting_first_ = next->next_;
+    if (bulk_waiting_first_ == NULL)
+      bulk_waiting_last_ = NULL;
+    is_bulk_in_flight_ = true;
+    send_one(next);
+  }
+  mutex_.unlock();
+  socket_mutex_.unlock();
+  has_sent_.lower();
+}
+
+void RequestMultiplexer::complete_settled() {
+  // Responses usually arrive in the order the requests were sent but that's
+  // up to the owner so check all of them.
+  MultiplexedRequest *prev = NULL;
+  MultiplexedRequest *current = in_flight_first_;
+  while (current != NULL) {
+    MultiplexedRequest *next = current->next_;
+    if (current->response_->is_settled()) {
+      complete(prev, current);
+    } else {
+      prev = current;
+    }
+    current = next;
+  }
+}
+
+void RequestMultiplexer::fail_in_flight() {
+  while (in_flight_first_ != NULL) {
+    in_flight_first_->has_failed_ = true;
+    complete(NULL, in_flight_first_);
+  }
+}
+
+void RequestMultiplexer::complete(MultiplexedRequest *prev,
+    MultiplexedRequest *request) {
+  if (prev == NULL) {
+    in_flight_first_ = request->next_;
+  } else {
+    prev->next_ = request->next_;
+  }
+  if (in_flight_last_ == request)
+    in_flight_last_ = prev;
+  if (request->lane_ == rlBulk) {
+    // The mux thread may be holding back the next bulk request.
+    is_bulk_in_flight_ = false;
+    has_work_.lower();
+  }
+  // Once the drawbridge is lowered the waiting thread may return and the
+  // request go away so this must be the last thing we do with it.
+  request->done_.lower();
+}
+
 PrpcConsoleConnector::PrpcConsoleConnector(rpc::MessageSocket *socket,
     InputSocket *in)
   : socket_(socket)
-  , in_(in) { }
+  , in_(in)
+  , transport_(NULL)
+  , use_fast_path_(false)
+  , use_numeric_selectors_(false)
+  , use_utf8_wire_(false)
+  , use_compact_values_(false)
+  , stream_id_(0)
+  , deferred_error_(0)
+  , in_flight_first_(0)
+  , in_flight_count_(0)
+  , max_in_flight_(0)
+  , mutex_(NULL)
+  , has_flush_timer_(false)
+  , flush_timer_(new_callback(&PrpcConsoleConnector::run_flush_timer, this))
+  , has_held_back_(Drawbridge::dsRaised)
+  , held_back_since_nanos_(0)
+  , max_delay_ms_(0)
+  , stop_flush_timer_(false)
+  , multiplexer_(NULL)
+  , max_bulk_frame_bytes_(0)
+  , stream_chunk_bytes_(0) { }
+
+PrpcConsoleConnector::~PrpcConsoleConnector() {
+  if (has_flush_timer_) {
+    stop_flush_timer_ = true;
+    has_held_back_.lower();
+    opaque_t result = o0();
+    F_LOG_FALSE(flush_timer_.join(&result));
+  }
+}
+
+PrpcConsoleConnector::Lock::Lock(PrpcConsoleConnector *connector)
+  : mutex_(connector->mutex_) {
+  if (mutex_ != NULL)
+    mutex_->lock();
+}
+
+PrpcConsoleConnector::Lock::~Lock() {
+  if (mutex_ != NULL)
+    mutex_->unlock();
+}
+
+fat_bool_t PrpcConsoleConnector::enable_write_coalescing(uint32_t max_bytes,
+    uint32_t max_delay_ms) {
+  if (is_multiplexing() || !coalescer()->initialize(max_bytes))
+    return F_FALSE;
+  if (max_delay_ms == 0)
+    return F_TRUE;
+  max_delay_ms_ = max_delay_ms;
+  if (mutex_ == NULL) {
+    F_TRY(F_BOOL(own_mutex_.initialize()));
+    mutex_ = &own_mutex_;
+  }
+  F_TRY(F_BOOL(has_held_back_.initialize()));
+  F_TRY(F_BOOL(flush_timer_.start()));
+  has_flush_timer_ = true;
+  return F_TRUE;
+}
+
+fat_bool_t PrpcConsoleConnector::enable_pipelining(uint32_t max_in_flight) {
+  if (max_in_flight == 0 || max_in_flight > kMaxInFlightLimit || is_multiplexing())
+    return F_FALSE;
+  max_in_flight_ = max_in_flight;
+  return F_TRUE;
+}
+
+fat_bool_t PrpcConsoleConnector::enable_multiplexing(uint32_t max_bulk_frame_bytes) {
+  if (coalescer()->is_enabled() || is_pipelining() || transport_ != NULL)
+    return F_FALSE;
+  own_multiplexer_ = new (kDefaultAlloc) RequestMultiplexer(socket(), in());
+  F_TRY(own_multiplexer_->start());
+  return enable_multiplexing(*own_multiplexer_, max_bulk_frame_bytes);
+}
+
+fat_bool_t PrpcConsoleConnector::enable_multiplexing(RequestMultiplexer *multiplexer,
+    uint32_t max_bulk_frame_bytes) {
+  if (coalescer()->is_enabled() || is_pipelining() || transport_ != NULL)
+    return F_FALSE;
+  // Keep frames a whole number of wide characters.
+  max_bulk_frame_bytes_ = max_bulk_frame_bytes & ~static_cast<uint32_t>(sizeof(wide_char_t) - 1);
+  multiplexer_ = multiplexer;
+  return F_TRUE;
+}
+
+void PrpcConsoleConnector::enable_write_streaming(uint32_t chunk_bytes) {
+  // Like bulk frames, chunks are a whole number of wide characters.
+  stream_chunk_bytes_ = chunk_bytes & ~static_cast<uint32_t>(sizeof(wide_char_t) - 1);
+}
+
+fat_bool_t PrpcConsoleConnector::enable_write_credits(uint32_t credits) {
+  return this->credits()->initialize(credits);
+}
+
+fat_bool_t PrpcConsoleConnector::configure(Options *options,
+    RequestMultiplexer *multiplexer) {
+  if (options->multiplex()) {
+    return (multiplexer == NULL)
+        ? enable_multiplexing(options->bulk_frame_max_bytes())
+        : enable_multiplexing(multiplexer, options->bulk_frame_max_bytes());
+  }
+  if (options->coalesce_writes())
+    F_TRY(enable_write_coalescing(options->coalesce_max_bytes(),
+        options->coalesce_max_delay_ms()));
+  if (options->pipeline_requests())
+    F_TRY(enable_pipelining(options->pipeline_max_in_flight()));
+  return F_TRUE;
+}
+
+opaque_t PrpcConsoleConnector::run_flush_timer() {
+  uint64_t max_delay_nanos = static_cast<uint64_t>(max_delay_ms_) * 1000000;
+  while (!stop_flush_timer_) {
+    // Raise before looking such that a write held back after we've looked
+    // lowers it again and we don't miss it.
+    has_held_back_.raise();
+    uint64_t remaining_nanos = 0;
+    {
+      // This is the lock everything else that uses the socket holds so the
+      // flush can't get mixed up with their messages.
+      Lock lock(this);
+      if (!coalescer()->is_empty()) {
+        uint64_t elapsed_nanos = LogBuffer::now_nanos() - held_back_since_nanos_;
+        if (elapsed_nanos >= max_delay_nanos) {
+          flush_pending_writes();
+        } else {
+          remaining_nanos = max_delay_nanos - elapsed_nanos;
+        }
+      }
+    }
+    if (remaining_nanos == 0) {
+      has_held_back_.pass();
+    } else {
+      // Round up so we don't wake up just before the deadline. Being woken
+      // early, because the writes have been flushed and new ones held back,
+      // is fine; we just look again.
+      has_held_back_.pass(Duration::millis((remaining_nanos + 999999) / 1000000));
+    }
+  }
+  return o0();
+}
+
+void PrpcConsoleConnector::on_holding_back_write() {
+  if (!has_flush_timer_ || !coalescer()->is_empty())
+    return;
+  held_back_since_nanos_ = LogBuffer::now_nanos();
+  has_held_back_.lower();
+}
+
+Variant PrpcConsoleConnector::selector(lpc_api_num_t apinum, const char *name) {
+  return use_numeric_selectors_
+      ? Variant::integer(apinum)
+      : Variant(name);
+}
+
+void PrpcConsoleConnector::flush_pending_writes() {
+  if (coalescer()->is_empty())
+    return;
+  response_t<uint32_t> result = transmit_write_console(coalescer()->output(),
+      coalescer()->pending(), coalescer()->is_unicode());
+  coalescer()->clear();
+  if (result.has_error())
+    defer_error(coalescer()->output(), result.error_code());
+}
+
+void PrpcConsoleConnector::defer_error(Handle handle, dword_t error) {
+  if (deferred_error_ != 0)
+    return;
+  deferred_error_ = error;
+  deferred_error_handle_ = handle;
+}
+
+dword_t PrpcConsoleConnector::take_deferred_error() {
+  dword_t result = deferred_error_;
+  deferred_error_ = 0;
+  return result;
+}
+
+dword_t PrpcConsoleConnector::take_deferred_error(Handle handle) {
+  return (deferred_error_handle_.id() == handle.id())
+      ? take_deferred_error()
+      : 0;
+}
+
+void PrpcConsoleConnector::reap_in_flight() {
+  while (in_flight_count_ > 0) {
+    in_flight_request_t *oldest = &in_flight_[in_flight_first_];
+    if (!oldest->response->is_settled())
+      // Responses arrive in order so if this one isn't done the later ones
+      // won't be either.
+      break;
+    if (oldest->response->is_rejected()) {
+      Variant error = oldest->response->peek_error(Variant::null());
+      dword_t code = static_cast<dword_t>(error.integer_value());
+      defer_error(oldest->handle, (code == 0) ? CONPRX_ERROR_INVALID_RESPONSE : code);
+    }
+    if (oldest->credits > 0)
+      credits()->release(oldest->credits);
+    oldest->response = rpc::IncomingResponse();
+    in_flight_first_ = (in_flight_first_ + 1) % kMaxInFlightLimit;
+    in_flight_count_--;
+  }
+}
+
+bool PrpcConsoleConnector::wait_for_in_flight(size_t max_remaining) {
+  reap_in_flight();
+  while (in_flight_count_ > max_remaining) {
+    if (!in()->process_next_instruction(NULL))
+      return false;
+    reap_in_flight();
+  }
+  return true;
+}
+
+response_t<bool_t> PrpcConsoleConnector::flush() {
+  Lock lock(this);
+  flush_pending_writes();
+  if (!wait_for_in_flight(0))
+    return response_t<bool_t>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+  dword_t error = take_deferred_error();
+  return (error == 0)
+      ? response_t<bool_t>::yes()
+      : response_t<bool_t>::error(error);
+}
+
+bool PrpcConsoleConnector::has_pending_requests() {
+  Lock lock(this);
+  // A deferred error counts too since it has to be reported by the next call
+  // that goes through to the backend.
+  return !coalescer()->is_empty() || (in_flight_count_ > 0) || (deferred_error_ != 0);
+}
 
 template <typename T, typename C>
 response_t<T> PrpcConsoleConnector::send_request(rpc::OutgoingRequest *request,
     rpc::IncomingResponse *resp_out) {
-  rpc::IncomingResponse resp = *resp_out = socket()->send_request(request);
-  while (!resp->is_settled()) {
-    if (!in()->process_next_instruction(NULL))
+  Lock lock(this);
+  flush_pending_writes();
+  // Synchronous requests act as a barrier for pipelined ones: everything sent
+  // before must have completed and if any of them failed that's what gets
+  // reported.
+  if (!wait_for_in_flight(0))
+    return response_t<T>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+  dword_t deferred_error = take_deferred_error();
+  if (deferred_error != 0)
+    return response_t<T>::error(deferred_error);
+  return transmit_request<T, C>(request, resp_out);
+}
+
+response_t<bool_t> PrpcConsoleConnector::send_request_pipelined(
+    rpc::OutgoingRequest *request, Handle handle) {
+  if (!is_pipelining()) {
+    rpc::IncomingResponse resp;
+    return send_request_default<bool_t>(request, &resp);
+  }
+  Lock lock(this);
+  flush_pending_writes();
+  return transmit_request_pipelined(request, handle);
+}
+
+response_t<bool_t> PrpcConsoleConnector::transmit_request_pipelined(
+    rpc::OutgoingRequest *request, Handle handle, size_t credits) {
+  if (!is_pipelining()) {
+    rpc::IncomingResponse resp;
+    response_t<bool_t> result = transmit_request< bool_t, DefaultConverter<bool_t> >(
+        request, &resp);
+    if (credits > 0)
+      this->credits()->release(credits);
+    return result;
+  }
+  // Make room for the new request which also gives us the most up-to-date
+  // view of which requests have failed.
+  if (!wait_for_in_flight(max_in_flight_ - 1)) {
+    if (credits > 0)
+      this->credits()->release(credits);
+    return response_t<bool_t>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+  }
+  // An earlier failure is reported by this call but the request is sent
+  // regardless, it isn't the one that failed.
+  dword_t error = take_deferred_error(handle);
+  size_t next = (in_flight_first_ + in_flight_count_) % kMaxInFlightLimit;
+  tag_stream(request);
+  in_flight_[next].response = socket()->send_request(request);
+  in_flight_[next].handle = handle;
+  in_flight_[next].credits = credits;
+  in_flight_count_++;
+  return (error == 0)
+      ? response_t<bool_t>::yes()
+      : response_t<bool_t>::error(error);
+}
+
+bool PrpcConsoleConnector::acquire_write_credits(rpc::OutgoingRequest *request,
+    size_t size) {
+  if (is_pipelining()) {
+    // Only we process the responses that give credits back so rather than
+    // block we process them until there's room.
+    reap_in_flight();
+    if (!credits()->try_acquire(size)) {
+      credits()->count_throttle();
+      do {
+        if (!in()->process_next_instruction(NULL))
+          return false;
+        reap_in_flight();
+      } while (!credits()->try_acquire(size));
+    }
+  } else {
+    credits()->acquire(size);
+  }
+  // Let the owner know how often we've been held back. This is only sent
+  // once it has happened so the common case costs nothing.
+  uint64_t throttle_count = credits()->throttle_count();
+  if (throttle_count > 0)
+    request->set_argument("throttled", Variant::integer(throttle_count));
+  return true;
+}
+
+template <typename T, typename C>
+response_t<T> PrpcConsoleConnector::transmit_request(rpc::OutgoingRequest *request,
+    rpc::IncomingResponse *resp_out, request_lane_t lane) {
+  rpc::IncomingResponse resp;
+  tag_stream(request);
+  if (is_multiplexing()) {
+    if (!multiplexer()->send(request, lane, &resp))
       return response_t<T>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+  } else {
+    resp = socket()->send_request(request);
+    while (!resp->is_settled()) {
+      if (!in()->process_next_instruction(NULL))
+        return response_t<T>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+    }
   }
+  *resp_out = resp;
   if (resp->is_fulfilled()) {
     return response_t<T>::of(C::convert(resp->peek_value(Variant::null())));
   } else {
@@ -248,6 +932,52 @@ response_t<T> PrpcConsoleConnector::send_request_default(rpc::OutgoingRequest *r
   return send_request< T, DefaultConverter<T> >(request, response_out);
 }
 
+Variant PrpcConsoleConnector::wrap_payload(tclib::Blob data, RingSlice *slice) {
+  if (transport_ != NULL
+      && data.size() >= SharedRingTransport::kMinPayloadSize
+      && transport_->up()->write(data, slice))
+    return NativeVariant(slice);
+  return Variant::blob(data.start(), static_cast<uint32_t>(data.size()));
+}
+
+bool PrpcConsoleConnector::unwrap_payload(Variant value, tclib::Blob buffer,
+    size_t *size_out, bool is_utf8) {
+  *size_out = 0;
+  RingSlice *slice = value.native_as<RingSlice>();
+  tclib::Blob payload;
+  if (slice == NULL) {
+    payload = tclib::Blob(value.blob_data(), value.blob_size());
+  } else if (transport_ == NULL || !transport_->down()->read(slice, &payload)) {
+    WARN("Invalid payload slice");
+    return false;
+  }
+  size_t bytes_to_copy;
+  if (is_utf8) {
+    size_t length = Utf8Codec::decode(static_cast<uint8_t*>(payload.start()),
+        payload.size(), static_cast<wide_char_t*>(buffer.start()),
+        buffer.size() / sizeof(wide_char_t));
+    bytes_to_copy = length * sizeof(wide_char_t);
+  } else {
+    bytes_to_copy = min_size(payload.size(), buffer.size());
+    blob_copy_to(tclib::Blob(payload.start(), bytes_to_copy), buffer);
+  }
+  if (slice != NULL)
+    transport_->down()->release(slice);
+  *size_out = bytes_to_copy;
+  return true;
+}
+
+void PrpcConsoleConnector::tag_stream(rpc::OutgoingRequest *request) {
+  if (stream_id_ != 0)
+    request->set_argument("stream", Variant::integer(stream_id_));
+}
+
+response_t<uint32_t> PrpcConsoleConnector::open_stream() {
+  rpc::OutgoingRequest req(Variant::null(), "open_stream");
+  rpc::IncomingResponse resp;
+  return send_request_default<uint32_t>(&req, &resp);
+}
+
 response_t<int64_t> PrpcConsoleConnector::poke(int64_t value) {
   Variant arg = value;
   rpc::OutgoingRequest req(Variant::null(), "poke", 1, &arg);
@@ -256,131 +986,360 @@ response_t<int64_t> PrpcConsoleConnector::poke(int64_t value) {
 }
 
 response_t<uint32_t> PrpcConsoleConnector::get_console_cp(bool is_output) {
+  if (use_fast_path_) {
+    fast_frame_t<fast_get_console_cp_t> frame = FastFrame::create<fast_get_console_cp_t>();
+    frame.body.is_output = is_output;
+    Variant frame_var = FastFrame::to_variant(&frame);
+    rpc::OutgoingRequest req(Variant::null(), FastFrame::kSelector, 1, &frame_var);
+    rpc::IncomingResponse resp;
+    return send_request_default<uint32_t>(&req, &resp);
+  }
   Variant args[1] = {Variant::boolean(is_output)};
-  rpc::OutgoingRequest req(Variant::null(), "get_console_cp", 1, args);
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anGetConsoleCP, "get_console_cp"), 1, args);
   rpc::IncomingResponse resp;
   return send_request_default<uint32_t>(&req, &resp);
 }
 
 response_t<bool_t> PrpcConsoleConnector::set_console_cp(uint32_t value, bool is_output) {
   Variant args[2] = {value, Variant::boolean(is_output)};
-  rpc::OutgoingRequest req(Variant::null(), "set_console_cp", 2, args);
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anSetConsoleCP, "set_console_cp"), 2, args);
   rpc::IncomingResponse resp;
   return send_request_default<bool_t>(&req, &resp);
 }
 
 response_t<bool_t> PrpcConsoleConnector::set_console_title(tclib::Blob data,
     bool is_unicode) {
+  RingSlice slice;
   Variant args[2] = {
-      Variant::blob(data.start(), static_cast<uint32_t>(data.size())),
+      wrap_payload(data, &slice),
       Variant::boolean(is_unicode)
   };
-  rpc::OutgoingRequest req(Variant::null(), "set_console_title", 2, args);
-  rpc::IncomingResponse resp;
-  return send_request_default<bool_t>(&req, &resp);
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anSetConsoleTitle, "set_console_title"), 2, args);
+  return send_request_pipelined(&req, Handle::invalid());
 }
 
 response_t<uint32_t> PrpcConsoleConnector::get_console_title(tclib::Blob buffer,
     bool is_unicode) {
   Variant args[2] = {buffer.size(), Variant::boolean(is_unicode)};
-  rpc::OutgoingRequest req(Variant::null(), "get_console_title", 2, args);
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anGetConsoleTitle, "get_console_title"), 2, args);
   rpc::IncomingResponse resp;
   response_t<Variant> result = send_request_default<Variant>(&req, &resp);
   if (result.has_error())
     return response_t<uint32_t>::error(result);
   Array pair = result.value();
-  plankton::Blob presult = pair[0];
   size_t char_size = StringUtils::char_size(is_unicode);
   uint32_t return_value = static_cast<uint32_t>(pair[1].integer_value());
-  if (buffer.size() >= char_size) {
-    // There is always an implicit null terminator after the response's contents
-    // so we never copy more than leaves room for that.
-    uint32_t bytes_to_write = static_cast<uint32_t>(min_size(presult.size(), buffer.size() - char_size));
-    blob_copy_to(tclib::Blob(presult.data(), bytes_to_write), buffer);
-    tclib::Blob(static_cast<byte_t*>(buffer.start()) + bytes_to_write, char_size).fill(0);
-  }
+  // There is always an implicit null terminator after the response's contents
+  // so we never copy more than leaves room for that.
+  size_t room = (buffer.size() >= char_size) ? (buffer.size() - char_size) : 0;
+  size_t bytes_written = 0;
+  if (!unwrap_payload(pair[0], tclib::Blob(buffer.start(), room), &bytes_written))
+    return response_t<uint32_t>::error(CONPRX_ERROR_INVALID_RESPONSE);
+  if (buffer.size() >= char_size)
+    tclib::Blob(static_cast<byte_t*>(buffer.start()) + bytes_written, char_size).fill(0);
   return response_t<uint32_t>::of(return_value);
 }
 
 response_t<uint32_t> PrpcConsoleConnector::get_console_mode(Handle handle) {
-  NativeVariant handle_var(&handle);
-  rpc::OutgoingRequest req(Variant::null(), "get_console_mode", 1, &handle_var);
+  WireValue<Handle> handle_wire(&handle, use_compact_values_);
+  Variant handle_var = handle_wire.variant();
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anGetConsoleMode, "get_console_mode"), 1, &handle_var);
   rpc::IncomingResponse resp;
   return send_request_default<uint32_t>(&req, &resp);
 }
 
 response_t<bool_t> PrpcConsoleConnector::set_console_mode(Handle handle,
     uint32_t mode) {
-  NativeVariant handle_var(&handle);
-  Variant args[2] = {handle_var, mode};
-  rpc::OutgoingRequest req(Variant::null(), "set_console_mode", 2, args);
-  rpc::IncomingResponse resp;
-  return send_request_default<bool_t>(&req, &resp);
+  WireValue<Handle> handle_wire(&handle, use_compact_values_);
+  Variant args[2] = {handle_wire.variant(), mode};
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anSetConsoleMode, "set_console_mode"), 2, args);
+  return send_request_pipelined(&req, handle);
 }
 
 response_t<bool_t> PrpcConsoleConnector::set_console_cursor_position(Handle output,
     coord_t position) {
-  NativeVariant output_var(&output);
-  NativeVariant position_var(&position);
-  Variant args[2] = {output_var, position_var};
-  rpc::OutgoingRequest req(Variant::null(), "set_console_cursor_position", 2, args);
-  rpc::IncomingResponse resp;
-  return send_request_default<bool_t>(&req, &resp);
+  if (use_fast_path_) {
+    fast_frame_t<fast_set_console_cursor_position_t> frame =
+        FastFrame::create<fast_set_console_cursor_position_t>();
+    frame.body.output = output.id();
+    frame.body.position = position;
+    Variant frame_var = FastFrame::to_variant(&frame);
+    rpc::OutgoingRequest req(Variant::null(), FastFrame::kSelector, 1, &frame_var);
+    return send_request_pipelined(&req, output);
+  }
+  WireValue<Handle> output_wire(&output, use_compact_values_);
+  WireValue<coord_t> position_wire(&position, use_compact_values_);
+  Variant args[2] = {output_wire.variant(), position_wire.variant()};
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anSetConsoleCursorPosition, "set_console_cursor_position"), 2, args);
+  return send_request_pipelined(&req, output);
 }
 
 response_t<bool_t> PrpcConsoleConnector::get_console_screen_buffer_info(
     Handle buffer, console_screen_buffer_infoex_t *info_out) {
-  NativeVariant buffer_var(&buffer);
-  rpc::OutgoingRequest req(Variant::null(), "get_console_screen_buffer_info",
+  if (use_fast_path_) {
+    fast_frame_t<fast_get_console_screen_buffer_info_t> frame =
+        FastFrame::create<fast_get_console_screen_buffer_info_t>();
+    frame.body.output = buffer.id();
+    Variant frame_var = FastFrame::to_variant(&frame);
+    rpc::OutgoingRequest req(Variant::null(), FastFrame::kSelector, 1, &frame_var);
+    rpc::IncomingResponse resp;
+    response_t<Variant> result = send_request_default<Variant>(&req, &resp);
+    if (result.has_error())
+      return response_t<bool_t>::error(result);
+    Variant info = result.value();
+    if (info.blob_size() != sizeof(*info_out))
+      return response_t<bool_t>::error(CONPRX_ERROR_INVALID_RESPONSE);
+    memcpy(info_out, info.blob_data(), sizeof(*info_out));
+    return response_t<bool_t>::yes();
+  }
+  WireValue<Handle> buffer_wire(&buffer, use_compact_values_);
+  Variant buffer_var = buffer_wire.variant();
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anGetConsoleScreenBufferInfo, "get_console_screen_buffer_info"),
       1, &buffer_var);
   rpc::IncomingResponse resp;
   response_t<Variant> result = send_request_default<Variant>(&req, &resp);
   if (result.has_error())
     return response_t<bool_t>::error(result);
-  console_screen_buffer_infoex_t *info = result.value().native_as<console_screen_buffer_infoex_t>();
-  if (info == NULL)
+  if (!CompactCodec::decode(result.value(), info_out))
     return response_t<bool_t>::error(CONPRX_ERROR_INVALID_RESPONSE);
-  *info_out = *info;
   return response_t<bool_t>::yes();
 }
 
 response_t<uint32_t> PrpcConsoleConnector::write_console(Handle output,
     tclib::Blob data, bool is_unicode) {
-  NativeVariant output_var(&output);
+  Lock lock(this);
+  if (!coalescer()->accepts(output, data.size(), is_unicode))
+    flush_pending_writes();
+  // Errors from earlier writes that were held back are reported on the next
+  // write to the same handle since that is the closest we can get to the call
+  // that failed. This write still goes ahead, it has nothing to do with the
+  // failure and the caller has no way to tell that it was dropped.
+  dword_t deferred_error = take_deferred_error(output);
+  response_t<uint32_t> result;
+  if (coalescer()->accepts(output, data.size(), is_unicode)) {
+    on_holding_back_write();
+    coalescer()->append(output, data, is_unicode);
+    if (coalescer()->is_full())
+      flush_pending_writes();
+    result = response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+  } else {
+    // Either coalescing is disabled or the data is too large to ever fit so
+    // pass it straight through.
+    result = transmit_write_console(output, data, is_unicode);
+  }
+  // The earlier error wins over this write's own since it happened first.
+  return (deferred_error == 0)
+      ? result
+      : response_t<uint32_t>::error(deferred_error);
+}
+
+response_t<uint32_t> PrpcConsoleConnector::transmit_write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  size_t max_frame_size = max_write_frame_bytes();
+  if (max_frame_size == 0 || data.size() <= max_frame_size)
+    return transmit_write_frame(output, data, is_unicode, rlInteractive);
+  // Send the write in frames such that calls from other threads can get
+  // through in between and neither side has to hold all of it at once. The
+  // backend writes each frame as it arrives; unless it's streamed it sees a
+  // sequence of writes which is indistinguishable from the one large one.
+  bool is_streamed = (stream_chunk_bytes_ > 0);
+  request_lane_t lane = is_multiplexing() ? rlBulk : rlInteractive;
+  byte_t *start = static_cast<byte_t*>(data.start());
+  size_t written = 0;
+  while (written < data.size()) {
+    tclib::Blob rest(start + written, data.size() - written);
+    size_t frame_size = next_write_frame_size(rest, max_frame_size, is_unicode);
+    write_chunk_t chunk = {written, frame_size == rest.size()};
+    response_t<uint32_t> result = transmit_write_frame(output,
+        tclib::Blob(rest.start(), frame_size), is_unicode, lane,
+        is_streamed ? &chunk : NULL);
+    if (result.has_error())
+      return result;
+    if (is_streamed && chunk.is_last && !is_pipelining())
+      // The backend's response to the last chunk gives the total for the
+      // whole write.
+      return result;
+    written += result.value();
+    if (result.value() < frame_size)
+      // A short write means the backend isn't taking any more right now.
+      break;
+  }
+  return response_t<uint32_t>::of(static_cast<uint32_t>(written));
+}
+
+size_t PrpcConsoleConnector::max_write_frame_bytes() {
+  size_t result = is_multiplexing() ? max_bulk_frame_bytes_ : 0;
+  if (stream_chunk_bytes_ > 0 && (result == 0 || stream_chunk_bytes_ < result))
+    result = stream_chunk_bytes_;
+  return result;
+}
+
+size_t PrpcConsoleConnector::next_write_frame_size(tclib::Blob data,
+    size_t max_size, bool is_unicode) {
+  if (data.size() <= max_size)
+    return data.size();
+  size_t size = max_size;
+  if (is_unicode)
+    return size;
+  // Ansi data may be utf-8 so back up to the start of the character that
+  // straddles the boundary, if there is one.
+  byte_t *bytes = static_cast<byte_t*>(data.start());
+  size_t backed_up = 0;
+  while (backed_up < 3 && size > 1 && (bytes[size] & 0xC0) == 0x80) {
+    size--;
+    backed_up++;
+  }
+  return size;
+}
+
+response_t<uint32_t> PrpcConsoleConnector::transmit_write_frame(Handle output,
+    tclib::Blob data, bool is_unicode, request_lane_t lane, write_chunk_t *chunk) {
+  RingSlice slice;
+  if (!is_unicode || !use_utf8_wire_)
+    return transmit_write_payload(output, wrap_payload(data, &slice),
+        data.size(), is_unicode, false, lane, chunk);
+  size_t length = data.size() / sizeof(wide_char_t);
+  size_t capacity = length * Utf8Codec::kMaxBytesPerUnit;
+  wide_char_t *chars = static_cast<wide_char_t*>(data.start());
+  // If the result is going through the transport anyway encode it straight
+  // into the ring such that the caller's text doesn't have to be copied again
+  // on its way to the backend. Whether it goes through the transport depends
+  // on the size of the encoded bytes, the same as for any other payload, and
+  // that's also exactly how much room it needs. There's no point measuring
+  // text that would be too short even if every character took the most
+  // bytes it can.
+  tclib::Blob space;
+  size_t encoded_size = 0;
+  if (transport_ != NULL && capacity >= SharedRingTransport::kMinPayloadSize)
+    encoded_size = Utf8Codec::encoded_size(chars, length);
+  if (encoded_size >= SharedRingTransport::kMinPayloadSize
+      && transport_->up()->reserve(encoded_size, &space)) {
+    size_t size = Utf8Codec::encode(chars, length,
+        static_cast<uint8_t*>(space.start()));
+    transport_->up()->commit(size, &slice);
+    return transmit_write_payload(output, NativeVariant(&slice), data.size(),
+        true, true, lane, chunk);
+  }
+  // Otherwise encode it on the side. This may be called from several threads
+  // at once when multiplexing so the memory can't be shared between calls.
+  uint8_t inline_memory[kInlineUtf8Size];
+  tclib::Blob memory(inline_memory, sizeof(inline_memory));
+  if (capacity > sizeof(inline_memory)) {
+    memory = allocator_default_malloc(capacity);
+    if (memory.start() == NULL)
+      return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  }
+  size_t size = Utf8Codec::encode(chars, length,
+      static_cast<uint8_t*>(memory.start()));
+  response_t<uint32_t> result = transmit_write_payload(output,
+      wrap_payload(tclib::Blob(memory.start(), size), &slice), data.size(),
+      true, true, lane, chunk);
+  if (memory.start() != inline_memory)
+    allocator_default_free(memory);
+  return result;
+}
+
+response_t<uint32_t> PrpcConsoleConnector::transmit_write_payload(Handle output,
+    Variant payload, size_t size, bool is_unicode, bool is_utf8,
+    request_lane_t lane, write_chunk_t *chunk) {
+  if (use_fast_path_) {
+    fast_frame_t<fast_write_console_t> frame = FastFrame::create<fast_write_console_t>();
+    frame.body.output = output.id();
+    frame.body.is_unicode = is_unicode;
+    frame.body.is_utf8 = is_utf8;
+    Variant args[2] = {FastFrame::to_variant(&frame), payload};
+    rpc::OutgoingRequest req(Variant::null(), FastFrame::kSelector, 2, args);
+    set_write_chunk_arguments(&req, chunk);
+    return transmit_write_request(&req, output, size, lane);
+  }
+  WireValue<Handle> output_wire(&output, use_compact_values_);
   Variant args[3] = {
-    output_var,
-    Variant::blob(data.start(), static_cast<uint32_t>(data.size())),
+    output_wire.variant(),
+    payload,
     Variant::boolean(is_unicode)
   };
-  rpc::OutgoingRequest req(Variant::null(), "write_console", 3, args);
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anWriteConsole, "write_console"), 3, args);
+  if (is_utf8)
+    req.set_argument("utf8", Variant::yes());
+  set_write_chunk_arguments(&req, chunk);
+  return transmit_write_request(&req, output, size, lane);
+}
+
+void PrpcConsoleConnector::set_write_chunk_arguments(rpc::OutgoingRequest *request,
+    write_chunk_t *chunk) {
+  if (chunk == NULL)
+    return;
+  request->set_argument("stream_offset", Variant::integer(chunk->offset));
+  if (chunk->is_last)
+    request->set_argument("stream_end", Variant::yes());
+}
+
+response_t<uint32_t> PrpcConsoleConnector::transmit_write_request(
+    rpc::OutgoingRequest *request, Handle output, size_t size,
+    request_lane_t lane) {
+  size_t credits = 0;
+  if (this->credits()->is_enabled()) {
+    if (!acquire_write_credits(request, size))
+      return response_t<uint32_t>::error(CONPRX_ERROR_PROCESSING_INSTRUCTIONS);
+    credits = size;
+  }
+  if (is_pipelining()) {
+    response_t<bool_t> sent = transmit_request_pipelined(request, output, credits);
+    return sent.has_error()
+        ? response_t<uint32_t>::error(sent)
+        : response_t<uint32_t>::of(static_cast<uint32_t>(size));
+  }
   rpc::IncomingResponse resp;
-  return send_request_default<uint32_t>(&req, &resp);
+  response_t<uint32_t> result = transmit_request< uint32_t, DefaultConverter<uint32_t> >(
+      request, &resp, lane);
+  if (credits > 0)
+    this->credits()->release(credits);
+  return result;
 }
 
 response_t<uint32_t> PrpcConsoleConnector::read_console(Handle input,
     tclib::Blob buffer, bool is_unicode, console_readconsole_control_t *input_control) {
-  NativeVariant input_var(&input);
-  NativeVariant control_var(input_control);
-  Variant args[4] = {input_var, buffer.size(), Variant::boolean(is_unicode),
-      control_var};
-  rpc::OutgoingRequest req(Variant::null(), "read_console", 4, args);
+  WireValue<Handle> input_wire(&input, use_compact_values_);
+  WireValue<console_readconsole_control_t> control_wire(input_control,
+      use_compact_values_);
+  Variant args[4] = {input_wire.variant(), buffer.size(),
+      Variant::boolean(is_unicode), control_wire.variant()};
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anReadConsole, "read_console"), 4, args);
+  if (is_unicode && use_utf8_wire_)
+    req.set_argument("utf8", Variant::yes());
   rpc::IncomingResponse resp;
   response_t<Variant> result = send_request_default<Variant>(&req, &resp);
   if (result.has_error())
     return response_t<uint32_t>::error(result);
   Map response = result.value();
-  plankton::Blob presult = response["data"];
-  uint32_t return_value = static_cast<uint32_t>(response["result"].integer_value());
-  uint32_t bytes_to_write = static_cast<uint32_t>(min_size(presult.size(), buffer.size()));
-  blob_copy_to(tclib::Blob(presult.data(), bytes_to_write), buffer);
-  console_readconsole_control_t *input_control_out = response["input_control"].native_as<console_readconsole_control_t>();
-  *input_control = *input_control_out;
-  return response_t<uint32_t>::of(return_value);
+  // The owner may decide to send the text as it is even if we asked for
+  // utf-8 so it says which it is. Either way what was read is what ended up
+  // in the buffer, which is only the same as the owner's result if the text
+  // was sent as it is and all of it fit.
+  size_t bytes_read = 0;
+  if (!unwrap_payload(response["data"], buffer, &bytes_read,
+          response["utf8"].bool_value()))
+    return response_t<uint32_t>::error(CONPRX_ERROR_INVALID_RESPONSE);
+  if (!CompactCodec::decode(response["input_control"], input_control))
+    return response_t<uint32_t>::error(CONPRX_ERROR_INVALID_RESPONSE);
+  return response_t<uint32_t>::of(static_cast<uint32_t>(bytes_read));
 }
 
 response_t<bool_t> PrpcConsoleConnector::create_process(NativeProcessInfo *info) {
-  NativeVariant info_var(info);
-  rpc::OutgoingRequest req(Variant::null(), "create_process", 1, &info_var);
+  WireValue<NativeProcessInfo> info_wire(info, use_compact_values_);
+  Variant info_var = info_wire.variant();
+  rpc::OutgoingRequest req(Variant::null(),
+      selector(anCreateProcess, "create_process"), 1, &info_var);
   rpc::IncomingResponse resp;
   return send_request_default<bool_t>(&req, &resp);
 }
@@ -14,6 +14,14 @@
 #include "io/stream.hh"
 #include "plankton-inl.hh"
 #include "rpc.hh"
+#include "share/compact.hh"
+#include "share/credits.hh"
+#include "share/fastpath.hh"
+#include "share/shmring.hh"
+#include "share/statepage.hh"
+#include "sync/drawbridge.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
 
 namespace conprx {
 
@@ -56,13 +64,25 @@ public:
       bool is_unicode, console_readconsole_control_t *input_control) = 0;
 
   virtual response_t<bool_t> create_process(NativeProcessInfo *info) = 0;
+
+  // Makes sure any requests this connector has held back have been delivered.
+  // Connectors that send every request immediately don't need to override
+  // this.
+  virtual response_t<bool_t> flush() { return response_t<bool_t>::yes(); }
+
+  // Returns true if there are requests that have been held back or whose
+  // responses haven't been processed yet, in which case the backend's state
+  // may not reflect them yet.
+  virtual bool has_pending_requests() { return false; }
 };
 
 // A console adaptor converts raw lpc messages into plankton messages to send
 // through a connector.
 class ConsoleAdaptor : public tclib::DefaultDestructable {
 public:
-  ConsoleAdaptor(ConsoleConnector *connector) : connector_(connector) { }
+  ConsoleAdaptor(ConsoleConnector *connector)
+    : connector_(connector)
+    , state_page_(NULL) { }
   virtual ~ConsoleAdaptor() { }
   virtual void default_destroy() { tclib::default_delete_concrete(this); }
 
@@ -74,9 +94,232 @@ public:
 
   response_t<int64_t> poke(int64_t value);
 
+  // Flushes any requests held back by the connector.
+  response_t<bool_t> flush();
+
+  // Sets the connector to send requests through. An agent that connects to
+  // its owner lazily creates the adaptor without one, which is fine for
+  // handlers that don't reach the backend, and sets it once connected.
+  void set_connector(ConsoleConnector *connector) { connector_ = connector; }
+
+  // Sets the page the backend publishes its state to. Queries that can be
+  // answered from the state are answered locally rather than calling the
+  // backend when the page is valid.
+  void set_state_page(ConsoleStatePage *page) { state_page_ = page; }
+
 private:
+  // Stores the backend's current state in the out parameter if it's available
+  // and up to date with the requests made through the connector, otherwise
+  // returns false.
+  bool read_local_state(console_state_t *state_out);
+
+  // Returns true if a get-title call with a buffer of the given size can be
+  // answered without the title itself, that is, the result is empty.
+  static bool is_title_result_empty(console_state_t *state, size_t buffer_size,
+      bool is_unicode);
+
+  // Fills in the given screen buffer info, either from the local state or by
+  // calling the backend.
+  response_t<bool_t> get_console_screen_buffer_info(Handle output,
+      console_screen_buffer_infoex_t *info_out);
+
   ConsoleConnector *connector() { return connector_; }
   ConsoleConnector *connector_;
+  ConsoleStatePage *state_page_;
+};
+
+class Options;
+
+// Buffer that accumulates consecutive writes to the same handle such that they
+// can be sent to the backend as a single write.
+class WriteCoalescer {
+public:
+  WriteCoalescer();
+  ~WriteCoalescer();
+
+  // Allocates a buffer of the given size. Until this has been called the
+  // coalescer is disabled and accepts nothing.
+  bool initialize(size_t capacity);
+
+  // Returns true if data of the given size can be appended to what is already
+  // pending without flushing first.
+  bool accepts(Handle output, size_t size, bool is_unicode);
+
+  // Appends the given data which must be accepted by this buffer.
+  void append(Handle output, tclib::Blob data, bool is_unicode);
+
+  // Drops all pending data.
+  void clear() { size_ = 0; }
+
+  bool is_enabled() { return memory_.start() != NULL; }
+  bool is_empty() { return size_ == 0; }
+  bool is_full() { return size_ == memory_.size(); }
+  size_t capacity() { return memory_.size(); }
+  tclib::Blob pending() { return tclib::Blob(memory_.start(), size_); }
+  Handle output() { return output_; }
+  bool is_unicode() { return is_unicode_; }
+
+private:
+  tclib::Blob memory_;
+  size_t size_;
+  Handle output_;
+  bool is_unicode_;
+};
+
+// The lanes requests are sent through by a multiplexer. Interactive requests
+// are always sent before bulk ones and bulk requests are sent one at a time so
+// a large write can only hold up an interactive call by the time it takes to
+// process one bulk frame.
+enum request_lane_t {
+  rlInteractive = 0,
+  rlBulk = 1
+};
+
+// A request submitted to a multiplexer. It lives on the submitting thread's
+// stack while that thread waits for the multiplexer to complete it.
+class MultiplexedRequest {
+public:
+  MultiplexedRequest(plankton::rpc::OutgoingRequest *request, request_lane_t lane);
+
+  // Must be called before the request is submitted.
+  bool initialize() { return done_.initialize(); }
+
+private:
+  friend class RequestQueue;
+  friend class RequestMultiplexer;
+  plankton::rpc::OutgoingRequest *request_;
+  request_lane_t lane_;
+  plankton::rpc::IncomingResponse response_;
+  // Lowered by the demux thread when the response has been received, or by
+  // whichever thread notices that the request has failed; the multiplexer
+  // doesn't touch the request after that.
+  tclib::Drawbridge done_;
+  bool has_failed_;
+  MultiplexedRequest *next_;
+};
+
+// Lock-free multi-producer single-consumer queue of submitted requests.
+// Producers push onto a stack with compare-and-swap; the consumer takes the
+// whole stack with an exchange and reverses it so requests come out in the
+// order they were pushed.
+class RequestQueue {
+public:
+  RequestQueue() : top_(NULL) { }
+
+  // Adds a request to the queue. Can be called from any thread.
+  void push(MultiplexedRequest *request);
+
+  // Removes everything from the queue and returns it as a list linked through
+  // the next_ fields, oldest first. Must only be called by the consumer.
+  MultiplexedRequest *take_all();
+
+private:
+  MultiplexedRequest *volatile top_;
+};
+
+// Lets any number of threads send requests through the same socket at the
+// same time. Requests are submitted through a queue per lane. A mux thread,
+// the only one that writes to the socket, takes them off the queues and sends
+// them, and a demux thread, the only one that reads from it, reads the
+// responses and hands each one back to the thread waiting for it. Sending
+// and reading both update the socket's record of which requests are waiting
+// for responses so the two threads take turns: the demux thread only reads
+// while there are responses to wait for and gives way to the mux thread
+// between reads whenever it has something to send. Any number of interactive
+// requests can be in flight at a time but only one bulk request.
+class RequestMultiplexer : public tclib::DefaultDestructable {
+public:
+  RequestMultiplexer(plankton::rpc::MessageSocket *socket, plankton::InputSocket *in);
+  virtual ~RequestMultiplexer();
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+
+  // Starts the mux and demux threads.
+  fat_bool_t start();
+
+  // Sets the stream the input socket reads from. If the multiplexer is
+  // destroyed while responses are still outstanding the stream is closed such
+  // that the demux thread, which would otherwise be blocked waiting for them,
+  // can be joined.
+  void set_input_stream(tclib::InStream *stream) { stream_ = stream; }
+
+  // Sends the given request through the given lane and waits for the
+  // response. Returns false if the connection has failed. Can be called from
+  // any thread.
+  bool send(plankton::rpc::OutgoingRequest *request, request_lane_t lane,
+      plankton::rpc::IncomingResponse *response_out);
+
+private:
+  // Main loop of the mux thread.
+  opaque_t run_mux();
+
+  // Main loop of the demux thread.
+  opaque_t run_demux();
+
+  // Sends the given list of requests or, if the connection has failed, fails
+  // them.
+  void send_submitted(MultiplexedRequest *submitted);
+
+  // Sends the given request and adds it to the in-flight list, or fails it if
+  // the connection has failed. The socket mutex and the mutex must be held.
+  void send_one(MultiplexedRequest *request);
+
+  // Acquires the socket mutex on the mux thread, making the demux thread give
+  // way if it's between reads. Must be followed by lowering has_sent_ once the
+  // mutex has been released.
+  void lock_socket_for_sending();
+
+  // Adds the given list of bulk requests to the ones waiting to be sent.
+  void defer_bulk(MultiplexedRequest *submitted);
+
+  // Sends the oldest waiting bulk request unless one is already in flight.
+  void send_next_bulk();
+
+  // Completes the in-flight requests that have been settled. The mutex must
+  // be held.
+  void complete_settled();
+
+  // Fails all the in-flight requests. The mutex must be held.
+  void fail_in_flight();
+
+  // Removes the given in-flight request, whose predecessor in the list is
+  // given, and wakes up the thread waiting for it. The mutex must be held.
+  void complete(MultiplexedRequest *prev, MultiplexedRequest *request);
+
+  plankton::rpc::MessageSocket *socket_;
+  plankton::rpc::MessageSocket *socket() { return socket_; }
+  plankton::InputSocket *in_;
+  plankton::InputSocket *in() { return in_; }
+  tclib::InStream *stream_;
+  RequestQueue *queue(request_lane_t lane) { return &queues_[lane]; }
+  RequestQueue queues_[2];
+  // Bulk requests that have been taken from their queue but not sent yet,
+  // oldest first. Only accessed by the mux thread.
+  MultiplexedRequest *bulk_waiting_first_;
+  MultiplexedRequest *bulk_waiting_last_;
+  // Lowered when there may be new requests in the queue, the bulk request in
+  // flight has completed, or the multiplexer is stopping.
+  tclib::Drawbridge has_work_;
+  // Lowered when requests have been sent, the mux thread is done with the
+  // socket, or the multiplexer is stopping.
+  tclib::Drawbridge has_sent_;
+  tclib::NativeThread mux_;
+  tclib::NativeThread demux_;
+  // Held by the mux thread while it sends and by the demux thread while it
+  // reads, which includes blocking on the socket.
+  tclib::NativeMutex socket_mutex_;
+  // Set while the mux thread is waiting for the socket mutex.
+  volatile bool is_mux_waiting_;
+  // Guards the in-flight list, is_bulk_in_flight_, and has_failed_ which are
+  // shared between the two threads. It's never held while blocking on the
+  // socket.
+  tclib::NativeMutex mutex_;
+  // The requests that have been sent but not completed, oldest first.
+  MultiplexedRequest *in_flight_first_;
+  MultiplexedRequest *in_flight_last_;
+  bool is_bulk_in_flight_;
+  bool has_failed_;
+  volatile bool is_stopping_;
+  bool is_started_;
 };
 
 // Concrete console connector that is implemented by sending messages over
@@ -84,6 +327,7 @@ private:
 class PrpcConsoleConnector : public ConsoleConnector {
 public:
   PrpcConsoleConnector(plankton::rpc::MessageSocket *socket, plankton::InputSocket *in);
+  virtual ~PrpcConsoleConnector();
   virtual void default_destroy() { tclib::default_delete_concrete(this); }
   virtual response_t<int64_t> poke(int64_t value);
   virtual response_t<uint32_t> get_console_cp(bool is_output);
@@ -101,27 +345,324 @@ public:
   virtual response_t<uint32_t> read_console(Handle input, tclib::Blob buffer,
       bool is_unicode, console_readconsole_control_t *input_control);
   virtual response_t<bool_t> create_process(NativeProcessInfo *info);
+  virtual response_t<bool_t> flush();
+  virtual bool has_pending_requests();
+
+  // Turns on coalescing of writes. Consecutive writes to the same handle with
+  // the same encoding are held back until max_bytes have accumulated, a call
+  // other than a write is made, the connector is flushed, or max_delay_ms have
+  // passed since the first of them was held back. A max delay of 0 means no
+  // deadline. If sending held back writes
+  // fails the error is reported by the next write to the same handle, which
+  // still goes ahead, or the next synchronous call, see defer_error.
+  fat_bool_t enable_write_coalescing(uint32_t max_bytes, uint32_t max_delay_ms);
+
+  // Turns on pipelining. Calls whose results are rarely used -- setting the
+  // title, mode, and cursor position, and writing -- return success
+  // immediately and their responses are processed later, with up to
+  // max_in_flight requests outstanding at a time. If one of them turns out to
+  // have failed the error is reported by the next call to the same handle or
+  // the next synchronous call, whichever comes first. The call that reports
+  // the error is still made. If several fail before the error has been
+  // reported it's the first one that is, see defer_error.
+  fat_bool_t enable_pipelining(uint32_t max_in_flight);
+
+  // The most requests that can be in flight at the same time.
+  static const size_t kMaxInFlightLimit = 256;
+
+  // Turns on multiplexing which makes it safe to call this connector from any
+  // number of threads at the same time, see {{RequestMultiplexer}}. Coalescing,
+  // pipelining, and the shared memory transport all assume a single caller so
+  // this fails if any of them are enabled, and they can't be enabled after
+  // this has been called.
+  //
+  // Writes larger than max_bulk_frame_bytes are split into frames of at most
+  // that size and sent through the bulk lane such that other threads' calls
+  // can get through in between. If it is 0 everything goes through the
+  // interactive lane in one piece.
+  fat_bool_t enable_multiplexing(uint32_t max_bulk_frame_bytes = kDefaultMaxBulkFrameBytes);
+
+  // Like the above but sends through the given multiplexer, which must outlive
+  // this connector, rather than one of its own. This is how the connector
+  // shares the socket with other senders, like the agent's log.
+  fat_bool_t enable_multiplexing(RequestMultiplexer *multiplexer,
+      uint32_t max_bulk_frame_bytes = kDefaultMaxBulkFrameBytes);
+
+  // The default largest bulk frame when multiplexing.
+  static const uint32_t kDefaultMaxBulkFrameBytes = 16384;
+
+  bool is_multiplexing() { return multiplexer_ != NULL; }
+
+  // Makes this connector hold the given mutex whenever it uses the socket,
+  // for when it isn't the only one sending through it; the agent's log does
+  // too. A multiplexing connector doesn't need this, everything goes through
+  // the multiplexer. Must be called before anything else is enabled.
+  void share_socket(tclib::NativeMutex *mutex) { mutex_ = mutex; }
+
+  // Makes this connector keep the bytes of writes that are on their way to
+  // the backend within the given number of credits, blocking when they run
+  // out. Only call this if the owner has granted credits.
+  fat_bool_t enable_write_credits(uint32_t credits);
+
+  // Returns the gate that keeps track of write credits.
+  WriteCreditGate *credits() { return &credits_; }
+
+  // Makes this connector send the calls that have a fixed-layout encoding
+  // using that rather than the general one. Only call this if the owner has
+  // said it understands the fast path.
+  void enable_fast_path() { use_fast_path_ = true; }
+
+  // Makes this connector identify the methods it calls by their api numbers
+  // rather than their names. Only call this if the owner has said it
+  // understands numeric selectors.
+  void enable_numeric_selectors() { use_numeric_selectors_ = true; }
+
+  // Makes this connector stream writes larger than chunk_bytes to the backend
+  // in chunks of at most that size, such that neither side has to hold more
+  // than a chunk of a write at a time and the backend can start writing the
+  // first chunk before the rest has arrived. Only call this if the owner has
+  // said it understands streamed writes.
+  void enable_write_streaming(uint32_t chunk_bytes);
+
+  // Makes this connector send wide text as utf-8 and ask for wide text to be
+  // returned as utf-8, which for mostly-ascii text is close to half the size.
+  // Only call this if the owner has said it understands utf-8 payloads.
+  void enable_utf8_wire() { use_utf8_wire_ = true; }
+
+  // Makes this connector send handles, coordinates and the other protocol
+  // value types in their compact encoding rather than as seeds. Only call this
+  // if the owner has said it understands compact values.
+  void enable_compact_values() { use_compact_values_ = true; }
+
+  // Makes this connector tag its requests with the given stream id, for an
+  // agent that shares another agent's channel to the backend rather than
+  // having one of its own. The id is one another connector on the channel got
+  // from open_stream. Stream 0, the default, is the channel's own agent and
+  // isn't tagged.
+  void set_stream_id(uint32_t value) { stream_id_ = value; }
+
+  // Asks the backend for a new stream on this connector's channel for another
+  // agent to use.
+  response_t<uint32_t> open_stream();
+
+  // Sets up this connector as specified by the given agent options. If they
+  // say to multiplex and a multiplexer is given it is used rather than a new
+  // one.
+  fat_bool_t configure(Options *options, RequestMultiplexer *multiplexer = NULL);
+
+  // Makes this connector send and receive large payloads through the given
+  // shared memory transport rather than inline in messages.
+  void set_transport(SharedRingTransport *transport) { transport_ = transport; }
 
   static tclib::pass_def_ref_t<ConsoleConnector> create(
       plankton::rpc::MessageSocket *socket, plankton::InputSocket *in);
 
 private:
+  // Holds the connector's lock while in scope, if the connector needs locking.
+  class Lock {
+  public:
+    Lock(PrpcConsoleConnector *connector);
+    ~Lock();
+  private:
+    tclib::NativeMutex *mutex_;
+  };
+
   // Send a request through the socket and wait for a response, converting it
-  // to an API response of the given type using the given converter.
+  // to an API response of the given type using the given converter. Any
+  // pending writes are flushed first.
   template <typename T, typename C>
   response_t<T> send_request(plankton::rpc::OutgoingRequest *request,
       plankton::rpc::IncomingResponse *response_out);
 
+  // Works the same way as send_request but doesn't lock or flush, it just
+  // sends the request. The lane only matters when multiplexing.
+  template <typename T, typename C>
+  response_t<T> transmit_request(plankton::rpc::OutgoingRequest *request,
+      plankton::rpc::IncomingResponse *response_out,
+      request_lane_t lane = rlInteractive);
+
+  // Sends a request whose result is only success or failure. If pipelining is
+  // enabled the request is sent without waiting for the response and success
+  // is returned, otherwise this works like send_request. The handle is the one
+  // the request concerns, or the invalid handle if none.
+  response_t<bool_t> send_request_pipelined(plankton::rpc::OutgoingRequest *request,
+      Handle handle);
+
+  // Works the same way as send_request_pipelined but doesn't lock or flush.
+  // The given number of write credits are released when the response has
+  // been processed.
+  response_t<bool_t> transmit_request_pipelined(plankton::rpc::OutgoingRequest *request,
+      Handle handle, size_t credits = 0);
+
+  // Takes write credits for the given request which writes size bytes,
+  // waiting for in-flight requests to complete if there aren't enough.
+  // Returns false if processing fails while waiting.
+  bool acquire_write_credits(plankton::rpc::OutgoingRequest *request, size_t size);
+
+  // Processes the responses to in-flight requests that have already been
+  // settled, oldest first, recording any errors.
+  void reap_in_flight();
+
+  // Processes instructions until no more than the given number of requests
+  // are in flight. Returns false if processing fails.
+  bool wait_for_in_flight(size_t max_remaining);
+
+  bool is_pipelining() { return max_in_flight_ > 0; }
+
   // Works the same way as send_request but uses the default converter for the
   // type T instead of requiring one to be specified.
   template <typename T>
   response_t<T> send_request_default(plankton::rpc::OutgoingRequest *request,
       plankton::rpc::IncomingResponse *response_out);
 
+  // Returns a variant that carries the given payload, through the transport
+  // if possible and inline otherwise. The slice must stay alive until the
+  // variant has been sent.
+  plankton::Variant wrap_payload(tclib::Blob data, RingSlice *slice);
+
+  // Copies as much as will fit of the payload carried by the given variant
+  // into the buffer, releasing it from the transport if that's where it was.
+  // If is_utf8 is true the payload is utf-8 which is widened on the way.
+  // Stores the number of bytes stored in the buffer in size_out. Returns false
+  // if the payload refers to the transport but can't be read from it.
+  bool unwrap_payload(plankton::Variant value, tclib::Blob buffer,
+      size_t *size_out, bool is_utf8 = false);
+
+  // Sends a write without any coalescing, split into bulk frames or stream
+  // chunks if it is too large to send in one piece.
+  response_t<uint32_t> transmit_write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+
+  // Where a frame sits within a streamed write.
+  struct write_chunk_t {
+    // The number of bytes of the write sent before this chunk.
+    size_t offset;
+    // Is this the last chunk of the write?
+    bool is_last;
+  };
+
+  // Sends a single write request through the given lane. If the write is
+  // streamed, chunk says which part of it this is, otherwise it is NULL.
+  response_t<uint32_t> transmit_write_frame(Handle output, tclib::Blob data,
+      bool is_unicode, request_lane_t lane, write_chunk_t *chunk = NULL);
+
+  // Sends a single write request whose payload has already been encoded and
+  // wrapped; size is the size of the data before it was encoded.
+  response_t<uint32_t> transmit_write_payload(Handle output,
+      plankton::Variant payload, size_t size, bool is_unicode, bool is_utf8,
+      request_lane_t lane, write_chunk_t *chunk);
+
+  // Wide text up to this many bytes is encoded as utf-8 on the stack, longer
+  // text in memory allocated for the purpose.
+  static const size_t kInlineUtf8Size = 1024;
+
+  // Marks the given write request as the given chunk of a streamed write.
+  static void set_write_chunk_arguments(plankton::rpc::OutgoingRequest *request,
+      write_chunk_t *chunk);
+
+  // Returns the largest frame to send a write in, or 0 if writes are always
+  // sent in one piece.
+  size_t max_write_frame_bytes();
+
+  // Returns the size of the next frame of at most max_size to send of the
+  // given write data, making sure not to split a character.
+  static size_t next_write_frame_size(tclib::Blob data, size_t max_size,
+      bool is_unicode);
+
+  // Sends an already built write request for size bytes, pipelining it if
+  // pipelining is enabled.
+  response_t<uint32_t> transmit_write_request(plankton::rpc::OutgoingRequest *request,
+      Handle output, size_t size, request_lane_t lane);
+
+  // Sends the pending writes, if there are any. A failure is remembered and
+  // reported later since the writes that failed have already been reported as
+  // successful. Must be called with the lock held.
+  void flush_pending_writes();
+
+  // Returns the selector to use when calling the method for the message with
+  // the given api number and name.
+  plankton::Variant selector(lpc_api_num_t apinum, const char *name);
+
+  // Records an error from a request that has already been reported as
+  // successful. Only one error is kept at a time: the first one wins and any
+  // that occur before it has been reported are dropped, later failures are
+  // usually a consequence of the first one anyway.
+  void defer_error(Handle handle, dword_t error);
+
+  // Returns and clears the deferred error, 0 if there is none.
+  dword_t take_deferred_error();
+
+  // Returns and clears the deferred error if it concerns the given handle,
+  // otherwise returns 0.
+  dword_t take_deferred_error(Handle handle);
+
+  // A request that has been sent but whose response hasn't been processed.
+  struct in_flight_request_t {
+    plankton::rpc::IncomingResponse response;
+    Handle handle;
+    // The write credits to release when the response has been processed.
+    size_t credits;
+  };
+
+  // Main loop of the thread that flushes pending writes when the deadline
+  // passes.
+  opaque_t run_flush_timer();
+
+  // Called with the lock held before a write is held back; if it's the first
+  // one since the last flush it starts the flush timer's countdown.
+  void on_holding_back_write();
+
   plankton::rpc::MessageSocket *socket_;
   plankton::rpc::MessageSocket *socket() { return socket_; }
   plankton::InputSocket *in_;
   plankton::InputSocket *in() { return in_; }
+  SharedRingTransport *transport_;
+  bool use_fast_path_;
+  bool use_numeric_selectors_;
+  bool use_utf8_wire_;
+  bool use_compact_values_;
+  uint32_t stream_id_;
+
+  // Tags the given request with this connector's stream if it has one.
+  void tag_stream(plankton::rpc::OutgoingRequest *request);
+
+  WriteCoalescer *coalescer() { return &coalescer_; }
+  WriteCoalescer coalescer_;
+
+  dword_t deferred_error_;
+  Handle deferred_error_handle_;
+
+  // Ring buffer of requests in flight, used when pipelining.
+  in_flight_request_t in_flight_[kMaxInFlightLimit];
+  size_t in_flight_first_;
+  size_t in_flight_count_;
+  size_t max_in_flight_;
+
+  // Held while the connector uses the socket. It is NULL, and there's no
+  // locking, unless the socket is shared or there is a flush timer since
+  // otherwise the connector is only ever called from the thread making
+  // console calls.
+  tclib::NativeMutex *mutex_;
+  // The mutex to use if there is a flush timer but the socket isn't shared.
+  tclib::NativeMutex own_mutex_;
+  bool has_flush_timer_;
+  tclib::NativeThread flush_timer_;
+  // Lowered when the first write since the last flush is held back, or the
+  // timer is stopping.
+  tclib::Drawbridge has_held_back_;
+  // When the first write since the last flush was held back.
+  uint64_t held_back_since_nanos_;
+  uint32_t max_delay_ms_;
+  volatile bool stop_flush_timer_;
+
+  RequestMultiplexer *multiplexer() { return multiplexer_; }
+  RequestMultiplexer *multiplexer_;
+  // The multiplexer if this connector created it itself.
+  tclib::def_ref_t<RequestMultiplexer> own_multiplexer_;
+  size_t max_bulk_frame_bytes_;
+  size_t stream_chunk_bytes_;
+
+  WriteCreditGate credits_;
 };
 
 } // conprx
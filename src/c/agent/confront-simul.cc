@@ -102,7 +102,12 @@ public:
   // appropriate as a return value from any boolean console functions.
   bool update_last_error(AbstractSimulatedMessage *message);
 
-  lpc::Interceptor *interceptor() { return &interceptor_; }
+  virtual lpc::Interceptor *interceptor() { return &interceptor_; }
+
+  // Hands the message to the agent the way the patched lpc call would, which
+  // means passing it straight to the native backend if interception has been
+  // disabled on this thread.
+  NtStatus deliver(lpc::Message *message);
 
   ConsoleAgent *agent() { return agent_; }
 
@@ -123,6 +128,12 @@ SimulatingConsoleFrontend::SimulatingConsoleFrontend(ConsoleAgent *agent,
 SimulatingConsoleFrontend::~SimulatingConsoleFrontend() {
 }
 
+NtStatus SimulatingConsoleFrontend::deliver(lpc::Message *message) {
+  return interceptor_.is_enabled()
+      ? agent()->on_message(message)
+      : message->call_native_backend();
+}
+
 int64_t SimulatingConsoleFrontend::poke_backend(int64_t value) {
   response_t<int64_t> result = agent()->adaptor()->poke(value);
   if (result.has_error()) {
@@ -215,7 +226,7 @@ uint32_t SimulatingConsoleFrontend::get_console_cp(bool is_output) {
   SimulatedMessage<ConsoleAgent::lmGetConsoleCP> message(this);
   lpc::get_console_cp_m *payload = message.payload();
   payload->is_output = is_output;
-  agent()->on_message(message.message());
+  deliver(message.message());
   update_last_error(&message);
   return payload->code_page_id;
 }
@@ -233,7 +244,7 @@ bool_t SimulatingConsoleFrontend::set_console_cp(uint32_t value, bool is_output)
   lpc::set_console_cp_m *payload = message.payload();
   payload->is_output = is_output;
   payload->code_page_id = value;
-  agent()->on_message(message.message());
+  deliver(message.message());
   return update_last_error(&message);
 }
 
@@ -252,7 +263,7 @@ bool_t SimulatingConsoleFrontend::set_console_cursor_position(handle_t output,
   lpc::set_console_cursor_position_m *payload = message.payload();
   payload->output = output;
   payload->position = position;
-  agent()->on_message(message.message());
+  deliver(message.message());
   return update_last_error(&message);
 }
 
@@ -263,7 +274,7 @@ bool_t SimulatingConsoleFrontend::set_console_title_a(ansi_cstr_t str) {
   payload->size_in_bytes_in = static_cast<uint32_t>(blob.size());
   payload->title = xform().local_to_remote(blob.start());
   payload->is_unicode = false;
-  agent()->on_message(message.message());
+  deliver(message.message());
   return update_last_error(&message);
 }
 
@@ -273,7 +284,7 @@ dword_t SimulatingConsoleFrontend::get_console_title_a(ansi_str_t str, dword_t n
   payload->size_in_bytes_in = n;
   payload->title = xform().local_to_remote(str);
   payload->is_unicode = false;
-  agent()->on_message(message.message());
+  deliver(message.message());
   update_last_error(&message);
   return payload->length_in_chars_out;
 }
@@ -285,7 +296,7 @@ bool_t SimulatingConsoleFrontend::set_console_title_w(wide_cstr_t str) {
   payload->size_in_bytes_in = static_cast<uint32_t>(blob.size());
   payload->title = xform().local_to_remote(blob.start());
   payload->is_unicode = true;
-  agent()->on_message(message.message());
+  deliver(message.message());
   return update_last_error(&message);
 }
 
@@ -295,7 +306,7 @@ dword_t SimulatingConsoleFrontend::get_console_title_w(wide_str_t str, dword_t n
   payload->size_in_bytes_in = n;
   payload->title = xform().local_to_remote(str);
   payload->is_unicode = true;
-  agent()->on_message(message.message());
+  deliver(message.message());
   update_last_error(&message);
   return payload->length_in_chars_out;
 }
@@ -329,7 +340,7 @@ bool_t SimulatingConsoleFrontend::write_console_aw(handle_t output, const void *
     payload->is_inline = false;
     payload->contents = const_cast<void*>(xform().local_to_remote(buffer));
   }
-  agent()->on_message(message.message());
+  deliver(message.message());
   if (chars_written != NULL)
     *chars_written = static_cast<dword_t>(payload->size_in_bytes / char_size);
   return update_last_error(&message);
@@ -368,7 +379,7 @@ bool_t SimulatingConsoleFrontend::read_console_aw(handle_t input, void *buffer,
     payload->ctrl_wakeup_mask = input_control->dwCtrlWakeupMask;
     payload->control_key_state = input_control->dwControlKeyState;
   }
-  agent()->on_message(message.message());
+  deliver(message.message());
   if (chars_read != NULL)
     *chars_read = static_cast<dword_t>(payload->size_in_bytes / char_size);
   if (input_control != NULL)
@@ -381,7 +392,7 @@ bool_t SimulatingConsoleFrontend::get_console_mode(handle_t handle, dword_t *mod
   lpc::get_console_mode_m *payload = message.payload();
   payload->handle = handle;
   payload->mode = 0;
-  agent()->on_message(message.message());
+  deliver(message.message());
   *mode_out = payload->mode;
   return update_last_error(&message);
 }
@@ -391,7 +402,7 @@ bool_t SimulatingConsoleFrontend::set_console_mode(handle_t handle, dword_t mode
   lpc::set_console_mode_m *payload = message.payload();
   payload->handle = handle;
   payload->mode = mode;
-  agent()->on_message(message.message());
+  deliver(message.message());
   return update_last_error(&message);
 }
 
@@ -416,7 +427,7 @@ bool_t SimulatingConsoleFrontend::get_console_screen_buffer_info(handle_t handle
   SimulatedMessage<ConsoleAgent::lmGetConsoleScreenBufferInfo> message(this);
   lpc::get_console_screen_buffer_info_m *payload = message.payload();
   payload->output = handle;
-  agent()->on_message(message.message());
+  deliver(message.message());
   store_console_screen_buffer_info(payload, info_out);
   return update_last_error(&message);
 }
@@ -426,7 +437,7 @@ bool_t SimulatingConsoleFrontend::get_console_screen_buffer_info_ex(handle_t han
   SimulatedMessage<ConsoleAgent::lmGetConsoleScreenBufferInfo> message(this);
   lpc::get_console_screen_buffer_info_m *payload = message.payload();
   payload->output = handle;
-  agent()->on_message(message.message());
+  deliver(message.message());
   store_console_screen_buffer_info(payload, console_screen_buffer_info_from_ex(info_out));
   info_out->wPopupAttributes = payload->popup_attributes;
   info_out->bFullscreenSupported = payload->fullscreen_supported;
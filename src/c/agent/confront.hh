@@ -19,6 +19,10 @@
 #include "utils/vector.hh"
 #include "share/protocol.hh"
 
+namespace lpc {
+class Interceptor;
+} // namespace lpc
+
 namespace conprx {
 
 class ConsoleAdaptor;
@@ -180,6 +184,10 @@ public:
 
   virtual int64_t poke_backend(int64_t value) { return 0; }
 
+  // Returns the interceptor calls through this frontend go through, or NULL
+  // if they don't go through one that's accessible.
+  virtual lpc::Interceptor *interceptor() { return NULL; }
+
   // Creates and returns a new instance of the native console frontend.
   static tclib::pass_def_ref_t<ConsoleFrontend> new_native();
 
@@ -0,0 +1,176 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "agent/logbuf.hh"
+
+#include <string.h>
+
+#ifndef IS_MSVC
+#include <time.h>
+#endif
+
+using namespace conprx;
+
+// Reads a value written by another thread, making sure everything that thread
+// wrote before is visible.
+static inline uint64_t load_acquire(volatile uint64_t *ptr) {
+#ifdef IS_MSVC
+  return static_cast<uint64_t>(InterlockedCompareExchange64(
+      reinterpret_cast<volatile LONG64*>(ptr), 0, 0));
+#else
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Updates a value, making sure everything written before is visible to other
+// threads before the new value is.
+static inline void store_release(volatile uint64_t *ptr, uint64_t value) {
+#ifdef IS_MSVC
+  InterlockedExchange64(reinterpret_cast<volatile LONG64*>(ptr),
+      static_cast<LONG64>(value));
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Sets the value to the replacement if it is the expected value. Returns true
+// if it was.
+static inline bool compare_and_swap(volatile uint64_t *ptr, uint64_t expected,
+    uint64_t replacement) {
+#ifdef IS_MSVC
+  return InterlockedCompareExchange64(reinterpret_cast<volatile LONG64*>(ptr),
+      static_cast<LONG64>(replacement), static_cast<LONG64>(expected))
+      == static_cast<LONG64>(expected);
+#else
+  return __atomic_compare_exchange_n(ptr, &expected, replacement, false,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Sets the value, returning the one it replaced.
+static inline uint64_t exchange(volatile uint64_t *ptr, uint64_t value) {
+#ifdef IS_MSVC
+  return static_cast<uint64_t>(InterlockedExchange64(
+      reinterpret_cast<volatile LONG64*>(ptr), static_cast<LONG64>(value)));
+#else
+  return __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static inline void increment(volatile uint64_t *ptr) {
+#ifdef IS_MSVC
+  InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(ptr));
+#else
+  __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+LogBuffer::LogBuffer()
+  : append_position_(0)
+  , take_position_(0)
+  , dropped_count_(0)
+  , is_draining_(0) {
+  for (size_t i = 0; i < kCapacity; i++)
+    slots_[i].sequence = i;
+}
+
+bool LogBuffer::append(log_entry_t *entry, uint64_t timestamp_nanos) {
+  uint64_t position = load_acquire(&append_position_);
+  slot_t *slot = NULL;
+  while (true) {
+    slot = slot_at(position);
+    int64_t lag = static_cast<int64_t>(load_acquire(&slot->sequence) - position);
+    if (lag == 0) {
+      // The slot is free for this position; claim it unless another thread
+      // got there first.
+      if (compare_and_swap(&append_position_, position, position + 1))
+        break;
+      position = load_acquire(&append_position_);
+    } else if (lag < 0) {
+      // The slot still holds the entry from the previous round so we're full.
+      increment(&dropped_count_);
+      return false;
+    } else {
+      // Another thread has claimed this position since we read it.
+      position = load_acquire(&append_position_);
+    }
+  }
+  slot->level = entry->level;
+  slot->line = static_cast<uint32_t>(entry->line);
+  slot->timestamp_nanos = timestamp_nanos;
+  slot->file = entry->file;
+  size_t size = (entry->message.chars == NULL) ? 0 : entry->message.size;
+  if (size >= kMaxMessageSize)
+    size = kMaxMessageSize - 1;
+  memcpy(slot->message, entry->message.chars, size);
+  slot->message[size] = '\0';
+  slot->message_size = static_cast<uint32_t>(size);
+  store_release(&slot->sequence, position + 1);
+  return true;
+}
+
+bool LogBuffer::try_begin_drain() {
+  return exchange(&is_draining_, 1) == 0;
+}
+
+void LogBuffer::end_drain() {
+  store_release(&is_draining_, 0);
+}
+
+size_t LogBuffer::ready_count() {
+  uint64_t first = take_position_;
+  size_t count = 0;
+  while (count < kCapacity
+      && load_acquire(&slot_at(first + count)->sequence) == first + count + 1)
+    count++;
+  return count;
+}
+
+void LogBuffer::peek(size_t index, CompactLogBatch::entry_t *entry_out) {
+  slot_t *slot = slot_at(take_position_ + index);
+  entry_out->level = slot->level;
+  entry_out->line = slot->line;
+  entry_out->timestamp_nanos = slot->timestamp_nanos;
+  entry_out->file = slot->file;
+  entry_out->message = slot->message;
+  entry_out->message_size = slot->message_size;
+}
+
+void LogBuffer::release(size_t count) {
+  uint64_t first = take_position_;
+  // Each slot becomes free for the append one round later.
+  for (size_t i = 0; i < count; i++)
+    store_release(&slot_at(first + i)->sequence, first + i + kCapacity);
+  store_release(&take_position_, first + count);
+}
+
+uint64_t LogBuffer::take_dropped_count() {
+  return exchange(&dropped_count_, 0);
+}
+
+size_t LogBuffer::pending_count() {
+  return static_cast<size_t>(load_acquire(&append_position_)
+      - load_acquire(&take_position_));
+}
+
+#ifdef IS_MSVC
+
+uint64_t LogBuffer::now_nanos() {
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  uint64_t ticks = (static_cast<uint64_t>(now.dwHighDateTime) << 32)
+      | now.dwLowDateTime;
+  // File times count 100ns ticks since 1601.
+  static const uint64_t kUnixEpochTicks = 116444736000000000ULL;
+  return (ticks - kUnixEpochTicks) * 100;
+}
+
+#else
+
+uint64_t LogBuffer::now_nanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+#endif
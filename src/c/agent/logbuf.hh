@@ -0,0 +1,101 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// A bounded buffer of log entries waiting to be shipped to the owner.
+///
+/// Any thread in the process may log so entries are appended without taking a
+/// lock: each slot has a sequence number that says whether it is free for the
+/// next append or holds an entry ready to be taken, and appending threads
+/// claim slots by advancing a shared position. Only one thread at a time
+/// takes entries out, the one that wins try_begin_drain. When the buffer is
+/// full new entries are counted and dropped rather than wait for room since
+/// the thread that logged may be the one that would make room.
+///
+/// Entries are copied in rather than referenced so the message is truncated to
+/// a fixed size. The file is assumed to be a string constant, as it is when it
+/// comes from the log macros, and only the pointer is kept.
+
+#ifndef _CONPRX_AGENT_LOGBUF_HH
+#define _CONPRX_AGENT_LOGBUF_HH
+
+#include "c/stdc.h"
+#include "share/compact.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+namespace conprx {
+
+class LogBuffer {
+public:
+  // The number of entries the buffer can hold. Must be a power of 2.
+  static const size_t kCapacity = 128;
+
+  // Messages longer than this are truncated.
+  static const size_t kMaxMessageSize = 256;
+
+  LogBuffer();
+
+  // Copies the given entry into the buffer, stamped with the given time.
+  // Returns false and counts the entry as dropped if the buffer is full.
+  bool append(log_entry_t *entry, uint64_t timestamp_nanos);
+
+  // Returns true if the calling thread may take entries out, false if
+  // another thread is already doing that. A thread that gets true must call
+  // end_drain when it's done.
+  bool try_begin_drain();
+  void end_drain();
+
+  // Returns the number of entries ready to be taken, counting from the oldest
+  // until the first that isn't completely written yet. Only the draining
+  // thread may call this.
+  size_t ready_count();
+
+  // Stores the index'th oldest entry, which must be ready, in the out
+  // parameter. Its strings point into the buffer so they're only valid until
+  // it's been released. Only the draining thread may call this.
+  void peek(size_t index, CompactLogBatch::entry_t *entry_out);
+
+  // Releases the given number of oldest entries, making room for new ones.
+  // Only the draining thread may call this.
+  void release(size_t count);
+
+  // Returns the number of entries dropped since the last call and resets the
+  // count.
+  uint64_t take_dropped_count();
+
+  // The approximate number of entries in the buffer, ready or not.
+  size_t pending_count();
+
+  // The current time in nanoseconds since the unix epoch, the timestamp
+  // entries are usually appended with.
+  static uint64_t now_nanos();
+
+private:
+  struct slot_t {
+    // If the slot is free this is the position whose append may use it, if it
+    // holds an entry it's one past the entry's position.
+    volatile uint64_t sequence;
+    log_level_t level;
+    uint32_t line;
+    uint64_t timestamp_nanos;
+    const char *file;
+    uint32_t message_size;
+    char message[kMaxMessageSize];
+  };
+
+  slot_t *slot_at(uint64_t position) { return &slots_[position & (kCapacity - 1)]; }
+
+  slot_t slots_[kCapacity];
+  // The position of the next append.
+  volatile uint64_t append_position_;
+  // The position of the oldest entry. Only changed by the draining thread.
+  volatile uint64_t take_position_;
+  volatile uint64_t dropped_count_;
+  volatile uint64_t is_draining_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_AGENT_LOGBUF_HH
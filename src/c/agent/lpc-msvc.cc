@@ -16,6 +16,7 @@ PortView::PortView()
 
 PatchingInterceptor::PatchingInterceptor(handler_t handler)
   : handler_(handler)
+  , is_fast_rejecting_(true)
   , patches_(Platform::get(), Vector<PatchRequest>(patch_requests_, kPatchRequestCount))
   , one_shot_special_handler_(false)
   , is_locating_cccs_(false)
@@ -42,6 +43,15 @@ ntstatus_t NTAPI PatchingInterceptor::nt_request_wait_reply_port_bridge(handle_t
   // optimizing compiler made the call into a jump, which is good in general but
   // not what we want here.
   PatchingInterceptor *inter = current();
+  // Most messages, in processes that never use the console all of them, are
+  // of no interest to the handler so those get passed straight through before
+  // any work is done on them. The calibration messages aren't in the set of
+  // intercepted apis so they have to get past the check while calibrating.
+  if (!InterceptedApis::contains(request->api_number)
+      && inter->is_fast_rejecting_
+      && !inter->one_shot_special_handler_)
+    return inter->nt_request_wait_reply_port_imposter(port_handle, request,
+        incoming_reply);
   if (inter->one_shot_special_handler_) {
     inter->one_shot_special_handler_ = false;
     if (request->api_number == kGetConsoleCPApiNum && inter->is_locating_cccs_) {
@@ -70,7 +80,7 @@ ntstatus_t NTAPI PatchingInterceptor::nt_request_wait_reply_port_bridge(handle_t
 
 ntstatus_t PatchingInterceptor::nt_request_wait_reply_port(handle_t port_handle,
     relevant_message_t *request, relevant_message_t *reply) {
-  if (enabled_) {
+  if (is_enabled()) {
     lpc::Message::Destination destination;
     if (port_handle == console_port_handle()) {
       destination = lpc::Message::Destination::mdConsole;
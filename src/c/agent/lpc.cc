@@ -11,17 +11,44 @@ using namespace conprx;
 
 PatchingInterceptor *PatchingInterceptor::current_ = NULL;
 
-Interceptor::Interceptor()
-  : enabled_(true) { }
+// Word W of the intercepted api bitmap. Each intercepted message contributes
+// its bit to the word it falls within, all in constant expressions, so the
+// bitmap is initialized statically and is valid before any code has run.
+template <size_t W>
+struct InterceptedApiWord {
+#define __ADD_API_BIT__(Name, name, NUM, FLAGS)                                \
+  | (((LPC_API_KEY(NUM) >> 5) == W) ? (1u << (LPC_API_KEY(NUM) & 31)) : 0u)
+  static const uint32_t kValue = 0u FOR_EACH_LPC_TO_INTERCEPT(__ADD_API_BIT__);
+#undef __ADD_API_BIT__
+};
+
+const uint32_t InterceptedApis::kWords[kWordCount] = {
+  InterceptedApiWord<0>::kValue, InterceptedApiWord<1>::kValue,
+  InterceptedApiWord<2>::kValue, InterceptedApiWord<3>::kValue,
+  InterceptedApiWord<4>::kValue, InterceptedApiWord<5>::kValue,
+  InterceptedApiWord<6>::kValue, InterceptedApiWord<7>::kValue
+};
+
+LPC_THREAD_LOCAL Interceptor::Disable *Interceptor::innermost_disable_ = NULL;
 
 Interceptor::Disable::Disable(Interceptor* interceptor)
   : interceptor_(interceptor)
-  , was_enabled_(interceptor->enabled_) {
-  interceptor->enabled_ = false;
+  , outer_(innermost_disable_) {
+  innermost_disable_ = this;
 }
 
 Interceptor::Disable::~Disable() {
-  interceptor_->enabled_ = was_enabled_;
+  innermost_disable_ = outer_;
+}
+
+bool Interceptor::is_disabled_here() {
+  Disable *current = innermost_disable_;
+  while (current != NULL) {
+    if (current->interceptor_ == this)
+      return true;
+    current = current->outer_;
+  }
+  return false;
 }
 
 // Returns true iff the given pc is within the function covered by the given
@@ -65,6 +65,37 @@ T *AddressXform::local_to_remote(T *arg) {
       : reinterpret_cast<T*>(reinterpret_cast<address_arith_t>(arg) - delta_);
 }
 
+// Returns the position of the given api number in the InterceptedApis bitmap.
+// It has to be a macro since it's used in constant expressions.
+#define LPC_API_KEY(NUM)                                                       \
+  ((((NUM) >> 16) * InterceptedApis::kIndexCount) + ((NUM) & 0xFFFF))
+
+// The set of api numbers of the messages the agent intercepts, as a bitmap
+// that's computed at compile time from FOR_EACH_LPC_TO_INTERCEPT so it can be
+// checked before anything else has been done with a message. Api numbers have
+// the index of the server that handles them in the upper 16 bits and the
+// index within the server in the lower; only the first few of each are
+// covered and anything outside those is taken not to be in the set.
+class InterceptedApis {
+public:
+  static const uint32_t kServerCount = 2;
+  static const uint32_t kIndexCount = 128;
+  static const size_t kWordCount = kServerCount * kIndexCount / 32;
+
+  // Returns true iff the agent intercepts messages with the given api number.
+  static bool contains(uint32_t api_number) {
+    uint32_t server = api_number >> 16;
+    uint32_t index = api_number & 0xFFFF;
+    if (server >= kServerCount || index >= kIndexCount)
+      return false;
+    uint32_t key = LPC_API_KEY(api_number);
+    return ((kWords[key >> 5] >> (key & 31)) & 1) != 0;
+  }
+
+private:
+  static const uint32_t kWords[kWordCount];
+};
+
 // The amount of stack to look at to try to determine the location of
 // ConsoleClientCallServer. It's 4 because the stack is expected to look like
 // this,
@@ -81,24 +112,44 @@ T *AddressXform::local_to_remote(T *arg) {
 // The amount of stack to capture and compare against the template.
 #define kLocateCCCSStackCaptureSize 5
 
+// Declares a variable that has a separate value for each thread.
+#ifdef IS_MSVC
+#  define LPC_THREAD_LOCAL __declspec(thread)
+#else
+#  define LPC_THREAD_LOCAL __thread
+#endif
+
 // An abstract interceptor implementation that can be implemented meaningfully
 // on both windows and linux.
 class Interceptor {
 public:
   virtual ~Interceptor() { }
-  Interceptor();
+  Interceptor() { }
 
-  // Disables redirection for the lifetime of instances, restoring the previous
-  // value on destruction.
+  // Disables redirection on the current thread for the lifetime of instances.
+  // Other threads, including ones that call through the same interceptor
+  // while this one is disabled, are unaffected. Instances must be destroyed in
+  // the reverse order they were created which they will be if they're only
+  // ever allocated on the stack.
   class Disable {
   public:
     Disable(Interceptor* interceptor);
     ~Disable();
   private:
+    friend class Interceptor;
     Interceptor *interceptor_;
-    bool was_enabled_;
+    // The disable that was innermost on this thread before this one.
+    Disable *outer_;
   };
 
+  // Returns true unless redirection through this interceptor has been
+  // disabled on the current thread. This is called for every intercepted
+  // message so the common case where nothing has been disabled on the thread
+  // is a single thread-local load.
+  bool is_enabled() {
+    return (innermost_disable_ == NULL) || !is_disabled_here();
+  }
+
   virtual conprx::NtStatus call_native_backend(handle_t port,
       relevant_message_t *request, relevant_message_t *incoming_reply) = 0;
 
@@ -109,8 +160,14 @@ public:
   // true iff enough stack could be captured to fill the buffer.
   static fat_bool_t capture_stacktrace(Vector<void*> buffer);
 
-protected:
-  bool enabled_;
+private:
+  // Returns true if any of the disables on this thread is for this
+  // interceptor.
+  bool is_disabled_here();
+
+  // The innermost disable on the current thread, NULL if there is none. The
+  // disables on a thread form a chain through their outer_ fields.
+  static LPC_THREAD_LOCAL Disable *innermost_disable_;
 };
 
 class PatchingInterceptor;
@@ -192,6 +249,12 @@ public:
 
   virtual fat_bool_t calibrate_console_port();
 
+  // Sets whether messages whose api numbers aren't in InterceptedApis should
+  // be passed straight through to the native implementation without going to
+  // the handler. This is the default; turn it off if the handler wants to see
+  // every message, say because it dumps the unknown ones.
+  void set_fast_reject(bool value) { is_fast_rejecting_ = value; }
+
 private:
   template <typename T> friend class ConcreteMessage;
   friend class PortView;
@@ -257,6 +320,9 @@ private:
 
   handler_t handler_;
 
+  // Are uninteresting messages passed straight through?
+  bool is_fast_rejecting_;
+
   // Setting this to true enables the special message handling but only for
   // the next call -- the variable will be set back to false as soon as it has
   // been used.
@@ -0,0 +1,37 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Windows-specific option reading.
+
+void Options::read_registry() {
+  read_registry_hive(HKEY_LOCAL_MACHINE);
+  read_registry_hive(HKEY_CURRENT_USER);
+}
+
+void Options::read_registry_hive(HKEY hive) {
+  HKEY key = NULL;
+  if (RegOpenKeyExA(hive, kRegistryKey, 0, KEY_READ, &key) != ERROR_SUCCESS)
+    // It's fine for the key not to exist, it just means that there are no
+    // options set in this hive.
+    return;
+#define __READ_REGISTRY_OPTION__(Name, name, NAME, type, DEFAULT)              \
+  read_registry_value(key, #Name, &name##_);
+  FOR_EACH_AGENT_OPTION(__READ_REGISTRY_OPTION__)
+#undef __READ_REGISTRY_OPTION__
+  RegCloseKey(key);
+}
+
+template <typename T>
+void Options::read_registry_value(HKEY key, const char *name, T *value_out) {
+  dword_t type = 0;
+  dword_t raw = 0;
+  dword_t size = sizeof(raw);
+  if (RegQueryValueExA(key, name, NULL, &type, reinterpret_cast<LPBYTE>(&raw),
+      &size) != ERROR_SUCCESS)
+    return;
+  if (type != REG_DWORD) {
+    WARN("Ignoring non-dword registry option %s", name);
+    return;
+  }
+  convert_dword(raw, value_out);
+}
@@ -0,0 +1,72 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "options.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace conprx;
+using namespace tclib;
+
+const char *const Options::kRegistryKey = "Software\\Tundra\\Console Agent";
+
+Options::Options() {
+#define __INIT_OPTION_FIELD__(Name, name, NAME, type, DEFAULT) name##_ = (DEFAULT);
+  FOR_EACH_AGENT_OPTION(__INIT_OPTION_FIELD__)
+#undef __INIT_OPTION_FIELD__
+}
+
+void Options::read_all() {
+  read_registry();
+  read_environment();
+}
+
+void Options::read_environment() {
+#define __READ_ENV_OPTION__(Name, name, NAME, type, DEFAULT)                   \
+  read_environment_value("CONSOLE_AGENT_" #NAME, &name##_);
+  FOR_EACH_AGENT_OPTION(__READ_ENV_OPTION__)
+#undef __READ_ENV_OPTION__
+}
+
+template <typename T>
+void Options::read_environment_value(const char *var, T *value_out) {
+  const char *value = getenv(var);
+  if (value != NULL && !parse_value(value, value_out))
+    WARN("Invalid value for %s: '%s'", var, value);
+}
+
+bool Options::parse_value(const char *str, bool *value_out) {
+  if (strcmp(str, "0") == 0) {
+    *value_out = false;
+    return true;
+  } else if (strcmp(str, "1") == 0) {
+    *value_out = true;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool Options::parse_value(const char *str, uint32_t *value_out) {
+  if (*str == '\0')
+    return false;
+  char *end = NULL;
+  unsigned long value = strtoul(str, &end, 10);
+  if (*end != '\0')
+    return false;
+  *value_out = static_cast<uint32_t>(value);
+  return true;
+}
+
+#ifdef IS_MSVC
+#include "options-msvc.cc"
+#else
+void Options::read_registry() {
+  // There's no registry so there's nothing to read.
+}
+#endif
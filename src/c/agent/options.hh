@@ -0,0 +1,102 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// The agent's runtime options. See the options section of {{agent.hh}} for
+/// where they're read from and what they mean.
+
+#ifndef _CONPRX_AGENT_OPTIONS_HH
+#define _CONPRX_AGENT_OPTIONS_HH
+
+#include "c/stdc.h"
+#include "utils/types.hh"
+
+namespace conprx {
+
+// The options understood by the agent. The columns are,
+//
+//   - Name: the upper camel case name used for the registry entry.
+//   - name: the lower case name used for accessors.
+//   - NAME: the all caps name used for the environment variable, after the
+//     CONSOLE_AGENT_ prefix.
+//   - type: the type of the value, either bool or uint32_t.
+//   - default: the value used if the option isn't set anywhere.
+//
+//  Name                  name                    NAME                     type      default
+#define FOR_EACH_AGENT_OPTION(F)                                                               \
+  F(Enabled,              enabled,                ENABLED,                 bool,     true)     \
+  F(VerboseLogging,       verbose_logging,        VERBOSE_LOGGING,         bool,     false)    \
+  F(CoalesceWrites,       coalesce_writes,        COALESCE_WRITES,         bool,     false)    \
+  F(CoalesceMaxBytes,     coalesce_max_bytes,     COALESCE_MAX_BYTES,      uint32_t, 4096)     \
+  F(CoalesceMaxDelayMs,   coalesce_max_delay_ms,  COALESCE_MAX_DELAY_MS,   uint32_t, 10)       \
+  F(PipelineRequests,     pipeline_requests,      PIPELINE_REQUESTS,       bool,     false)    \
+  F(PipelineMaxInFlight,  pipeline_max_in_flight, PIPELINE_MAX_IN_FLIGHT,  uint32_t, 32)     \
+  F(FastPath,             fast_path,              FAST_PATH,               bool,     false)    \
+  F(NumericSelectors,     numeric_selectors,      NUMERIC_SELECTORS,       bool,     false)    \
+  F(Multiplex,            multiplex,              MULTIPLEX,               bool,     false)    \
+  F(BulkFrameMaxBytes,    bulk_frame_max_bytes,   BULK_FRAME_MAX_BYTES,    uint32_t, 16384)    \
+  F(WriteCredits,         write_credits,          WRITE_CREDITS,           bool,     false)    \
+  F(StreamChunkBytes,     stream_chunk_bytes,     STREAM_CHUNK_BYTES,      uint32_t, 0)        \
+  F(Utf8Wire,             utf8_wire,              UTF8_WIRE,               bool,     false)    \
+  F(CompactValues,        compact_values,         COMPACT_VALUES,          bool,     false)    \
+  F(TraceLpcs,            trace_lpcs,             TRACE_LPCS,              uint32_t, 0)        \
+  F(DelegateLpcs,         delegate_lpcs,          DELEGATE_LPCS,           uint32_t, 0)        \
+  F(SuspendLpcs,          suspend_lpcs,           SUSPEND_LPCS,            uint32_t, 0)        \
+  F(DumpUnknownLpcs,      dump_unknown_lpcs,      DUMP_UNKNOWN_LPCS,       bool,     false)
+
+// A set of agent option values.
+class Options {
+public:
+  // Initializes a set of options to their default values.
+  Options();
+
+  // Reads the options from all the sources, overriding the current values. The
+  // sources are read in order such that later ones take precedence.
+  void read_all();
+
+  // Reads just the environment variable options.
+  void read_environment();
+
+  // Reads just the registry options. Does nothing except on windows.
+  void read_registry();
+
+#define __DECLARE_OPTION_ACCESSORS__(Name, name, NAME, type, DEFAULT)          \
+  type name() { return name##_; }                                              \
+  void set_##name(type value) { name##_ = value; }
+  FOR_EACH_AGENT_OPTION(__DECLARE_OPTION_ACCESSORS__)
+#undef __DECLARE_OPTION_ACCESSORS__
+
+  // The registry key, relative to the hive, that holds the options.
+  static const char *const kRegistryKey;
+
+private:
+  // Parse the string value of an environment variable, storing the result in
+  // the out parameter. Returns false and leaves the out value untouched if the
+  // string isn't valid.
+  static bool parse_value(const char *str, bool *value_out);
+  static bool parse_value(const char *str, uint32_t *value_out);
+
+  // Converts a raw registry dword to an option value.
+  static void convert_dword(dword_t raw, bool *value_out) { *value_out = (raw != 0); }
+  static void convert_dword(dword_t raw, uint32_t *value_out) { *value_out = raw; }
+
+  // Reads the option stored in the given environment variable.
+  template <typename T>
+  static void read_environment_value(const char *var, T *value_out);
+
+#ifdef IS_MSVC
+  // Reads all the options stored under the given hive.
+  void read_registry_hive(HKEY hive);
+
+  // Reads a single option from the given opened registry key.
+  template <typename T>
+  static void read_registry_value(HKEY key, const char *name, T *value_out);
+#endif
+
+#define __DECLARE_OPTION_FIELD__(Name, name, NAME, type, DEFAULT) type name##_;
+  FOR_EACH_AGENT_OPTION(__DECLARE_OPTION_FIELD__)
+#undef __DECLARE_OPTION_FIELD__
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_AGENT_OPTIONS_HH
@@ -19,22 +19,106 @@ using namespace plankton;
 ConsoleBackendService::ConsoleBackendService(ConsoleBackendContext *context)
   : backend_(NULL)
   , context_(context)
+  , transport_(NULL)
+  , agent_uses_transport_(false)
+  , agent_uses_compact_values_(false)
+  , state_page_(NULL)
+  , is_state_published_(false)
+  , write_credit_limit_(kDefaultWriteCreditLimit)
+  , write_bytes_received_(0)
+  , agent_throttle_count_(0)
+  , dropped_log_entry_count_(0)
+  , executor_(NULL)
   , agent_is_ready_(false)
-  , agent_is_done_(false) {
+  , agent_is_done_(false)
+  , next_stream_id_(1)
+  , current_stream_(0) {
 
   registry()->add_fallback(ConsoleTypes::registry());
 
-  register_method("log", new_callback(&ConsoleBackendService::on_log, this));
-  register_method("is_ready", new_callback(&ConsoleBackendService::on_is_ready, this));
-  register_method("is_done", new_callback(&ConsoleBackendService::on_is_done, this));
-  register_method("poke", new_callback(&ConsoleBackendService::on_poke, this));
+  for (size_t i = 0; i < kNamedMethodTableSize; i++)
+    named_methods_[i] = NULL;
+  size_t named_count = 0;
+  for (const named_method_t *entry = kNamedMethods; entry->name != NULL; entry++) {
+    size_t slot = hash_method_name(entry->name) & (kNamedMethodTableSize - 1);
+    while (named_methods_[slot] != NULL)
+      slot = (slot + 1) & (kNamedMethodTableSize - 1);
+    named_methods_[slot] = entry;
+    named_count++;
+  }
+  CHECK_TRUE("named method table too full", named_count * 2 <= kNamedMethodTableSize);
+
+  // No methods are registered with the service, everything comes in through
+  // the fallback such that numeric selectors can be looked up before names,
+  // see on_request.
+  set_fallback(new_callback(&ConsoleBackendService::on_request, this));
+}
+
+fat_bool_t ConsoleBackendService::set_executor(HandlerExecutor *executor) {
+  CHECK_FALSE("executor set after connecting", agent_is_ready_);
+  if (backend() != NULL)
+    F_TRY(backend()->enable_concurrent_calls());
+  F_TRY(F_BOOL(response_mutex_.initialize()));
+  F_TRY(F_BOOL(state_mutex_.initialize()));
+  executor_ = executor;
+  return F_TRUE;
+}
+
+void ConsoleBackendService::run_handler(handler_t handler,
+    rpc::RequestData *data, ResponseCallback resp) {
+  ResponseCallback callback = resp;
+  if (executor() != NULL) {
+    // The handler may respond right away or pass the callback on to a job or
+    // a pending read that responds later from another thread; either way it
+    // has to go through the mutex.
+    SerializedResponse *serialized = new (kDefaultAlloc) SerializedResponse(
+        resp, &response_mutex_);
+    callback = serialized->callback();
+  }
+  if (!select_stream(data))
+    return callback(rpc::OutgoingResponse::failure(CONPRX_ERROR_UNKNOWN_STREAM));
+  (this->*handler)(data, callback);
+}
+
+bool ConsoleBackendService::select_stream(rpc::RequestData *data) {
+  current_stream_ = 0;
+  Variant stream = data->argument("stream");
+  if (!stream.is_integer())
+    return true;
+  uint32_t id = static_cast<uint32_t>(stream.integer_value());
+  for (size_t i = 0; i < open_streams_.size(); i++) {
+    if (open_streams_[i] == id) {
+      current_stream_ = id;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ConsoleBackendService::decode_handle(Variant value, Handle *handle_out) {
+  Handle handle;
+  if (!CompactCodec::decode(value, &handle))
+    return false;
+  *handle_out = qualify(handle);
+  return true;
+}
 
-#define __GEN_REGISTER__(Name, name, NUM, FLAGS)                               \
-  lfPa FLAGS (, register_method(#name, new_callback(&ConsoleBackendService::on_##name, this)));
-  FOR_EACH_LPC_TO_INTERCEPT(__GEN_REGISTER__)
-#undef __GEN_REGISTER__
+ConsoleBackendService::ResponseCallback
+    ConsoleBackendService::SerializedResponse::callback() {
+  return new_callback(&SerializedResponse::send, this);
+}
+
+void ConsoleBackendService::SerializedResponse::send(
+    rpc::OutgoingResponse response) {
+  mutex_->lock();
+  resp_(response);
+  mutex_->unlock();
+  tclib::default_delete_concrete(this);
+}
 
-  set_fallback(new_callback(&ConsoleBackendService::message_not_understood, this));
+void ConsoleBackendService::await_key(uint64_t key) {
+  if (executor() != NULL)
+    executor()->wait_idle(key);
 }
 
 // Dummy implementation used when none has been explicitly specified.
@@ -44,7 +128,7 @@ public:
   virtual response_t<bool_t> get_screen_buffer_info(bool is_error,
       ScreenBufferInfo *info_out);
   virtual response_t<uint32_t> write(tclib::Blob blob, bool is_unicode, bool is_error);
-  virtual response_t<uint32_t> read(tclib::Blob buffer, bool is_unicode,
+  virtual response_t<uint32_t> read(ResponseBuffer *buffer, bool is_unicode,
       ReadConsoleControl *input_control);
   virtual response_t<bool_t> set_cursor_position(coord_t position, bool is_error);
   static NoWinTty *get();
@@ -64,7 +148,7 @@ response_t<uint32_t> NoWinTty::write(tclib::Blob blob, bool is_unicode, bool is_
   return response_t<uint32_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
 }
 
-response_t<uint32_t> NoWinTty::read(tclib::Blob buffer, bool is_unicode,
+response_t<uint32_t> NoWinTty::read(ResponseBuffer *buffer, bool is_unicode,
     ReadConsoleControl *input_control) {
   return response_t<uint32_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
 }
@@ -85,37 +169,88 @@ BasicConsoleBackend::BasicConsoleBackend()
   , input_codepage_(cpUtf8)
   , output_codepage_(cpUtf8)
   , title_(ucs16_empty())
-  , wty_(NoWinTty::get()) { }
+  , wty_(NoWinTty::get())
+  , needs_lock_(false) { }
 
 BasicConsoleBackend::~BasicConsoleBackend() {
   ucs16_default_delete(title_);
 }
 
+BasicConsoleBackend::Lock::Lock(BasicConsoleBackend *backend)
+  : mutex_(backend->needs_lock_ ? &backend->mutex_ : NULL) {
+  if (mutex_ != NULL)
+    mutex_->lock();
+}
+
+BasicConsoleBackend::Lock::~Lock() {
+  if (mutex_ != NULL)
+    mutex_->unlock();
+}
+
+fat_bool_t BasicConsoleBackend::enable_concurrent_calls() {
+  if (needs_lock_)
+    return F_TRUE;
+  F_TRY(F_BOOL(mutex_.initialize()));
+  needs_lock_ = true;
+  return F_TRUE;
+}
+
+void ConsoleBackend::begin_read_console(PendingRead *read) {
+  size_t bytes_read = 0;
+  response_t<uint32_t> result = read_console(read->input(), read->buffer(),
+      read->is_unicode(), &bytes_read, read->input_control());
+  read->complete(result, bytes_read);
+}
+
 response_t<bool_t> BasicConsoleBackend::connect(Handle stdin_handle,
     Handle stdout_handle, Handle stderr_handle) {
+  Lock lock(this);
+  handles()->register_std_handle(kStdInputHandle, stdin_handle, 0);
+  handles()->register_std_handle(kStdOutputHandle, stdout_handle, 0);
+  handles()->register_std_handle(kStdErrorHandle, stderr_handle, 0);
+  std_handles_[0] = stdin_handle;
+  std_handles_[1] = stdout_handle;
+  std_handles_[2] = stderr_handle;
+  return response_t<bool_t>::yes();
+}
+
+response_t<bool_t> BasicConsoleBackend::connect_stream(Handle stdin_handle,
+    Handle stdout_handle, Handle stderr_handle) {
+  Lock lock(this);
   handles()->register_std_handle(kStdInputHandle, stdin_handle, 0);
   handles()->register_std_handle(kStdOutputHandle, stdout_handle, 0);
   handles()->register_std_handle(kStdErrorHandle, stderr_handle, 0);
   return response_t<bool_t>::yes();
 }
 
+response_t<bool_t> BasicConsoleBackend::disconnect_stream(Handle first,
+    Handle limit) {
+  Lock lock(this);
+  handles()->release_shadows(first.id(), limit.id());
+  return response_t<bool_t>::yes();
+}
+
 response_t<int64_t> BasicConsoleBackend::poke(int64_t value) {
+  Lock lock(this);
   int64_t response = last_poke_;
   last_poke_ = value;
   return response_t<int64_t>::of(response);
 }
 
 response_t<uint32_t> BasicConsoleBackend::get_console_cp(bool is_output) {
+  Lock lock(this);
   return response_t<uint32_t>::of(is_output ? output_codepage_ : input_codepage_);
 }
 
 response_t<bool_t> BasicConsoleBackend::set_console_cp(uint32_t value, bool is_output) {
+  Lock lock(this);
   (is_output ? output_codepage_ : input_codepage_) = value;
   return response_t<bool_t>::yes();
 }
 
-response_t<uint32_t> BasicConsoleBackend::get_console_title(tclib::Blob buffer,
+response_t<uint32_t> BasicConsoleBackend::get_console_title(ResponseBuffer *buffer,
     bool is_unicode, size_t *bytes_written_out) {
+  Lock lock(this);
   return is_unicode
       ? get_console_title_wide(buffer, bytes_written_out)
       : get_console_title_ansi(buffer, bytes_written_out);
@@ -127,19 +262,22 @@ response_t<bool_t> BasicConsoleBackend::set_console_cursor_position(Handle outpu
   return wty()->set_cursor_position(position, shadow.is_error());
 }
 
-response_t<uint32_t> BasicConsoleBackend::get_console_title_wide(tclib::Blob buffer,
+response_t<uint32_t> BasicConsoleBackend::get_console_title_wide(ResponseBuffer *output,
     size_t *bytes_written_out) {
-  if (buffer.size() == 0) {
+  size_t title_chars_no_null = title().length;
+  size_t buffer_chars_with_null = output->capacity() / sizeof(wide_char_t);
+  if (buffer_chars_with_null == 0) {
     *bytes_written_out = 0;
     return response_t<uint32_t>::of(0);
   }
   // This is super verbose but it's sooo easy to get the whole title-length,
   // buffer-length, null/no-null mixed up.
-  wide_str_t wstr = static_cast<wide_str_t>(buffer.start());
-  size_t title_chars_no_null = title().length;
-  size_t buffer_chars_with_null = buffer.size() / sizeof(wide_char_t);
   size_t buffer_chars_no_null = buffer_chars_with_null - 1;
   size_t char_to_copy_no_null = min_size(title_chars_no_null, buffer_chars_no_null);
+  tclib::Blob buffer;
+  if (!output->reserve((char_to_copy_no_null + 1) * sizeof(wide_char_t), &buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  wide_str_t wstr = static_cast<wide_str_t>(buffer.start());
   for (size_t i = 0; i < char_to_copy_no_null; i++)
     wstr[i] = title().chars[i];
   wstr[char_to_copy_no_null] = '\0';
@@ -147,22 +285,25 @@ response_t<uint32_t> BasicConsoleBackend::get_console_title_wide(tclib::Blob buf
   return response_t<uint32_t>::of(static_cast<uint32_t>(title_chars_no_null * sizeof(wide_char_t)));
 }
 
-response_t<uint32_t> BasicConsoleBackend::get_console_title_ansi(tclib::Blob buffer,
+response_t<uint32_t> BasicConsoleBackend::get_console_title_ansi(ResponseBuffer *output,
     size_t *bytes_written_out) {
   size_t title_chars_no_null = title().length;
-  ansi_str_t astr = static_cast<ansi_str_t>(buffer.start());
-  if (buffer.size() < title_chars_no_null) {
+  if (output->capacity() < title_chars_no_null) {
     // We refuse to return less than the full title if the buffer is too small.
     *bytes_written_out = 0;
     return response_t<uint32_t>::of(0);
   }
+  tclib::Blob buffer;
+  if (!output->reserve(title_chars_no_null, &buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  ansi_str_t astr = static_cast<ansi_str_t>(buffer.start());
   for (size_t i = 0; i < title_chars_no_null; i++)
     astr[i] = MsDosCodec::wide_to_ansi_char(title().chars[i]);
   // There's a weird corner case here where we'll allow a buffer that's the
   // null terminator too short to hold the complete terminated title -- but we
   // return the title anyway and overwrite the last character with the
   // terminator.
-  size_t null_index = (buffer.size() == title_chars_no_null) ? (title_chars_no_null - 1) : title_chars_no_null;
+  size_t null_index = (output->capacity() == title_chars_no_null) ? (title_chars_no_null - 1) : title_chars_no_null;
   *bytes_written_out = null_index;
   return response_t<uint32_t>::of(static_cast<uint32_t>(title_chars_no_null));
 }
@@ -200,8 +341,10 @@ size_t BasicConsoleBackend::ucs16_to_blob(ucs16_t str, tclib::Blob blob, bool is
 
 response_t<bool_t> BasicConsoleBackend::set_console_title(tclib::Blob title,
     bool is_unicode) {
+  ucs16_t value = blob_to_ucs16(title, is_unicode);
+  Lock lock(this);
   ucs16_default_delete(title_);
-  title_ = blob_to_ucs16(title, is_unicode);
+  title_ = value;
   return response_t<bool_t>::yes();
 }
 
@@ -210,10 +353,12 @@ void BasicConsoleBackend::set_title(const char *value) {
 }
 
 HandleShadow BasicConsoleBackend::get_handle_shadow(Handle handle) {
+  Lock lock(this);
   return handles()->get_shadow(handle);
 }
 
 response_t<bool_t> BasicConsoleBackend::set_console_mode(Handle handle, uint32_t mode) {
+  Lock lock(this);
   handles()->set_handle_mode(handle, mode);
   return response_t<bool_t>::yes();
 }
@@ -224,14 +369,70 @@ response_t<bool_t> BasicConsoleBackend::get_console_screen_buffer_info(
   return wty()->get_screen_buffer_info(shadow.is_error(), info_out);
 }
 
+response_t<bool_t> BasicConsoleBackend::get_console_state(console_state_t *state,
+    uint32_t parts) {
+  if (parts == spAll)
+    struct_zero_fill(*state);
+  // The state is copied under the lock but the wty is asked for the screen
+  // buffers after releasing it.
+  Handle std_handles[3];
+  HandleShadow shadows[3];
+  {
+    Lock lock(this);
+    if ((parts & spCodepages) != 0) {
+      state->input_codepage = input_codepage_;
+      state->output_codepage = output_codepage_;
+    }
+    if ((parts & spTitle) != 0)
+      state->title_length = static_cast<uint32_t>(title().length);
+    for (size_t i = 0; i < 3; i++) {
+      std_handles[i] = std_handles_[i];
+      if (std_handles[i].is_valid())
+        shadows[i] = handles()->get_shadow(std_handles[i]);
+    }
+  }
+  if ((parts & (spModes | spScreenBuffers)) != 0) {
+    for (size_t i = 0; i < 3; i++)
+      get_handle_state(std_handles[i], shadows[i], parts, &state->handles[i]);
+  }
+  return response_t<bool_t>::yes();
+}
+
+void BasicConsoleBackend::get_handle_state(Handle handle, HandleShadow shadow,
+    uint32_t parts, console_handle_state_t *state) {
+  if (!handle.is_valid())
+    return;
+  state->handle = handle.id();
+  if ((parts & spModes) != 0)
+    state->mode = shadow.mode();
+  if ((parts & spScreenBuffers) != 0) {
+    ScreenBufferInfo info;
+    response_t<bool_t> resp = wty()->get_screen_buffer_info(shadow.is_error(), &info);
+    state->has_screen_buffer_info = resp.has_error() ? 0 : 1;
+    if (!resp.has_error())
+      state->screen_buffer_info = *info.raw();
+  }
+}
+
 response_t<uint32_t> BasicConsoleBackend::write_console(Handle output,
     tclib::Blob data, bool is_unicode) {
   HandleShadow shadow = get_handle_shadow(output);
   return wty()->write(data, is_unicode, shadow.is_error());
 }
 
+response_t<uint32_t> BasicConsoleBackend::write_console_utf8(Handle output,
+    tclib::Blob data) {
+  HandleShadow shadow = get_handle_shadow(output);
+  response_t<uint32_t> result = wty()->write_utf8(data, shadow.is_error());
+  if (result.has_error())
+    return result;
+  size_t length = Utf8Codec::decoded_length(static_cast<uint8_t*>(data.start()),
+      min_size(result.value(), data.size()));
+  return response_t<uint32_t>::of(static_cast<uint32_t>(length * sizeof(wide_char_t)));
+}
+
 response_t<uint32_t> BasicConsoleBackend::read_console(Handle input,
-    tclib::Blob buffer, bool is_unicode, size_t *bytes_read_out,
+    ResponseBuffer *buffer, bool is_unicode, size_t *bytes_read_out,
     ReadConsoleControl *input_control) {
   response_t<uint32_t> resp = wty()->read(buffer, is_unicode, input_control);
   if (resp.has_error())
@@ -251,13 +452,15 @@ response_t<bool_t> BasicConsoleBackend::create_process(NativeProcessHandle *proc
 
 void ConsoleBackendService::on_log(rpc::RequestData *data, ResponseCallback resp) {
   Variant remote_value = data->argument(0);
-  LogEntry *remote_entry = remote_value.native_as<LogEntry>();
-  if (remote_entry == NULL) {
+  // A compact entry points into the request so it's only valid until we
+  // return, which is fine since it's logged right away.
+  LogEntry remote_entry;
+  if (!CompactCodec::decode(remote_value, &remote_entry)) {
     TextWriter writer;
     writer.write(remote_value);
     INFO("Unknown log: %s", *writer);
   } else {
-    log_entry_t local_entry = *remote_entry->as_struct();
+    log_entry_t local_entry = *remote_entry.as_struct();
     if (local_entry.level == llFatal)
       local_entry.level = llError;
     log_entry(&local_entry);
@@ -265,23 +468,118 @@ void ConsoleBackendService::on_log(rpc::RequestData *data, ResponseCallback resp
   resp(rpc::OutgoingResponse::success(Variant::yes()));
 }
 
+void ConsoleBackendService::on_log_batch(rpc::RequestData *data,
+    ResponseCallback resp) {
+  Variant batch = data->argument(0);
+  if (!batch.is_blob())
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
+  CompactReader reader(static_cast<const uint8_t*>(batch.blob_data()),
+      batch.blob_size());
+  uint32_t entry_count = 0;
+  uint64_t dropped_count = 0;
+  // Each entry takes up at least the smallest possible entry's size which
+  // keeps a bad count from making us spin.
+  if (!CompactLogBatch::read_header(&reader, &entry_count, &dropped_count)
+      || entry_count > batch.blob_size() / CompactLogBatch::kMinEntrySize)
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
+  // The entries point into the request which is fine since they're logged
+  // right away.
+  char timestamp[CompactLogBatch::kMaxTimestampSize];
+  for (uint32_t i = 0; i < entry_count; i++) {
+    CompactLogBatch::entry_t entry;
+    CompactLogBatch::read_entry(&reader, &entry);
+    CompactLogBatch::format_timestamp(entry.timestamp_nanos, timestamp,
+        sizeof(timestamp));
+    log_entry_t local_entry;
+    log_entry_default_init(&local_entry,
+        (entry.level == llFatal) ? llError : entry.level, entry.file,
+        entry.line, new_string(entry.message, entry.message_size),
+        new_c_string(timestamp));
+    log_entry(&local_entry);
+  }
+  if (dropped_count > 0) {
+    dropped_log_entry_count_ += dropped_count;
+    WARN("Agent dropped %i log entries", static_cast<int>(dropped_count));
+  }
+  if (!reader.is_complete())
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
+  resp(rpc::OutgoingResponse::success(Variant::yes()));
+}
+
 void ConsoleBackendService::on_is_ready(rpc::RequestData *data, ResponseCallback resp) {
   Handle *stdin_handle = data->argument("stdin").native_as<Handle>();
   Handle *stdout_handle = data->argument("stdout").native_as<Handle>();
   Handle *stderr_handle = data->argument("stderr").native_as<Handle>();
   if (stdin_handle == NULL || stdout_handle == NULL || stderr_handle == NULL)
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
+  if (current_stream_ != 0) {
+    // The channel's features were settled by the agent that opened it and
+    // apply to every stream so the stream's agent gets none of the optional
+    // ones; it only has its handles registered.
+    if (backend() != NULL)
+      backend()->connect_stream(qualify(*stdin_handle),
+          qualify(*stdout_handle), qualify(*stderr_handle));
+    return resp(rpc::OutgoingResponse::success(Variant::null()));
+  }
   if (backend() != NULL)
     backend()->connect(*stdin_handle, *stdout_handle, *stderr_handle);
+  publish_state(spAll);
+  agent_uses_transport_ = (transport() != NULL)
+      && data->argument("shared_memory").bool_value();
+  agent_uses_compact_values_ = data->argument("compact_values").bool_value();
   agent_is_ready_ = true;
-  resp(rpc::OutgoingResponse::success(Variant::null()));
+  // Let the agent know which of the optional protocol features it asked for
+  // we understand.
+  Map features = data->factory()->new_map();
+  features.set("fast_path", Variant::boolean(data->argument("fast_path").bool_value()));
+  features.set("numeric_selectors",
+      Variant::boolean(data->argument("numeric_selectors").bool_value()));
+  features.set("utf8_wire", Variant::boolean(data->argument("utf8_wire").bool_value()));
+  features.set("stream_writes",
+      Variant::boolean(data->argument("stream_writes").bool_value()));
+  features.set("compact_values", Variant::boolean(agent_uses_compact_values_));
+  features.set("log_batches", Variant::boolean(data->argument("log_batches").bool_value()));
+  if (data->argument("write_credits").bool_value() && write_credit_limit_ > 0) {
+    features.set("write_credits", Variant::integer(write_credit_limit_));
+    if (!write_credits_.is_enabled()
+        && !write_credits_.initialize(write_credit_limit_))
+      WARN("Failed to enable write credits; they won't be enforced");
+  }
+  resp(rpc::OutgoingResponse::success(features));
 }
 
 void ConsoleBackendService::on_is_done(rpc::RequestData *data, ResponseCallback resp) {
-  agent_is_done_ = true;
+  if (current_stream_ == 0) {
+    agent_is_done_ = true;
+  } else {
+    for (size_t i = 0; i < open_streams_.size(); i++) {
+      if (open_streams_[i] == current_stream_) {
+        open_streams_.erase(open_streams_.begin() + i);
+        break;
+      }
+    }
+    // Stream ids aren't reused so nothing will refer to the stream's handles
+    // again.
+    if (backend() != NULL) {
+      int64_t stream = current_stream_;
+      backend()->disconnect_stream(Handle(stream << kStreamHandleShift),
+          Handle((stream + 1) << kStreamHandleShift));
+    }
+  }
   resp(rpc::OutgoingResponse::success(Variant::null()));
 }
 
+void ConsoleBackendService::on_open_stream(rpc::RequestData *data,
+    ResponseCallback resp) {
+  // Ids aren't reused so a stale tag can never end up in another process'
+  // namespace.
+  if (next_stream_id_ > kMaxStreamId)
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_STATE));
+  uint32_t id = next_stream_id_++;
+  open_streams_.push_back(id);
+  resp(rpc::OutgoingResponse::success(Variant::integer(id)));
+}
+
 template <typename T>
 class VariantDefaultConverter {
 public:
@@ -320,35 +618,38 @@ void ConsoleBackendService::on_get_console_cp(rpc::RequestData *data, ResponseCa
 void ConsoleBackendService::on_set_console_cp(rpc::RequestData *data, ResponseCallback resp) {
   uint32_t value = static_cast<uint32_t>(data->argument(0).integer_value());
   bool is_output = data->argument(1).bool_value();
-  forward_response(backend()->set_console_cp(value, is_output), resp);
+  response_t<bool_t> result = backend()->set_console_cp(value, is_output);
+  publish_state(spCodepages);
+  forward_response(result, resp);
 }
 
 void ConsoleBackendService::on_set_console_cursor_position(rpc::RequestData *data, ResponseCallback resp) {
-  Handle *output = data->argument(0).native_as<Handle>();
-  if (output == NULL)
+  Handle output;
+  if (!decode_handle(data->argument(0), &output))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
-  coord_t *position = data->argument(1).native_as<coord_t>();
-  if (position == NULL)
+  coord_t position;
+  if (!CompactCodec::decode(data->argument(1), &position))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
-  forward_response(backend()->set_console_cursor_position(*output, *position), resp);
+  await_key(handle_key(output));
+  response_t<bool_t> result = backend()->set_console_cursor_position(output,
+      position);
+  publish_state(spScreenBuffers);
+  forward_response(result, resp);
 }
 
 void ConsoleBackendService::on_get_console_title(rpc::RequestData *data, ResponseCallback resp) {
   uint32_t byte_size = static_cast<uint32_t>(data->argument(0).integer_value());
   bool is_unicode = data->argument(1).bool_value();
-  plankton::Blob scratch_blob = data->factory()->new_blob(byte_size);
-  tclib::Blob scratch(scratch_blob.mutable_data(), byte_size);
-  blob_fill(scratch, 0);
+  await_key(kConsoleKey);
+  ScratchResponseBuffer buffer(this, byte_size, data->factory());
   size_t bytes_written = 0;
-  response_t<uint32_t> result = backend()->get_console_title(scratch, is_unicode,
+  response_t<uint32_t> result = backend()->get_console_title(&buffer, is_unicode,
       &bytes_written);
   if (result.has_error()) {
     resp(rpc::OutgoingResponse::failure(Variant::integer(result.error_code())));
   } else {
-    plankton::Blob response_blob = Variant::blob(scratch_blob.data(),
-        static_cast<uint32_t>(bytes_written));
     Array pair = data->factory()->new_array(2);
-    pair.add(response_blob);
+    pair.add(buffer.wrap(bytes_written));
     pair.add(result.value());
     resp(rpc::OutgoingResponse::success(pair));
   }
@@ -358,87 +659,541 @@ tclib::Blob ConsoleBackendService::to_blob(Variant value) {
   return tclib::Blob(value.blob_data(), value.blob_size());
 }
 
+bool ConsoleBackendService::resolve_payload(Variant value, tclib::Blob *data_out) {
+  RingSlice *slice = value.native_as<RingSlice>();
+  if (slice == NULL) {
+    *data_out = to_blob(value);
+    return true;
+  }
+  return (transport() != NULL) && transport()->up()->read(slice, data_out);
+}
+
+void ConsoleBackendService::release_payload(Variant value) {
+  RingSlice *slice = value.native_as<RingSlice>();
+  if (slice != NULL && transport() != NULL)
+    transport()->up()->release(slice);
+}
+
+tclib::Blob ConsoleBackendService::new_response_scratch(size_t size,
+    Factory *factory, scratch_origin_t *origin_out) {
+  tclib::Blob scratch;
+  if (agent_uses_transport_
+      && (size >= SharedRingTransport::kMinPayloadSize)
+      && transport()->down()->reserve(size, &scratch)) {
+    *origin_out = soRing;
+  } else if (scratch_pool()->acquire(size, &scratch)) {
+    *origin_out = soPool;
+  } else {
+    plankton::Blob scratch_blob = factory->new_blob(static_cast<uint32_t>(size));
+    scratch = tclib::Blob(scratch_blob.mutable_data(), size);
+    *origin_out = soArena;
+  }
+  return scratch;
+}
+
+Variant ConsoleBackendService::wrap_response_scratch(tclib::Blob scratch,
+    size_t size, scratch_origin_t origin, Factory *factory) {
+  if (origin == soRing && size >= SharedRingTransport::kMinPayloadSize) {
+    RingSlice *slice = new (factory) RingSlice();
+    transport()->down()->commit(size, slice);
+    return NativeVariant(slice);
+  }
+  // Small payloads are sent inline even if they were produced in the ring;
+  // the reservation just gets discarded.
+  return Variant::blob(scratch.start(), static_cast<uint32_t>(size));
+}
+
+void ConsoleBackendService::release_response_scratch(tclib::Blob scratch,
+    scratch_origin_t origin) {
+  // Ring reservations are either committed or discarded by the next one and
+  // arena memory goes away with the request so only pooled buffers have to be
+  // given back.
+  if (origin == soPool)
+    scratch_pool()->release(scratch);
+}
+
+ConsoleBackendService::ScratchResponseBuffer::ScratchResponseBuffer(
+    ConsoleBackendService *service, size_t capacity, Factory *factory)
+  : ResponseBuffer(capacity)
+  , service_(service)
+  , factory_(factory)
+  , origin_(soArena) { }
+
+ConsoleBackendService::ScratchResponseBuffer::~ScratchResponseBuffer() {
+  service_->release_response_scratch(memory_, origin_);
+}
+
+bool ConsoleBackendService::ScratchResponseBuffer::reserve(size_t size,
+    tclib::Blob *memory_out) {
+  size = min_size(size, capacity());
+  if (size > memory_.size()) {
+    scratch_origin_t origin = soArena;
+    tclib::Blob memory = service_->new_response_scratch(size, factory_, &origin);
+    // If both are in the ring the new reservation may overlap the old one so
+    // this has to be a move.
+    if (memory_.size() > 0)
+      memmove(memory.start(), memory_.start(), memory_.size());
+    service_->release_response_scratch(memory_, origin_);
+    memory_ = memory;
+    origin_ = origin;
+  }
+  *memory_out = tclib::Blob(memory_.start(), size);
+  return true;
+}
+
+Variant ConsoleBackendService::ScratchResponseBuffer::wrap(size_t size) {
+  return service_->wrap_response_scratch(memory_, min_size(size, memory_.size()),
+      origin_, factory_);
+}
+
 void ConsoleBackendService::on_write_console(rpc::RequestData *data, ResponseCallback resp) {
-  Handle *handle = data->argument(0).native_as<Handle>();
-  if (handle == NULL)
+  Handle handle;
+  if (!decode_handle(data->argument(0), &handle))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
-  tclib::Blob chars = to_blob(data->argument(1));
   bool is_unicode = data->argument(2).bool_value();
-  forward_response(backend()->write_console(*handle, chars, is_unicode), resp);
+  bool is_utf8 = is_unicode && data->argument("utf8").bool_value();
+  write_console(handle, data->argument(1), is_unicode, is_utf8, data, resp);
+}
+
+void ConsoleBackendService::write_console(Handle output, Variant payload,
+    bool is_unicode, bool is_utf8, rpc::RequestData *data,
+    ResponseCallback resp) {
+  tclib::Blob chars;
+  if (!resolve_payload(payload, &chars))
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
+  count_write(chars.size(), data);
+  bool is_stream_end = data->argument("stream_end").bool_value();
+  uint64_t stream_offset = static_cast<uint64_t>(
+      data->argument("stream_offset").integer_value());
+  // A write beyond the agent's credits is rejected rather than waited for;
+  // waiting would mean not reading anything else from the agent meanwhile.
+  size_t credits = 0;
+  if (write_credits_.is_enabled()) {
+    if (!write_credits_.try_acquire(chars.size())) {
+      write_credits_.count_throttle();
+      release_payload(payload);
+      return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_OUT_OF_CREDITS));
+    }
+    credits = chars.size();
+  }
+  if (executor() != NULL) {
+    WriteJob *job = new (kDefaultAlloc) WriteJob(this, output, is_unicode,
+        is_utf8, is_stream_end, stream_offset, credits, resp);
+    bool copied = job->initialize(chars);
+    release_payload(payload);
+    if (!copied) {
+      tclib::default_delete_concrete(job);
+      if (credits > 0)
+        write_credits_.release(credits);
+      return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_SYSTEM));
+    }
+    return executor()->submit(handle_key(output), job);
+  }
+  response_t<uint32_t> result = write_console_text(output, chars, is_unicode,
+      is_utf8);
+  release_payload(payload);
+  publish_state(spScreenBuffers);
+  if (credits > 0)
+    write_credits_.release(credits);
+  forward_response(stream_write_result(result, is_stream_end, stream_offset),
+      resp);
+}
+
+ConsoleBackendService::PayloadJob::PayloadJob(ConsoleBackendService *service,
+    ResponseCallback resp)
+  : service_(service)
+  , resp_(resp) { }
+
+ConsoleBackendService::PayloadJob::~PayloadJob() {
+  if (payload_.start() != NULL)
+    allocator_default_free(payload_);
+}
+
+bool ConsoleBackendService::PayloadJob::initialize(tclib::Blob payload) {
+  // Always allocate at least a byte so an empty payload is distinguishable
+  // from a failed allocation.
+  payload_ = allocator_default_malloc((payload.size() == 0) ? 1 : payload.size());
+  if (payload_.start() == NULL)
+    return false;
+  memcpy(payload_.start(), payload.start(), payload.size());
+  payload_ = tclib::Blob(payload_.start(), payload.size());
+  return true;
+}
+
+ConsoleBackendService::WriteJob::WriteJob(ConsoleBackendService *service,
+    Handle output, bool is_unicode, bool is_utf8, bool is_stream_end,
+    uint64_t stream_offset, size_t credits, ResponseCallback resp)
+  : PayloadJob(service, resp)
+  , output_(output)
+  , is_unicode_(is_unicode)
+  , is_utf8_(is_utf8)
+  , is_stream_end_(is_stream_end)
+  , stream_offset_(stream_offset)
+  , credits_(credits) { }
+
+void ConsoleBackendService::WriteJob::run() {
+  response_t<uint32_t> result = service_->write_console_text(output_, payload_,
+      is_unicode_, is_utf8_);
+  service_->publish_state(spScreenBuffers);
+  // The agent gets its credits back with the response so they have to be
+  // back with us before it can send a write that uses them.
+  if (credits_ > 0)
+    service_->write_credits_.release(credits_);
+  forward_response(stream_write_result(result, is_stream_end_, stream_offset_),
+      resp_);
+  tclib::default_delete_concrete(this);
+}
+
+void ConsoleBackendService::count_write(size_t size, rpc::RequestData *data) {
+  write_bytes_received_ += size;
+  // The agent sends its running total so we only have to keep the largest.
+  Variant throttled = data->argument("throttled");
+  if (throttled.is_integer()) {
+    uint64_t count = static_cast<uint64_t>(throttled.integer_value());
+    if (count > agent_throttle_count_)
+      agent_throttle_count_ = count;
+  }
+}
+
+response_t<uint32_t> ConsoleBackendService::stream_write_result(
+    response_t<uint32_t> result, bool is_stream_end, uint64_t stream_offset) {
+  if (result.has_error() || !is_stream_end)
+    return result;
+  // The chunks are written as they arrive so there's nothing to do at the
+  // end except tell the agent how much was written in total.
+  return response_t<uint32_t>::of(static_cast<uint32_t>(stream_offset + result.value()));
+}
+
+response_t<uint32_t> ConsoleBackendService::write_console_text(Handle output,
+    tclib::Blob chars, bool is_unicode, bool is_utf8) {
+  if (!is_utf8)
+    return backend()->write_console(output, chars, is_unicode);
+  response_t<uint32_t> result = backend()->write_console_utf8(output, chars);
+  if (!result.has_error() || result.error_code() != CONPRX_ERROR_NOT_IMPLEMENTED)
+    return result;
+  // The backend wants wide text. Every byte of utf-8 becomes at most one wide
+  // character so this is enough room.
+  size_t capacity = chars.size() * sizeof(wide_char_t);
+  tclib::Blob wide;
+  // The pool isn't thread safe so it's only used when writes are guaranteed
+  // to happen on the reading thread.
+  bool is_pooled = (executor() == NULL) && scratch_pool()->acquire(capacity, &wide);
+  if (!is_pooled) {
+    wide = allocator_default_malloc(capacity);
+    if (wide.start() == NULL)
+      return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  }
+  size_t length = Utf8Codec::decode(static_cast<uint8_t*>(chars.start()),
+      chars.size(), static_cast<wide_char_t*>(wide.start()), chars.size());
+  result = backend()->write_console(output,
+      tclib::Blob(wide.start(), length * sizeof(wide_char_t)), true);
+  if (is_pooled) {
+    scratch_pool()->release(wide);
+  } else {
+    allocator_default_free(wide);
+  }
+  return result;
 }
 
 void ConsoleBackendService::on_read_console(rpc::RequestData *data, ResponseCallback resp) {
-  Handle *handle = data->argument(0).native_as<Handle>();
-  if (handle == NULL)
+  Handle handle;
+  if (!decode_handle(data->argument(0), &handle))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
   uint32_t byte_size = static_cast<uint32_t>(data->argument(1).integer_value());
   bool is_unicode = data->argument(2).bool_value();
-  console_readconsole_control_t *control_in = data->argument(3).native_as<console_readconsole_control_t>();
-  if (control_in == NULL)
+  ReadConsoleControl control;
+  if (!CompactCodec::decode(data->argument(3), control.raw()))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
-  ReadConsoleControl control_out(control_in);
-  plankton::Blob scratch_blob = data->factory()->new_blob(byte_size);
-  tclib::Blob scratch(scratch_blob.mutable_data(), byte_size);
-  blob_fill(scratch, 0);
-  size_t bytes_read = 0;
-  response_t<uint32_t> result = backend()->read_console(*handle, scratch, is_unicode,
-      &bytes_read, &control_out);
+  // If the agent asked for wide text as utf-8 it's encoded into a second
+  // buffer. Through the shared ring it's not worth it and the two buffers
+  // could overlap there so in that case it's sent as it is.
+  bool is_utf8 = is_unicode && data->argument("utf8").bool_value()
+      && !agent_uses_transport_;
+  // The backend may keep the read until there is input, in which case we go
+  // on handling other requests and it responds when it completes the read.
+  await_key(handle_key(handle));
+  ServicePendingRead *read = new (kDefaultAlloc) ServicePendingRead(this,
+      handle, is_unicode, is_utf8, &control, byte_size, resp);
+  backend()->begin_read_console(read);
+}
+
+ConsoleBackendService::ServicePendingRead::ServicePendingRead(
+    ConsoleBackendService *service, Handle input, bool is_unicode, bool is_utf8,
+    ReadConsoleControl *input_control, size_t byte_size, ResponseCallback resp)
+  : PendingRead(input, is_unicode, input_control)
+  , service_(service)
+  , is_utf8_(is_utf8)
+  , resp_(resp)
+  , buffer_(service, byte_size, &arena_) { }
+
+void ConsoleBackendService::ServicePendingRead::complete(
+    response_t<uint32_t> result, size_t bytes_read) {
+  // Reading echoes the input so the cursor may have moved.
+  service_->publish_state(spScreenBuffers);
+  respond(result, bytes_read);
+  tclib::default_delete_concrete(this);
+}
+
+void ConsoleBackendService::ServicePendingRead::respond(
+    response_t<uint32_t> result, size_t bytes_read) {
+  size_t wide_length = bytes_read / sizeof(wide_char_t);
+  ScratchResponseBuffer utf8_buffer(service_,
+      is_utf8_ ? (wide_length * Utf8Codec::kMaxBytesPerUnit) : 0, &arena_);
   if (result.has_error()) {
-    resp(rpc::OutgoingResponse::failure(Variant::integer(result.error_code())));
+    resp_(rpc::OutgoingResponse::failure(Variant::integer(result.error_code())));
   } else {
-    plankton::Blob response_blob = Variant::blob(scratch_blob.data(),
-        static_cast<uint32_t>(bytes_read));
-    Map response = data->factory()->new_map();
-    response.set("data", response_blob);
+    Map response = arena_.new_map();
+    if (is_utf8_) {
+      tclib::Blob wide;
+      tclib::Blob utf8;
+      buffer_.reserve(bytes_read, &wide);
+      utf8_buffer.reserve_all(&utf8);
+      size_t size = Utf8Codec::encode(static_cast<wide_char_t*>(wide.start()),
+          wide_length, static_cast<uint8_t*>(utf8.start()));
+      response.set("data", utf8_buffer.wrap(size));
+      response.set("utf8", Variant::yes());
+    } else {
+      response.set("data", buffer_.wrap(bytes_read));
+    }
     response.set("result", result.value());
-    NativeVariant control_var(control_out.raw());
-    response.set("input_control", control_var);
-    resp(rpc::OutgoingResponse::success(response));
+    WireValue<console_readconsole_control_t> control_wire(input_control()->raw(),
+        service_->agent_uses_compact_values_);
+    response.set("input_control", control_wire.variant());
+    resp_(rpc::OutgoingResponse::success(response));
   }
 }
 
+void ConsoleBackendService::ServicePendingRead::abandon() {
+  tclib::default_delete_concrete(this);
+}
+
 void ConsoleBackendService::on_set_console_title(rpc::RequestData *data, ResponseCallback resp) {
-  tclib::Blob chars = to_blob(data->argument(0));
+  tclib::Blob chars;
+  if (!resolve_payload(data->argument(0), &chars))
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
   bool is_unicode = data->argument(1).bool_value();
-  forward_response(backend()->set_console_title(chars, is_unicode), resp);
+  if (executor() != NULL) {
+    SetTitleJob *job = new (kDefaultAlloc) SetTitleJob(this, is_unicode, resp);
+    bool copied = job->initialize(chars);
+    release_payload(data->argument(0));
+    if (!copied) {
+      tclib::default_delete_concrete(job);
+      return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_SYSTEM));
+    }
+    return executor()->submit(kConsoleKey, job);
+  }
+  response_t<bool_t> result = backend()->set_console_title(chars, is_unicode);
+  release_payload(data->argument(0));
+  publish_state(spTitle);
+  forward_response(result, resp);
+}
+
+void ConsoleBackendService::SetTitleJob::run() {
+  response_t<bool_t> result = service_->backend()->set_console_title(payload_,
+      is_unicode_);
+  service_->publish_state(spTitle);
+  forward_response(result, resp_);
+  tclib::default_delete_concrete(this);
 }
 
 void ConsoleBackendService::on_set_console_mode(rpc::RequestData *data, ResponseCallback resp) {
-  Handle *handle = data->argument(0).native_as<Handle>();
-  if (handle == NULL)
+  Handle handle;
+  if (!decode_handle(data->argument(0), &handle))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
   uint32_t mode = static_cast<uint32_t>(data->argument(1).integer_value());
-  forward_response(backend()->set_console_mode(*handle, mode), resp);
+  await_key(handle_key(handle));
+  response_t<bool_t> result = backend()->set_console_mode(handle, mode);
+  publish_state(spModes);
+  forward_response(result, resp);
 }
 
 void ConsoleBackendService::on_get_console_screen_buffer_info(rpc::RequestData *data,
     ResponseCallback resp) {
-  Handle *output = data->argument(0).native_as<Handle>();
-  if (output == NULL)
+  Handle output;
+  if (!decode_handle(data->argument(0), &output))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_EXPECTED_HANDLE));
-  ScreenBufferInfo *info = new (data->factory()) ScreenBufferInfo();
-  response_t<bool_t> result = backend()->get_console_screen_buffer_info(*output, info);
+  await_key(handle_key(output));
+  ScreenBufferInfo *info = new_info_scratch();
+  response_t<bool_t> result = backend()->get_console_screen_buffer_info(output, info);
   if (result.has_error()) {
     return resp(rpc::OutgoingResponse::failure(result.error_code()));
   } else {
-    NativeVariant info_var(info->raw());
-    return resp(rpc::OutgoingResponse::success(info_var));
+    WireValue<console_screen_buffer_infoex_t> info_wire(info->raw(),
+        agent_uses_compact_values_);
+    return resp(rpc::OutgoingResponse::success(info_wire.variant()));
   }
 }
 
+void ConsoleBackendService::on_fast(rpc::RequestData *data, ResponseCallback resp) {
+  tclib::Blob frame = to_blob(data->argument(0));
+  fast_frame_header_t *header = FastFrame::header(frame);
+  if (header == NULL)
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
+  switch (header->apinum) {
+#define __GEN_FAST_CASE__(Name, name, NUM, FLAGS) lfFp FLAGS (                 \
+    case NUM: {                                                                \
+      fast_##name##_t *body = FastFrame::body<fast_##name##_t>(frame);         \
+      if (body == NULL)                                                        \
+        return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT)); \
+      return on_fast_##name(body, data, resp);                                 \
+    },)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_FAST_CASE__)
+#undef __GEN_FAST_CASE__
+    default:
+      return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_NOT_IMPLEMENTED));
+  }
+}
+
+void ConsoleBackendService::on_fast_get_console_cp(fast_get_console_cp_t *body,
+    rpc::RequestData *data, ResponseCallback resp) {
+  forward_response(backend()->get_console_cp(body->is_output != 0), resp);
+}
+
+void ConsoleBackendService::on_fast_set_console_cursor_position(
+    fast_set_console_cursor_position_t *body, rpc::RequestData *data,
+    ResponseCallback resp) {
+  Handle output = qualify(Handle(body->output));
+  await_key(handle_key(output));
+  response_t<bool_t> result = backend()->set_console_cursor_position(output,
+      body->position);
+  publish_state(spScreenBuffers);
+  forward_response(result, resp);
+}
+
+void ConsoleBackendService::on_fast_write_console(fast_write_console_t *body,
+    rpc::RequestData *data, ResponseCallback resp) {
+  write_console(qualify(Handle(body->output)), data->argument(1),
+      body->is_unicode != 0, body->is_unicode != 0 && body->is_utf8 != 0, data,
+      resp);
+}
+
+void ConsoleBackendService::on_fast_get_console_screen_buffer_info(
+    fast_get_console_screen_buffer_info_t *body, rpc::RequestData *data,
+    ResponseCallback resp) {
+  Handle output = qualify(Handle(body->output));
+  await_key(handle_key(output));
+  ScreenBufferInfo *info = new_info_scratch();
+  response_t<bool_t> result = backend()->get_console_screen_buffer_info(output,
+      info);
+  if (result.has_error())
+    return resp(rpc::OutgoingResponse::failure(result.error_code()));
+  // The response is the raw struct rather than a seed.
+  resp(rpc::OutgoingResponse::success(Variant::blob(info->raw(),
+      static_cast<uint32_t>(sizeof(*info->raw())))));
+}
+
 void ConsoleBackendService::on_create_process(rpc::RequestData *data, ResponseCallback resp) {
-  NativeProcessInfo *info = data->argument(0).native_as<NativeProcessInfo>();
-  if (info == NULL)
+  NativeProcessInfo info(0);
+  if (!CompactCodec::decode(data->argument(0), &info))
     return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_INVALID_ARGUMENT));
-  native_process_id_t id = info->id();
+  // Injecting the agent can take a while so with an executor it doesn't hold
+  // up other calls.
+  if (executor() != NULL) {
+    CreateProcessJob *job = new (kDefaultAlloc) CreateProcessJob(this,
+        info.id(), resp);
+    return executor()->submit(kConsoleKey, job);
+  }
+  create_process(info.id(), resp);
+}
+
+void ConsoleBackendService::create_process(native_process_id_t id,
+    ResponseCallback resp) {
   NativeProcessHandle handle;
   fat_bool_t opened = handle.open(id);
   if (!opened)
-    resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_SYSTEM));
+    return resp(rpc::OutgoingResponse::failure(CONPRX_ERROR_SYSTEM));
   forward_response(backend()->create_process(&handle, context()), resp);
   handle.close();
 }
 
+void ConsoleBackendService::CreateProcessJob::run() {
+  service_->create_process(id_, resp_);
+  tclib::default_delete_concrete(this);
+}
+
+void ConsoleBackendService::publish_state(uint32_t parts) {
+  if (state_page() == NULL || backend() == NULL)
+    return;
+  // The page has a single writer so with an executor publishing has to be
+  // serialized.
+  if (executor() != NULL)
+    state_mutex_.lock();
+  if (!is_state_published_)
+    parts = spAll;
+  response_t<bool_t> result = backend()->get_console_state(&published_state_,
+      parts);
+  is_state_published_ = !result.has_error();
+  if (is_state_published_) {
+    state_page()->publish(&published_state_);
+  } else {
+    state_page()->invalidate();
+  }
+  if (executor() != NULL)
+    state_mutex_.unlock();
+}
+
+ConsoleBackendService::handler_t ConsoleBackendService::numeric_handler(
+    int64_t apinum) {
+  switch (apinum) {
+#define __GEN_CASE__(Name, name, NUM, FLAGS) lfPa FLAGS (,                     \
+    case NUM: return &ConsoleBackendService::on_##name;)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_CASE__)
+#undef __GEN_CASE__
+    default: return NULL;
+  }
+}
+
+const ConsoleBackendService::named_method_t ConsoleBackendService::kNamedMethods[] = {
+  {"log", &ConsoleBackendService::on_log},
+  {"log_batch", &ConsoleBackendService::on_log_batch},
+  {"is_ready", &ConsoleBackendService::on_is_ready},
+  {"is_done", &ConsoleBackendService::on_is_done},
+  {"poke", &ConsoleBackendService::on_poke},
+  {"open_stream", &ConsoleBackendService::on_open_stream},
+  {FastFrame::kSelector, &ConsoleBackendService::on_fast},
+#define __GEN_NAMED__(Name, name, NUM, FLAGS) lfPa FLAGS (,                    \
+  {#name, &ConsoleBackendService::on_##name},)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_NAMED__)
+#undef __GEN_NAMED__
+  {NULL, NULL}
+};
+
+uint32_t ConsoleBackendService::hash_method_name(const char *name) {
+  // FNV-1a.
+  uint32_t hash = 2166136261U;
+  for (const char *p = name; *p != '\0'; p++) {
+    hash ^= static_cast<uint8_t>(*p);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+ConsoleBackendService::handler_t ConsoleBackendService::named_handler(
+    Variant selector) {
+  if (!selector.is_string())
+    return NULL;
+  const char *chars = selector.string_chars();
+  size_t slot = hash_method_name(chars) & (kNamedMethodTableSize - 1);
+  while (named_methods_[slot] != NULL) {
+    const named_method_t *entry = named_methods_[slot];
+    if (strcmp(entry->name, chars) == 0)
+      return entry->handler;
+    slot = (slot + 1) & (kNamedMethodTableSize - 1);
+  }
+  return NULL;
+}
+
+void ConsoleBackendService::on_request(rpc::RequestData *data,
+    ResponseCallback resp) {
+  Variant selector = data->selector();
+  handler_t handler = selector.is_integer()
+      ? numeric_handler(selector.integer_value())
+      : named_handler(selector);
+  if (handler == NULL)
+    handler = &ConsoleBackendService::message_not_understood;
+  run_handler(handler, data, resp);
+}
+
 void ConsoleBackendService::message_not_understood(rpc::RequestData *data,
     ResponseCallback resp) {
   TextWriter writer;
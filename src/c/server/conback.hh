@@ -4,10 +4,19 @@
 #ifndef _CONPRX_SERVER_CONBACK
 #define _CONPRX_SERVER_CONBACK
 
+#include "c/stdvector.hh"
 #include "rpc.hh"
+#include "server/executor.hh"
 #include "server/handman.hh"
+#include "server/scratch.hh"
 #include "server/wty.hh"
+#include "share/compact.hh"
+#include "share/credits.hh"
+#include "share/fastpath.hh"
 #include "share/protocol.hh"
+#include "share/shmring.hh"
+#include "share/statepage.hh"
+#include "sync/mutex.hh"
 #include "sync/pipe.hh"
 #include "sync/process.hh"
 #include "sync/thread.hh"
@@ -34,6 +43,41 @@ public:
   virtual fat_bool_t inject_agent(tclib::NativeProcessHandle *process) = 0;
 };
 
+// A console read that may complete some time after the request that started
+// it has been handled, typically once the user has typed something. The
+// backend is given the read and must complete or abandon it exactly once,
+// either before returning or later; the read holds on to everything needed to
+// respond so the backend only has to keep the pointer.
+class PendingRead {
+public:
+  PendingRead(Handle input, bool is_unicode, ReadConsoleControl *input_control)
+    : input_(input)
+    , is_unicode_(is_unicode)
+    , input_control_(*input_control->raw()) { }
+  virtual ~PendingRead() { }
+
+  Handle input() { return input_; }
+  bool is_unicode() { return is_unicode_; }
+  ReadConsoleControl *input_control() { return &input_control_; }
+
+  // The buffer to read the input into.
+  virtual ResponseBuffer *buffer() = 0;
+
+  // Responds to the read with the given result, bytes_read being how much of
+  // the buffer holds input. This disposes the read so it must not be used
+  // afterwards.
+  virtual void complete(response_t<uint32_t> result, size_t bytes_read) = 0;
+
+  // Disposes the read without responding, for when the backend goes away
+  // before there is any input.
+  virtual void abandon() = 0;
+
+private:
+  Handle input_;
+  bool is_unicode_;
+  ReadConsoleControl input_control_;
+};
+
 // Virtual type, implementations of which can be used as the implementation of
 // a console.
 class ConsoleBackend {
@@ -44,6 +88,23 @@ public:
   virtual response_t<bool_t> connect(Handle stdin_handle, Handle stdout_handle,
       Handle stderr_handle) = 0;
 
+  // Called when the agent of another process, typically a child, starts
+  // sharing the console through a stream of its own on an existing channel.
+  // The handles are the other process' standard handles qualified by the
+  // stream so they don't collide with the first agent's. Unlike connect this
+  // shouldn't change which handles the console state describes.
+  virtual response_t<bool_t> connect_stream(Handle stdin_handle,
+      Handle stdout_handle, Handle stderr_handle) {
+    return response_t<bool_t>::yes();
+  }
+
+  // Called when the agent of a stream is done. Every handle qualified by the
+  // stream has an id at least first and below limit; the backend should
+  // forget anything it knows about them since they won't be used again.
+  virtual response_t<bool_t> disconnect_stream(Handle first, Handle limit) {
+    return response_t<bool_t>::yes();
+  }
+
   // Debug/test call.
   virtual response_t<int64_t> poke(int64_t value) = 0;
 
@@ -57,8 +118,9 @@ public:
   virtual response_t<bool_t> set_console_cursor_position(Handle output,
       coord_t position) = 0;
 
-  // Fill the given buffer with the title.
-  virtual response_t<uint32_t> get_console_title(tclib::Blob buffer, bool is_unicode,
+  // Fill the given buffer with the title, reserving only as much of it as the
+  // title needs.
+  virtual response_t<uint32_t> get_console_title(ResponseBuffer *buffer, bool is_unicode,
       size_t *bytes_written_out) = 0;
 
   // Set the title to the contents of the given buffer.
@@ -72,9 +134,31 @@ public:
   virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
       bool is_unicode) = 0;
 
-  virtual response_t<uint32_t> read_console(Handle output, tclib::Blob buffer,
+  // Writes text the agent sent as utf-8. The result is the size in bytes the
+  // part that was written has as wide characters, the same as write_console
+  // would return for the wide text. Backends don't have to implement this,
+  // the text will just be widened and passed to write_console instead.
+  virtual response_t<uint32_t> write_console_utf8(Handle output, tclib::Blob data) {
+    return response_t<uint32_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
+
+  virtual response_t<uint32_t> read_console(Handle output, ResponseBuffer *buffer,
       bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control) = 0;
 
+  // Starts the given read. A backend that knows it would have to wait for
+  // input can keep the read and complete it once the input has arrived such
+  // that the service keeps handling other requests meanwhile. By default the
+  // read is done right away through read_console, blocking the service until
+  // it's done. Either way the agent's caller waits for the read, and unless
+  // the agent multiplexes so do its other threads' calls.
+  virtual void begin_read_console(PendingRead *read);
+
+  // Called before the backend starts being called from several threads at
+  // the same time, see ConsoleBackendService::set_executor. A backend that
+  // keeps state must make calls safe to overlap from then on. By default
+  // nothing happens.
+  virtual fat_bool_t enable_concurrent_calls() { return F_TRUE; }
+
   // Fill in the given output parameter with information about the buffer with
   // the given handle.
   virtual response_t<bool_t> get_console_screen_buffer_info(Handle buffer,
@@ -83,6 +167,16 @@ public:
   // Notifies this backend that a process with the given uid has been created.
   virtual response_t<bool_t> create_process(tclib::NativeProcessHandle *process,
       ConsoleBackendContext *context) = 0;
+
+  // Bring the given snapshot of the state agents can read without calling the
+  // backend up to date. Only the parts given by the mask of
+  // console_state_part_t values have to be filled in, the rest hold what they
+  // held last time. Backends that can't describe their state cheaply don't
+  // have to implement this, agents will just call them instead.
+  virtual response_t<bool_t> get_console_state(console_state_t *state,
+      uint32_t parts) {
+    return response_t<bool_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
 };
 
 // A complete implementation of a console backend.
@@ -92,12 +186,15 @@ public:
   virtual ~BasicConsoleBackend();
   virtual response_t<bool_t> connect(Handle stdin_handle, Handle stdout_handle,
       Handle stderr_handle);
+  virtual response_t<bool_t> connect_stream(Handle stdin_handle,
+      Handle stdout_handle, Handle stderr_handle);
+  virtual response_t<bool_t> disconnect_stream(Handle first, Handle limit);
   virtual response_t<int64_t> poke(int64_t value);
   virtual response_t<uint32_t> get_console_cp(bool is_output);
   virtual response_t<bool_t> set_console_cp(uint32_t value, bool is_output);
   virtual response_t<bool_t> set_console_cursor_position(Handle output,
       coord_t position);
-  virtual response_t<uint32_t> get_console_title(tclib::Blob buffer,
+  virtual response_t<uint32_t> get_console_title(ResponseBuffer *buffer,
       bool is_unicode, size_t *bytes_written_out);
   virtual response_t<bool_t> set_console_title(tclib::Blob title,
       bool is_unicode);
@@ -106,10 +203,18 @@ public:
       ScreenBufferInfo *info_out);
   virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
       bool is_unicode);
-  virtual response_t<uint32_t> read_console(Handle output, tclib::Blob buffer,
+  virtual response_t<uint32_t> write_console_utf8(Handle output, tclib::Blob data);
+  virtual response_t<uint32_t> read_console(Handle output, ResponseBuffer *buffer,
       bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control);
   virtual response_t<bool_t> create_process(tclib::NativeProcessHandle *process,
       ConsoleBackendContext *context);
+  virtual response_t<bool_t> get_console_state(console_state_t *state,
+      uint32_t parts);
+
+  // Makes calls lock the title, code pages, and handle shadows while they use
+  // them. Calls to the wty are made without holding the lock so a slow write
+  // to one handle doesn't hold up calls for others; the wty must allow that.
+  virtual fat_bool_t enable_concurrent_calls();
 
   // Returns info about the given handle, if the handle isn't known the default
   // info is returned.
@@ -143,13 +248,28 @@ public:
 
 private:
   // Get-title for ansi strings.
-  response_t<uint32_t> get_console_title_ansi(tclib::Blob buffer,
+  response_t<uint32_t> get_console_title_ansi(ResponseBuffer *buffer,
       size_t *bytes_written_out);
 
   // Get-title for wide strings.
-  response_t<uint32_t> get_console_title_wide(tclib::Blob buffer,
+  response_t<uint32_t> get_console_title_wide(ResponseBuffer *buffer,
       size_t *bytes_written_out);
 
+  // Fills in the given parts of the given handle state from the given standard
+  // handle and its shadow.
+  void get_handle_state(Handle handle, HandleShadow shadow, uint32_t parts,
+      console_handle_state_t *state);
+
+  // Holds the backend's lock while in scope, if concurrent calls have been
+  // enabled.
+  class Lock {
+  public:
+    Lock(BasicConsoleBackend *backend);
+    ~Lock();
+  private:
+    tclib::NativeMutex *mutex_;
+  };
+
   WinTty *wty() { return wty_; }
   int64_t last_poke_;
   uint32_t input_codepage_;
@@ -158,6 +278,11 @@ private:
   WinTty *wty_;
   HandleManager *handles() { return &handles_; }
   HandleManager handles_;
+  Handle std_handles_[3];
+  // The mutex is only used once concurrent calls have been enabled, until
+  // then the backend is only ever called from one thread.
+  tclib::NativeMutex mutex_;
+  bool needs_lock_;
 };
 
 // The service the driver will call back to when it wants to access the manager.
@@ -169,18 +294,77 @@ public:
   // Returns true once the agent has reported that it's ready.
   bool agent_is_ready() { return agent_is_ready_; }
 
-  // Returns true once the agent has reported that it's done.
+  // Returns true once the agent has reported that it's done. Agents that
+  // share the channel through streams being done doesn't count.
   bool agent_is_done() { return agent_is_done_; }
 
+  // The number of streams other agents currently have open on this service's
+  // channel, see on_open_stream.
+  size_t open_stream_count() { return open_streams_.size(); }
+
   void set_backend(ConsoleBackend *backend) { backend_ = backend; }
 
+  // Sets the shared memory transport bulk payloads can be exchanged through.
+  // The agent's half is only used if it reports that it has opened it.
+  void set_transport(SharedRingTransport *transport) { transport_ = transport; }
+
+  // Sets the page to publish the console state to such that the agent can
+  // answer queries about it locally. The state is published when the agent
+  // reports that it's ready and after every call that may change it.
+  void set_state_page(ConsoleStatePage *page) { state_page_ = page; }
+
   // Returns the type registry to use for this backend.
   plankton::TypeRegistry *registry() { return &registry_; }
 
+  // The pool response scratch buffers are taken from. Its counters tell how
+  // much the service has had to allocate.
+  ScratchPool *scratch_pool() { return &scratch_pool_; }
+
+  // Sets how many bytes of writes the agent may have outstanding before it
+  // has to wait for responses. This bounds how much memory a single chatty
+  // process can make us hold. It is only granted to agents that ask for it so
+  // it must be set before the agent reports that it's ready. The limit is
+  // enforced too: a write from an agent that has been granted credits and
+  // has more than that outstanding is rejected with
+  // CONPRX_ERROR_OUT_OF_CREDITS. Without an executor each write is processed
+  // before the next is read so that never happens.
+  void set_write_credit_limit(uint32_t value) { write_credit_limit_ = value; }
+
+  // The number of bytes of console writes received from the agent.
+  uint64_t write_bytes_received() { return write_bytes_received_; }
+
+  // The number of times the agent has reported having had to wait for write
+  // credits before sending.
+  uint64_t agent_throttle_count() { return agent_throttle_count_; }
+
+  // The number of times the agent has sent writes beyond its credits and had
+  // them rejected.
+  uint64_t credit_overrun_count() { return write_credits_.throttle_count(); }
+
+  // The number of log entries the agent has reported dropping because they
+  // were logged faster than it could ship them.
+  uint64_t dropped_log_entry_count() { return dropped_log_entry_count_; }
+
+  // The write credit limit used unless another has been set.
+  static const uint32_t kDefaultWriteCreditLimit = 1024 * 1024;
+
+  // Makes the service run the calls that may take a while, writes, setting
+  // the title, and creating processes, on the given executor rather than the
+  // thread that reads the requests. Requests are still decoded on the reading
+  // thread and calls that concern the same handle still happen in the order
+  // they were received but calls for different handles may now be made
+  // concurrently so the backend must allow that; it is told through
+  // enable_concurrent_calls. Must be called after the backend has been set
+  // and before the agent connects.
+  fat_bool_t set_executor(HandlerExecutor *executor);
+
 private:
   // Handles logs entries logged by the agent.
   void on_log(plankton::rpc::RequestData*, ResponseCallback);
 
+  // Handles a batch of log entries, see CompactLogBatch.
+  void on_log_batch(plankton::rpc::RequestData*, ResponseCallback);
+
   // Called when the agent has completed its setup.
   void on_is_ready(plankton::rpc::RequestData*, ResponseCallback);
   void on_is_done(plankton::rpc::RequestData*, ResponseCallback);
@@ -189,18 +373,317 @@ private:
   // passed through to the implementation.
   void on_poke(plankton::rpc::RequestData*, ResponseCallback);
 
+  // Streams let several agents, typically those of a process' children,
+  // share one channel to the service rather than each having a connection and
+  // service of their own. An agent asks for a stream with open_stream and
+  // then tags every request it sends with the stream's id as the "stream"
+  // argument, starting with is_ready and ending with is_done which closes the
+  // stream. Untagged requests belong to stream 0, the agent the channel was
+  // opened for. Each stream has its own namespace of handles since the same
+  // handle value in two processes refers to different things.
+  void on_open_stream(plankton::rpc::RequestData*, ResponseCallback);
+
+  // Sets the stream of the request about to be handled. Returns false if the
+  // request is tagged with a stream that isn't open.
+  bool select_stream(plankton::rpc::RequestData *data);
+
+  // Returns the given handle qualified by the stream of the request being
+  // handled such that handles from different streams never collide. Handles
+  // from stream 0 are left as they are, as are negative ones since those are
+  // the invalid handle and pseudo handles that mean the same on every stream.
+  Handle qualify(Handle handle) {
+    return (current_stream_ == 0 || handle.id() < 0)
+        ? handle
+        : Handle(handle.id() | (static_cast<int64_t>(current_stream_) << kStreamHandleShift));
+  }
+
+  // Decodes the handle held by the given variant, compact or not, into the
+  // out parameter and qualifies it. Returns false if it doesn't hold one.
+  bool decode_handle(Variant value, Handle *handle_out);
+
+  // Where in a qualified handle the stream id goes. Windows handle values
+  // stay well below this.
+  static const int kStreamHandleShift = 40;
+
+  // The largest stream id that fits above the shift.
+  static const uint32_t kMaxStreamId = (1 << (63 - kStreamHandleShift)) - 1;
+
   // Returns a blob corresponding to the given blob variant. If the variant is
   // not a plankton blob the empty blob will be returned.
   static tclib::Blob to_blob(Variant value);
 
+  // Stores the payload carried by the given variant, either inline or in the
+  // shared ring, in the out parameter. Returns false if the payload is a slice
+  // that doesn't make sense.
+  bool resolve_payload(Variant value, tclib::Blob *data_out);
+
+  // Makes the space held by the given payload available to the agent again if
+  // it was passed through the shared ring.
+  void release_payload(Variant value);
+
+  // Where a response scratch buffer came from.
+  enum scratch_origin_t {
+    // Reserved in the shared ring.
+    soRing,
+    // Taken from the scratch pool.
+    soPool,
+    // Allocated in the request's arena.
+    soArena
+  };
+
+  // Returns a buffer of the given size for the backend to produce a response
+  // payload into. If the agent uses the shared memory transport the buffer is
+  // reserved directly in the ring so the payload doesn't have to be copied
+  // again before the agent sees it, otherwise it's taken from the scratch
+  // pool if it fits; origin_out tells which is the case.
+  tclib::Blob new_response_scratch(size_t size, Factory *factory,
+      scratch_origin_t *origin_out);
+
+  // Returns a variant that carries the first size bytes of a buffer returned
+  // by new_response_scratch to the agent.
+  Variant wrap_response_scratch(tclib::Blob scratch, size_t size,
+      scratch_origin_t origin, Factory *factory);
+
+  // Gives a buffer returned by new_response_scratch back once the response
+  // that carries it has been sent.
+  void release_response_scratch(tclib::Blob scratch, scratch_origin_t origin);
+
+  // The response buffer handlers pass to the backend. Memory is obtained
+  // through new_response_scratch when the backend asks for it and given back
+  // when the buffer is destroyed, which must be after the response that
+  // carries it has been sent.
+  class ScratchResponseBuffer : public ResponseBuffer {
+  public:
+    ScratchResponseBuffer(ConsoleBackendService *service, size_t capacity,
+        Factory *factory);
+    virtual ~ScratchResponseBuffer();
+    virtual bool reserve(size_t size, tclib::Blob *memory_out);
+
+    // Returns a variant that carries the first size bytes produced into this
+    // buffer to the agent.
+    Variant wrap(size_t size);
+
+  private:
+    ConsoleBackendService *service_;
+    Factory *factory_;
+    tclib::Blob memory_;
+    scratch_origin_t origin_;
+  };
+
+  // A read started by on_read_console. It has its own arena rather than the
+  // request's since it may outlive the request.
+  class ServicePendingRead : public PendingRead {
+  public:
+    ServicePendingRead(ConsoleBackendService *service, Handle input,
+        bool is_unicode, bool is_utf8, ReadConsoleControl *input_control,
+        size_t byte_size, ResponseCallback resp);
+    virtual ResponseBuffer *buffer() { return &buffer_; }
+    virtual void complete(response_t<uint32_t> result, size_t bytes_read);
+    virtual void abandon();
+
+  private:
+    // Sends the response to the read. The utf-8 buffer it may use has to be
+    // released before the read is disposed.
+    void respond(response_t<uint32_t> result, size_t bytes_read);
+
+    ConsoleBackendService *service_;
+    bool is_utf8_;
+    ResponseCallback resp_;
+    Arena arena_;
+    ScratchResponseBuffer buffer_;
+  };
+
+  // Sends one response while holding the response mutex, such that responses
+  // from handlers on the reading thread and from jobs on the executor's
+  // workers don't interleave on the socket. Disposes itself once the response
+  // has been sent so the callback stays valid for as long as the call is
+  // outstanding, even after the handler has returned. A call that is never
+  // responded to, a read that is abandoned for instance, leaks it.
+  class SerializedResponse {
+  public:
+    SerializedResponse(ResponseCallback resp, tclib::NativeMutex *mutex)
+      : resp_(resp)
+      , mutex_(mutex) { }
+
+    // Returns a callback that sends the response through this.
+    ResponseCallback callback();
+
+  private:
+    void send(plankton::rpc::OutgoingResponse response);
+
+    ResponseCallback resp_;
+    tclib::NativeMutex *mutex_;
+  };
+
+  // A call that carries a payload, decoded on the reading thread and run on
+  // the executor. The payload is copied since the request, and the ring space
+  // it may have come through, are only valid until the handler returns.
+  class PayloadJob : public ExecutorJob {
+  public:
+    PayloadJob(ConsoleBackendService *service, ResponseCallback resp);
+    virtual ~PayloadJob();
+
+    // Copies the payload. Returns false if there wasn't memory for it.
+    bool initialize(tclib::Blob payload);
+
+  protected:
+    ConsoleBackendService *service_;
+    ResponseCallback resp_;
+    tclib::Blob payload_;
+  };
+
+  class WriteJob : public PayloadJob {
+  public:
+    WriteJob(ConsoleBackendService *service, Handle output, bool is_unicode,
+        bool is_utf8, bool is_stream_end, uint64_t stream_offset,
+        size_t credits, ResponseCallback resp);
+    virtual void run();
+
+  private:
+    Handle output_;
+    bool is_unicode_;
+    bool is_utf8_;
+    bool is_stream_end_;
+    uint64_t stream_offset_;
+    // The credits taken for the write, given back once it has been
+    // processed.
+    size_t credits_;
+  };
+
+  class SetTitleJob : public PayloadJob {
+  public:
+    SetTitleJob(ConsoleBackendService *service, bool is_unicode,
+        ResponseCallback resp)
+      : PayloadJob(service, resp)
+      , is_unicode_(is_unicode) { }
+    virtual void run();
+
+  private:
+    bool is_unicode_;
+  };
+
+  class CreateProcessJob : public ExecutorJob {
+  public:
+    CreateProcessJob(ConsoleBackendService *service, native_process_id_t id,
+        ResponseCallback resp)
+      : service_(service)
+      , id_(id)
+      , resp_(resp) { }
+    virtual void run();
+
+  private:
+    ConsoleBackendService *service_;
+    native_process_id_t id_;
+    ResponseCallback resp_;
+  };
+
+  // Opens the given process and lets the backend set it up.
+  void create_process(native_process_id_t id, ResponseCallback resp);
+
+  // The executor key for calls that concern the console as a whole rather
+  // than one handle. No handle has this id.
+  static const uint64_t kConsoleKey = 0;
+
+  // Returns the executor key for calls that concern the given handle.
+  static uint64_t handle_key(Handle handle) {
+    return static_cast<uint64_t>(handle.id());
+  }
+
+  // If there is an executor, waits for the jobs for the given key to
+  // complete such that a call handled right away comes after them.
+  void await_key(uint64_t key);
+
+  // Returns the cleared screen buffer info to produce a response into.
+  ScreenBufferInfo *new_info_scratch() {
+    info_scratch_ = ScreenBufferInfo();
+    return &info_scratch_;
+  }
+
 #define __GEN_HANDLER__(Name, name, NUM, FLAGS)                                \
   void on_##name(plankton::rpc::RequestData*, ResponseCallback);
   FOR_EACH_LPC_TO_INTERCEPT(__GEN_HANDLER__)
 #undef __GEN_HANDLER__
 
-  // The fallback to call on unknown messages.
+  // Handles a request that carries a fixed-layout fast frame by dispatching
+  // it to the fast handler for the message.
+  void on_fast(plankton::rpc::RequestData*, ResponseCallback);
+
+#define __GEN_FAST_HANDLER__(Name, name, NUM, FLAGS)                           \
+  lfFp FLAGS (void on_fast_##name(fast_##name##_t*, plankton::rpc::RequestData*, ResponseCallback);,)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_FAST_HANDLER__)
+#undef __GEN_FAST_HANDLER__
+
+  // Records a write of the given size, along with the throttle count the
+  // agent attached to it if there is one.
+  void count_write(size_t size, plankton::rpc::RequestData *data);
+
+  // Writes the given text to the backend, widening it first if it is utf-8
+  // and the backend doesn't take utf-8.
+  response_t<uint32_t> write_console_text(Handle output, tclib::Blob chars,
+      bool is_unicode, bool is_utf8);
+
+  // Returns the result to respond to a write request with given the
+  // backend's result. Large writes may be streamed in chunks and the
+  // response to the last chunk gives the total written for all of them,
+  // which is the given offset of the last chunk plus what it wrote.
+  static response_t<uint32_t> stream_write_result(response_t<uint32_t> result,
+      bool is_stream_end, uint64_t stream_offset);
+
+  // Handles a write request whose arguments have been decoded, either right
+  // away or by submitting it to the executor.
+  void write_console(Handle output, Variant payload, bool is_unicode,
+      bool is_utf8, plankton::rpc::RequestData *data, ResponseCallback resp);
+
+  // Publishes the backend's current state to the state page, if there is one.
+  // Must be called before responding to a call that may have changed the
+  // state such that the agent doesn't see the old state after the response.
+  // Only the given parts of the state, a mask of console_state_part_t values,
+  // are fetched from the backend again.
+  void publish_state(uint32_t parts);
+
+  // The handler called on requests whose selectors aren't understood.
   void message_not_understood(plankton::rpc::RequestData*, ResponseCallback);
 
+  // A request handler.
+  typedef void (ConsoleBackendService::*handler_t)(
+      plankton::rpc::RequestData*, ResponseCallback);
+
+  // Every request comes in through here, whatever its selector. Numeric
+  // selectors, which agents that negotiated them use for every console call,
+  // are looked up first and names after that.
+  void on_request(plankton::rpc::RequestData *data, ResponseCallback resp);
+
+  // Calls the given handler on the reading thread. This is the single place
+  // responses get serialized when there is an executor.
+  void run_handler(handler_t handler, plankton::rpc::RequestData *data,
+      ResponseCallback resp);
+
+  // Returns the handler for the message with the given api number, NULL if
+  // there is none. This is a switch generated from the intercepted messages
+  // so the table is built by the compiler.
+  static handler_t numeric_handler(int64_t apinum);
+
+  // A method that can be called by name.
+  struct named_method_t {
+    const char *name;
+    handler_t handler;
+  };
+
+  // The methods that can be called by name, terminated by a NULL name.
+  static const named_method_t kNamedMethods[];
+
+  // Names are looked up in a table hashed by name with linear probing, which
+  // the constructor fills in from kNamedMethods. It's kept at most half full
+  // so probe sequences stay short.
+  static const size_t kNamedMethodTableSize = 256;
+
+  // Returns the hash of the given method name.
+  static uint32_t hash_method_name(const char *name);
+
+  // Returns the handler for the method with the given name, NULL if there is
+  // none or the selector isn't a string.
+  handler_t named_handler(Variant selector);
+
   ConsoleBackend *backend_;
   ConsoleBackend *backend() { return backend_; }
   ConsoleBackendContext *context_;
@@ -208,8 +691,52 @@ private:
 
   plankton::TypeRegistry registry_;
 
+  const named_method_t *named_methods_[kNamedMethodTableSize];
+
+  SharedRingTransport *transport_;
+  SharedRingTransport *transport() { return transport_; }
+  bool agent_uses_transport_;
+  // Did the agent say it understands compact values? If so responses use
+  // them too.
+  bool agent_uses_compact_values_;
+
+  ConsoleStatePage *state_page_;
+  ConsoleStatePage *state_page() { return state_page_; }
+  // The state last published to the page. Is it up to date with the backend?
+  // If not the next publish fetches all of it.
+  console_state_t published_state_;
+  bool is_state_published_;
+
+  ScratchPool scratch_pool_;
+
+  // Screen buffer info responses are produced here rather than allocated per
+  // request; those handlers always run on the reading thread and respond
+  // before returning so one is enough.
+  ScreenBufferInfo info_scratch_;
+
+  HandlerExecutor *executor_;
+  HandlerExecutor *executor() { return executor_; }
+  // Held while sending a response when there is an executor.
+  tclib::NativeMutex response_mutex_;
+  // Held while publishing the state when there is an executor.
+  tclib::NativeMutex state_mutex_;
+
+  uint32_t write_credit_limit_;
+  // The credits the agent has in use, once it's been granted some.
+  WriteCreditGate write_credits_;
+  uint64_t write_bytes_received_;
+  uint64_t agent_throttle_count_;
+  uint64_t dropped_log_entry_count_;
+
   bool agent_is_ready_;
   bool agent_is_done_;
+
+  // The ids of the streams that are open, other than stream 0.
+  std::vector<uint32_t> open_streams_;
+  uint32_t next_stream_id_;
+  // The stream of the request being handled. Requests are decoded on the
+  // reading thread so this is only used there.
+  uint32_t current_stream_;
 };
 
 } // namespace conprx
@@ -0,0 +1,343 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "async/promise-inl.hh"
+#include "server/daemon.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+#include "utils/string-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+
+using namespace tclib;
+using namespace conprx;
+using namespace plankton;
+
+SynchronizedConsoleBackend::SynchronizedConsoleBackend(ConsoleBackend *delegate)
+  : delegate_(delegate) { }
+
+fat_bool_t SynchronizedConsoleBackend::initialize() {
+  return F_BOOL(mutex_.initialize());
+}
+
+// Calls the given method on the delegate while holding the mutex and returns
+// the result.
+#define __SYNCHRONIZED__(TYPE, CALL) do {                                      \
+  mutex_.lock();                                                               \
+  TYPE __result__ = delegate_->CALL;                                           \
+  mutex_.unlock();                                                             \
+  return __result__;                                                           \
+} while (false)
+
+response_t<bool_t> SynchronizedConsoleBackend::connect(Handle stdin_handle,
+    Handle stdout_handle, Handle stderr_handle) {
+  __SYNCHRONIZED__(response_t<bool_t>, connect(stdin_handle, stdout_handle,
+      stderr_handle));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::connect_stream(
+    Handle stdin_handle, Handle stdout_handle, Handle stderr_handle) {
+  __SYNCHRONIZED__(response_t<bool_t>, connect_stream(stdin_handle,
+      stdout_handle, stderr_handle));
+}
+
+response_t<int64_t> SynchronizedConsoleBackend::poke(int64_t value) {
+  __SYNCHRONIZED__(response_t<int64_t>, poke(value));
+}
+
+response_t<uint32_t> SynchronizedConsoleBackend::get_console_cp(bool is_output) {
+  __SYNCHRONIZED__(response_t<uint32_t>, get_console_cp(is_output));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::set_console_cp(uint32_t value,
+    bool is_output) {
+  __SYNCHRONIZED__(response_t<bool_t>, set_console_cp(value, is_output));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::set_console_cursor_position(
+    Handle output, coord_t position) {
+  __SYNCHRONIZED__(response_t<bool_t>, set_console_cursor_position(output,
+      position));
+}
+
+response_t<uint32_t> SynchronizedConsoleBackend::get_console_title(
+    ResponseBuffer *buffer, bool is_unicode, size_t *bytes_written_out) {
+  __SYNCHRONIZED__(response_t<uint32_t>, get_console_title(buffer, is_unicode,
+      bytes_written_out));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::set_console_title(
+    tclib::Blob title, bool is_unicode) {
+  __SYNCHRONIZED__(response_t<bool_t>, set_console_title(title, is_unicode));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::set_console_mode(Handle handle,
+    uint32_t mode) {
+  __SYNCHRONIZED__(response_t<bool_t>, set_console_mode(handle, mode));
+}
+
+response_t<uint32_t> SynchronizedConsoleBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  __SYNCHRONIZED__(response_t<uint32_t>, write_console(output, data,
+      is_unicode));
+}
+
+response_t<uint32_t> SynchronizedConsoleBackend::write_console_utf8(
+    Handle output, tclib::Blob data) {
+  __SYNCHRONIZED__(response_t<uint32_t>, write_console_utf8(output, data));
+}
+
+response_t<uint32_t> SynchronizedConsoleBackend::read_console(Handle output,
+    ResponseBuffer *buffer, bool is_unicode, size_t *bytes_read_out,
+    ReadConsoleControl *input_control) {
+  __SYNCHRONIZED__(response_t<uint32_t>, read_console(output, buffer,
+      is_unicode, bytes_read_out, input_control));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::get_console_screen_buffer_info(
+    Handle buffer, ScreenBufferInfo *info_out) {
+  __SYNCHRONIZED__(response_t<bool_t>, get_console_screen_buffer_info(buffer,
+      info_out));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::create_process(
+    NativeProcessHandle *process, ConsoleBackendContext *context) {
+  __SYNCHRONIZED__(response_t<bool_t>, create_process(process, context));
+}
+
+response_t<bool_t> SynchronizedConsoleBackend::get_console_state(
+    console_state_t *state, uint32_t parts) {
+  __SYNCHRONIZED__(response_t<bool_t>, get_console_state(state, parts));
+}
+
+#undef __SYNCHRONIZED__
+
+ConsoleSession::ConsoleSession(uint64_t id)
+  : id_(id)
+  , synchronized_(&backend_) { }
+
+fat_bool_t ConsoleSession::initialize(WinTty *wty) {
+  if (wty != NULL)
+    backend_.set_wty(wty);
+  return synchronized_.initialize();
+}
+
+ConsoleDaemon::ConsoleDaemon()
+  : wty_(NULL)
+  , loop_(NULL)
+  , agent_dll_(string_empty())
+  , accepted_count_(0)
+  , is_stopping_(false) { }
+
+ConsoleDaemon::~ConsoleDaemon() {
+  stop();
+  join_agents();
+  for (size_t i = 0; i < sessions_.size(); i++)
+    default_delete_concrete(sessions_[i]);
+}
+
+fat_bool_t ConsoleDaemon::listen(const char *address) {
+  F_TRY(F_BOOL(sessions_mutex_.initialize()));
+  return socket_.listen(address);
+}
+
+ConsoleSession *ConsoleDaemon::get_session(uint64_t id) {
+  sessions_mutex_.lock();
+  ConsoleSession *result = NULL;
+  for (size_t i = 0; i < sessions_.size() && result == NULL; i++) {
+    if (sessions_[i]->id() == id)
+      result = sessions_[i];
+  }
+  if (result == NULL) {
+    ConsoleSession *session = new (kDefaultAlloc) ConsoleSession(id);
+    if (session->initialize(wty_)) {
+      sessions_.push_back(session);
+      result = session;
+    } else {
+      default_delete_concrete(session);
+    }
+  }
+  sessions_mutex_.unlock();
+  return result;
+}
+
+fat_bool_t ConsoleDaemon::accept_agent() {
+  AgentConnection *agent = new (kDefaultAlloc) AgentConnection(this);
+  fat_bool_t accepted = socket_.accept(agent->stream());
+  if (!accepted) {
+    default_delete_concrete(agent);
+    return accepted;
+  }
+  accepted_count_++;
+  // Clean up after the agents that are done while we're here, otherwise a
+  // long-running daemon would hold on to every agent it ever served.
+  reap_agents();
+  fat_bool_t started = agent->start();
+  if (!started) {
+    // Failing to serve one agent shouldn't stop the daemon.
+    WARN("Failed to start serving agent (" kFatBoolFileLine ")",
+        fat_bool_file(started), fat_bool_line(started));
+    default_delete_concrete(agent);
+    return F_TRUE;
+  }
+  agents_.push_back(agent);
+  return F_TRUE;
+}
+
+fat_bool_t ConsoleDaemon::serve() {
+  while (!is_stopping_) {
+    fat_bool_t accepted = accept_agent();
+    // Accepting fails when the socket is closed by stop so that's not an
+    // error.
+    if (!accepted && !is_stopping_)
+      return accepted;
+  }
+  return F_TRUE;
+}
+
+void ConsoleDaemon::stop() {
+  is_stopping_ = true;
+  socket_.close();
+}
+
+void ConsoleDaemon::join_agents() {
+  for (size_t i = 0; i < agents_.size(); i++) {
+    F_LOG_FALSE(agents_[i]->join());
+    default_delete_concrete(agents_[i]);
+  }
+  agents_.clear();
+}
+
+void ConsoleDaemon::reap_agents() {
+  size_t kept = 0;
+  for (size_t i = 0; i < agents_.size(); i++) {
+    AgentConnection *agent = agents_[i];
+    if (agent->is_finished()) {
+      F_LOG_FALSE(agent->join());
+      default_delete_concrete(agent);
+    } else {
+      agents_[kept++] = agent;
+    }
+  }
+  agents_.resize(kept);
+}
+
+fat_bool_t ConsoleDaemon::inject_agent(NativeProcessHandle *process,
+    uint64_t session_id) {
+  if (string_is_empty(agent_dll_)) {
+    WARN("No agent dll to inject into new process");
+    return F_FALSE;
+  }
+  connect_data_t data;
+  struct_zero_fill(data);
+  data.magic = connect_data_t::kMagic;
+  data.parent_process_id = IF_MSVC(GetCurrentProcessId(), 0);
+  strncpy(data.daemon_address, socket_.address(), sizeof(data.daemon_address) - 1);
+  data.session_id = session_id;
+  NativeProcessHandle::InjectRequest injection(agent_dll_);
+  injection.set_connector(new_c_string("ConprxAgentConnect"),
+      blob_new(&data, sizeof(data)), blob_empty());
+  F_TRY(process->start_inject_library(&injection));
+  return process->complete_inject_library(&injection);
+}
+
+ConsoleDaemon::AgentConnection::AgentConnection(ConsoleDaemon *daemon)
+  : daemon_(daemon)
+  , hello_received_(0)
+  , has_session_(false)
+  , service_(this)
+  , thread_(new_callback(&AgentConnection::run, this))
+  , is_looped_(false)
+  , loop_done_(Drawbridge::dsRaised)
+  , is_finished_(false) {
+  struct_zero_fill(hello_);
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::start() {
+  if (daemon_->loop_ == NULL)
+    return F_BOOL(thread_.start());
+  F_TRY(F_BOOL(loop_done_.initialize()));
+  F_TRY(daemon_->loop_->add(this));
+  is_looped_ = true;
+  return F_TRUE;
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::receive_hello(bool wait) {
+  F_TRY(LocalSocket::receive_preamble(*stream_,
+      tclib::Blob(&hello_, sizeof(hello_)), &hello_received_, wait));
+  if (hello_received_ < sizeof(hello_))
+    return F_TRUE;
+  if (hello_.magic != daemon_hello_t::kMagic) {
+    WARN("Agent connected with invalid hello");
+    return F_FALSE;
+  }
+  ConsoleSession *session = daemon_->get_session(hello_.session_id);
+  if (session == NULL)
+    return F_FALSE;
+  return join_session(session);
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::join_session(ConsoleSession *session) {
+  service_.set_backend(session->backend());
+  agent_ = new (kDefaultAlloc) rpc::StreamServiceConnector(*stream_, *stream_);
+  agent_->set_default_type_registry(service_.registry());
+  F_TRY(agent_->init(service_.handler()));
+  has_session_ = true;
+  return F_TRUE;
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::inject_agent(
+    NativeProcessHandle *process) {
+  return daemon_->inject_agent(process, hello_.session_id);
+}
+
+naked_file_handle_t ConsoleDaemon::AgentConnection::event_handle() {
+  return stream_->to_raw_handle();
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::on_event(bool *is_done_out) {
+  if (!has_session_) {
+    // The hello arrives like any other input so the loop doesn't block on
+    // it; until it's all there there's nothing else to do.
+    *is_done_out = false;
+    return receive_hello(false);
+  }
+  InputSocket::ProcessInstrStatus status;
+  F_TRY(agent_->input()->process_next_instruction(&status));
+  F_TRY(F_BOOL(!status.is_error()));
+  *is_done_out = service_.agent_is_done();
+  return F_TRUE;
+}
+
+void ConsoleDaemon::AgentConnection::on_removed() {
+  // Whether the agent was done or failed there's nothing more to read.
+  stream_->close();
+  is_finished_ = true;
+  loop_done_.lower();
+}
+
+opaque_t ConsoleDaemon::AgentConnection::run() {
+  if (receive_hello(true)) {
+    while (!service_.agent_is_done()) {
+      InputSocket::ProcessInstrStatus status;
+      fat_bool_t processed = agent_->input()->process_next_instruction(&status);
+      // The agent going away without saying it's done isn't something the
+      // daemon can do anything about so it just stops serving it.
+      if (!processed || status.is_error())
+        break;
+    }
+  }
+  stream_->close();
+  is_finished_ = true;
+  return o0();
+}
+
+fat_bool_t ConsoleDaemon::AgentConnection::join() {
+  if (is_looped_)
+    return F_BOOL(loop_done_.pass());
+  opaque_t result = o0();
+  return F_BOOL(thread_.join(&result));
+}
@@ -0,0 +1,229 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// A long-running backend that serves agents connecting over a local socket.
+///
+/// Without a daemon every command is launched by a host of its own which
+/// creates a backend, the pipes and the shared memory, injects the agent, and
+/// waits for it to connect. With one the backend is already running; the
+/// launcher injects the agent with the daemon's address and the agent
+/// connects to it directly.
+///
+/// Agents say which console session they belong to when they connect, in a
+/// preamble read by whatever serves the agent rather than the thread
+/// accepting connections, so a client that's slow to send it or sends garbage
+/// only affects itself. All
+/// agents in one session share a backend, and so the console's state, for as
+/// long as the daemon runs. Each agent is served on a thread of its own, or
+/// by an event loop if the daemon is given one, and a session's backend is
+/// only called by one of them at a time.
+
+#ifndef _CONPRX_SERVER_DAEMON_HH
+#define _CONPRX_SERVER_DAEMON_HH
+
+#include "c/stdvector.hh"
+#include "server/conback.hh"
+#include "server/evloop.hh"
+#include "share/localsock.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
+
+namespace conprx {
+
+// A backend that passes calls on to another while holding a mutex, such that
+// a backend that isn't thread safe can be called from several threads.
+class SynchronizedConsoleBackend : public ConsoleBackend {
+public:
+  SynchronizedConsoleBackend(ConsoleBackend *delegate);
+  fat_bool_t initialize();
+
+  virtual response_t<bool_t> connect(Handle stdin_handle, Handle stdout_handle,
+      Handle stderr_handle);
+  virtual response_t<bool_t> connect_stream(Handle stdin_handle,
+      Handle stdout_handle, Handle stderr_handle);
+  virtual response_t<int64_t> poke(int64_t value);
+  virtual response_t<uint32_t> get_console_cp(bool is_output);
+  virtual response_t<bool_t> set_console_cp(uint32_t value, bool is_output);
+  virtual response_t<bool_t> set_console_cursor_position(Handle output,
+      coord_t position);
+  virtual response_t<uint32_t> get_console_title(ResponseBuffer *buffer,
+      bool is_unicode, size_t *bytes_written_out);
+  virtual response_t<bool_t> set_console_title(tclib::Blob title,
+      bool is_unicode);
+  virtual response_t<bool_t> set_console_mode(Handle handle, uint32_t mode);
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  virtual response_t<uint32_t> write_console_utf8(Handle output, tclib::Blob data);
+  virtual response_t<uint32_t> read_console(Handle output, ResponseBuffer *buffer,
+      bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control);
+  virtual response_t<bool_t> get_console_screen_buffer_info(Handle buffer,
+      ScreenBufferInfo *info_out);
+  virtual response_t<bool_t> create_process(tclib::NativeProcessHandle *process,
+      ConsoleBackendContext *context);
+  virtual response_t<bool_t> get_console_state(console_state_t *state,
+      uint32_t parts);
+
+  // Reads aren't passed on to the delegate's begin_read_console: a read it
+  // parks would be completed by whichever thread delivers the input, outside
+  // the mutex, so reads are always done right away through read_console.
+
+private:
+  ConsoleBackend *delegate_;
+  tclib::NativeMutex mutex_;
+};
+
+// The state shared by the agents in one console session.
+class ConsoleSession {
+public:
+  ConsoleSession(uint64_t id);
+  fat_bool_t initialize(WinTty *wty);
+
+  uint64_t id() { return id_; }
+
+  // The backend the session's agents call.
+  ConsoleBackend *backend() { return &synchronized_; }
+
+  // The backend that holds the session's state. Only safe to use directly
+  // while no agents are connected.
+  BasicConsoleBackend *state() { return &backend_; }
+
+private:
+  uint64_t id_;
+  BasicConsoleBackend backend_;
+  SynchronizedConsoleBackend synchronized_;
+};
+
+// Accepts agents on a local socket and serves them.
+class ConsoleDaemon {
+public:
+  ConsoleDaemon();
+
+  // Stops the daemon if it's running and waits for the agents that are still
+  // connected to be done.
+  virtual ~ConsoleDaemon();
+
+  // Sets the wty the backends of sessions created from now on use. If none is
+  // set they use a dummy one.
+  void set_wty(WinTty *wty) { wty_ = wty; }
+
+  // Makes agents that connect from now on be served by the given loop rather
+  // than a thread each. The loop must be running and outlive the agents.
+  void set_event_loop(AgentEventLoop *loop) { loop_ = loop; }
+
+  // Starts listening for agents at the given address.
+  fat_bool_t listen(const char *address);
+
+  // Sets the agent dll injected into processes the agents create. If none is
+  // set creating processes fails.
+  void set_agent_dll(utf8_t value) { agent_dll_ = value; }
+
+  // Waits for the next agent to connect and starts serving it on a thread of
+  // its own, or the loop. Agents that are done by now are disposed.
+  fat_bool_t accept_agent();
+
+  // Accepts agents until the daemon is stopped. Agents that fail to say hello
+  // properly are dropped without affecting the others.
+  fat_bool_t serve();
+
+  // Stops listening such that serve returns; can be called from another
+  // thread. Agents that are already connected are served until they're done.
+  void stop();
+
+  // Returns the session with the given id, creating it if there isn't one
+  // already. Sessions live as long as the daemon. Returns NULL if creating
+  // the session failed. Can be called from any thread.
+  ConsoleSession *get_session(uint64_t id);
+
+  // The number of sessions that have been created.
+  size_t session_count() { return sessions_.size(); }
+
+  // The number of agents that have connected so far.
+  size_t agent_count() { return accepted_count_; }
+
+  // The number of agents that haven't been disposed yet, which are the ones
+  // still being served and any that have finished since the last accept.
+  size_t live_agent_count() { return agents_.size(); }
+
+  // Injects the agent into the given process, telling it to connect to this
+  // daemon and join the given session.
+  fat_bool_t inject_agent(tclib::NativeProcessHandle *process,
+      uint64_t session_id);
+
+private:
+  // The connection to one agent.
+  class AgentConnection : public tclib::DefaultDestructable,
+      public AgentEventSource, public ConsoleBackendContext {
+  public:
+    AgentConnection(ConsoleDaemon *daemon);
+    virtual void default_destroy() { tclib::default_delete_concrete(this); }
+
+    // Where to store the stream for the connection once it's been accepted.
+    tclib::def_ref_t<tclib::InOutStream> *stream() { return &stream_; }
+
+    // Starts serving the agent, beginning with reading its hello.
+    fat_bool_t start();
+
+    // Waits for the agent to be done.
+    fat_bool_t join();
+
+    // Returns true once the agent is done or has failed and the connection
+    // can be joined without waiting.
+    bool is_finished() { return is_finished_; }
+
+    virtual tclib::naked_file_handle_t event_handle();
+    virtual fat_bool_t on_event(bool *is_done_out);
+    virtual void on_removed();
+
+    // Processes created by the agent get agents of their own that join the
+    // same session.
+    virtual fat_bool_t inject_agent(tclib::NativeProcessHandle *process);
+
+  private:
+    // Main loop of the connection's thread.
+    opaque_t run();
+
+    // Reads as much of the hello as is available, or if wait is true all of
+    // it, and once it's complete joins the session it names.
+    fat_bool_t receive_hello(bool wait);
+
+    // Starts serving the agent with the given session's backend.
+    fat_bool_t join_session(ConsoleSession *session);
+
+    ConsoleDaemon *daemon_;
+    daemon_hello_t hello_;
+    size_t hello_received_;
+    bool has_session_;
+    ConsoleBackendService service_;
+    tclib::def_ref_t<tclib::InOutStream> stream_;
+    tclib::def_ref_t<plankton::rpc::StreamServiceConnector> agent_;
+    tclib::NativeThread thread_;
+    // Is the agent served by the daemon's loop rather than the thread?
+    bool is_looped_;
+    // Lowered when the loop is done serving the agent, if it's served by one.
+    tclib::Drawbridge loop_done_;
+    volatile bool is_finished_;
+  };
+
+  // Waits for all the agents to be done and disposes them.
+  void join_agents();
+
+  // Disposes the agents that are done.
+  void reap_agents();
+
+  LocalSocket socket_;
+  WinTty *wty_;
+  AgentEventLoop *loop_;
+  utf8_t agent_dll_;
+  // Agents join sessions from the threads serving them so the sessions are
+  // guarded by a mutex.
+  tclib::NativeMutex sessions_mutex_;
+  std::vector<ConsoleSession*> sessions_;
+  // Only changed by the thread accepting agents.
+  std::vector<AgentConnection*> agents_;
+  size_t accepted_count_;
+  volatile bool is_stopping_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SERVER_DAEMON_HH
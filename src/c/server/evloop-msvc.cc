@@ -0,0 +1,31 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Windows implementation of the event loop, which there isn't yet. Agents
+/// are served by a thread each instead.
+
+fat_bool_t AgentEventLoop::open_platform() {
+  WARN("The agent event loop isn't supported on windows");
+  return F_FALSE;
+}
+
+void AgentEventLoop::close_platform() {
+  // Opening never succeeds so there's nothing to close.
+}
+
+fat_bool_t AgentEventLoop::watch_platform(AgentEventSource *source,
+    bool is_new) {
+  return F_FALSE;
+}
+
+void AgentEventLoop::unwatch_platform(AgentEventSource *source) { }
+
+void AgentEventLoop::wake_platform() { }
+
+bool AgentEventLoop::has_input_platform(AgentEventSource *source) {
+  return false;
+}
+
+AgentEventSource *AgentEventLoop::wait_platform() {
+  return NULL;
+}
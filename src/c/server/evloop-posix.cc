@@ -0,0 +1,82 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Posix implementation of the event loop using epoll.
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+fat_bool_t AgentEventLoop::open_platform() {
+  int wait_set = epoll_create1(EPOLL_CLOEXEC);
+  if (wait_set == -1) {
+    WARN("Failed to create epoll instance");
+    return F_FALSE;
+  }
+  int wake = eventfd(0, EFD_CLOEXEC);
+  if (wake == -1) {
+    WARN("Failed to create eventfd");
+    close(wait_set);
+    return F_FALSE;
+  }
+  // The wake handle is level-triggered and never reset so once it's been
+  // signalled every worker that waits sees it.
+  struct epoll_event event;
+  struct_zero_fill(event);
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(wait_set, EPOLL_CTL_ADD, wake, &event) == -1) {
+    close(wake);
+    close(wait_set);
+    return F_FALSE;
+  }
+  wait_set_ = wait_set;
+  wake_ = wake;
+  return F_TRUE;
+}
+
+void AgentEventLoop::close_platform() {
+  close(wake_);
+  close(wait_set_);
+}
+
+fat_bool_t AgentEventLoop::watch_platform(AgentEventSource *source,
+    bool is_new) {
+  // One-shot means that once a worker has been given the source it isn't
+  // given to any others until it has been rearmed, which happens once the
+  // worker is done with it.
+  struct epoll_event event;
+  struct_zero_fill(event);
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = source;
+  int op = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  return F_BOOL(epoll_ctl(wait_set_, op, source->event_handle(), &event) == 0);
+}
+
+void AgentEventLoop::unwatch_platform(AgentEventSource *source) {
+  epoll_ctl(wait_set_, EPOLL_CTL_DEL, source->event_handle(), NULL);
+}
+
+void AgentEventLoop::wake_platform() {
+  uint64_t value = 1;
+  if (write(wake_, &value, sizeof(value)) != sizeof(value))
+    WARN("Failed to wake event loop workers");
+}
+
+bool AgentEventLoop::has_input_platform(AgentEventSource *source) {
+  struct pollfd entry;
+  struct_zero_fill(entry);
+  entry.fd = source->event_handle();
+  entry.events = POLLIN;
+  return (poll(&entry, 1, 0) == 1) && ((entry.revents & POLLIN) != 0);
+}
+
+AgentEventSource *AgentEventLoop::wait_platform() {
+  struct epoll_event event;
+  int count = epoll_wait(wait_set_, &event, 1, -1);
+  // Interrupted waits just get retried by the caller.
+  if (count != 1)
+    return NULL;
+  return static_cast<AgentEventSource*>(event.data.ptr);
+}
@@ -0,0 +1,179 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "server/evloop.hh"
+#include "utils/alloc.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace tclib;
+
+// Adds one to a counter that several workers update.
+static inline void increment(volatile uint64_t *ptr) {
+#ifdef IS_MSVC
+  InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(ptr));
+#else
+  __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+AgentEventLoop::AgentEventLoop(size_t worker_count)
+  : worker_count_(worker_count)
+  , max_worker_count_(2 * worker_count)
+  , idle_count_(0)
+  , removed_(Drawbridge::dsRaised)
+  , source_count_(0)
+  , event_count_(0)
+  , failure_count_(0)
+  , is_stopping_(false)
+  , is_started_(false)
+  , wait_set_()
+  , wake_() { }
+
+AgentEventLoop::~AgentEventLoop() {
+  stop();
+}
+
+fat_bool_t AgentEventLoop::start() {
+  CHECK_FALSE("event loop started twice", is_started_);
+  CHECK_TRUE("event loop without workers", worker_count_ > 0);
+  F_TRY(F_BOOL(mutex_.initialize()));
+  F_TRY(F_BOOL(removed_.initialize()));
+  F_TRY(open_platform());
+  is_started_ = true;
+  mutex_.lock();
+  fat_bool_t started = F_TRUE;
+  for (size_t i = 0; i < worker_count_ && started; i++)
+    started = start_worker();
+  mutex_.unlock();
+  return started;
+}
+
+fat_bool_t AgentEventLoop::start_worker() {
+  NativeThread *worker = new (kDefaultAlloc) NativeThread(
+      new_callback(&AgentEventLoop::run_worker, this));
+  workers_.push_back(worker);
+  idle_count_++;
+  return F_BOOL(worker->start());
+}
+
+size_t AgentEventLoop::worker_count() {
+  mutex_.lock();
+  size_t result = workers_.size();
+  mutex_.unlock();
+  return result;
+}
+
+void AgentEventLoop::on_worker_busy() {
+  mutex_.lock();
+  idle_count_--;
+  if (idle_count_ == 0 && !is_stopping_ && workers_.size() < max_worker_count_) {
+    // Failing to start a spare just means there's one less to go around.
+    F_LOG_FALSE(start_worker());
+  }
+  mutex_.unlock();
+}
+
+void AgentEventLoop::stop() {
+  if (!is_started_)
+    return;
+  // Once this is set under the mutex no more spare workers get started so
+  // the workers don't change while we join them.
+  mutex_.lock();
+  is_stopping_ = true;
+  mutex_.unlock();
+  wake_platform();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    opaque_t result = o0();
+    F_LOG_FALSE(workers_[i]->join(&result));
+    default_delete_concrete(workers_[i]);
+  }
+  workers_.clear();
+  close_platform();
+  is_started_ = false;
+}
+
+fat_bool_t AgentEventLoop::add(AgentEventSource *source) {
+  CHECK_TRUE("adding to idle event loop", is_started_);
+  mutex_.lock();
+  source_count_++;
+  mutex_.unlock();
+  fat_bool_t watching = watch_platform(source, true);
+  if (!watching) {
+    mutex_.lock();
+    source_count_--;
+    mutex_.unlock();
+  }
+  return watching;
+}
+
+void AgentEventLoop::wait_idle() {
+  mutex_.lock();
+  while (source_count_ > 0) {
+    // Raise while holding the mutex, see HandlerExecutor::submit.
+    removed_.raise();
+    mutex_.unlock();
+    removed_.pass();
+    mutex_.lock();
+  }
+  mutex_.unlock();
+}
+
+void AgentEventLoop::dispatch(AgentEventSource *source) {
+  bool is_done = false;
+  fat_bool_t processed = F_TRUE;
+  // Waiting on the source again would miss whatever it has buffered so that
+  // has to be processed first. Input still on the handle would be signalled
+  // but processing it straight away saves a round trip through the wait set.
+  for (size_t count = 0; processed && !is_done; count++) {
+    if (count > 0 && !source->has_buffered_input()
+        && (count >= kMaxDrainCount || !has_input_platform(source)))
+      break;
+    processed = source->on_event(&is_done);
+    increment(&event_count_);
+  }
+  if (!processed) {
+    remove(source, true);
+  } else if (is_done) {
+    remove(source, false);
+  } else if (!watch_platform(source, false)) {
+    // If we can't wait for the source anymore it won't get served so it's as
+    // good as failed.
+    remove(source, true);
+  }
+}
+
+void AgentEventLoop::remove(AgentEventSource *source, bool has_failed) {
+  unwatch_platform(source);
+  if (has_failed)
+    increment(&failure_count_);
+  source->on_removed();
+  mutex_.lock();
+  source_count_--;
+  removed_.lower();
+  mutex_.unlock();
+}
+
+opaque_t AgentEventLoop::run_worker() {
+  while (!is_stopping_) {
+    AgentEventSource *source = wait_platform();
+    if (source == NULL)
+      continue;
+    on_worker_busy();
+    dispatch(source);
+    mutex_.lock();
+    idle_count_++;
+    mutex_.unlock();
+  }
+  return o0();
+}
+
+#ifdef IS_MSVC
+#include "evloop-msvc.cc"
+#else
+#include "evloop-posix.cc"
+#endif
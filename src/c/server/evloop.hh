@@ -0,0 +1,162 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// An event loop that serves many agents on a few threads.
+///
+/// The usual way to serve an agent is to have a thread sit in a loop reading
+/// its next message, which is fine for one agent but means a thread per agent
+/// when a backend serves many, most of them blocked most of the time. The
+/// event loop instead waits for input on all of them at once and only hands
+/// an agent to one of its workers when it has something to read.
+///
+/// While a worker is processing a message from an agent the agent isn't
+/// waited on, so its messages are processed one at a time and in order. Once
+/// the worker is done it keeps processing while the agent has more input, up
+/// to a limit so one busy agent doesn't hold on to the worker forever, and
+/// only then goes back to waiting on it. Input a source has already read
+/// ahead into its own buffers is invisible to the handle so sources that do
+/// that must report it through has_buffered_input and it always gets
+/// processed before the source is waited on again.
+///
+/// Processing a message blocks if only part of it has arrived. Agents write
+/// whole messages at a time so that's usually short, but an agent that stops
+/// halfway through would keep its worker blocked. So that can't starve the
+/// other agents the loop starts spare workers, up to a limit, whenever all
+/// the workers it has are busy.
+///
+/// Only posix, using epoll, is implemented; on windows initializing fails.
+
+#ifndef _CONPRX_SERVER_EVLOOP_HH
+#define _CONPRX_SERVER_EVLOOP_HH
+
+#include "c/stdc.h"
+#include "c/stdvector.hh"
+#include "io/stream.hh"
+#include "sync/drawbridge.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
+#include "utils/fatbool.hh"
+
+namespace conprx {
+
+// Something that can be served by an event loop.
+class AgentEventSource {
+public:
+  virtual ~AgentEventSource() { }
+
+  // The handle to wait for input on.
+  virtual tclib::naked_file_handle_t event_handle() = 0;
+
+  // Called when there is input on the handle. Should process one message and
+  // set the out parameter to true if no more are expected, in which case the
+  // source is removed from the loop. Returning false also removes it.
+  virtual fat_bool_t on_event(bool *is_done_out) = 0;
+
+  // Returns true if the source has read input from the handle that it hasn't
+  // processed yet. Waiting on the handle won't signal that input so the loop
+  // keeps calling on_event until this returns false.
+  virtual bool has_buffered_input() { return false; }
+
+  // Called once the source has been removed from the loop, after which the
+  // loop doesn't touch it again.
+  virtual void on_removed() { }
+};
+
+// Waits for input on any number of sources and processes it on a fixed
+// number of worker threads.
+class AgentEventLoop {
+public:
+  AgentEventLoop(size_t worker_count);
+
+  // The most messages a worker processes from one source before it lets
+  // other sources have a turn, unless the source has buffered input.
+  static const size_t kMaxDrainCount = 16;
+
+  // Stops the loop if it's running and releases its resources.
+  ~AgentEventLoop();
+
+  // Creates the underlying wait set and starts the workers.
+  fat_bool_t start();
+
+  // Starts waiting for input on the given source. The source must stay alive
+  // until it has been removed.
+  fat_bool_t add(AgentEventSource *source);
+
+  // Blocks until all the sources that have been added have been removed.
+  void wait_idle();
+
+  // Stops the workers once they're done with the message they're processing,
+  // if any. Sources that are still in the loop are left where they are and
+  // don't get on_removed called.
+  void stop();
+
+  // The number of sources currently in the loop.
+  size_t source_count() { return source_count_; }
+
+  // The number of messages processed so far.
+  uint64_t event_count() { return event_count_; }
+
+  // The number of sources that have been removed because processing a
+  // message failed.
+  uint64_t failure_count() { return failure_count_; }
+
+  // Sets how many workers the loop may have, counting the spare ones it
+  // starts when all the others are busy. Defaults to twice the number it
+  // starts with. Must be called before starting.
+  void set_max_worker_count(size_t value) { max_worker_count_ = value; }
+
+  // The number of workers the loop currently has.
+  size_t worker_count();
+
+private:
+  // Main loop of the worker threads.
+  opaque_t run_worker();
+
+  // Handles input on the given source and then either waits for more or
+  // removes it.
+  void dispatch(AgentEventSource *source);
+
+  // Removes the source from the loop and notifies it.
+  void remove(AgentEventSource *source, bool has_failed);
+
+  // Starts another worker. The mutex must be held.
+  fat_bool_t start_worker();
+
+  // Called by a worker when it has been given a source; starts a spare
+  // worker if that leaves none waiting.
+  void on_worker_busy();
+
+  // Platform-specific parts.
+  fat_bool_t open_platform();
+  void close_platform();
+  fat_bool_t watch_platform(AgentEventSource *source, bool is_new);
+  void unwatch_platform(AgentEventSource *source);
+  void wake_platform();
+  // Returns true if there is input waiting on the source's handle.
+  bool has_input_platform(AgentEventSource *source);
+  // Waits for the next source with input. Returns NULL if the loop is being
+  // stopped.
+  AgentEventSource *wait_platform();
+
+  size_t worker_count_;
+  size_t max_worker_count_;
+  // Guarded by the mutex since spare workers are started by other workers.
+  std::vector<tclib::NativeThread*> workers_;
+  // The number of workers that aren't processing a source.
+  size_t idle_count_;
+  tclib::NativeMutex mutex_;
+  // Lowered when a source is removed.
+  tclib::Drawbridge removed_;
+  volatile size_t source_count_;
+  volatile uint64_t event_count_;
+  volatile uint64_t failure_count_;
+  volatile bool is_stopping_;
+  bool is_started_;
+  // The wait set and the handle used to wake the workers when stopping.
+  tclib::naked_file_handle_t wait_set_;
+  tclib::naked_file_handle_t wake_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SERVER_EVLOOP_HH
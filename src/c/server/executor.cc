@@ -0,0 +1,163 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "server/executor.hh"
+#include "utils/alloc.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace tclib;
+
+HandlerExecutor::HandlerExecutor(size_t worker_count, size_t max_queued)
+  : worker_count_(worker_count)
+  , max_queued_(max_queued)
+  , has_work_(Drawbridge::dsRaised)
+  , progress_(Drawbridge::dsRaised)
+  , ready_first_(NULL)
+  , ready_last_(NULL)
+  , queued_(0)
+  , completed_count_(0)
+  , is_stopping_(false)
+  , is_started_(false) {
+  for (size_t i = 0; i < kLaneCount; i++) {
+    lane_t *lane = &lanes_[i];
+    lane->first = lane->last = NULL;
+    lane->is_running = lane->is_ready = false;
+    lane->next_ready = NULL;
+  }
+}
+
+HandlerExecutor::~HandlerExecutor() {
+  stop();
+}
+
+fat_bool_t HandlerExecutor::start() {
+  CHECK_FALSE("executor started twice", is_started_);
+  CHECK_TRUE("executor without workers", worker_count_ > 0);
+  F_TRY(F_BOOL(mutex_.initialize()));
+  F_TRY(F_BOOL(has_work_.initialize()));
+  F_TRY(F_BOOL(progress_.initialize()));
+  is_started_ = true;
+  for (size_t i = 0; i < worker_count_; i++) {
+    NativeThread *worker = new (kDefaultAlloc) NativeThread(
+        new_callback(&HandlerExecutor::run_worker, this));
+    workers_.push_back(worker);
+    F_TRY(F_BOOL(worker->start()));
+  }
+  return F_TRUE;
+}
+
+void HandlerExecutor::stop() {
+  if (!is_started_)
+    return;
+  mutex_.lock();
+  is_stopping_ = true;
+  has_work_.lower();
+  mutex_.unlock();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    opaque_t result = o0();
+    F_LOG_FALSE(workers_[i]->join(&result));
+    default_delete_concrete(workers_[i]);
+  }
+  workers_.clear();
+  is_started_ = false;
+}
+
+HandlerExecutor::lane_t *HandlerExecutor::lane(uint64_t key) {
+  // Handle ids tend to differ mostly in the middle bits so fold everything
+  // down before taking the low bits.
+  uint64_t hash = key ^ (key >> 32);
+  hash ^= (hash >> 16);
+  hash ^= (hash >> 6);
+  return &lanes_[hash & (kLaneCount - 1)];
+}
+
+void HandlerExecutor::make_ready(lane_t *lane) {
+  lane->is_ready = true;
+  lane->next_ready = NULL;
+  if (ready_last_ == NULL) {
+    ready_first_ = lane;
+  } else {
+    ready_last_->next_ready = lane;
+  }
+  ready_last_ = lane;
+}
+
+void HandlerExecutor::submit(uint64_t key, ExecutorJob *job) {
+  CHECK_TRUE("submitting to idle executor", is_started_);
+  mutex_.lock();
+  while (queued_ >= max_queued_) {
+    // Raise while holding the mutex such that a job completing after we've
+    // looked lowers it again and we don't miss it.
+    progress_.raise();
+    mutex_.unlock();
+    progress_.pass();
+    mutex_.lock();
+  }
+  lane_t *target = lane(key);
+  job->next_ = NULL;
+  if (target->last == NULL) {
+    target->first = job;
+  } else {
+    target->last->next_ = job;
+  }
+  target->last = job;
+  queued_++;
+  if (!target->is_running && !target->is_ready)
+    make_ready(target);
+  has_work_.lower();
+  mutex_.unlock();
+}
+
+void HandlerExecutor::wait_idle(uint64_t key) {
+  if (!is_started_)
+    return;
+  lane_t *target = lane(key);
+  mutex_.lock();
+  while (target->is_running || target->first != NULL) {
+    progress_.raise();
+    mutex_.unlock();
+    progress_.pass();
+    mutex_.lock();
+  }
+  mutex_.unlock();
+}
+
+opaque_t HandlerExecutor::run_worker() {
+  mutex_.lock();
+  while (true) {
+    lane_t *next = ready_first_;
+    if (next == NULL) {
+      if (is_stopping_)
+        break;
+      has_work_.raise();
+      mutex_.unlock();
+      has_work_.pass();
+      mutex_.lock();
+      continue;
+    }
+    ready_first_ = next->next_ready;
+    if (ready_first_ == NULL)
+      ready_last_ = NULL;
+    next->is_ready = false;
+    ExecutorJob *job = next->first;
+    next->first = job->next_;
+    if (next->first == NULL)
+      next->last = NULL;
+    next->is_running = true;
+    mutex_.unlock();
+    job->run();
+    mutex_.lock();
+    next->is_running = false;
+    if (next->first != NULL)
+      make_ready(next);
+    queued_--;
+    completed_count_++;
+    progress_.lower();
+  }
+  mutex_.unlock();
+  return o0();
+}
@@ -0,0 +1,120 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// A bounded pool of worker threads for running backend handlers.
+///
+/// By default the backend service handles every request on the thread that
+/// reads them, so one expensive call, a write to a terminal that is slow to
+/// render or a process creation that has to inject the agent, holds up every
+/// request behind it. The service can instead hand those calls to an executor
+/// once it has decoded them.
+///
+/// Jobs are submitted with a key, a handle for instance, and jobs with the
+/// same key run one at a time in the order they were submitted. Jobs with
+/// different keys may run concurrently on different workers. Keys are mapped
+/// to a fixed set of lanes so two keys can end up sharing one, which means
+/// their jobs are serialized unnecessarily but never reordered.
+
+#ifndef _CONPRX_SERVER_EXECUTOR_HH
+#define _CONPRX_SERVER_EXECUTOR_HH
+
+#include "c/stdc.h"
+#include "c/stdvector.hh"
+#include "sync/drawbridge.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
+#include "utils/fatbool.hh"
+
+namespace conprx {
+
+// A unit of work run by an executor. The job is responsible for disposing
+// itself once it has run; the executor doesn't touch it after calling run.
+class ExecutorJob {
+public:
+  ExecutorJob() : next_(NULL) { }
+  virtual ~ExecutorJob() { }
+
+  // Does the work. Called on one of the executor's workers.
+  virtual void run() = 0;
+
+private:
+  friend class HandlerExecutor;
+  ExecutorJob *next_;
+};
+
+// Runs submitted jobs on a fixed number of worker threads.
+class HandlerExecutor {
+public:
+  HandlerExecutor(size_t worker_count, size_t max_queued);
+
+  // Stops the executor if it's running.
+  ~HandlerExecutor();
+
+  // Starts the worker threads.
+  fat_bool_t start();
+
+  // Waits for all jobs submitted so far to complete and then stops the
+  // workers. Nothing may be submitted after this has been called.
+  void stop();
+
+  // Submits a job to be run after the jobs already submitted with the same
+  // key. If max_queued jobs are already waiting or running this blocks until
+  // one completes.
+  void submit(uint64_t key, ExecutorJob *job);
+
+  // Blocks until all jobs submitted with the given key have completed. Used
+  // by callers that do work related to the key themselves and need it to
+  // happen in order with the jobs.
+  void wait_idle(uint64_t key);
+
+  // The number of jobs that have completed.
+  uint64_t completed_count() { return completed_count_; }
+
+  // The number of lanes keys are mapped to.
+  static const size_t kLaneCount = 64;
+
+private:
+  // The jobs for the keys that map to one lane, oldest first.
+  struct lane_t {
+    ExecutorJob *first;
+    ExecutorJob *last;
+    // Is one of this lane's jobs running?
+    bool is_running;
+    // Is this lane in the ready list?
+    bool is_ready;
+    lane_t *next_ready;
+  };
+
+  // Returns the lane the given key maps to.
+  lane_t *lane(uint64_t key);
+
+  // Adds the given lane to the end of the ready list. Must be called with
+  // the mutex held.
+  void make_ready(lane_t *lane);
+
+  // Main loop of the worker threads.
+  opaque_t run_worker();
+
+  size_t worker_count_;
+  size_t max_queued_;
+  std::vector<tclib::NativeThread*> workers_;
+  tclib::NativeMutex mutex_;
+  // Lowered when there may be a ready lane or the executor is stopping.
+  tclib::Drawbridge has_work_;
+  // Lowered when a job completes.
+  tclib::Drawbridge progress_;
+  lane_t lanes_[kLaneCount];
+  // Lanes that have jobs waiting and none running, in the order they became
+  // ready.
+  lane_t *ready_first_;
+  lane_t *ready_last_;
+  // The number of jobs waiting or running.
+  size_t queued_;
+  volatile uint64_t completed_count_;
+  bool is_stopping_;
+  bool is_started_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SERVER_EXECUTOR_HH
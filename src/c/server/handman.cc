@@ -22,8 +22,8 @@ void HandleManager::set_handle_mode(Handle handle, uint32_t mode) {
 }
 
 HandleShadow *HandleManager::get_or_create_shadow(Handle handle, bool create_if_missing) {
-  address_arith_t key = reinterpret_cast<address_arith_t>(handle.ptr());
-  platform_hash_map<address_arith_t, HandleShadow>::iterator iter = handles_.find(key);
+  int64_t key = handle.id();
+  platform_hash_map<int64_t, HandleShadow>::iterator iter = handles_.find(key);
   if (iter == handles_.end()) {
     if (create_if_missing) {
       return &handles_[key];
@@ -39,3 +39,14 @@ HandleShadow HandleManager::get_shadow(Handle handle) {
   HandleShadow *shadow = get_or_create_shadow(handle, false);
   return (shadow == NULL) ? HandleShadow() : *shadow;
 }
+
+void HandleManager::release_shadows(int64_t first, int64_t limit) {
+  platform_hash_map<int64_t, HandleShadow>::iterator iter = handles_.begin();
+  while (iter != handles_.end()) {
+    if (first <= iter->first && iter->first < limit) {
+      handles_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
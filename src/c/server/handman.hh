@@ -44,9 +44,15 @@ public:
   // it doesn't, but if it really doesn't a default shadow is returned.
   HandleShadow get_shadow(Handle handle);
 
+  // Forgets the shadows of all handles whose ids are at least first and
+  // below limit.
+  void release_shadows(int64_t first, int64_t limit);
+
 private:
 
-  platform_hash_map<address_arith_t, HandleShadow> handles_;
+  // Keyed by the handles' ids rather than their pointer values since ids of
+  // qualified handles don't fit in a pointer on 32-bit platforms.
+  platform_hash_map<int64_t, HandleShadow> handles_;
 };
 
 } // namespace conprx
@@ -1,6 +1,7 @@
 //- Copyright 2014 the Neutrino authors (see AUTHORS).
 //- Licensed under the Apache License, Version 2.0 (see LICENSE).
 
+#include "daemon.hh"
 #include "host.hh"
 #include "launch.hh"
 
@@ -22,9 +23,73 @@ static OutStream *open_trace_stream() {
   return FileSystem::native()->open(new_c_string(trace_file), OPEN_FILE_MODE_WRITE).out();
 }
 
+// The number of threads a daemon serves its agents on.
+static const size_t kDaemonWorkerCount = 4;
+
+// Runs a backend daemon at the given address until it's killed. Processes
+// started by its agents get the given agent library injected, if there is
+// one.
+static fat_bool_t run_daemon(const char *address, const char *library) {
+  def_ref_t<ConsoleFrontend> own_frontend = ConsoleFrontend::new_native();
+  def_ref_t<ConsolePlatform> own_platform = ConsolePlatform::new_native();
+  def_ref_t<WinTty> wty = WinTty::new_adapted(*own_frontend, *own_platform);
+  // The loop has to outlive the daemon since the daemon waits for the agents
+  // it serves when it's destroyed.
+  AgentEventLoop loop(kDaemonWorkerCount);
+  ConsoleDaemon daemon;
+  daemon.set_wty(*wty);
+  if (library != NULL)
+    daemon.set_agent_dll(new_c_string(library));
+  // Where there's no event loop a thread per agent works too, it just
+  // doesn't scale as well.
+  if (loop.start())
+    daemon.set_event_loop(&loop);
+  F_TRY(daemon.listen(address));
+  return daemon.serve();
+}
+
+// Should agents put off connecting until the process first uses the console?
+static bool use_lazy_connect() {
+  const char *lazy = getenv("CONPRX_LAZY_CONNECT");
+  return (lazy != NULL) && (strcmp(lazy, "1") == 0);
+}
+
+// Launches a command whose agent is served by the daemon at the given
+// address. The console session is given by the CONPRX_SESSION environment
+// variable.
+static fat_bool_t run_via_daemon(const char *address, int argc, char *argv[],
+    int *exit_code_out) {
+  utf8_t library = new_c_string(argv[0]);
+  utf8_t command = new_c_string(argv[1]);
+  int new_argc = argc - 2;
+  utf8_t *new_argv = new utf8_t[new_argc];
+  for (int i = 0; i < new_argc; i++)
+    new_argv[i] = new_c_string(argv[2 + i]);
+  const char *session = getenv("CONPRX_SESSION");
+  uint64_t session_id = (session == NULL) ? 0 : strtoull(session, NULL, 10);
+  DaemonLauncher launcher(library, address, session_id);
+  launcher.set_lazy_connect(use_lazy_connect());
+  F_TRY(launcher.initialize());
+  F_TRY(launcher.start(command, new_argc, new_argv));
+  return launcher.join(exit_code_out);
+}
+
 fat_bool_t fat_main(int argc, char *argv[], int *exit_code_out) {
+  bool is_daemon_mode = (argc >= 2)
+      && (strcmp(argv[1], "--daemon") == 0 || strcmp(argv[1], "--via") == 0);
+  if (is_daemon_mode && !LocalSocket::kIsSupported) {
+    fprintf(stderr, "Daemons aren't supported on this platform\n");
+    return F_FALSE;
+  }
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "--daemon") == 0)
+    return run_daemon(argv[2], (argc == 4) ? argv[3] : NULL);
+  if (argc >= 5 && strcmp(argv[1], "--via") == 0)
+    return run_via_daemon(argv[2], argc - 3, argv + 3, exit_code_out);
   if (argc < 3) {
     fprintf(stderr, "Usage: host <library> <command ...>\n");
+    if (LocalSocket::kIsSupported)
+      fprintf(stderr, "       host --daemon <address> [<library>]\n"
+          "       host --via <address> <library> <command ...>\n");
     return F_FALSE;
   }
   utf8_t library = new_c_string(argv[1]);
@@ -44,6 +109,7 @@ fat_bool_t fat_main(int argc, char *argv[], int *exit_code_out) {
   backend.set_title("Console host");
   InjectingLauncher launcher(library);
   launcher.set_backend(&backend);
+  launcher.set_lazy_connect(use_lazy_connect());
 
   F_TRY(launcher.initialize());
   F_TRY(launcher.start(command, new_argc, new_argv));
@@ -55,7 +121,9 @@ fat_bool_t fat_main(int argc, char *argv[], int *exit_code_out) {
     observer.install(launcher.attachment()->socket());
   }
 
-  F_TRY(launcher.attachment()->process_messages());
+  // A lazy agent is already being served by the launcher.
+  if (!launcher.is_monitoring_agent())
+    F_TRY(launcher.attachment()->process_messages());
   F_TRY(launcher.join(exit_code_out));
 
   if (trace_stream != NULL)
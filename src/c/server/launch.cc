@@ -3,9 +3,11 @@
 
 #include "async/promise-inl.hh"
 #include "server/launch.hh"
+#include "share/localsock.hh"
 
 BEGIN_C_INCLUDES
 #include "utils/log.h"
+#include "utils/misc-inl.h"
 #include "utils/string-inl.h"
 END_C_INCLUDES
 
@@ -17,11 +19,15 @@ ProcessAttachment::ProcessAttachment(NativeProcessHandle *process, Launcher *lau
   : process_(process)
   , service_(launcher)
   , agent_monitor_done_(Drawbridge::dsLowered)
-  , backend_(NULL) { }
+  , backend_(NULL)
+  , is_lazy_connect_(false) { }
 
 Launcher::Launcher()
   : state_(lsConstructed)
-  , backend_(NULL) {
+  , backend_(NULL)
+  , is_lazy_connect_(false)
+  , loop_(NULL)
+  , has_started_agent_monitor_(false) {
   process_.set_flags(pfStartSuspendedOnWindows | pfNewHiddenConsoleOnWindows);
 }
 
@@ -32,6 +38,13 @@ fat_bool_t Launcher::prepare_start() {
 fat_bool_t InjectingProcessAttachment::prepare_start() {
   F_TRY(up_.open(NativePipe::pfDefault));
   F_TRY(down_.open(NativePipe::pfDefault));
+  // The shared memory is an optimization so if we can't get it we just send
+  // everything through the pipes.
+  if (transport_.create(SharedRingTransport::kDefaultSize)) {
+    set_transport(&transport_);
+  } else {
+    WARN("Failed to create shared memory; sending payloads inline");
+  }
   return F_TRUE;
 }
 
@@ -47,6 +60,17 @@ fat_bool_t InjectingProcessAttachment::start_connect_to_agent() {
   data.parent_process_id = IF_MSVC(GetCurrentProcessId(), 0);
   data.agent_in_handle = down_.in()->to_raw_handle();
   data.agent_out_handle = up_.out()->to_raw_handle();
+  struct_zero_fill(data.shared_memory_name);
+  data.shared_memory_size = 0;
+  struct_zero_fill(data.daemon_address);
+  data.session_id = 0;
+  data.flags = is_lazy_connect() ? connect_data_t::cfLazyConnect : 0;
+  SharedMemory *memory = transport_.memory();
+  if (memory->is_open()) {
+    strncpy(data.shared_memory_name, memory->name(),
+        sizeof(data.shared_memory_name) - 1);
+    data.shared_memory_size = static_cast<uint32_t>(memory->memory().size());
+  }
   blob_t blob_in = blob_new(&data, sizeof(data));
   injection()->set_connector(new_c_string("ConprxAgentConnect"), blob_in,
       blob_empty());
@@ -67,6 +91,17 @@ opaque_t InjectingProcessAttachment::ensure_agent_ready_background() {
 }
 
 fat_bool_t InjectingProcessAttachment::complete_connect_to_agent() {
+  if (is_lazy_connect()) {
+    // Attaching doesn't block, only waiting for the agent to be ready does,
+    // and that we don't do, so there's no need for a thread.
+    F_TRY(attach_agent_service());
+    fat_bool_t injected = process()->complete_inject_library(injection());
+    if (!injected) {
+      F_TRY(abort_agent_service());
+      F_TRY(process()->kill());
+    }
+    return injected;
+  }
   // Spin off a thread to communicate with the agent while we wait for the
   // injection to complete. Ideally we'd be able to wait for both on the same
   // thread but this works and we can look into a smarter way to do this if
@@ -99,6 +134,7 @@ fat_bool_t Launcher::initialize() {
   attachment_ = create_attachment(process());
   if (backend_ != NULL)
     attachment_->set_backend(backend_);
+  attachment_->set_lazy_connect(is_lazy_connect_);
   F_TRY(attachment()->initialize());
   state_ = lsInitialized;
   return F_TRUE;
@@ -134,7 +170,33 @@ fat_bool_t Launcher::connect_agent() {
 
   F_TRY(ensure_process_resumed());
 
-  return attachment()->ensure_agent_service_ready();
+  // A lazy agent says it's ready whenever it first needs us which may be
+  // never, so whoever processes its messages will see it then.
+  if (!attachment()->is_lazy_connect())
+    F_TRY(attachment()->ensure_agent_service_ready());
+
+  return start_serving_agent();
+}
+
+fat_bool_t Launcher::start_serving_agent() {
+  if (loop_ != NULL) {
+    attachment()->agent_monitor_done()->raise();
+    return loop_->add(attachment());
+  }
+  // An eager agent has been serviced until it was ready and the caller takes
+  // over from there, but a lazy one may be about to connect and nothing else
+  // is reading from it yet.
+  if (!attachment()->is_lazy_connect())
+    return F_TRUE;
+  attachment()->agent_monitor_done()->raise();
+  agent_monitor_.set_callback(new_callback(&ProcessAttachment::monitor_agent,
+      attachment()));
+  if (!agent_monitor_.start()) {
+    attachment()->agent_monitor_done()->lower();
+    return F_FALSE;
+  }
+  has_started_agent_monitor_ = true;
+  return F_TRUE;
 }
 
 fat_bool_t ProcessAttachment::attach_agent_service() {
@@ -182,6 +244,21 @@ void ProcessAttachment::set_backend(ConsoleBackend *backend) {
   service()->set_backend(backend);
 }
 
+void ProcessAttachment::set_transport(SharedRingTransport *transport) {
+  service()->set_transport(transport);
+  service()->set_state_page(transport->state_page());
+}
+
+void Launcher::set_lazy_connect(bool value) {
+  CHECK_TRUE("too late to set lazy connect", attachment_.is_null());
+  is_lazy_connect_ = value;
+}
+
+void Launcher::set_event_loop(AgentEventLoop *loop) {
+  CHECK_TRUE("too late to set event loop", state_ < lsStarted);
+  loop_ = loop;
+}
+
 void Launcher::set_backend(ConsoleBackend *backend) {
   CHECK_TRUE("too late to set backend", attachment_.is_null());
   backend_ = backend;
@@ -205,14 +282,35 @@ opaque_t ProcessAttachment::monitor_agent() {
 }
 
 fat_bool_t ProcessAttachment::process_messages() {
-  while (!service()->agent_is_done()) {
-    InputSocket::ProcessInstrStatus status;
-    F_TRY(agent()->input()->process_next_instruction(&status));
-    F_TRY(F_BOOL(!status.is_error()));
-  }
+  bool is_done = service()->agent_is_done();
+  while (!is_done)
+    F_TRY(process_next_message(&is_done));
+  return F_TRUE;
+}
+
+fat_bool_t ProcessAttachment::process_next_message(bool *is_done_out) {
+  InputSocket::ProcessInstrStatus status;
+  F_TRY(agent()->input()->process_next_instruction(&status));
+  F_TRY(F_BOOL(!status.is_error()));
+  *is_done_out = service()->agent_is_done();
   return F_TRUE;
 }
 
+naked_file_handle_t ProcessAttachment::event_handle() {
+  return owner_in()->to_raw_handle();
+}
+
+fat_bool_t ProcessAttachment::on_event(bool *is_done_out) {
+  return process_next_message(is_done_out);
+}
+
+void ProcessAttachment::on_removed() {
+  // There may be threads waiting for this so failing to lower it would leave
+  // them stuck; all we can do is complain.
+  if (!agent_monitor_done()->lower())
+    WARN("Failed to signal that the agent monitor is done");
+}
+
 fat_bool_t ProcessAttachment::close_agent(bool use_agent) {
   if (!agent_monitor_done()->pass())
     // We have to wait for the agent monitor to be done, otherwise we might
@@ -234,5 +332,66 @@ fat_bool_t Launcher::join(int *exit_code_out) {
     return F_FALSE;
   }
   *exit_code_out = process_.exit_code().peek_value(1);
+  if (has_started_agent_monitor_) {
+    // The agent says it's done as it's uninstalled, connected or not, so the
+    // monitor finishes once the process has.
+    opaque_t monitor_result = o0();
+    F_TRY(F_BOOL(agent_monitor_.join(&monitor_result)));
+    has_started_agent_monitor_ = false;
+    F_TRY(o2f(monitor_result));
+  }
   return F_TRUE;
 }
+
+DaemonProcessAttachment::DaemonProcessAttachment(NativeProcessHandle *process,
+    Launcher *launcher, utf8_t agent_dll, const char *daemon_address,
+    uint64_t session_id)
+  : ProcessAttachment(process, launcher)
+  , daemon_address_(daemon_address)
+  , session_id_(session_id)
+  , injection_(agent_dll) { }
+
+fat_bool_t DaemonProcessAttachment::start_connect_to_agent() {
+  connect_data_t data;
+  struct_zero_fill(data);
+  data.magic = connect_data_t::kMagic;
+  data.parent_process_id = IF_MSVC(GetCurrentProcessId(), 0);
+  if (strlen(daemon_address_) >= sizeof(data.daemon_address)) {
+    WARN("Daemon address too long: %s", daemon_address_);
+    return F_FALSE;
+  }
+  strncpy(data.daemon_address, daemon_address_, sizeof(data.daemon_address) - 1);
+  data.session_id = session_id_;
+  data.flags = is_lazy_connect() ? connect_data_t::cfLazyConnect : 0;
+  blob_t blob_in = blob_new(&data, sizeof(data));
+  injection()->set_connector(new_c_string("ConprxAgentConnect"), blob_in,
+      blob_empty());
+  F_TRY(process()->start_inject_library(injection()));
+  return F_TRUE;
+}
+
+fat_bool_t DaemonProcessAttachment::complete_connect_to_agent() {
+  fat_bool_t injected = process()->complete_inject_library(injection());
+  if (!injected) {
+    F_TRY(process()->kill());
+    return injected;
+  }
+  return F_TRUE;
+}
+
+tclib::pass_def_ref_t<ProcessAttachment> DaemonLauncher::create_attachment(
+    tclib::NativeProcessHandle *process) {
+  return new (kDefaultAlloc) DaemonProcessAttachment(process, this, agent_dll_,
+      daemon_address_, session_id_);
+}
+
+fat_bool_t DaemonLauncher::connect_agent() {
+  if (!LocalSocket::kIsSupported) {
+    // The agent wouldn't be able to connect so don't start it.
+    WARN("Daemons aren't supported on this platform");
+    return F_FALSE;
+  }
+  F_TRY(attachment()->start_connect_to_agent());
+  F_TRY(attachment()->complete_connect_to_agent());
+  return ensure_process_resumed();
+}
@@ -6,6 +6,7 @@
 
 #include "rpc.hh"
 #include "server/conback.hh"
+#include "server/evloop.hh"
 #include "share/protocol.hh"
 #include "sync/pipe.hh"
 #include "sync/process.hh"
@@ -24,7 +25,8 @@ using plankton::rpc::StreamServiceConnector;
 
 class Launcher;
 
-class ProcessAttachment : public tclib::DefaultDestructable {
+class ProcessAttachment : public tclib::DefaultDestructable,
+    public AgentEventSource {
 public:
   ProcessAttachment(tclib::NativeProcessHandle *process, Launcher *launcher);
   virtual ~ProcessAttachment() { }
@@ -64,6 +66,25 @@ public:
   // Returns the custom backend backing this launcher.
   ConsoleBackend *backend() { return backend_; }
 
+  // Sets the shared memory transport the owner service will use to exchange
+  // bulk payloads with the agent and publish the console state through.
+  void set_transport(SharedRingTransport *transport);
+
+  // Sets how many bytes of writes the agent may have in flight at once. See
+  // ConsoleBackendService::set_write_credit_limit.
+  void set_write_credit_limit(uint32_t value) { service()->set_write_credit_limit(value); }
+
+  // Returns how often the agent has reported waiting for write credits.
+  uint64_t agent_throttle_count() { return service()->agent_throttle_count(); }
+
+  // Sets whether the agent should connect lazily, see
+  // Launcher::set_lazy_connect.
+  void set_lazy_connect(bool value) { is_lazy_connect_ = value; }
+  bool is_lazy_connect() { return is_lazy_connect_; }
+
+  // Returns true once the agent has said it's ready.
+  bool agent_is_ready() { return service()->agent_is_ready(); }
+
   // Returns a drawbridge that gets lowered when the the agent monitor is done.
   // This is useful when running the agent in a separate thread: you close the
   // connection which causes the agent to wind down and then wait for this
@@ -89,6 +110,17 @@ public:
   // Run the agent owner service.
   fat_bool_t process_messages();
 
+  // Processes the next message from the agent, setting the out parameter to
+  // true if the agent said it was done.
+  fat_bool_t process_next_message(bool *is_done_out);
+
+  // Instead of having a thread run monitor_agent the attachment can be added
+  // to an event loop. As with monitor_agent the agent monitor drawbridge has
+  // to be raised first and it gets lowered once the agent is done.
+  virtual tclib::naked_file_handle_t event_handle();
+  virtual fat_bool_t on_event(bool *is_done_out);
+  virtual void on_removed();
+
   fat_bool_t close_agent(bool use_agent);
 
 private:
@@ -101,6 +133,7 @@ private:
   tclib::Drawbridge agent_monitor_done_;
 
   ConsoleBackend *backend_;
+  bool is_lazy_connect_;
 };
 
 // Encapsulates launching a child process and injecting the agent dll.
@@ -125,6 +158,10 @@ public:
   // Wait for the process to exit, storing the exit code in the out param.
   virtual fat_bool_t join(int *exit_code_out);
 
+  // Returns true if the launcher is running the agent monitor itself, in which
+  // case the caller mustn't process the agent's messages.
+  bool is_monitoring_agent() { return has_started_agent_monitor_; }
+
   // Sets the backend the owner agent will delegate calls to when it receives
   // them from the agent.
   void set_backend(ConsoleBackend *backend);
@@ -132,6 +169,22 @@ public:
   // Returns the custom backend backing this launcher.
   ConsoleBackend *backend() { return attachment()->backend(); }
 
+  // Makes the agent put off connecting to the owner until the process first
+  // makes a call that has to reach the backend, and the launch not wait for
+  // the agent to be ready before letting the process run. Processes that
+  // never use the console then start as quickly as they would without the
+  // agent, apart from injecting it. Since the agent can say it's ready at any
+  // point its messages have to be processed from the start; unless there's an
+  // event loop to do that the launcher runs the agent monitor on a thread of
+  // its own which join waits for. Must be called before initializing.
+  void set_lazy_connect(bool value);
+
+  // Makes the launcher serve the agent on the given event loop once it has
+  // connected rather than leaving it to the caller to have a thread run the
+  // attachment's agent monitor. The loop must be started and outlive the
+  // agent. Must be called before starting.
+  void set_event_loop(AgentEventLoop *loop);
+
   virtual tclib::pass_def_ref_t<ProcessAttachment> create_attachment(
       tclib::NativeProcessHandle *process) = 0;
 
@@ -159,6 +212,10 @@ protected:
   // Does the work of connecting the agent.
   virtual fat_bool_t connect_agent();
 
+  // Hands the agent to the event loop if there is one, otherwise if it
+  // connects lazily starts a thread running the agent monitor.
+  fat_bool_t start_serving_agent();
+
 private:
   enum State {
     lsConstructed = 0,
@@ -171,7 +228,11 @@ private:
 
   State state_;
   ConsoleBackend *backend_;
+  bool is_lazy_connect_;
+  AgentEventLoop *loop_;
   tclib::def_ref_t<ProcessAttachment> attachment_;
+  tclib::NativeThread agent_monitor_;
+  bool has_started_agent_monitor_;
 };
 
 class InjectingProcessAttachment : public ProcessAttachment {
@@ -186,8 +247,8 @@ public:
   virtual tclib::OutStream *owner_out() { return down_.out(); }
 
   // Before we can start we need to open up the pipes over which we'll be
-  // communicating. These can be created without blocking so we do that early
-  // on.
+  // communicating, and the shared memory for bulk payloads. These can be
+  // created without blocking so we do that early on.
   virtual fat_bool_t prepare_start();
 
   // Inject the dll and start it running. At some point after this has been
@@ -205,6 +266,7 @@ private:
   utf8_t agent_dll_;
   tclib::NativePipe up_;
   tclib::NativePipe down_;
+  SharedRingTransport transport_;
   tclib::NativeProcessHandle::InjectRequest injection_;
   tclib::NativeProcessHandle::InjectRequest *injection() { return &injection_; }
 
@@ -228,6 +290,59 @@ private:
   utf8_t agent_dll_;
 };
 
+// An attachment for a process whose agent is served by a backend daemon, see
+// {{daemon.hh}}. The agent connects to the daemon itself so all there is to
+// do here is inject it with the daemon's address.
+class DaemonProcessAttachment : public ProcessAttachment {
+public:
+  DaemonProcessAttachment(tclib::NativeProcessHandle *process,
+      Launcher *launcher, utf8_t agent_dll, const char *daemon_address,
+      uint64_t session_id);
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+
+  // Starts injecting the dll.
+  virtual fat_bool_t start_connect_to_agent();
+
+  // Waits for the injection to complete, killing the process if it fails.
+  virtual fat_bool_t complete_connect_to_agent();
+
+private:
+  const char *daemon_address_;
+  uint64_t session_id_;
+  tclib::NativeProcessHandle::InjectRequest injection_;
+  tclib::NativeProcessHandle::InjectRequest *injection() { return &injection_; }
+};
+
+// A launcher that injects the agent into the process and lets it connect to
+// an already running backend daemon, rather than serving it itself. The
+// address must stay valid while launching. Launching fails where there are no
+// local sockets, see {{share/localsock.hh}}.
+class DaemonLauncher : public Launcher {
+public:
+  DaemonLauncher(utf8_t agent_dll, const char *daemon_address,
+      uint64_t session_id)
+    : agent_dll_(agent_dll)
+    , daemon_address_(daemon_address)
+    , session_id_(session_id) { }
+
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+
+  virtual tclib::pass_def_ref_t<ProcessAttachment> create_attachment(
+      tclib::NativeProcessHandle *process);
+
+  virtual bool use_agent() { return true; }
+
+protected:
+  // There's no service on our side to wait for so this just injects the
+  // agent and resumes the process.
+  virtual fat_bool_t connect_agent();
+
+private:
+  utf8_t agent_dll_;
+  const char *daemon_address_;
+  uint64_t session_id_;
+};
+
 } // namespace conprx
 
 #endif // _CONPRX_SERVER_LAUNCH
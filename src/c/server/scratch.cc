@@ -0,0 +1,71 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "server/scratch.hh"
+#include "utils/alloc.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace tclib;
+
+bool FixedResponseBuffer::reserve(size_t size, Blob *memory_out) {
+  *memory_out = Blob(memory_.start(), min_size(size, capacity()));
+  return true;
+}
+
+ScratchPool::ScratchPool()
+  : allocation_count_(0)
+  , reuse_count_(0)
+  , oversize_count_(0) {
+  for (size_t i = 0; i < kClassCount; i++)
+    free_count_[i] = 0;
+}
+
+ScratchPool::~ScratchPool() {
+  for (size_t i = 0; i < kClassCount; i++) {
+    for (size_t j = 0; j < free_count_[i]; j++)
+      allocator_default_free(free_[i][j]);
+  }
+}
+
+size_t ScratchPool::class_index(size_t size) {
+  size_t index = 0;
+  while (index < kClassCount && class_size(index) < size)
+    index++;
+  return index;
+}
+
+bool ScratchPool::acquire(size_t size, Blob *scratch_out) {
+  size_t index = class_index(size);
+  if (index == kClassCount) {
+    oversize_count_++;
+    return false;
+  }
+  Blob memory;
+  if (free_count_[index] > 0) {
+    memory = free_[index][--free_count_[index]];
+    reuse_count_++;
+  } else {
+    memory = allocator_default_malloc(class_size(index));
+    if (memory.start() == NULL)
+      return false;
+    allocation_count_++;
+  }
+  *scratch_out = Blob(memory.start(), size);
+  return true;
+}
+
+void ScratchPool::release(Blob scratch) {
+  size_t index = class_index(scratch.size());
+  CHECK_REL("releasing oversize scratch", index, <, kClassCount);
+  Blob memory(scratch.start(), class_size(index));
+  if (free_count_[index] < kMaxFreePerClass) {
+    free_[index][free_count_[index]++] = memory;
+  } else {
+    allocator_default_free(memory);
+  }
+}
@@ -0,0 +1,114 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Reusable scratch buffers for the backend service.
+///
+/// Calls like reading the console or the title need a buffer of the size the
+/// caller asked for to produce the result into. Allocating a fresh one per
+/// call means long sessions churn the allocator for no reason since the
+/// buffer is only needed until the response has been sent. Instead the
+/// service takes buffers from a pool that keeps released buffers around,
+/// grouped by size class, and hands them out again.
+///
+/// Backends produce those results into a {{ResponseBuffer}} rather than a
+/// buffer of the full requested size: the caller says how much it accepts but
+/// memory is only obtained once the backend asks for it, and only as much as
+/// it asks for. Callers often ask for far more than they get, a 64k read that
+/// returns a single line for instance.
+
+#ifndef _CONPRX_SERVER_SCRATCH_HH
+#define _CONPRX_SERVER_SCRATCH_HH
+
+#include "c/stdc.h"
+#include "utils/blob.hh"
+
+namespace conprx {
+
+// A buffer a backend produces a response payload into. The memory isn't
+// cleared so backends must only rely on what they've written themselves.
+class ResponseBuffer {
+public:
+  ResponseBuffer(size_t capacity) : capacity_(capacity) { }
+  virtual ~ResponseBuffer() { }
+
+  // The most bytes the caller accepts.
+  size_t capacity() { return capacity_; }
+
+  // Stores memory for the given number of bytes, or the capacity if that is
+  // smaller, in the out parameter. The contents of memory returned by earlier
+  // calls are preserved but it may move so only the most recent memory is
+  // valid. Returns false if the memory couldn't be obtained.
+  virtual bool reserve(size_t size, tclib::Blob *memory_out) = 0;
+
+  // Stores memory for the full capacity in the out parameter. Use this when
+  // there's no telling up front how much will be produced.
+  bool reserve_all(tclib::Blob *memory_out) { return reserve(capacity(), memory_out); }
+
+private:
+  size_t capacity_;
+};
+
+// A response buffer over memory owned by the caller.
+class FixedResponseBuffer : public ResponseBuffer {
+public:
+  FixedResponseBuffer(tclib::Blob memory)
+    : ResponseBuffer(memory.size())
+    , memory_(memory) { }
+  virtual bool reserve(size_t size, tclib::Blob *memory_out);
+
+private:
+  tclib::Blob memory_;
+};
+
+// A pool of scratch buffers in power-of-two size classes.
+class ScratchPool {
+public:
+  ScratchPool();
+  ~ScratchPool();
+
+  // Stores a buffer of exactly the given size in the out parameter. The
+  // buffer isn't cleared. Returns false if the size is larger than the
+  // largest size class, in which case the caller has to get the memory
+  // elsewhere.
+  bool acquire(size_t size, tclib::Blob *scratch_out);
+
+  // Returns a buffer obtained from acquire to the pool.
+  void release(tclib::Blob scratch);
+
+  // The number of times a new buffer had to be allocated.
+  uint64_t allocation_count() { return allocation_count_; }
+
+  // The number of times a buffer was reused.
+  uint64_t reuse_count() { return reuse_count_; }
+
+  // The number of requests that were too large to be served from the pool.
+  uint64_t oversize_count() { return oversize_count_; }
+
+  // The smallest size class.
+  static const size_t kMinClassSize = 256;
+
+  // The number of size classes; the largest is kMinClassSize << (kClassCount - 1).
+  static const size_t kClassCount = 9;
+
+  // The most free buffers kept around per size class. Handlers only need one
+  // buffer at a time so this only matters when calls are handled
+  // concurrently.
+  static const size_t kMaxFreePerClass = 4;
+
+private:
+  // Returns the index of the smallest class that fits the given size.
+  static size_t class_index(size_t size);
+
+  // Returns the size of the buffers in the given class.
+  static size_t class_size(size_t index) { return kMinClassSize << index; }
+
+  tclib::Blob free_[kClassCount][kMaxFreePerClass];
+  size_t free_count_[kClassCount];
+  uint64_t allocation_count_;
+  uint64_t reuse_count_;
+  uint64_t oversize_count_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SERVER_SCRATCH_HH
@@ -19,7 +19,7 @@ public:
   virtual void default_destroy() { tclib::default_delete_concrete(this); }
   virtual response_t<bool_t> get_screen_buffer_info(bool is_error,
       ScreenBufferInfo *info_out);
-  virtual response_t<uint32_t> read(tclib::Blob buffer, bool is_unicode,
+  virtual response_t<uint32_t> read(ResponseBuffer *buffer, bool is_unicode,
       ReadConsoleControl *input_control);
   virtual response_t<uint32_t> write(tclib::Blob blob, bool is_unicode, bool is_error);
   virtual response_t<bool_t> set_cursor_position(coord_t position, bool is_error);
@@ -47,8 +47,12 @@ response_t<bool_t> AdaptedWinTty::get_screen_buffer_info(bool is_error,
       : last_error<bool_t>();
 }
 
-response_t<uint32_t> AdaptedWinTty::read(tclib::Blob buffer, bool is_unicode,
+response_t<uint32_t> AdaptedWinTty::read(ResponseBuffer *output, bool is_unicode,
     ReadConsoleControl *input_control) {
+  // The frontend has to be given room for as much as it may read.
+  tclib::Blob buffer;
+  if (!output->reserve_all(&buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
   handle_t handle = platform()->get_std_handle(kStdInputHandle);
   dword_t chars_read = 0;
   bool read_succeeded = false;
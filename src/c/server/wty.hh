@@ -9,6 +9,7 @@
 
 #include "agent/conapi-types.hh"
 #include "agent/confront.hh"
+#include "server/scratch.hh"
 #include "share/protocol.hh"
 #include "utils/alloc.hh"
 #include "utils/blob.hh"
@@ -26,14 +27,24 @@ public:
   virtual response_t<bool_t> get_screen_buffer_info(bool is_error,
       ScreenBufferInfo *info_out) = 0;
 
-  // Read up to to the buffer's capacity from the wty's input.
-  virtual response_t<uint32_t> read(tclib::Blob buffer, bool is_unicode,
+  // Read up to to the buffer's capacity from the wty's input. Only reserve as
+  // much of the buffer as is needed to hold what is read, if that is known.
+  virtual response_t<uint32_t> read(ResponseBuffer *buffer, bool is_unicode,
       ReadConsoleControl *input_control) = 0;
 
   // Write up to the buffer's capacity to the wty's output, either standard or
   // error.
   virtual response_t<uint32_t> write(tclib::Blob blob, bool is_unicode, bool is_error) = 0;
 
+  // Write utf-8 encoded text to the wty's output, returning the number of
+  // bytes of it that were written. Wtys whose output is byte-oriented can
+  // implement this to save text sent as utf-8 from being widened only to be
+  // narrowed again; by default it isn't implemented and the text is passed to
+  // write as wide characters instead.
+  virtual response_t<uint32_t> write_utf8(tclib::Blob blob, bool is_error) {
+    return response_t<uint32_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
+
   // Sets the cursor position of an output buffer.
   virtual response_t<bool_t> set_cursor_position(coord_t position,
       bool is_error) = 0;
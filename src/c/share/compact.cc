@@ -0,0 +1,301 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/compact.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/string-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+#include <time.h>
+
+using namespace conprx;
+using namespace plankton;
+using namespace tclib;
+
+void CompactWriter::write_u16(uint16_t value) {
+  write_u8(static_cast<uint8_t>(value));
+  write_u8(static_cast<uint8_t>(value >> 8));
+}
+
+void CompactWriter::write_u32(uint32_t value) {
+  write_u16(static_cast<uint16_t>(value));
+  write_u16(static_cast<uint16_t>(value >> 16));
+}
+
+void CompactWriter::write_u64(uint64_t value) {
+  write_u32(static_cast<uint32_t>(value));
+  write_u32(static_cast<uint32_t>(value >> 32));
+}
+
+void CompactWriter::write_bytes(const void *data, size_t size) {
+  memcpy(cursor_, data, size);
+  cursor_ += size;
+}
+
+bool CompactReader::has_room(size_t size) {
+  if (!has_failed_ && size <= static_cast<size_t>(limit_ - cursor_))
+    return true;
+  has_failed_ = true;
+  return false;
+}
+
+uint8_t CompactReader::read_u8() {
+  return has_room(1) ? *cursor_++ : 0;
+}
+
+uint16_t CompactReader::read_u16() {
+  uint16_t low = read_u8();
+  uint16_t high = read_u8();
+  return static_cast<uint16_t>(low | (high << 8));
+}
+
+uint32_t CompactReader::read_u32() {
+  uint32_t low = read_u16();
+  uint32_t high = read_u16();
+  return low | (high << 16);
+}
+
+uint64_t CompactReader::read_u64() {
+  uint64_t low = read_u32();
+  uint64_t high = read_u32();
+  return low | (high << 32);
+}
+
+const uint8_t *CompactReader::read_bytes(size_t size) {
+  if (!has_room(size))
+    return NULL;
+  const uint8_t *result = cursor_;
+  cursor_ += size;
+  return result;
+}
+
+void CompactSchema<Handle>::write(Handle *value, CompactWriter *writer) {
+  writer->write_u64(static_cast<uint64_t>(value->id()));
+}
+
+void CompactSchema<Handle>::read(CompactReader *reader, Handle *value_out) {
+  *value_out = Handle(static_cast<int64_t>(reader->read_u64()));
+}
+
+void CompactSchema<coord_t>::write(coord_t *value, CompactWriter *writer) {
+  writer->write_u16(static_cast<uint16_t>(value->X));
+  writer->write_u16(static_cast<uint16_t>(value->Y));
+}
+
+void CompactSchema<coord_t>::read(CompactReader *reader, coord_t *value_out) {
+  value_out->X = static_cast<int16_t>(reader->read_u16());
+  value_out->Y = static_cast<int16_t>(reader->read_u16());
+}
+
+void CompactSchema<small_rect_t>::write(small_rect_t *value, CompactWriter *writer) {
+  writer->write_u16(static_cast<uint16_t>(value->Left));
+  writer->write_u16(static_cast<uint16_t>(value->Top));
+  writer->write_u16(static_cast<uint16_t>(value->Right));
+  writer->write_u16(static_cast<uint16_t>(value->Bottom));
+}
+
+void CompactSchema<small_rect_t>::read(CompactReader *reader, small_rect_t *value_out) {
+  value_out->Left = static_cast<int16_t>(reader->read_u16());
+  value_out->Top = static_cast<int16_t>(reader->read_u16());
+  value_out->Right = static_cast<int16_t>(reader->read_u16());
+  value_out->Bottom = static_cast<int16_t>(reader->read_u16());
+}
+
+void CompactSchema<console_screen_buffer_info_t>::write(
+    console_screen_buffer_info_t *value, CompactWriter *writer) {
+  CompactSchema<coord_t>::write(&value->dwSize, writer);
+  CompactSchema<coord_t>::write(&value->dwCursorPosition, writer);
+  writer->write_u16(value->wAttributes);
+  CompactSchema<small_rect_t>::write(&value->srWindow, writer);
+  CompactSchema<coord_t>::write(&value->dwMaximumWindowSize, writer);
+}
+
+void CompactSchema<console_screen_buffer_info_t>::read(CompactReader *reader,
+    console_screen_buffer_info_t *value_out) {
+  CompactSchema<coord_t>::read(reader, &value_out->dwSize);
+  CompactSchema<coord_t>::read(reader, &value_out->dwCursorPosition);
+  value_out->wAttributes = reader->read_u16();
+  CompactSchema<small_rect_t>::read(reader, &value_out->srWindow);
+  CompactSchema<coord_t>::read(reader, &value_out->dwMaximumWindowSize);
+}
+
+void CompactSchema<console_screen_buffer_infoex_t>::write(
+    console_screen_buffer_infoex_t *value, CompactWriter *writer) {
+  CompactSchema<console_screen_buffer_info_t>::write(
+      console_screen_buffer_info_from_ex(value), writer);
+  writer->write_u16(value->wPopupAttributes);
+  writer->write_u8(value->bFullscreenSupported ? 1 : 0);
+  // The color table goes as one packed block of little-endian values rather
+  // than the array of integers the plain encoding uses.
+  for (size_t i = 0; i < 16; i++)
+    writer->write_u32(value->ColorTable[i]);
+}
+
+void CompactSchema<console_screen_buffer_infoex_t>::read(CompactReader *reader,
+    console_screen_buffer_infoex_t *value_out) {
+  value_out->cbSize = sizeof(*value_out);
+  CompactSchema<console_screen_buffer_info_t>::read(reader,
+      console_screen_buffer_info_from_ex(value_out));
+  value_out->wPopupAttributes = reader->read_u16();
+  value_out->bFullscreenSupported = reader->read_u8();
+  for (size_t i = 0; i < 16; i++)
+    value_out->ColorTable[i] = static_cast<colorref_t>(reader->read_u32());
+}
+
+void CompactSchema<console_readconsole_control_t>::write(
+    console_readconsole_control_t *value, CompactWriter *writer) {
+  writer->write_u32(value->nInitialChars);
+  writer->write_u32(value->dwCtrlWakeupMask);
+  writer->write_u32(value->dwControlKeyState);
+}
+
+void CompactSchema<console_readconsole_control_t>::read(CompactReader *reader,
+    console_readconsole_control_t *value_out) {
+  value_out->nLength = sizeof(*value_out);
+  value_out->nInitialChars = static_cast<ulong_t>(reader->read_u32());
+  value_out->dwCtrlWakeupMask = static_cast<ulong_t>(reader->read_u32());
+  value_out->dwControlKeyState = static_cast<ulong_t>(reader->read_u32());
+}
+
+void CompactSchema<NativeProcessInfo>::write(NativeProcessInfo *value,
+    CompactWriter *writer) {
+  writer->write_u64(static_cast<uint64_t>(value->id()));
+}
+
+void CompactSchema<NativeProcessInfo>::read(CompactReader *reader,
+    NativeProcessInfo *value_out) {
+  *value_out = NativeProcessInfo(static_cast<native_process_id_t>(reader->read_u64()));
+}
+
+// Returns the encoded size of a string with the given characters.
+static size_t compact_string_size(const char *chars, size_t length) {
+  return (chars == NULL) ? 4 : (4 + length + 1);
+}
+
+static void write_compact_string(const char *chars, size_t length,
+    CompactWriter *writer) {
+  if (chars == NULL) {
+    writer->write_u32(CompactSchema<LogEntry>::kNullString);
+    return;
+  }
+  writer->write_u32(static_cast<uint32_t>(length));
+  writer->write_bytes(chars, length);
+  writer->write_u8(0);
+}
+
+// Returns the string written by write_compact_string which points into the
+// reader's data. If the string isn't terminated where it should be the reader
+// is marked as failed and the result is NULL.
+static const char *read_compact_string(CompactReader *reader) {
+  uint32_t length = reader->read_u32();
+  if (length == CompactSchema<LogEntry>::kNullString)
+    return NULL;
+  const uint8_t *chars = reader->read_bytes(static_cast<size_t>(length) + 1);
+  if (chars == NULL)
+    return NULL;
+  if (chars[length] != 0) {
+    reader->fail();
+    return NULL;
+  }
+  return reinterpret_cast<const char*>(chars);
+}
+
+size_t CompactSchema<LogEntry>::size(LogEntry *value) {
+  log_entry_t *entry = value->as_struct();
+  const char *file = entry->file;
+  return 4 + 4
+      + compact_string_size(file, (file == NULL) ? 0 : strlen(file))
+      + compact_string_size(entry->message.chars, entry->message.size)
+      + compact_string_size(entry->timestamp.chars, entry->timestamp.size);
+}
+
+void CompactSchema<LogEntry>::write(LogEntry *value, CompactWriter *writer) {
+  log_entry_t *entry = value->as_struct();
+  const char *file = entry->file;
+  writer->write_u32(static_cast<uint32_t>(entry->level));
+  writer->write_u32(static_cast<uint32_t>(entry->line));
+  write_compact_string(file, (file == NULL) ? 0 : strlen(file), writer);
+  write_compact_string(entry->message.chars, entry->message.size, writer);
+  write_compact_string(entry->timestamp.chars, entry->timestamp.size, writer);
+}
+
+void CompactSchema<LogEntry>::read(CompactReader *reader, LogEntry *value_out) {
+  log_level_t level = static_cast<log_level_t>(reader->read_u32());
+  uint32_t line = reader->read_u32();
+  const char *file = read_compact_string(reader);
+  const char *message = read_compact_string(reader);
+  const char *timestamp = read_compact_string(reader);
+  log_entry_default_init(value_out->as_struct(), level, file, line,
+      new_c_string(message == NULL ? "" : message),
+      new_c_string(timestamp == NULL ? "" : timestamp));
+}
+
+size_t CompactLogBatch::entry_size(entry_t *entry) {
+  const char *file = entry->file;
+  return 4 + 4 + 8
+      + compact_string_size(file, (file == NULL) ? 0 : strlen(file))
+      + compact_string_size(entry->message, entry->message_size);
+}
+
+void CompactLogBatch::write_header(uint32_t entry_count, uint64_t dropped_count,
+    CompactWriter *writer) {
+  writer->write_u8(ctLogBatch);
+  writer->write_u32(entry_count);
+  writer->write_u64(dropped_count);
+}
+
+void CompactLogBatch::write_entry(entry_t *entry, CompactWriter *writer) {
+  const char *file = entry->file;
+  writer->write_u32(static_cast<uint32_t>(entry->level));
+  writer->write_u32(entry->line);
+  writer->write_u64(entry->timestamp_nanos);
+  write_compact_string(file, (file == NULL) ? 0 : strlen(file), writer);
+  write_compact_string(entry->message, entry->message_size, writer);
+}
+
+bool CompactLogBatch::read_header(CompactReader *reader,
+    uint32_t *entry_count_out, uint64_t *dropped_count_out) {
+  if (reader->read_u8() != ctLogBatch)
+    return false;
+  *entry_count_out = reader->read_u32();
+  *dropped_count_out = reader->read_u64();
+  return true;
+}
+
+void CompactLogBatch::read_entry(CompactReader *reader, entry_t *entry_out) {
+  entry_out->level = static_cast<log_level_t>(reader->read_u32());
+  entry_out->line = reader->read_u32();
+  entry_out->timestamp_nanos = reader->read_u64();
+  entry_out->file = read_compact_string(reader);
+  const char *message = read_compact_string(reader);
+  entry_out->message = (message == NULL) ? "" : message;
+  entry_out->message_size = static_cast<uint32_t>(strlen(entry_out->message));
+}
+
+void CompactLogBatch::format_timestamp(uint64_t nanos, char *buf, size_t size) {
+  time_t seconds = static_cast<time_t>(nanos / 1000000000);
+  struct tm parts;
+#ifdef IS_MSVC
+  bool converted = (gmtime_s(&parts, &seconds) == 0);
+#else
+  bool converted = (gmtime_r(&seconds, &parts) != NULL);
+#endif
+  size_t length = converted ? strftime(buf, size, "%Y-%m-%d %H:%M:%S", &parts) : 0;
+  if (length == 0) {
+    buf[0] = '\0';
+    return;
+  }
+  // Then the microseconds which strftime doesn't know about.
+  if (length + 8 > size)
+    return;
+  uint32_t micros = static_cast<uint32_t>((nanos % 1000000000) / 1000);
+  buf[length] = '.';
+  for (size_t i = 6; i > 0; i--) {
+    buf[length + i] = static_cast<char>('0' + (micros % 10));
+    micros /= 10;
+  }
+  buf[length + 7] = '\0';
+}
@@ -0,0 +1,285 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Compact, schema-compiled encoding of the protocol's value types.
+///
+/// By default the value types in {{protocol.hh}} travel as plankton seeds: a
+/// header that names the type and a map from field names to values. Decoding
+/// one means looking every field up by name and allocating the result through
+/// the factory, which for something as small as a handle is most of the cost
+/// of the call. Each type can instead be sent as a blob that holds a one-byte
+/// tag identifying the type followed by its fields in a fixed order,
+/// little-endian and without names. The order is given by the type's
+/// {{CompactSchema}} which is compiled into a straight sequence of reads and
+/// writes; decoding stores the fields directly in storage the caller provides.
+///
+/// Receivers accept both forms so only senders have to know whether the other
+/// side understands the compact one, which the agent and owner agree on in the
+/// is_ready message.
+
+#ifndef _CONPRX_SHARE_COMPACT_HH
+#define _CONPRX_SHARE_COMPACT_HH
+
+#include "share/protocol.hh"
+#include "utils/alloc.hh"
+#include "utils/blob.hh"
+
+namespace conprx {
+
+// Tags that say which type a compact value holds. These are part of the
+// protocol so existing values mustn't change.
+enum compact_tag_t {
+  ctHandle = 1,
+  ctCoord = 2,
+  ctSmallRect = 3,
+  ctScreenBufferInfo = 4,
+  ctScreenBufferInfoEx = 5,
+  ctReadConsoleControl = 6,
+  ctNativeProcessInfo = 7,
+  ctLogEntry = 8,
+  ctLogBatch = 9
+};
+
+// Writes fields one after another, little-endian. The caller is responsible
+// for making sure there's room.
+class CompactWriter {
+public:
+  CompactWriter(uint8_t *start) : start_(start), cursor_(start) { }
+
+  void write_u8(uint8_t value) { *cursor_++ = value; }
+  void write_u16(uint16_t value);
+  void write_u32(uint32_t value);
+  void write_u64(uint64_t value);
+  void write_bytes(const void *data, size_t size);
+
+  // The number of bytes written so far.
+  size_t size() { return cursor_ - start_; }
+
+private:
+  uint8_t *start_;
+  uint8_t *cursor_;
+};
+
+// Reads fields written by a CompactWriter. Reading past the end returns zeros
+// and marks the reader as failed, such that decoders only have to check once
+// they're done.
+class CompactReader {
+public:
+  CompactReader(const uint8_t *start, size_t size)
+    : cursor_(start), limit_(start + size), has_failed_(false) { }
+
+  uint8_t read_u8();
+  uint16_t read_u16();
+  uint32_t read_u32();
+  uint64_t read_u64();
+
+  // Returns a pointer to the next size bytes and skips them, or NULL if there
+  // aren't that many left.
+  const uint8_t *read_bytes(size_t size);
+
+  // Returns true if all the reads so far were within the data and it has all
+  // been read.
+  bool is_complete() { return !has_failed_ && cursor_ == limit_; }
+
+  // Marks this reader as failed, for when the data is well-formed as far as
+  // the reader can tell but not what the schema expects.
+  void fail() { has_failed_ = true; }
+
+private:
+  // Returns true if there are size more bytes to read, otherwise marks this
+  // reader as failed.
+  bool has_room(size_t size);
+
+  const uint8_t *cursor_;
+  const uint8_t *limit_;
+  bool has_failed_;
+};
+
+// The compact encoding of the type T. Each type that has one specializes this
+// with,
+//
+//   - kTag: the type's compact_tag_t.
+//   - size(value): the size of the value's fields when encoded.
+//   - write(value, writer): writes the value's fields in schema order.
+//   - read(reader, value_out): reads the fields in the same order, storing
+//     them in value_out.
+template <typename T>
+struct CompactSchema { };
+
+#define __DECLARE_COMPACT_SCHEMA__(Type, TAG, SIZE)                            \
+  template <> struct CompactSchema<Type> {                                     \
+    static const uint8_t kTag = (TAG);                                         \
+    static size_t size(Type *value) { return (SIZE); }                         \
+    static void write(Type *value, CompactWriter *writer);                     \
+    static void read(CompactReader *reader, Type *value_out);                  \
+  }
+
+__DECLARE_COMPACT_SCHEMA__(Handle, ctHandle, 8);
+__DECLARE_COMPACT_SCHEMA__(coord_t, ctCoord, 4);
+__DECLARE_COMPACT_SCHEMA__(small_rect_t, ctSmallRect, 8);
+__DECLARE_COMPACT_SCHEMA__(console_screen_buffer_info_t, ctScreenBufferInfo, 22);
+__DECLARE_COMPACT_SCHEMA__(console_screen_buffer_infoex_t, ctScreenBufferInfoEx,
+    22 + 2 + 1 + 16 * 4);
+__DECLARE_COMPACT_SCHEMA__(console_readconsole_control_t, ctReadConsoleControl, 12);
+__DECLARE_COMPACT_SCHEMA__(NativeProcessInfo, ctNativeProcessInfo, 8);
+
+#undef __DECLARE_COMPACT_SCHEMA__
+
+// Log entries are the only values whose size varies. The strings are stored
+// with their terminators so the decoded entry can point straight into the
+// encoding, which means it is only valid as long as that is.
+template <> struct CompactSchema<LogEntry> {
+  static const uint8_t kTag = ctLogEntry;
+  static size_t size(LogEntry *value);
+  static void write(LogEntry *value, CompactWriter *writer);
+  static void read(CompactReader *reader, LogEntry *value_out);
+
+  // Length written in place of a string's length when it is NULL.
+  static const uint32_t kNullString = 0xFFFFFFFF;
+};
+
+// A batch of log entries sent by the agent in a single message. Rather than
+// the formatted timestamp string a LogEntry carries each entry has the time it
+// was logged as nanoseconds since the unix epoch, which the receiver formats
+// if and when it needs to. The batch also says how many entries the sender
+// had to drop since the previous batch because it had no room for them.
+//
+// A batch is the ctLogBatch tag, the number of entries and the number
+// dropped, followed by the entries back to back.
+class CompactLogBatch {
+public:
+  // An entry as it is written to or read from a batch. When read the strings
+  // point into the batch so they're only valid as long as that is.
+  struct entry_t {
+    log_level_t level;
+    uint32_t line;
+    uint64_t timestamp_nanos;
+    const char *file;
+    const char *message;
+    uint32_t message_size;
+  };
+
+  // The size of the tag and counts that precede the entries.
+  static const size_t kHeaderSize = 1 + 4 + 8;
+
+  // The size of an entry without a file and with an empty message.
+  static const size_t kMinEntrySize = 4 + 4 + 8 + 4 + 5;
+
+  // Returns the encoded size of the given entry.
+  static size_t entry_size(entry_t *entry);
+
+  static void write_header(uint32_t entry_count, uint64_t dropped_count,
+      CompactWriter *writer);
+  static void write_entry(entry_t *entry, CompactWriter *writer);
+
+  // Reads the tag and counts. Returns false if the data isn't a batch.
+  static bool read_header(CompactReader *reader, uint32_t *entry_count_out,
+      uint64_t *dropped_count_out);
+  static void read_entry(CompactReader *reader, entry_t *entry_out);
+
+  // Stores the given timestamp, in utc, in the buffer as a terminated string
+  // the way it is shown in the log.
+  static void format_timestamp(uint64_t nanos, char *buf, size_t size);
+
+  // Long enough for any formatted timestamp.
+  static const size_t kMaxTimestampSize = 32;
+};
+
+// Encoding and decoding of compact values.
+class CompactCodec {
+public:
+  // Returns the size of the compact encoding of the given value.
+  template <typename T>
+  static size_t size(T *value) { return 1 + CompactSchema<T>::size(value); }
+
+  // Encodes the given value into out which must have room for size(value)
+  // bytes. Returns the number of bytes written.
+  template <typename T>
+  static size_t encode(T *value, uint8_t *out);
+
+  // Decodes the value held by the given variant into value_out, whether the
+  // variant holds the compact encoding or a seed. Returns false, leaving
+  // value_out in an unspecified state, if it holds neither.
+  template <typename T>
+  static bool decode(plankton::Variant value, T *value_out);
+};
+
+// The form a value of type T is sent in: its compact encoding if the other
+// side understands that, otherwise the value itself which plankton encodes as
+// a seed. Values whose encoding is small are encoded in place, larger ones in
+// memory allocated for the purpose. The variant refers to the value or the
+// encoding so it is only valid as long as both this and the value are.
+template <typename T>
+class WireValue {
+public:
+  WireValue(T *value, bool is_compact);
+  ~WireValue();
+
+  plankton::Variant variant();
+
+private:
+  static const size_t kInlineSize = 96;
+  T *value_;
+  tclib::Blob encoded_;
+  uint8_t inline_[kInlineSize];
+};
+
+template <typename T>
+size_t CompactCodec::encode(T *value, uint8_t *out) {
+  CompactWriter writer(out);
+  writer.write_u8(CompactSchema<T>::kTag);
+  CompactSchema<T>::write(value, &writer);
+  return writer.size();
+}
+
+template <typename T>
+bool CompactCodec::decode(plankton::Variant value, T *value_out) {
+  if (!value.is_blob()) {
+    T *native = value.native_as<T>();
+    if (native == NULL)
+      return false;
+    *value_out = *native;
+    return true;
+  }
+  CompactReader reader(static_cast<const uint8_t*>(value.blob_data()),
+      value.blob_size());
+  if (reader.read_u8() != CompactSchema<T>::kTag)
+    return false;
+  CompactSchema<T>::read(&reader, value_out);
+  return reader.is_complete();
+}
+
+template <typename T>
+WireValue<T>::WireValue(T *value, bool is_compact)
+  : value_(value) {
+  if (!is_compact)
+    return;
+  size_t size = CompactCodec::size(value);
+  if (size <= kInlineSize) {
+    encoded_ = tclib::Blob(inline_, size);
+  } else {
+    encoded_ = allocator_default_malloc(size);
+  }
+  if (encoded_.start() != NULL)
+    CompactCodec::encode(value, static_cast<uint8_t*>(encoded_.start()));
+}
+
+template <typename T>
+WireValue<T>::~WireValue() {
+  if (encoded_.start() != NULL && encoded_.start() != inline_)
+    allocator_default_free(encoded_);
+}
+
+template <typename T>
+plankton::Variant WireValue<T>::variant() {
+  // If allocating the encoding failed the value is sent as a seed which the
+  // other side will understand either way.
+  if (encoded_.start() == NULL)
+    return plankton::NativeVariant(value_);
+  return plankton::Variant::blob(encoded_.start(),
+      static_cast<uint32_t>(encoded_.size()));
+}
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_COMPACT_HH
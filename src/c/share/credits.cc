@@ -0,0 +1,72 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/credits.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace tclib;
+
+WriteCreditGate::WriteCreditGate()
+  : released_(Drawbridge::dsRaised)
+  , limit_(0)
+  , outstanding_(0)
+  , throttle_count_(0) { }
+
+fat_bool_t WriteCreditGate::initialize(size_t limit) {
+  CHECK_FALSE("credit gate initialized twice", is_enabled());
+  F_TRY(F_BOOL(mutex_.initialize()));
+  F_TRY(F_BOOL(released_.initialize()));
+  limit_ = limit;
+  return F_TRUE;
+}
+
+bool WriteCreditGate::has_room(size_t size) {
+  return (outstanding_ == 0) || (size <= limit_ - min_size(outstanding_, limit_));
+}
+
+bool WriteCreditGate::try_acquire(size_t size) {
+  mutex_.lock();
+  bool result = has_room(size);
+  if (result)
+    outstanding_ += size;
+  mutex_.unlock();
+  return result;
+}
+
+void WriteCreditGate::acquire(size_t size) {
+  bool was_throttled = false;
+  while (true) {
+    mutex_.lock();
+    if (has_room(size)) {
+      outstanding_ += size;
+      mutex_.unlock();
+      break;
+    }
+    // Raise while holding the mutex such that a release after we've looked
+    // lowers it again and we don't miss it.
+    released_.raise();
+    mutex_.unlock();
+    was_throttled = true;
+    released_.pass();
+  }
+  if (was_throttled)
+    count_throttle();
+}
+
+void WriteCreditGate::release(size_t size) {
+  mutex_.lock();
+  outstanding_ -= min_size(size, outstanding_);
+  released_.lower();
+  mutex_.unlock();
+}
+
+void WriteCreditGate::count_throttle() {
+  mutex_.lock();
+  throttle_count_++;
+  mutex_.unlock();
+}
@@ -0,0 +1,69 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Credit-based flow control for console writes.
+///
+/// The backend grants an agent that asks for it a number of bytes of writes
+/// it may have outstanding at once. The agent takes credits before sending a
+/// write and gets them back when the response arrives; the backend counts the
+/// same bytes from when it receives a write until it has processed it.
+
+#ifndef _CONPRX_SHARE_CREDITS_HH
+#define _CONPRX_SHARE_CREDITS_HH
+
+#include "c/stdc.h"
+#include "sync/drawbridge.hh"
+#include "sync/mutex.hh"
+#include "utils/fatbool.hh"
+
+namespace conprx {
+
+// Keeps track of the bytes of writes that have been sent but not yet
+// processed, such that they stay within the credits the backend has granted.
+// The agent uses one to stay within its credits and the backend one to hold
+// back agents that don't. A write that is larger than all the credits is let
+// through when nothing else is outstanding, otherwise it could never be sent.
+class WriteCreditGate {
+public:
+  WriteCreditGate();
+
+  // Enables the gate with the given number of credits.
+  fat_bool_t initialize(size_t limit);
+
+  bool is_enabled() { return limit_ > 0; }
+
+  // Takes credits for the given number of bytes if they're available.
+  // Returns false, and takes nothing, if not.
+  bool try_acquire(size_t size);
+
+  // Takes credits for the given number of bytes, blocking until another
+  // thread releases enough if they're not available. Only use this if
+  // another thread is guaranteed to release them.
+  void acquire(size_t size);
+
+  // Gives back credits for the given number of bytes once the writes they
+  // were taken for have been processed.
+  void release(size_t size);
+
+  // Records that a write had to wait for credits.
+  void count_throttle();
+
+  // The number of times a write has had to wait for credits.
+  uint64_t throttle_count() { return throttle_count_; }
+
+private:
+  // Returns true if size bytes can be taken right now. Must be called with
+  // the mutex held.
+  bool has_room(size_t size);
+
+  tclib::NativeMutex mutex_;
+  // Lowered when credits are released.
+  tclib::Drawbridge released_;
+  size_t limit_;
+  size_t outstanding_;
+  volatile uint64_t throttle_count_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_CREDITS_HH
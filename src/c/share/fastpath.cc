@@ -0,0 +1,25 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/fastpath.hh"
+
+using namespace conprx;
+
+const char *const FastFrame::kSelector = "fast";
+
+fast_frame_header_t *FastFrame::header(tclib::Blob blob) {
+  if (blob.size() < sizeof(fast_frame_header_t))
+    return NULL;
+  fast_frame_header_t *result = static_cast<fast_frame_header_t*>(blob.start());
+  return (result->size == blob.size()) ? result : NULL;
+}
+
+bool FastFrame::has_fast_encoding(uint32_t apinum) {
+  switch (apinum) {
+#define __GEN_CASE__(Name, name, NUM, FLAGS) lfFp FLAGS (case NUM: return true;,)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_CASE__)
+#undef __GEN_CASE__
+    default:
+      return false;
+  }
+}
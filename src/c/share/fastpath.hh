@@ -0,0 +1,134 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Fixed-layout binary encoding of the hottest console messages.
+///
+/// The general protocol sends each call as a plankton request with a string
+/// selector and an array of arguments, handles and coordinates encoded as
+/// seeds. That's flexible but for the calls that are made all the time the
+/// encoding and decoding cost adds up. The messages marked Fp in
+/// {{FOR_EACH_LPC_TO_INTERCEPT}} can instead be sent as a single request whose
+/// first argument is a blob holding a fixed-layout frame: a header that gives
+/// the api number followed by a plain struct with the arguments. Bulk payloads
+/// are passed as a second argument the same way as in the general protocol.
+///
+/// The agent asks for the fast path in its is_ready message and only uses it
+/// if the owner says it understands it; everything else, and everything if the
+/// owner doesn't understand it, goes through the general protocol.
+
+#ifndef _CONPRX_SHARE_FASTPATH_HH
+#define _CONPRX_SHARE_FASTPATH_HH
+
+#include "share/protocol.hh"
+#include "utils/blob.hh"
+
+namespace conprx {
+
+// The header at the start of every fast frame.
+struct fast_frame_header_t {
+  // Api number of the message, as given in FOR_EACH_LPC_TO_INTERCEPT.
+  uint32_t apinum;
+  // Size of the whole frame, including the header.
+  uint32_t size;
+};
+
+// The message-specific parts of the fast frames. Each message marked Fp must
+// have one of these named after it. The layouts have to be the same for 32-
+// and 64-bit processes so the fields are ordered largest first and padded
+// explicitly.
+struct fast_get_console_screen_buffer_info_t {
+  int64_t output;
+};
+
+struct fast_set_console_cursor_position_t {
+  int64_t output;
+  coord_t position;
+  uint32_t padding;
+};
+
+struct fast_write_console_t {
+  int64_t output;
+  uint32_t is_unicode;
+  // Nonzero if the payload of a unicode write has been encoded as utf-8.
+  uint32_t is_utf8;
+};
+
+struct fast_get_console_cp_t {
+  uint32_t is_output;
+  uint32_t padding;
+};
+
+// Maps a message-specific struct to the api number of its message.
+template <typename T>
+struct FastFrameInfo { };
+
+#define __DECLARE_FAST_FRAME_INFO__(Name, name, NUM, FLAGS)                    \
+  lfFp FLAGS (                                                                 \
+    template <> struct FastFrameInfo<fast_##name##_t> {                        \
+      static const uint32_t kApiNum = (NUM);                                   \
+    };,)
+FOR_EACH_LPC_TO_INTERCEPT(__DECLARE_FAST_FRAME_INFO__)
+#undef __DECLARE_FAST_FRAME_INFO__
+
+// A complete fast frame for the message whose arguments are given by T.
+template <typename T>
+struct fast_frame_t {
+  fast_frame_header_t header;
+  T body;
+};
+
+// Utilities for working with fast frames.
+class FastFrame {
+public:
+  // Returns a new frame for the message whose arguments are given by T with
+  // the header filled in and the body cleared.
+  template <typename T>
+  static fast_frame_t<T> create();
+
+  // Returns a blob variant that refers to the given frame. The variant is only
+  // valid as long as the frame is.
+  template <typename T>
+  static plankton::Variant to_variant(fast_frame_t<T> *frame) {
+    return plankton::Variant::blob(frame, static_cast<uint32_t>(sizeof(*frame)));
+  }
+
+  // Returns the header of the frame stored in the given blob or NULL if the
+  // blob doesn't hold a frame.
+  static fast_frame_header_t *header(tclib::Blob blob);
+
+  // Returns the body of the frame stored in the given blob, assuming it's the
+  // frame for the message whose arguments are given by T. If the blob doesn't
+  // hold a frame of the right size NULL is returned.
+  template <typename T>
+  static T *body(tclib::Blob blob);
+
+  // Returns true if the message with the given api number has a fast
+  // encoding.
+  static bool has_fast_encoding(uint32_t apinum);
+
+  // The selector used for requests that carry a fast frame.
+  static const char *const kSelector;
+};
+
+template <typename T>
+fast_frame_t<T> FastFrame::create() {
+  fast_frame_t<T> frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.header.apinum = FastFrameInfo<T>::kApiNum;
+  frame.header.size = static_cast<uint32_t>(sizeof(frame));
+  return frame;
+}
+
+template <typename T>
+T *FastFrame::body(tclib::Blob blob) {
+  fast_frame_header_t *head = header(blob);
+  if (head == NULL
+      || head->apinum != FastFrameInfo<T>::kApiNum
+      || head->size != sizeof(fast_frame_t<T>))
+    return NULL;
+  return &static_cast<fast_frame_t<T>*>(blob.start())->body;
+}
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_FASTPATH_HH
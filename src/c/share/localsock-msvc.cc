@@ -0,0 +1,29 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Windows implementation of local sockets, which there isn't yet. Agents
+/// launched the usual way talk to their backend through pipes instead.
+
+fat_bool_t LocalSocket::listen_platform() {
+  WARN("Local sockets aren't supported on windows");
+  return F_FALSE;
+}
+
+fat_bool_t LocalSocket::accept(def_ref_t<InOutStream> *stream_out) {
+  return F_FALSE;
+}
+
+fat_bool_t LocalSocket::receive_preamble(InOutStream *stream, Blob preamble_out,
+    size_t *received_inout, bool wait) {
+  return F_FALSE;
+}
+
+void LocalSocket::close_platform() {
+  // Listening never succeeds so there's nothing to close.
+}
+
+fat_bool_t LocalSocket::connect(const char *address, Blob preamble,
+    def_ref_t<InOutStream> *stream_out) {
+  WARN("Local sockets aren't supported on windows");
+  return F_FALSE;
+}
@@ -0,0 +1,96 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Posix implementation of local sockets using unix domain sockets.
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Fills in the socket address for the given path.
+static void init_unix_address(const char *path, struct sockaddr_un *addr_out) {
+  struct_zero_fill(*addr_out);
+  addr_out->sun_family = AF_UNIX;
+  strncpy(addr_out->sun_path, path, sizeof(addr_out->sun_path) - 1);
+}
+
+fat_bool_t LocalSocket::listen_platform() {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    WARN("Failed to create socket for %s", address_);
+    return F_FALSE;
+  }
+  struct sockaddr_un addr;
+  init_unix_address(address_, &addr);
+  // A daemon that went away without cleaning up may have left the path
+  // behind, in which case binding fails.
+  unlink(address_);
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1
+      || ::listen(fd, SOMAXCONN) == -1) {
+    WARN("Failed to listen at %s", address_);
+    ::close(fd);
+    return F_FALSE;
+  }
+  handle_ = fd;
+  return F_TRUE;
+}
+
+fat_bool_t LocalSocket::accept(def_ref_t<InOutStream> *stream_out) {
+  while (true) {
+    int fd = ::accept(handle_, NULL, NULL);
+    if (fd != -1) {
+      *stream_out = InOutStream::from_raw_handle(fd);
+      return F_TRUE;
+    }
+    // A client that gave up before we got to it is its own problem, any
+    // other error means the socket is no good.
+    if (errno != EINTR && errno != ECONNABORTED)
+      return F_FALSE;
+  }
+}
+
+fat_bool_t LocalSocket::receive_preamble(InOutStream *stream, Blob preamble_out,
+    size_t *received_inout, bool wait) {
+  int fd = static_cast<int>(stream->to_raw_handle());
+  uint8_t *start = static_cast<uint8_t*>(preamble_out.start());
+  while (*received_inout < preamble_out.size()) {
+    ssize_t received = recv(fd, start + *received_inout,
+        preamble_out.size() - *received_inout, wait ? MSG_WAITALL : MSG_DONTWAIT);
+    if (received > 0) {
+      *received_inout += static_cast<size_t>(received);
+    } else if (received == -1 && errno == EINTR) {
+      continue;
+    } else if (received == -1 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // The rest will come later.
+      return F_TRUE;
+    } else {
+      return F_FALSE;
+    }
+  }
+  return F_TRUE;
+}
+
+void LocalSocket::close_platform() {
+  // Closing alone doesn't wake up a thread blocked accepting, shutting down
+  // does.
+  shutdown(handle_, SHUT_RDWR);
+  ::close(handle_);
+  unlink(address_);
+}
+
+fat_bool_t LocalSocket::connect(const char *address, Blob preamble,
+    def_ref_t<InOutStream> *stream_out) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return F_FALSE;
+  struct sockaddr_un addr;
+  init_unix_address(address, &addr);
+  if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1
+      || send(fd, preamble.start(), preamble.size(), 0) != static_cast<ssize_t>(preamble.size())) {
+    ::close(fd);
+    return F_FALSE;
+  }
+  *stream_out = InOutStream::from_raw_handle(fd);
+  return F_TRUE;
+}
@@ -0,0 +1,48 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/localsock.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+
+using namespace conprx;
+using namespace tclib;
+
+LocalSocket::LocalSocket()
+  : is_listening_(false) {
+  struct_zero_fill(address_);
+}
+
+LocalSocket::~LocalSocket() {
+  close();
+}
+
+fat_bool_t LocalSocket::listen(const char *address) {
+  CHECK_FALSE("already listening", is_listening_);
+  if (strlen(address) >= kMaxAddressLength) {
+    WARN("Socket address too long: %s", address);
+    return F_FALSE;
+  }
+  strncpy(address_, address, kMaxAddressLength - 1);
+  F_TRY(listen_platform());
+  is_listening_ = true;
+  return F_TRUE;
+}
+
+void LocalSocket::close() {
+  if (!is_listening_)
+    return;
+  is_listening_ = false;
+  close_platform();
+}
+
+#ifdef IS_MSVC
+#include "localsock-msvc.cc"
+#else
+#include "localsock-posix.cc"
+#endif
@@ -0,0 +1,97 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Local stream sockets that agents use to connect to a backend daemon.
+///
+/// Normally every command gets a backend of its own and the agent talks to it
+/// through pipes the launcher creates before injecting it. A daemon instead
+/// serves any number of agents from one long-running process; it listens on a
+/// local socket and the launcher only has to pass the socket's address to the
+/// agent. On posix these are unix domain sockets named by a path. There is no
+/// windows implementation yet so there listening and connecting always fail,
+/// and the host doesn't offer to run or use a daemon.
+
+#ifndef _CONPRX_SHARE_LOCALSOCK_HH
+#define _CONPRX_SHARE_LOCALSOCK_HH
+
+#include "c/stdc.h"
+#include "io/stream.hh"
+#include "utils/alloc.hh"
+#include "utils/blob.hh"
+#include "utils/fatbool.hh"
+
+namespace conprx {
+
+// The preamble an agent sends after connecting to a daemon, before any
+// messages. It tells the daemon which console session the agent belongs to.
+struct daemon_hello_t {
+  int32_t magic;
+  uint32_t reserved;
+  uint64_t session_id;
+
+  // The magic value that identifies a hello.
+  static const int32_t kMagic = 0xDAE0CAFE;
+};
+
+// A socket listening for local connections.
+class LocalSocket {
+public:
+  LocalSocket();
+
+  // Stops listening if this socket is listening.
+  ~LocalSocket();
+
+  // Starts listening at the given address. If something is already there it
+  // is replaced.
+  fat_bool_t listen(const char *address);
+
+  // Waits for a connection and stores a stream for it in the out parameter.
+  // Connections that are aborted before they're accepted are skipped. Fails
+  // if the socket is closed while waiting. The client's preamble is left for
+  // receive_preamble to read such that a slow client doesn't hold up
+  // accepting the next one.
+  fat_bool_t accept(tclib::def_ref_t<tclib::InOutStream> *stream_out);
+
+  // Reads the fixed-size preamble the client sends before anything else into
+  // the given memory, the first *received_inout bytes of which have already
+  // been read, and updates the count. If wait is true this blocks until the
+  // whole preamble has arrived, otherwise it only reads what is there. Fails
+  // if the client goes away before sending all of it. The preamble is read
+  // directly from the stream's handle since the stream itself may read ahead.
+  static fat_bool_t receive_preamble(tclib::InOutStream *stream,
+      tclib::Blob preamble_out, size_t *received_inout, bool wait);
+
+  // Stops listening and removes the address. Can be called from another
+  // thread to make a waiting accept fail.
+  void close();
+
+  bool is_listening() { return is_listening_; }
+
+  // The address this socket is listening at.
+  const char *address() { return address_; }
+
+  // Connects to the socket listening at the given address, sends the given
+  // preamble, and stores a stream for the connection in the out parameter.
+  static fat_bool_t connect(const char *address, tclib::Blob preamble,
+      tclib::def_ref_t<tclib::InOutStream> *stream_out);
+
+  // The longest address, including the null terminator. This is the smallest
+  // size of sockaddr_un's path across the platforms we care about.
+  static const size_t kMaxAddressLength = 104;
+
+  // Constant that's true when local sockets, and so daemons, work.
+  static const bool kIsSupported = !kIsMsvc;
+
+private:
+  // Platform-specific parts of listen and close.
+  fat_bool_t listen_platform();
+  void close_platform();
+
+  char address_[kMaxAddressLength];
+  tclib::naked_file_handle_t handle_;
+  volatile bool is_listening_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_LOCALSOCK_HH
@@ -2,6 +2,7 @@
 //- Licensed under the Apache License, Version 2.0 (see LICENSE).
 
 #include "share/protocol.hh"
+#include "share/shmring.hh"
 
 #include "marshal-inl.hh"
 #include "utils/callback.hh"
@@ -37,6 +38,7 @@ TypeRegistry *ConsoleTypes::registry() {
     instance->register_type<console_readconsole_control_t>();
     instance->register_type<LogEntry>();
     instance->register_type<NativeProcessInfo>();
+    instance->register_type<RingSlice>();
   }
   return instance;
 }
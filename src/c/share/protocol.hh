@@ -22,21 +22,25 @@
 //   - Sw: this message should be implemented in the platform simulator
 //   - Sp: suspend on calls to this message
 //   - Ba: this is a base, not a console, message
+//   - Fp: has a fixed-layout binary encoding, see share/fastpath.hh
 //
-//  Name                        name                            apinum   (Tr Da Pa Sw Sp Ba)
-#define FOR_EACH_LPC_TO_INTERCEPT(F)                                                         \
-  F(GetConsoleMode,             get_console_mode,               0x00008, (_, _, X, X, _, _)) \
-  F(GetConsoleScreenBufferInfo, get_console_screen_buffer_info, 0x0000B, (_, _, _, _, _, _)) \
-  F(SetConsoleMode,             set_console_mode,               0x00011, (_, _, _, X, _, _)) \
-  F(SetConsoleCursorPosition,   set_console_cursor_position,    0x00016, (_, _, _, _, _, _)) \
-  F(ReadConsole,                read_console,                   0x0001D, (_, _, _, _, _, _)) \
-  F(WriteConsole,               write_console,                  0x0001E, (_, _, _, _, _, _)) \
-  F(GetConsoleTitle,            get_console_title,              0x00024, (_, _, _, _, _, _)) \
-  F(SetConsoleTitle,            set_console_title,              0x00025, (_, _, _, _, _, _)) \
-  F(GetConsoleCP,               get_console_cp,                 0x0003C, (_, _, _, _, _, _)) \
-  F(SetConsoleCP,               set_console_cp,                 0x0003D, (_, _, _, _, _, _)) \
-  F(ConsoleConnect,             console_connect,                0x00053, (_, _, X, _, _, _)) \
-  F(CreateProcess,              create_process,                 0x10000, (_, _, _, _, _, X))
+// Tr, Da, and Sp are only the defaults, the agent's TraceLpcs, DelegateLpcs,
+// and SuspendLpcs options can turn them on at runtime.
+//
+//  Name                        name                            apinum   (Tr Da Pa Sw Sp Ba Fp)
+#define FOR_EACH_LPC_TO_INTERCEPT(F)                                                            \
+  F(GetConsoleMode,             get_console_mode,               0x00008, (_, _, X, X, _, _, _)) \
+  F(GetConsoleScreenBufferInfo, get_console_screen_buffer_info, 0x0000B, (_, _, _, _, _, _, X)) \
+  F(SetConsoleMode,             set_console_mode,               0x00011, (_, _, _, X, _, _, _)) \
+  F(SetConsoleCursorPosition,   set_console_cursor_position,    0x00016, (_, _, _, _, _, _, X)) \
+  F(ReadConsole,                read_console,                   0x0001D, (_, _, _, _, _, _, _)) \
+  F(WriteConsole,               write_console,                  0x0001E, (_, _, _, _, _, _, X)) \
+  F(GetConsoleTitle,            get_console_title,              0x00024, (_, _, _, _, _, _, _)) \
+  F(SetConsoleTitle,            set_console_title,              0x00025, (_, _, _, _, _, _, _)) \
+  F(GetConsoleCP,               get_console_cp,                 0x0003C, (_, _, _, _, _, _, X)) \
+  F(SetConsoleCP,               set_console_cp,                 0x0003D, (_, _, _, _, _, _, _)) \
+  F(ConsoleConnect,             console_connect,                0x00053, (_, _, X, _, _, _, _)) \
+  F(CreateProcess,              create_process,                 0x10000, (_, _, _, _, _, X, _))
 
 // Messages that we know about and so don't want to dump/suspend on when
 // doing that on unknown messages, but that we also don't have an implementation
@@ -51,15 +55,26 @@
   F(NlsGetUserInfo,             ,                               0x1001B,                )
 
 // LPC minor flag extractors.
-#define lfTr(TR, DA, PA, SW, SP, BA) TR
-#define lfDa(TR, DA, PA, SW, SP, BA) DA
-#define lfPa(TR, DA, PA, SW, SP, BA) PA
-#define lfSw(TR, DA, PA, SW, SP, BA) SW
-#define lfSp(TR, DA, PA, SW, SP, BA) SP
-#define lfBa(TR, DA, PA, SW, SP, BA) BA
+#define lfTr(TR, DA, PA, SW, SP, BA, FP) TR
+#define lfDa(TR, DA, PA, SW, SP, BA, FP) DA
+#define lfPa(TR, DA, PA, SW, SP, BA, FP) PA
+#define lfSw(TR, DA, PA, SW, SP, BA, FP) SW
+#define lfSp(TR, DA, PA, SW, SP, BA, FP) SP
+#define lfBa(TR, DA, PA, SW, SP, BA, FP) BA
+#define lfFp(TR, DA, PA, SW, SP, BA, FP) FP
 
 namespace conprx {
 
+// The api numbers of the intercepted messages. When both sides agree to it
+// these are also used as the selectors of the requests the agent sends to the
+// backend instead of the method names.
+enum lpc_api_num_t {
+  anNone = -1
+#define __GEN_API_NUM_ENUM__(Name, name, NUM, FLAGS) , an##Name = (NUM)
+  FOR_EACH_LPC_TO_INTERCEPT(__GEN_API_NUM_ENUM__)
+#undef __GEN_API_NUM_ENUM__
+};
+
 // A small subset of code pages.
 enum code_page_t {
   cpMsDos = 437,
@@ -80,6 +95,28 @@ struct connect_data_t {
   tclib::naked_file_handle_t agent_in_handle;
   tclib::naked_file_handle_t agent_out_handle;
 
+  // Name and size of the shared memory to use for bulk payloads. A size of 0
+  // means that there is no shared memory and all payloads go through the
+  // pipes.
+  char shared_memory_name[64];
+  uint32_t shared_memory_size;
+
+  // The local socket address of the backend daemon to connect to instead of
+  // using the handles, see {{localsock.hh}}, and the console session to join
+  // there. The address is empty unless the agent is served by a daemon.
+  char daemon_address[104];
+  uint64_t session_id;
+
+  // Flags that control how the agent connects, see connect_flag_t.
+  uint32_t flags;
+
+  enum connect_flag_t {
+    // Don't connect to the owner until a message needs it, see
+    // ConsoleAgent::set_lazy_connect. The owner doesn't wait for the agent
+    // to be ready.
+    cfLazyConnect = 0x1
+  };
+
   // The magic value we expect to find in the magic field if it has been
   // transferred correctly.
   static const int32_t kMagic = 0xFABACAEA;
@@ -101,7 +138,11 @@ enum conprx_error_t {
   CONPRX_ERROR_INVALID_ARGUMENT = 0x0010,
   CONPRX_ERROR_SYSTEM = 0x0011,
   CONPRX_ERROR_INVALID_STATE = 0x0012,
-  CONPRX_ERROR_AGENT_INJECTION_FAILED = 0x0013
+  CONPRX_ERROR_AGENT_INJECTION_FAILED = 0x0013,
+  CONPRX_ERROR_UNKNOWN_STREAM = 0x0014,
+  // A write was sent beyond the agent's credits. It can be sent again once
+  // the writes before it have completed.
+  CONPRX_ERROR_OUT_OF_CREDITS = 0x0015
 };
 
 // A wrapper around an nt status code that makes it easier to dissect the value
@@ -0,0 +1,49 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Windows implementation of shared memory using named file mappings.
+
+#include <stdio.h>
+
+fat_bool_t SharedMemory::create_platform(size_t size) {
+  static uint32_t next_serial = 0;
+  _snprintf(name_, kMaxNameLength, "Local\\conprx-%u-%u",
+      static_cast<uint32_t>(GetCurrentProcessId()), next_serial++);
+  name_[kMaxNameLength - 1] = '\0';
+  handle_t mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+      PAGE_READWRITE, 0, static_cast<dword_t>(size), name_);
+  if (mapping == NULL) {
+    WARN("Failed to create shared memory %s: %i", name_, GetLastError());
+    return F_FALSE;
+  }
+  handle_ = mapping;
+  void *start = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (start == NULL) {
+    close_platform();
+    return F_FALSE;
+  }
+  memory_ = tclib::Blob(start, size);
+  return F_TRUE;
+}
+
+fat_bool_t SharedMemory::open_platform(size_t size) {
+  handle_t mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, false, name_);
+  if (mapping == NULL) {
+    WARN("Failed to open shared memory %s: %i", name_, GetLastError());
+    return F_FALSE;
+  }
+  handle_ = mapping;
+  void *start = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (start == NULL) {
+    close_platform();
+    return F_FALSE;
+  }
+  memory_ = tclib::Blob(start, size);
+  return F_TRUE;
+}
+
+void SharedMemory::close_platform() {
+  if (memory_.start() != NULL)
+    UnmapViewOfFile(memory_.start());
+  CloseHandle(handle_);
+}
@@ -0,0 +1,61 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Posix implementation of shared memory using named shm objects.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+fat_bool_t SharedMemory::create_platform(size_t size) {
+  static uint32_t next_serial = 0;
+  snprintf(name_, kMaxNameLength, "/conprx-%i-%u", static_cast<int>(getpid()),
+      next_serial++);
+  int fd = shm_open(name_, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    WARN("Failed to create shared memory %s", name_);
+    return F_FALSE;
+  }
+  handle_ = fd;
+  if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+    WARN("Failed to resize shared memory %s", name_);
+    close_platform();
+    return F_FALSE;
+  }
+  void *start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (start == MAP_FAILED) {
+    close_platform();
+    return F_FALSE;
+  }
+  memory_ = tclib::Blob(start, size);
+  return F_TRUE;
+}
+
+fat_bool_t SharedMemory::open_platform(size_t size) {
+  int fd = shm_open(name_, O_RDWR, 0);
+  if (fd == -1) {
+    WARN("Failed to open shared memory %s", name_);
+    return F_FALSE;
+  }
+  handle_ = fd;
+  void *start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (start == MAP_FAILED) {
+    close_platform();
+    return F_FALSE;
+  }
+  memory_ = tclib::Blob(start, size);
+  return F_TRUE;
+}
+
+void SharedMemory::close_platform() {
+  if (memory_.start() != NULL)
+    munmap(memory_.start(), memory_.size());
+  ::close(handle_);
+  // The name only needs to live until the other side has opened the memory,
+  // after that the mapping keeps it alive, but we can't easily know when that
+  // is so the owner removes it when it's done.
+  if (is_owner_)
+    shm_unlink(name_);
+}
@@ -0,0 +1,192 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/shmring.hh"
+
+#include "marshal-inl.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+
+using namespace conprx;
+using namespace plankton;
+using namespace tclib;
+
+// Reads a ring position written by the other side, making sure everything the
+// other side wrote before updating the position is visible.
+static inline uint64_t load_acquire(volatile uint64_t *ptr) {
+#ifdef IS_MSVC
+  return static_cast<uint64_t>(InterlockedCompareExchange64(
+      reinterpret_cast<volatile LONG64*>(ptr), 0, 0));
+#else
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Updates a ring position, making sure everything written before is visible
+// to the other side before the new position is.
+static inline void store_release(volatile uint64_t *ptr, uint64_t value) {
+#ifdef IS_MSVC
+  InterlockedExchange64(reinterpret_cast<volatile LONG64*>(ptr),
+      static_cast<LONG64>(value));
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+SharedMemory::SharedMemory()
+  : is_owner_(false)
+  , handle_() {
+  name_[0] = '\0';
+}
+
+SharedMemory::~SharedMemory() {
+  close();
+}
+
+fat_bool_t SharedMemory::create(size_t size) {
+  CHECK_FALSE("shared memory already open", is_open());
+  is_owner_ = true;
+  return create_platform(size);
+}
+
+fat_bool_t SharedMemory::open(const char *name, size_t size) {
+  CHECK_FALSE("shared memory already open", is_open());
+  if (strlen(name) >= kMaxNameLength)
+    return F_FALSE;
+  strcpy(name_, name);
+  is_owner_ = false;
+  return open_platform(size);
+}
+
+void SharedMemory::close() {
+  if (!is_open())
+    return;
+  close_platform();
+  memory_ = tclib::Blob();
+}
+
+DefaultSeedType<RingSlice> RingSlice::kSeedType("conprx.RingSlice");
+
+RingSlice *RingSlice::new_instance(Variant header, Factory *factory) {
+  return new (factory) RingSlice();
+}
+
+Variant RingSlice::to_seed(Factory *factory) {
+  Seed seed = factory->new_seed(seed_type());
+  seed.set_field("offset", offset_);
+  seed.set_field("size", size_);
+  return seed;
+}
+
+void RingSlice::init(Seed payload, Factory *factory) {
+  offset_ = payload.get_field("offset").integer_value();
+  size_ = payload.get_field("size").integer_value();
+}
+
+SharedRing::SharedRing()
+  : header_(NULL)
+  , data_(NULL)
+  , capacity_(0)
+  , reserved_start_(0)
+  , reserved_size_(0) { }
+
+void SharedRing::initialize(tclib::Blob memory, bool reset) {
+  CHECK_REL("ring memory too small", memory.size(), >, sizeof(shared_ring_header_t));
+  header_ = static_cast<shared_ring_header_t*>(memory.start());
+  data_ = static_cast<byte_t*>(memory.start()) + sizeof(shared_ring_header_t);
+  capacity_ = memory.size() - sizeof(shared_ring_header_t);
+  if (reset) {
+    struct_zero_fill(*header_);
+  }
+}
+
+bool SharedRing::write(tclib::Blob data, RingSlice *slice_out) {
+  tclib::Blob space;
+  if (!reserve(data.size(), &space))
+    return false;
+  memcpy(space.start(), data.start(), data.size());
+  commit(data.size(), slice_out);
+  return true;
+}
+
+bool SharedRing::reserve(size_t size, tclib::Blob *space_out) {
+  reserved_size_ = 0;
+  if (size == 0 || size > capacity_)
+    return false;
+  // Only we write the head so there's no need to synchronize reading it.
+  uint64_t head = header_->head;
+  uint64_t tail = load_acquire(&header_->tail);
+  // Payloads are always contiguous so if there isn't room before the end of
+  // the memory we skip to the start.
+  uint64_t start = head;
+  uint64_t until_end = capacity_ - (head % capacity_);
+  if (size > until_end)
+    start += until_end;
+  if (start + size - tail > capacity_)
+    return false;
+  reserved_start_ = start;
+  reserved_size_ = size;
+  *space_out = tclib::Blob(at(start), size);
+  return true;
+}
+
+void SharedRing::commit(size_t size, RingSlice *slice_out) {
+  CHECK_REL("committing more than reserved", size, <=, reserved_size_);
+  store_release(&header_->head, reserved_start_ + size);
+  *slice_out = RingSlice(reserved_start_, size);
+  reserved_size_ = 0;
+}
+
+bool SharedRing::read(RingSlice *slice, tclib::Blob *data_out) {
+  uint64_t head = load_acquire(&header_->head);
+  uint64_t tail = header_->tail;
+  uint64_t start = slice->offset();
+  uint64_t end = start + slice->size();
+  if (start < tail || end > head || end < start)
+    return false;
+  if ((start % capacity_) + slice->size() > capacity_)
+    // Slices never wrap so this one can't have been produced by a well-behaved
+    // producer.
+    return false;
+  *data_out = tclib::Blob(at(start), static_cast<size_t>(slice->size()));
+  return true;
+}
+
+void SharedRing::release(RingSlice *slice) {
+  uint64_t end = slice->offset() + slice->size();
+  if (end > header_->tail)
+    store_release(&header_->tail, end);
+}
+
+fat_bool_t SharedRingTransport::create(size_t size) {
+  F_TRY(memory()->create(size));
+  initialize_rings(true);
+  return F_TRUE;
+}
+
+fat_bool_t SharedRingTransport::open(const char *name, size_t size) {
+  F_TRY(memory()->open(name, size));
+  initialize_rings(false);
+  return F_TRUE;
+}
+
+void SharedRingTransport::initialize_rings(bool reset) {
+  tclib::Blob all = memory()->memory();
+  byte_t *page_start = static_cast<byte_t*>(all.start());
+  state_page()->initialize(tclib::Blob(page_start, ConsoleStatePage::kSize), reset);
+  size_t half = (all.size() - ConsoleStatePage::kSize) / 2;
+  byte_t *start = page_start + ConsoleStatePage::kSize;
+  up()->initialize(tclib::Blob(start, half), reset);
+  down()->initialize(tclib::Blob(start + half, half), reset);
+}
+
+#ifdef IS_MSVC
+#include "shmring-msvc.cc"
+#else
+#include "shmring-posix.cc"
+#endif
@@ -0,0 +1,201 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Shared-memory transport for bulk payloads.
+///
+/// The agent and its owner exchange control messages over plankton rpc but
+/// copying large payloads -- write data, read results, titles -- through a
+/// pipe costs a kernel round trip per chunk. Instead the owner creates a block
+/// of shared memory split into two single-producer single-consumer rings, one
+/// in each direction. A payload is copied into the sender's ring and the rpc
+/// message carries a {{RingSlice}} that tells the receiver where to find it.
+/// Once the receiver is done with a payload it releases it which makes the
+/// space available to the sender again.
+///
+/// A payload that is passed on as it is, like the text of a write, gets copied
+/// once from the caller's memory into the ring; the receiver uses it in place.
+/// A payload that has to be produced first, like a read result or text being
+/// encoded as utf-8, is produced directly into space reserved in the ring so
+/// it isn't copied at all.
+///
+/// Payloads are produced and consumed in the order the messages they belong to
+/// are sent and processed so releasing a slice implicitly releases everything
+/// before it. If there is no room in the ring the sender just falls back to
+/// sending the payload inline.
+
+#ifndef _CONPRX_SHARE_SHMRING_HH
+#define _CONPRX_SHARE_SHMRING_HH
+
+#include "io/stream.hh"
+#include "plankton-inl.hh"
+#include "share/statepage.hh"
+#include "utils/blob.hh"
+#include "utils/fatbool.hh"
+#include "utils/types.hh"
+
+namespace conprx {
+
+// A block of memory that can be shared between processes, identified by name.
+class SharedMemory {
+public:
+  SharedMemory();
+  ~SharedMemory();
+
+  // Creates a new block of the given size with a fresh name that other
+  // processes can use to open it.
+  fat_bool_t create(size_t size);
+
+  // Opens an existing block created by another process.
+  fat_bool_t open(const char *name, size_t size);
+
+  // Unmaps the memory and releases the underlying handle.
+  void close();
+
+  tclib::Blob memory() { return memory_; }
+
+  const char *name() { return name_; }
+
+  bool is_open() { return memory_.start() != NULL; }
+
+  // The longest name, including the null terminator, a block can have.
+  static const size_t kMaxNameLength = 64;
+
+private:
+  // Platform-specific parts of create, open, and close.
+  fat_bool_t create_platform(size_t size);
+  fat_bool_t open_platform(size_t size);
+  void close_platform();
+
+  tclib::Blob memory_;
+  char name_[kMaxNameLength];
+  bool is_owner_;
+  tclib::naked_file_handle_t handle_;
+};
+
+// Reference to a payload stored in a shared ring. The offset is a position in
+// the ring's logical stream of bytes, not an offset into the underlying memory.
+class RingSlice {
+public:
+  RingSlice() : offset_(0), size_(0) { }
+  RingSlice(uint64_t offset, uint64_t size) : offset_(offset), size_(size) { }
+
+  uint64_t offset() { return offset_; }
+  uint64_t size() { return size_; }
+
+  // The seed type for ring slices.
+  static plankton::SeedType<RingSlice> *seed_type() { return &kSeedType; }
+
+private:
+  template <typename T> friend class plankton::DefaultSeedType;
+  static RingSlice *new_instance(plankton::Variant header, plankton::Factory *factory);
+  plankton::Variant to_seed(plankton::Factory *factory);
+  void init(plankton::Seed payload, plankton::Factory *factory);
+  static plankton::DefaultSeedType<RingSlice> kSeedType;
+
+  uint64_t offset_;
+  uint64_t size_;
+};
+
+// The part of a ring that lives at the start of its shared memory. The head is
+// only written by the producer and the tail only by the consumer; they're
+// kept on separate cache lines so the two sides don't contend.
+struct shared_ring_header_t {
+  volatile uint64_t head;
+  uint8_t head_padding[56];
+  volatile uint64_t tail;
+  uint8_t tail_padding[56];
+};
+
+// A single-producer single-consumer ring of bytes in shared memory.
+class SharedRing {
+public:
+  SharedRing();
+
+  // Sets this ring up to use the given memory, the start of which holds the
+  // header. If reset is true the header is cleared, which should only be done
+  // by the side that created the memory.
+  void initialize(tclib::Blob memory, bool reset);
+
+  // Copies the data into the ring, storing where it was written in the out
+  // parameter. Returns false without writing anything if there isn't room.
+  bool write(tclib::Blob data, RingSlice *slice_out);
+
+  // Reserves a contiguous block of the given size, storing it in the out
+  // parameter, such that the caller can produce a payload directly into the
+  // ring rather than copying it in afterwards. Nothing is visible to the
+  // consumer until the reservation is committed, and reserving again discards
+  // the previous reservation. Returns false if there isn't room.
+  bool reserve(size_t size, tclib::Blob *space_out);
+
+  // Makes the first size bytes of the last reservation visible to the
+  // consumer, storing where they are in the out parameter.
+  void commit(size_t size, RingSlice *slice_out);
+
+  // Stores a view of the data referenced by the given slice in the out
+  // parameter. Returns false if the slice isn't within the unreleased part of
+  // the ring, which means the producer is misbehaving.
+  bool read(RingSlice *slice, tclib::Blob *data_out);
+
+  // Releases the given slice and everything produced before it.
+  void release(RingSlice *slice);
+
+  // The number of data bytes the ring can hold.
+  size_t capacity() { return static_cast<size_t>(capacity_); }
+
+  bool is_initialized() { return header_ != NULL; }
+
+private:
+  // Returns a pointer to the byte at the given logical position.
+  byte_t *at(uint64_t position) { return data_ + (position % capacity_); }
+
+  shared_ring_header_t *header_;
+  byte_t *data_;
+  uint64_t capacity_;
+  uint64_t reserved_start_;
+  uint64_t reserved_size_;
+};
+
+// The pair of rings, one in each direction, that make up the transport between
+// an agent and its owner. The start of the memory holds the console state page
+// which the owner writes and the agent only reads.
+class SharedRingTransport {
+public:
+  SharedRingTransport() { }
+
+  // Creates the shared memory. Called by the owner.
+  fat_bool_t create(size_t size);
+
+  // Opens the shared memory created by the owner. Called by the agent.
+  fat_bool_t open(const char *name, size_t size);
+
+  // The ring through which the agent sends payloads to the owner.
+  SharedRing *up() { return &up_; }
+
+  // The ring through which the owner sends payloads to the agent.
+  SharedRing *down() { return &down_; }
+
+  // The page through which the owner publishes the console state.
+  ConsoleStatePage *state_page() { return &state_page_; }
+
+  SharedMemory *memory() { return &memory_; }
+
+  // Payloads smaller than this aren't worth the bookkeeping so they're always
+  // sent inline.
+  static const size_t kMinPayloadSize = 256;
+
+  // The size of shared memory to use if there's no reason to pick another.
+  static const size_t kDefaultSize = 1 << 20;
+
+private:
+  // Splits the memory between the state page and the two rings.
+  void initialize_rings(bool reset);
+
+  SharedMemory memory_;
+  ConsoleStatePage state_page_;
+  SharedRing up_;
+  SharedRing down_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_SHMRING_HH
@@ -0,0 +1,97 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/statepage.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/misc-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+
+using namespace conprx;
+using namespace tclib;
+
+// Reads the sequence number, making sure nothing read after it is read before.
+static inline uint64_t load_acquire(volatile uint64_t *ptr) {
+#ifdef IS_MSVC
+  return static_cast<uint64_t>(InterlockedCompareExchange64(
+      reinterpret_cast<volatile LONG64*>(ptr), 0, 0));
+#else
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Updates the sequence number, making sure everything written before is
+// visible before the new number is.
+static inline void store_release(volatile uint64_t *ptr, uint64_t value) {
+#ifdef IS_MSVC
+  InterlockedExchange64(reinterpret_cast<volatile LONG64*>(ptr),
+      static_cast<LONG64>(value));
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Keeps reads on the one side and writes on the other of the fence from being
+// reordered across it.
+static inline void full_fence() {
+#ifdef IS_MSVC
+  MemoryBarrier();
+#else
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+void ConsoleStatePage::initialize(tclib::Blob memory, bool reset) {
+  CHECK_REL("state page memory too small", memory.size(), >=, kSize);
+  page_ = static_cast<console_state_page_t*>(memory.start());
+  if (reset)
+    struct_zero_fill(*page_);
+}
+
+void ConsoleStatePage::publish(console_state_t *state) {
+  // Only we write the sequence so there's no need to synchronize reading it.
+  uint64_t sequence = page_->sequence;
+  store_release(&page_->sequence, sequence + 1);
+  full_fence();
+  page_->state = *state;
+  page_->is_valid = 1;
+  store_release(&page_->sequence, sequence + 2);
+}
+
+void ConsoleStatePage::invalidate() {
+  uint64_t sequence = page_->sequence;
+  store_release(&page_->sequence, sequence + 1);
+  full_fence();
+  page_->is_valid = 0;
+  store_release(&page_->sequence, sequence + 2);
+}
+
+bool ConsoleStatePage::read(console_state_t *state_out) {
+  if (page_ == NULL)
+    return false;
+  for (size_t i = 0; i < kMaxReadAttempts; i++) {
+    uint64_t before = load_acquire(&page_->sequence);
+    if ((before & 1) != 0)
+      continue;
+    uint32_t is_valid = page_->is_valid;
+    memcpy(state_out, &page_->state, sizeof(*state_out));
+    full_fence();
+    uint64_t after = page_->sequence;
+    if (before == after)
+      return is_valid != 0;
+  }
+  return false;
+}
+
+console_handle_state_t *ConsoleStatePage::find_handle(console_state_t *state,
+    Handle handle) {
+  for (size_t i = 0; i < 3; i++) {
+    console_handle_state_t *entry = &state->handles[i];
+    if (entry->handle != 0 && entry->handle == handle.id())
+      return entry;
+  }
+  return NULL;
+}
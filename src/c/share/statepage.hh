@@ -0,0 +1,115 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+/// Shared-memory snapshot of the console state that agents read locally.
+///
+/// Runtime libraries query things like the code pages and screen buffer info
+/// many times while a process starts up and each query would otherwise be a
+/// full round trip to the backend. Instead the backend publishes a snapshot of
+/// the state those queries depend on to a page of memory shared with the agent
+/// whenever something changes and the agent answers the queries from there.
+///
+/// The page is protected by a sequence lock: the backend, the only writer,
+/// makes the sequence number odd while it updates the snapshot and even again
+/// when it's done. The agent copies the snapshot out and only uses the copy if
+/// the sequence was the same, and even, before and after. A page that has
+/// never been published, or has been invalidated, isn't used.
+
+#ifndef _CONPRX_SHARE_STATEPAGE_HH
+#define _CONPRX_SHARE_STATEPAGE_HH
+
+#include "share/protocol.hh"
+#include "utils/blob.hh"
+
+namespace conprx {
+
+// The state of one of the standard handles.
+struct console_handle_state_t {
+  // The handle's id, or 0 if this entry isn't used.
+  int64_t handle;
+  uint32_t mode;
+  // Nonzero if screen_buffer_info is valid, which is only the case for
+  // output handles.
+  uint32_t has_screen_buffer_info;
+  console_screen_buffer_infoex_t screen_buffer_info;
+};
+
+// The parts of the console state that can be brought up to date separately,
+// such that an operation only has to republish what it may have changed.
+enum console_state_part_t {
+  spCodepages = 0x1,
+  spTitle = 0x2,
+  spModes = 0x4,
+  spScreenBuffers = 0x8,
+  spAll = 0xF
+};
+
+// A snapshot of the console state. The layout has to be the same for 32- and
+// 64-bit processes.
+struct console_state_t {
+  uint32_t input_codepage;
+  uint32_t output_codepage;
+  // The length of the title in characters, not counting the terminator.
+  uint32_t title_length;
+  uint32_t padding;
+  // The standard handles, indexed by input, output, error.
+  console_handle_state_t handles[3];
+};
+
+// The layout of the shared page. Everything after the sequence number is only
+// accessed under the sequence lock.
+struct console_state_page_t {
+  volatile uint64_t sequence;
+  uint8_t sequence_padding[56];
+  // Nonzero if the state is valid. The page is invalidated by clearing this
+  // rather than resetting the sequence number since a reader could otherwise
+  // see the same number before and after an update.
+  uint32_t is_valid;
+  uint32_t padding;
+  console_state_t state;
+};
+
+// Reads and writes the console state page in a block of shared memory.
+class ConsoleStatePage {
+public:
+  ConsoleStatePage() : page_(NULL) { }
+
+  // Sets this page up to use the given memory which must be at least kSize
+  // bytes. If reset is true the page is cleared, which should only be done by
+  // the side that created the memory.
+  void initialize(tclib::Blob memory, bool reset);
+
+  // Makes the given state visible to readers. Must only be called by one
+  // writer at a time.
+  void publish(console_state_t *state);
+
+  // Makes the page invalid such that readers stop using it, for instance if
+  // the state can no longer be described.
+  void invalidate();
+
+  // Copies the current state into the out parameter. Returns false if the
+  // page has never been published, has been invalidated, or is being updated
+  // too often to get a consistent copy; in those cases the reader should ask
+  // the backend instead.
+  bool read(console_state_t *state_out);
+
+  // Returns the state of the given handle within the given snapshot or NULL
+  // if it isn't one of the standard handles.
+  static console_handle_state_t *find_handle(console_state_t *state, Handle handle);
+
+  bool is_initialized() { return page_ != NULL; }
+
+  // The amount of memory the page takes up, rounded up to a cache line.
+  static const size_t kSize = (sizeof(console_state_page_t) + 63) & ~static_cast<size_t>(63);
+
+  // How many times a reader retries if the page changes while it's copying
+  // before giving up.
+  static const size_t kMaxReadAttempts = 16;
+
+private:
+  console_state_page_t *page_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_SHARE_STATEPAGE_HH
@@ -150,6 +150,160 @@ const uint8_t MsDosCodec::kWideToGraphic[29] = {
 };
 
 
+// Returns true if none of the 4 wide characters packed in the given word is
+// outside ascii.
+static inline bool is_ascii_wide_word(uint64_t word) {
+  return (word & 0xFF80FF80FF80FF80ULL) == 0;
+}
+
+// Returns true if none of the 8 bytes packed in the given word is outside
+// ascii.
+static inline bool is_ascii_byte_word(uint64_t word) {
+  return (word & 0x8080808080808080ULL) == 0;
+}
+
+size_t Utf8Codec::encode(const wide_char_t *chars, size_t length, uint8_t *out) {
+  uint8_t *start = out;
+  size_t i = 0;
+  while (i < length) {
+    // Most of what we see is ascii so check 8 characters at a time and narrow
+    // them all at once if they are. The check is independent of byte order
+    // and the inner loop is simple enough for the compiler to vectorize.
+    while (i + 8 <= length) {
+      uint64_t words[2];
+      memcpy(words, chars + i, sizeof(words));
+      if (!is_ascii_wide_word(words[0] | words[1]))
+        break;
+      for (size_t j = 0; j < 8; j++)
+        out[j] = static_cast<uint8_t>(chars[i + j]);
+      out += 8;
+      i += 8;
+    }
+    if (i == length)
+      break;
+    uint32_t unit = chars[i++];
+    if (unit < 0x80) {
+      *out++ = static_cast<uint8_t>(unit);
+    } else if (unit < 0x800) {
+      *out++ = static_cast<uint8_t>(0xC0 | (unit >> 6));
+      *out++ = static_cast<uint8_t>(0x80 | (unit & 0x3F));
+    } else if (0xD800 <= unit && unit < 0xDC00 && i < length
+        && 0xDC00 <= chars[i] && chars[i] < 0xE000) {
+      uint32_t code_point = 0x10000 + ((unit - 0xD800) << 10) + (chars[i++] - 0xDC00);
+      *out++ = static_cast<uint8_t>(0xF0 | (code_point >> 18));
+      *out++ = static_cast<uint8_t>(0x80 | ((code_point >> 12) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | ((code_point >> 6) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | (code_point & 0x3F));
+    } else {
+      // Everything else, including unpaired surrogates, is 3 bytes.
+      *out++ = static_cast<uint8_t>(0xE0 | (unit >> 12));
+      *out++ = static_cast<uint8_t>(0x80 | ((unit >> 6) & 0x3F));
+      *out++ = static_cast<uint8_t>(0x80 | (unit & 0x3F));
+    }
+  }
+  return out - start;
+}
+
+// Returns true if the byte at the given index exists and is a continuation
+// byte.
+static inline bool is_continuation(const uint8_t *bytes, size_t size, size_t index) {
+  return index < size && (bytes[index] & 0xC0) == 0x80;
+}
+
+size_t Utf8Codec::decode_one(const uint8_t *bytes, size_t size,
+    uint32_t *code_point_out) {
+  uint8_t lead = bytes[0];
+  if (lead < 0x80) {
+    *code_point_out = lead;
+    return 1;
+  } else if ((lead & 0xE0) == 0xC0 && is_continuation(bytes, size, 1)) {
+    *code_point_out = ((lead & 0x1F) << 6) | (bytes[1] & 0x3F);
+    return 2;
+  } else if ((lead & 0xF0) == 0xE0 && is_continuation(bytes, size, 1)
+      && is_continuation(bytes, size, 2)) {
+    *code_point_out = ((lead & 0x0F) << 12) | ((bytes[1] & 0x3F) << 6)
+        | (bytes[2] & 0x3F);
+    return 3;
+  } else if ((lead & 0xF8) == 0xF0 && is_continuation(bytes, size, 1)
+      && is_continuation(bytes, size, 2) && is_continuation(bytes, size, 3)) {
+    uint32_t code_point = ((lead & 0x07) << 18) | ((bytes[1] & 0x3F) << 12)
+        | ((bytes[2] & 0x3F) << 6) | (bytes[3] & 0x3F);
+    *code_point_out = (0x10000 <= code_point && code_point < 0x110000)
+        ? code_point
+        : 0xFFFD;
+    return 4;
+  } else {
+    *code_point_out = 0xFFFD;
+    return 1;
+  }
+}
+
+size_t Utf8Codec::decode(const uint8_t *bytes, size_t size, wide_char_t *out,
+    size_t capacity) {
+  size_t i = 0;
+  size_t count = 0;
+  while (i < size) {
+    while (i + 8 <= size && count + 8 <= capacity) {
+      uint64_t word;
+      memcpy(&word, bytes + i, sizeof(word));
+      if (!is_ascii_byte_word(word))
+        break;
+      for (size_t j = 0; j < 8; j++)
+        out[count + j] = bytes[i + j];
+      count += 8;
+      i += 8;
+    }
+    if (i == size)
+      break;
+    uint32_t code_point = 0;
+    size_t consumed = decode_one(bytes + i, size - i, &code_point);
+    if (code_point < 0x10000) {
+      if (count + 1 > capacity)
+        break;
+      out[count++] = static_cast<wide_char_t>(code_point);
+    } else {
+      if (count + 2 > capacity)
+        break;
+      code_point -= 0x10000;
+      out[count++] = static_cast<wide_char_t>(0xD800 + (code_point >> 10));
+      out[count++] = static_cast<wide_char_t>(0xDC00 + (code_point & 0x3FF));
+    }
+    i += consumed;
+  }
+  return count;
+}
+
+size_t Utf8Codec::encoded_size(const wide_char_t *chars, size_t length) {
+  size_t size = 0;
+  size_t i = 0;
+  while (i < length) {
+    uint32_t unit = chars[i++];
+    if (unit < 0x80) {
+      size += 1;
+    } else if (unit < 0x800) {
+      size += 2;
+    } else if (0xD800 <= unit && unit < 0xDC00 && i < length
+        && 0xDC00 <= chars[i] && chars[i] < 0xE000) {
+      i++;
+      size += 4;
+    } else {
+      size += 3;
+    }
+  }
+  return size;
+}
+
+size_t Utf8Codec::decoded_length(const uint8_t *bytes, size_t size) {
+  size_t i = 0;
+  size_t count = 0;
+  while (i < size) {
+    uint32_t code_point = 0;
+    i += decode_one(bytes + i, size - i, &code_point);
+    count += (code_point < 0x10000) ? 1 : 2;
+  }
+  return count;
+}
+
 ucs16_t conprx::ucs16_default_dup(ucs16_t str) {
   if (ucs16_is_empty(str))
     return str;
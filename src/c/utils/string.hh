@@ -54,6 +54,42 @@ private:
   static const uint8_t kWideToGraphic[29];
 };
 
+// Conversion between utf-16 and utf-8, used to send wide text in the more
+// compact encoding. Unpaired surrogates are encoded as if they were characters
+// (what's sometimes called wtf-8) rather than rejected, such that any sequence
+// of wide characters survives the trip through utf-8 unchanged. That includes
+// surrogate pairs that have been split in two.
+class Utf8Codec {
+public:
+  // Encodes the given wide characters as utf-8, storing the result in out
+  // which must have room for kMaxBytesPerUnit bytes for each character.
+  // Returns the number of bytes written.
+  static size_t encode(const wide_char_t *chars, size_t length, uint8_t *out);
+
+  // Returns the number of bytes encode would write for the given wide
+  // characters.
+  static size_t encoded_size(const wide_char_t *chars, size_t length);
+
+  // Decodes the given utf-8 into wide characters, storing at most capacity of
+  // them in out. Stops before a character that doesn't fit. Malformed bytes
+  // decode as the replacement character. Returns the number of wide characters
+  // written.
+  static size_t decode(const uint8_t *bytes, size_t size, wide_char_t *out,
+      size_t capacity);
+
+  // Returns the number of wide characters the given utf-8 decodes to.
+  static size_t decoded_length(const uint8_t *bytes, size_t size);
+
+  // The most utf-8 bytes a single wide character can encode as. Surrogate
+  // pairs encode as 4 bytes which is 2 per wide character.
+  static const size_t kMaxBytesPerUnit = 3;
+
+private:
+  // Decodes the character at the start of the given bytes, storing the code
+  // point in the out parameter. Returns the number of bytes it takes up.
+  static size_t decode_one(const uint8_t *bytes, size_t size, uint32_t *code_point_out);
+};
+
 // A ucs-16 string, that is, like utf-16 except that surrogate pairs are left
 // uninterpreted.
 struct ucs16_t {
@@ -0,0 +1,95 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Timings of the agent talking to the backend through the driver. The numbers
+// are logged rather than checked; the behaviour they rely on is covered by
+// the agent tests.
+
+#include "driver-manager.hh"
+#include "test.hh"
+#include "timer.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+// Backend that accepts writes and counts how much was written.
+class CountingWriteBackend : public BasicConsoleBackend {
+public:
+  CountingWriteBackend() : bytes_written(0) { }
+  response_t<uint32_t> write_console(Handle output, tclib::Blob data, bool is_unicode);
+  uint64_t bytes_written;
+};
+
+response_t<uint32_t> CountingWriteBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  bytes_written += data.size();
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+// Compares writing large payloads through the pipe with writing them through
+// shared memory.
+MULTITEST(agent, write_throughput, bool, use_shared_memory, ("shm", true),
+    ("pipe", false)) {
+  CountingWriteBackend backend;
+  DriverManager driver;
+  DriverManagerJoiner joiner;
+  driver.set_agent_type(DriverManager::atFake);
+  driver.set_frontend_type(dfSimulating);
+  driver.set_use_shared_memory(use_shared_memory);
+  driver.set_use_wire_extensions(true);
+  driver.set_backend(&backend);
+  ASSERT_F_TRUE(driver.start());
+  ASSERT_F_TRUE(driver.connect());
+  joiner.set_driver(&driver);
+
+  DriverRequest gsh0 = driver.get_std_handle(conprx::kStdOutputHandle);
+  Handle output = *gsh0->native_as<Handle>();
+
+  static const size_t kChunkSize = 16384;
+  static const size_t kChunkCount = 256;
+  static ansi_char_t chunk[kChunkSize];
+  for (size_t i = 0; i < kChunkSize; i++)
+    chunk[i] = static_cast<ansi_char_t>('a' + (i % 26));
+  tclib::Blob data(chunk, kChunkSize);
+
+  WallClockTimer timer;
+  for (size_t i = 0; i < kChunkCount; i++)
+    driver.write_console_a(output, data);
+  LOG_INFO("Wrote %i KB through %s in %i us (%.1f MB/s)",
+      static_cast<int>(backend.bytes_written / 1024),
+      use_shared_memory ? "shared memory" : "pipe",
+      static_cast<int>(timer.elapsed_micros()),
+      timer.megabytes_per_second(backend.bytes_written));
+  ASSERT_EQ(kChunkSize * kChunkCount, backend.bytes_written);
+}
+
+// Compares how long it takes before the driver is running with and without
+// the agent connecting lazily, and how long the first call that needs the
+// backend takes.
+MULTITEST(agent, startup_latency, bool, use_lazy, ("lazy", true),
+    ("eager", false)) {
+  BasicConsoleBackend backend;
+  DriverManager driver;
+  DriverManagerJoiner joiner;
+  driver.set_agent_type(DriverManager::atFake);
+  driver.set_frontend_type(dfSimulating);
+  driver.set_lazy_connect(use_lazy);
+  driver.set_backend(&backend);
+  WallClockTimer startup;
+  ASSERT_F_TRUE(driver.start());
+  ASSERT_F_TRUE(driver.connect());
+  uint64_t startup_micros = startup.elapsed_micros();
+  joiner.set_driver(&driver);
+
+  WallClockTimer first_call;
+  driver.get_console_cp();
+  uint64_t first_call_micros = first_call.elapsed_micros();
+  LOG_INFO("Connecting %s: started in %i us, first call took %i us",
+      use_lazy ? "lazily" : "eagerly", static_cast<int>(startup_micros),
+      static_cast<int>(first_call_micros));
+}
@@ -0,0 +1,264 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Timings of calls going from a simulated frontend through the backend
+// service. The numbers are logged rather than checked; the behaviour they
+// rely on is covered by the conback tests.
+
+#include "test.hh"
+#include "timer.hh"
+#include "utils/string.hh"
+#include "conback-utils.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+// Backend that answers the calls that have a fast encoding without doing any
+// real work, so all that's left is the cost of the protocol.
+class CannedBackend : public BasicConsoleBackend {
+public:
+  CannedBackend() : info_count_(0) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  virtual response_t<bool_t> set_console_cursor_position(Handle output,
+      coord_t position);
+  virtual response_t<bool_t> get_console_screen_buffer_info(Handle buffer,
+      ScreenBufferInfo *info_out);
+  size_t info_count_;
+};
+
+response_t<uint32_t> CannedBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+response_t<bool_t> CannedBackend::set_console_cursor_position(Handle output,
+    coord_t position) {
+  return response_t<bool_t>::yes();
+}
+
+response_t<bool_t> CannedBackend::get_console_screen_buffer_info(Handle buffer,
+    ScreenBufferInfo *info_out) {
+  info_count_++;
+  info_out->set_size(coord_new(80, 25));
+  info_out->set_attributes(0x1F);
+  return response_t<bool_t>::yes();
+}
+
+// Runs the calls that have a fast encoding through the general and the fast
+// encoding and logs the cost per call. The in-memory stream means the time is
+// all spent encoding and decoding.
+MULTITEST(conback, fast_path, bool, use_fast_path, ("fast", true),
+    ("general", false)) {
+  CannedBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_fast_path)
+    frontend.connector()->enable_fast_path();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kIterations = 10000;
+  dword_t written = 0;
+  console_screen_buffer_info_t info;
+  WallClockTimer timer;
+  for (size_t i = 0; i < kIterations; i++) {
+    frontend->write_console_a(output, "abc", 3, &written, NULL);
+    frontend->get_console_cp();
+    frontend->set_console_cursor_position(output, coord_new(4, 5));
+    frontend->get_console_screen_buffer_info(output, &info);
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  LOG_INFO("%s encoding: %i ns per message",
+      use_fast_path ? "Fast" : "General",
+      static_cast<int>(elapsed / (kIterations * 4)));
+  ASSERT_EQ(kIterations, backend.info_count_);
+}
+
+// Runs calls through numeric and named selectors and logs the cost per call.
+MULTITEST(conback, numeric_selectors, bool, use_numeric_selectors,
+    ("numeric", true), ("named", false)) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_numeric_selectors)
+    frontend.connector()->enable_numeric_selectors();
+
+  static const size_t kIterations = 10000;
+  WallClockTimer timer;
+  for (size_t i = 0; i < kIterations; i++) {
+    frontend->set_console_cp(cpUtf8);
+    frontend->get_console_cp();
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  LOG_INFO("%s selectors: %i ns per message",
+      use_numeric_selectors ? "Numeric" : "Named",
+      static_cast<int>(elapsed / (kIterations * 2)));
+  ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+}
+
+// A thread that writes through a shared frontend as fast as it can.
+class WritingThread : public tclib::DefaultDestructable {
+public:
+  WritingThread(ConsoleFrontend *frontend, handle_t output, size_t count)
+    : frontend_(frontend)
+    , output_(output)
+    , count_(count)
+    , thread_(new_callback(&WritingThread::run, this)) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  opaque_t run();
+  NativeThread *thread() { return &thread_; }
+
+private:
+  ConsoleFrontend *frontend_;
+  handle_t output_;
+  size_t count_;
+  NativeThread thread_;
+};
+
+opaque_t WritingThread::run() {
+  for (size_t i = 0; i < count_; i++) {
+    dword_t written = 0;
+    frontend_->write_console_a(output_, "abc", 3, &written, NULL);
+    frontend_->get_console_cp();
+  }
+  return o0();
+}
+
+// Logs the cost per call of a number of threads making calls through the same
+// multiplexed connector.
+TEST(conback, multiplexed_stress) {
+  CannedBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_multiplexing());
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kThreadCount = 4;
+  static const size_t kCallCount = 1000;
+  def_ref_t<WritingThread> threads[kThreadCount];
+  for (size_t i = 0; i < kThreadCount; i++)
+    threads[i] = new (kDefaultAlloc) WritingThread(frontend.frontend(),
+        output, kCallCount);
+  WallClockTimer timer;
+  for (size_t i = 0; i < kThreadCount; i++)
+    ASSERT_TRUE(threads[i]->thread()->start());
+  for (size_t i = 0; i < kThreadCount; i++) {
+    opaque_t result = o0();
+    ASSERT_TRUE(threads[i]->thread()->join(&result));
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  LOG_INFO("multiplexed: %i ns per call with %i threads",
+      static_cast<int>(elapsed / (2 * kThreadCount * kCallCount)),
+      static_cast<int>(kThreadCount));
+}
+
+// Writes a corpus of typical log lines as wide text and logs how many bytes
+// cross the wire and how long it takes with and without utf-8.
+MULTITEST(conback, utf8_wire, bool, use_utf8, ("utf8", true), ("utf16", false)) {
+  static const char *const kCorpus[4] = {
+    "2016-03-14 09:26:53.589 [INFO] worker-3: processed 1024 records in 12ms\r\n",
+    "2016-03-14 09:26:53.601 [WARN] cache: evicting 17 entries (size 65536)\r\n",
+    "  at org.example.Scheduler.run(Scheduler.java:142)\r\n",
+    "Build succeeded: 0 errors, 3 warnings -- caf\xc3\xa9 \xe2\x94\x80\xe2\x94\x80\r\n"
+  };
+  wide_char_t lines[4][128];
+  size_t lengths[4];
+  for (size_t i = 0; i < 4; i++) {
+    size_t size = strlen(kCorpus[i]);
+    lengths[i] = Utf8Codec::decode(reinterpret_cast<const uint8_t*>(kCorpus[i]),
+        size, lines[i], 128);
+  }
+
+  CannedBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_utf8)
+    frontend.connector()->enable_utf8_wire();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kIterations = 2500;
+  size_t wide_bytes = 0;
+  dword_t written = 0;
+  WallClockTimer timer;
+  for (size_t i = 0; i < kIterations; i++) {
+    size_t line = i % 4;
+    frontend->write_console_w(output, lines[line],
+        static_cast<dword_t>(lengths[line]), &written, NULL);
+    wide_bytes += lengths[line] * sizeof(wide_char_t);
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  uint64_t wire_bytes = frontend.service()->write_bytes_received();
+  LOG_INFO("%s wire: %i%% of utf-16 bytes, %i ns per write",
+      use_utf8 ? "Utf-8" : "Utf-16",
+      static_cast<int>(wire_bytes * 100 / wide_bytes),
+      static_cast<int>(elapsed / kIterations));
+}
+
+static int compare_uint64(const void *a, const void *b) {
+  uint64_t va = *static_cast<const uint64_t*>(a);
+  uint64_t vb = *static_cast<const uint64_t*>(b);
+  return (va < vb) ? -1 : ((va == vb) ? 0 : 1);
+}
+
+// Logs how long interactive calls take while another thread saturates the
+// connection with bulk writes, with and without separate lanes for them.
+MULTITEST(conback, priority_lanes, bool, use_lanes, ("lanes", true),
+    ("single", false)) {
+  SlowWriteBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  // The in-memory stream is small so the frames have to be too.
+  ASSERT_F_TRUE(frontend.connector()->enable_multiplexing(use_lanes ? 128 : 0));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  SaturatingWriter writer(frontend.frontend(), output);
+  ASSERT_TRUE(writer.thread()->start());
+  static const size_t kMaxSamples = 1024;
+  uint64_t samples[kMaxSamples];
+  size_t sample_count = 0;
+  while (!writer.is_done_ && sample_count < kMaxSamples) {
+    WallClockTimer timer;
+    frontend->get_console_cp();
+    samples[sample_count++] = timer.elapsed_nanos();
+  }
+  opaque_t result = o0();
+  ASSERT_TRUE(writer.thread()->join(&result));
+
+  if (sample_count == 0)
+    return;
+  qsort(samples, sample_count, sizeof(uint64_t), compare_uint64);
+  LOG_INFO("%s: interactive latency p50 %i us, p99 %i us, max %i us",
+      use_lanes ? "lanes" : "single",
+      static_cast<int>(samples[sample_count / 2] / 1000),
+      static_cast<int>(samples[(sample_count * 99) / 100] / 1000),
+      static_cast<int>(samples[sample_count - 1] / 1000));
+}
+
+// Logs the cost per call of calls whose arguments are handles and coordinates
+// with the arguments sent compactly and as seeds.
+MULTITEST(conback, compact_values, bool, use_compact, ("compact", true),
+    ("seed", false)) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_compact)
+    frontend.connector()->enable_compact_values();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kIterations = 10000;
+  console_screen_buffer_info_t info;
+  WallClockTimer timer;
+  for (size_t i = 0; i < kIterations; i++) {
+    int16_t column = static_cast<int16_t>(i % 80);
+    frontend->set_console_cursor_position(output, coord_new(column, 3));
+    frontend->get_console_screen_buffer_info(output, &info);
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  LOG_INFO("%s values: %i ns per call", use_compact ? "Compact" : "Seed",
+      static_cast<int>(elapsed / (kIterations * 2)));
+}
@@ -0,0 +1,52 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Timings of clients connecting to a backend daemon. The numbers are logged
+// rather than checked; the behaviour they rely on is covered by the daemon
+// tests.
+
+#include "daemon-utils.hh"
+#include "test.hh"
+#include "timer.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+#ifndef IS_MSVC
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+// Connecting is what a daemon saves over launching a backend per command so
+// it's worth keeping an eye on.
+TEST(daemon, connect) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  char address[LocalSocket::kMaxAddressLength];
+#ifndef IS_MSVC
+  snprintf(address, sizeof(address), "/tmp/conprx-daemon-bench-%i",
+      static_cast<int>(getpid()));
+#endif
+
+  ConsoleDaemon daemon;
+  ASSERT_F_TRUE(daemon.listen(address));
+  DaemonRunner runner(&daemon);
+  ASSERT_TRUE(runner.thread()->start());
+
+  WallClockTimer timer;
+  DaemonClient client;
+  ASSERT_F_TRUE(client.connect(address, 1));
+  ASSERT_EQ(0, client.connector()->poke(5).value());
+  LOG_INFO("daemon: %i us to connect and make the first call",
+      static_cast<int>(timer.elapsed_micros()));
+
+  ASSERT_F_TRUE(client.send_is_done());
+  daemon.stop();
+  opaque_t result = o0();
+  ASSERT_TRUE(runner.thread()->join(&result));
+}
@@ -0,0 +1,56 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Timings of serving many agents from an event loop. The numbers are logged
+// rather than checked; the behaviour they rely on is covered by the evloop
+// tests.
+
+#include "evloop-utils.hh"
+#include "test.hh"
+#include "timer.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+// Logs the cost per call when every agent has a request in flight at once and
+// they're all served by a handful of workers.
+TEST(evloop, many_agents) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  static const size_t kAgentCount = 128;
+  static const size_t kWorkerCount = 4;
+  static const size_t kRoundCount = 50;
+
+  AgentEventLoop loop(kWorkerCount);
+  ASSERT_F_TRUE(loop.start());
+  def_ref_t<FakeAgentAttachment> agents[kAgentCount];
+  for (size_t i = 0; i < kAgentCount; i++) {
+    agents[i] = new (kDefaultAlloc) FakeAgentAttachment();
+    ASSERT_F_TRUE(agents[i]->open());
+    agents[i]->agent_monitor_done()->raise();
+    ASSERT_F_TRUE(loop.add(*agents[i]));
+  }
+
+  WallClockTimer timer;
+  for (size_t round = 1; round <= kRoundCount; round++) {
+    rpc::IncomingResponse resps[kAgentCount];
+    for (size_t i = 0; i < kAgentCount; i++)
+      resps[i] = agents[i]->send_poke(round * kAgentCount + i);
+    for (size_t i = 0; i < kAgentCount; i++)
+      ASSERT_F_TRUE(agents[i]->await(resps[i]));
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  LOG_INFO("evloop: %i ns per call with %i agents on %i workers",
+      static_cast<int>(elapsed / (kRoundCount * kAgentCount)),
+      static_cast<int>(kAgentCount), static_cast<int>(kWorkerCount));
+
+  for (size_t i = 0; i < kAgentCount; i++)
+    ASSERT_F_TRUE(agents[i]->await(agents[i]->send_is_done()));
+  loop.wait_idle();
+  loop.stop();
+}
@@ -0,0 +1,127 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Timings of the paths messages take through the interceptor and the agent.
+// The numbers are logged rather than checked; the behaviour they rely on is
+// covered by the lpc tests.
+
+#include "test.hh"
+#include "agent/lpc.hh"
+#include "conback-utils.hh"
+#include "timer.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace lpc;
+using namespace tclib;
+
+// Logs the cost of the check on the intercept path when nothing is disabled.
+TEST(lpc, enabled_check) {
+  static const size_t kCheckCount = 10000000;
+  conprx::SimulatedAgent agent(NULL);
+  tclib::def_ref_t<conprx::InMemoryConsolePlatform> platform
+      = conprx::InMemoryConsolePlatform::new_simulating(&agent);
+  tclib::def_ref_t<conprx::ConsoleFrontend> frontend
+      = conprx::ConsoleFrontend::new_simulating(&agent, *platform);
+  Interceptor *interceptor = frontend->interceptor();
+
+  conprx::WallClockTimer timer;
+  size_t enabled_count = 0;
+  for (size_t i = 0; i < kCheckCount; i++) {
+    if (interceptor->is_enabled())
+      enabled_count++;
+  }
+  uint64_t elapsed = timer.elapsed_nanos();
+  ASSERT_EQ(kCheckCount, enabled_count);
+  LOG_INFO("lpc: %i ps per enabled check",
+      static_cast<int>(elapsed * 1000 / kCheckCount));
+}
+
+// An interceptor whose native backend does nothing but count the calls, so
+// what's measured is the cost of getting there.
+class PassThroughInterceptor : public Interceptor {
+public:
+  PassThroughInterceptor() : call_count(0) { }
+  virtual conprx::NtStatus call_native_backend(handle_t port,
+      relevant_message_t *request, relevant_message_t *incoming_reply);
+  virtual fat_bool_t calibrate_console_port() { return F_TRUE; }
+  size_t call_count;
+};
+
+conprx::NtStatus PassThroughInterceptor::call_native_backend(handle_t port,
+    relevant_message_t *request, relevant_message_t *incoming_reply) {
+  call_count++;
+  return conprx::NtStatus::success();
+}
+
+// Compares the cost of passing a message the agent doesn't care about through
+// to the native backend by way of the handler, which is what the patched lpc
+// call used to do for every message, with rejecting it up front.
+TEST(lpc, pass_through_overhead) {
+  static const size_t kCallCount = 1000000;
+  // NlsGetUserInfo, one of the many base messages the agent ignores.
+  static const uint32_t kApiNumber = 0x1001B;
+  conprx::SimulatedAgent agent(NULL);
+  PassThroughInterceptor pass_through;
+  Interceptor *interceptor = &pass_through;
+  relevant_message_t request;
+  struct_zero_fill(request);
+  request.api_number = kApiNumber;
+  relevant_message_t reply;
+  struct_zero_fill(reply);
+
+  conprx::WallClockTimer handler_timer;
+  for (size_t i = 0; i < kCallCount; i++) {
+    Message message(NULL, interceptor, AddressXform(), Message::mdBase,
+        &request, &reply);
+    agent.on_message(&message);
+  }
+  uint64_t handler_nanos = handler_timer.elapsed_nanos();
+
+  conprx::WallClockTimer reject_timer;
+  for (size_t i = 0; i < kCallCount; i++) {
+    if (!InterceptedApis::contains(request.api_number))
+      interceptor->call_native_backend(NULL, &request, &reply);
+  }
+  uint64_t reject_nanos = reject_timer.elapsed_nanos();
+
+  ASSERT_EQ(2 * kCallCount, pass_through.call_count);
+  LOG_INFO("lpc: passing through costs %i ps via the handler, %i ps when "
+      "rejected early", static_cast<int>(handler_nanos * 1000 / kCallCount),
+      static_cast<int>(reject_nanos * 1000 / kCallCount));
+}
+
+// Measures the cost of getting a handle's mode through the frontend with no
+// flags set on the message against with it delegated through the flagged
+// path.
+TEST(lpc, runtime_flags_overhead) {
+  static const size_t kCallCount = 100000;
+  static const uint32_t kMode = 0x2A;
+  conprx::SimulatedAgent agent(NULL);
+  tclib::def_ref_t<conprx::InMemoryConsolePlatform> platform
+      = conprx::InMemoryConsolePlatform::new_simulating(&agent);
+  tclib::def_ref_t<conprx::ConsoleFrontend> frontend
+      = conprx::ConsoleFrontend::new_simulating(&agent, *platform);
+  handle_t handle = reinterpret_cast<handle_t>(static_cast<address_arith_t>(0x3C));
+  platform->set_console_mode(handle, kMode);
+
+  dword_t mode = 0;
+  conprx::WallClockTimer plain_timer;
+  for (size_t i = 0; i < kCallCount; i++)
+    frontend->get_console_mode(handle, &mode);
+  uint64_t plain_nanos = plain_timer.elapsed_nanos();
+
+  agent.options()->set_delegate_lpcs(1 << conprx::ConsoleAgent::liGetConsoleMode);
+  agent.read_lpc_flags();
+  conprx::WallClockTimer flagged_timer;
+  for (size_t i = 0; i < kCallCount; i++)
+    frontend->get_console_mode(handle, &mode);
+  uint64_t flagged_nanos = flagged_timer.elapsed_nanos();
+
+  ASSERT_EQ(kMode, mode);
+  LOG_INFO("lpc: getting the mode costs %i ns with no flags, %i ns when "
+      "delegated", static_cast<int>(plain_nanos / kCallCount),
+      static_cast<int>(flagged_nanos / kCallCount));
+}
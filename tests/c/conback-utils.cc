@@ -2,6 +2,7 @@
 //- Licensed under the Apache License, Version 2.0 (see LICENSE).
 
 #include "conback-utils.hh"
+#include "timer.hh"
 
 using namespace conprx;
 using namespace plankton;
@@ -31,6 +32,11 @@ fat_bool_t SimulatedFrontendAdaptor::initialize() {
   return F_TRUE;
 }
 
+void SimulatedFrontendAdaptor::set_state_page(ConsoleStatePage *page) {
+  agent_.adaptor()->set_state_page(page);
+  service_.set_state_page(page);
+}
+
 fat_bool_t FrontendMultiplexer::initialize() {
   if (use_native_) {
     native_frontend_ = ConsoleFrontend::new_native();
@@ -46,3 +52,32 @@ fat_bool_t FrontendMultiplexer::initialize() {
   }
   return F_TRUE;
 }
+
+response_t<uint32_t> SlowWriteBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  WallClockTimer timer;
+  while (timer.elapsed_nanos() < data.size() * kNanosPerByte)
+    ;
+  write_count_++;
+  bytes_written_ += data.size();
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+SaturatingWriter::SaturatingWriter(ConsoleFrontend *frontend, handle_t output)
+  : is_done_(false)
+  , bytes_written_(0)
+  , frontend_(frontend)
+  , output_(output)
+  , thread_(new_callback(&SaturatingWriter::run, this)) { }
+
+opaque_t SaturatingWriter::run() {
+  char block[kBlockSize];
+  memset(block, 'x', kBlockSize);
+  for (size_t i = 0; i < kBlockCount; i++) {
+    dword_t written = 0;
+    if (frontend_->write_console_a(output_, block, kBlockSize, &written, NULL))
+      bytes_written_ += written;
+  }
+  is_done_ = true;
+  return o0();
+}
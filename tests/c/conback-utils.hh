@@ -41,6 +41,16 @@ public:
   ConsoleFrontend *operator->() { return frontend(); }
   ConsoleFrontend *frontend() { return *frontend_; }
   InMemoryConsolePlatform *platform() { return *platform_; }
+  PrpcConsoleConnector *connector() { return &connector_; }
+  ConsoleBackendService *service() { return &service_; }
+
+  // The agent's end of the connection to the service, for tests that need to
+  // send requests without waiting for the response.
+  plankton::rpc::StreamServiceConnector *streams() { return &streams_; }
+
+  // Makes the backend publish its state to the given page and the agent
+  // answer queries from it.
+  void set_state_page(ConsoleStatePage *page);
 private:
   ConsoleBackend *backend_;
   tclib::ByteBufferStream buffer_;
@@ -82,6 +92,36 @@ private:
   bool trace_;
 };
 
+// Backend whose writes take time proportional to their size, like a terminal
+// that has to render them.
+class SlowWriteBackend : public BasicConsoleBackend {
+public:
+  SlowWriteBackend() : write_count_(0), bytes_written_(0) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  size_t write_count_;
+  size_t bytes_written_;
+  static const uint64_t kNanosPerByte = 2000;
+};
+
+// A thread that keeps writing large blocks through a shared frontend.
+class SaturatingWriter : public tclib::DefaultDestructable {
+public:
+  SaturatingWriter(ConsoleFrontend *frontend, handle_t output);
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  opaque_t run();
+  tclib::NativeThread *thread() { return &thread_; }
+  volatile bool is_done_;
+  size_t bytes_written_;
+  static const size_t kBlockSize = 512;
+  static const size_t kBlockCount = 40;
+
+private:
+  ConsoleFrontend *frontend_;
+  handle_t output_;
+  tclib::NativeThread thread_;
+};
+
 } // namespace conprx
 
 // Declare a console backend test that runs both the same tests against the
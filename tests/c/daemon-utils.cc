@@ -0,0 +1,44 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "daemon-utils.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace plankton;
+using namespace tclib;
+
+DaemonRunner::DaemonRunner(ConsoleDaemon *daemon)
+  : daemon_(daemon)
+  , thread_(new_callback(&DaemonRunner::run, this)) { }
+
+opaque_t DaemonRunner::run() {
+  F_LOG_FALSE(daemon_->serve());
+  return o0();
+}
+
+fat_bool_t DaemonClient::connect(const char *address, uint64_t session_id) {
+  daemon_hello_t hello;
+  struct_zero_fill(hello);
+  hello.magic = daemon_hello_t::kMagic;
+  hello.session_id = session_id;
+  F_TRY(LocalSocket::connect(address, tclib::Blob(&hello, sizeof(hello)),
+      &stream_));
+  streams_ = new (kDefaultAlloc) rpc::StreamServiceConnector(*stream_, *stream_);
+  streams_->set_default_type_registry(ConsoleTypes::registry());
+  F_TRY(streams_->init(empty_callback()));
+  connector_ = new (kDefaultAlloc) PrpcConsoleConnector(streams_->socket(),
+      streams_->input());
+  return F_TRUE;
+}
+
+fat_bool_t DaemonClient::send_is_done() {
+  rpc::OutgoingRequest req(Variant::null(), "is_done");
+  rpc::IncomingResponse resp = streams_->socket()->send_request(&req);
+  while (!resp->is_settled())
+    F_TRY(streams_->input()->process_next_instruction(NULL));
+  return F_BOOL(resp->is_fulfilled());
+}
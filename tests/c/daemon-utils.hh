@@ -0,0 +1,44 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#ifndef _CONPRX_DAEMON_UTILS_HH
+#define _CONPRX_DAEMON_UTILS_HH
+
+#include "agent/conconn.hh"
+#include "rpc.hh"
+#include "server/daemon.hh"
+
+namespace conprx {
+
+// Runs a daemon's accept loop on a thread of its own.
+class DaemonRunner {
+public:
+  DaemonRunner(ConsoleDaemon *daemon);
+  tclib::NativeThread *thread() { return &thread_; }
+
+private:
+  opaque_t run();
+
+  ConsoleDaemon *daemon_;
+  tclib::NativeThread thread_;
+};
+
+// An agent-like client that connects to a daemon the same way the agent does
+// and calls it through a connector.
+class DaemonClient {
+public:
+  fat_bool_t connect(const char *address, uint64_t session_id);
+  PrpcConsoleConnector *connector() { return *connector_; }
+
+  // Tells the daemon this client is done, after which it stops serving it.
+  fat_bool_t send_is_done();
+
+private:
+  tclib::def_ref_t<tclib::InOutStream> stream_;
+  tclib::def_ref_t<plankton::rpc::StreamServiceConnector> streams_;
+  tclib::def_ref_t<PrpcConsoleConnector> connector_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_DAEMON_UTILS_HH
@@ -24,6 +24,10 @@ DriverConnection::DriverConnection()
 DriverManager::DriverManager()
   : has_started_agent_monitor_(false)
   , silence_log_(false)
+  , use_shared_memory_(false)
+  , lazy_connect_(false)
+  , use_wire_extensions_(false)
+  , loop_(NULL)
   , agent_path_(string_empty())
   , agent_type_(atNone)
   , frontend_type_(dfDummy)
@@ -253,6 +257,19 @@ fat_bool_t DriverManager::start() {
       F_TRY(launcher->allocate());
       builder.add_option("fake-agent-channel",
           launcher->agent_channel()->name().chars);
+      if (use_shared_memory_) {
+        F_TRY(launcher->create_transport(SharedRingTransport::kDefaultSize));
+        SharedMemory *memory = launcher->transport()->memory();
+        builder.add_option("fake-agent-shared-memory", memory->name());
+        builder.add_option("fake-agent-shared-memory-size",
+            static_cast<int64_t>(memory->memory().size()));
+      }
+      if (lazy_connect_) {
+        builder.add_option("fake-agent-lazy", Variant::yes());
+        launcher->set_lazy_connect(true);
+      }
+      if (use_wire_extensions_)
+        builder.add_option("fake-agent-wire-extensions", Variant::yes());
       launcher_ = launcher;
       break;
     }
@@ -261,6 +278,8 @@ fat_bool_t DriverManager::start() {
   }
   if (backend_ != NULL)
     launcher()->set_backend(backend_);
+  if (loop_ != NULL)
+    launcher()->set_event_loop(loop_);
   F_TRY(launcher()->initialize());
   agent_monitor_.set_callback(new_callback(&ProcessAttachment::monitor_agent,
       launcher()->attachment()));
@@ -285,7 +304,8 @@ fat_bool_t DriverManager::start() {
   F_TRY(launcher()->start(exec, 1, &args));
   if (trace())
     tracer_.install(launcher()->attachment()->socket());
-  if (!use_agent())
+  // With an event loop or a lazy agent the launcher is already serving it.
+  if (!use_agent() || loop_ != NULL || launcher()->is_monitoring_agent())
     return F_TRUE;
   launcher()->attachment()->agent_monitor_done()->raise();
   has_started_agent_monitor_ = true;
@@ -347,6 +367,12 @@ fat_bool_t DriverManager::join(int *exit_code_out) {
   }
 }
 
+DriverManagerJoiner::~DriverManagerJoiner() {
+  if (manager_ == NULL)
+    return;
+  ASSERT_F_TRUE(manager_->join(NULL));
+}
+
 utf8_t DriverManager::executable_path() {
   const char *result = getenv("DRIVER");
   ASSERT_TRUE(result != NULL);
@@ -382,10 +408,17 @@ fat_bool_t FakeAgentLauncher::allocate() {
   return F_TRUE;
 }
 
+fat_bool_t FakeAgentLauncher::create_transport(size_t size) {
+  return transport()->create(size);
+}
+
 tclib::pass_def_ref_t<ProcessAttachment> FakeAgentLauncher::create_attachment(
     tclib::NativeProcessHandle *process) {
-  return new (kDefaultAlloc) FakeAgentProcessAttachment(process, this,
-      *agent_channel_);
+  FakeAgentProcessAttachment *attachment = new (kDefaultAlloc)
+      FakeAgentProcessAttachment(process, this, *agent_channel_);
+  if (transport()->memory()->is_open())
+    attachment->set_transport(transport());
+  return attachment;
 }
 
 fat_bool_t FakeAgentProcessAttachment::start_connect_to_agent() {
@@ -122,11 +122,19 @@ public:
   // Allocate the underlying channel.
   fat_bool_t allocate();
 
+  // Creates shared memory of the given size for the fake agent to exchange
+  // bulk payloads through. Must be called before the attachment is created.
+  fat_bool_t create_transport(size_t size);
+
   virtual tclib::pass_def_ref_t<ProcessAttachment> create_attachment(
       tclib::NativeProcessHandle *process);
 
   tclib::ServerChannel *agent_channel() { return *agent_channel_; }
 
+  // Returns the shared memory transport, which may or may not have been
+  // created.
+  SharedRingTransport *transport() { return &transport_; }
+
   FakeAgentProcessAttachment *attachment() { return static_cast<FakeAgentProcessAttachment*>(Launcher::attachment()); }
 
   virtual bool use_agent() { return true; }
@@ -136,6 +144,7 @@ protected:
 
 private:
   tclib::def_ref_t<tclib::ServerChannel> agent_channel_;
+  SharedRingTransport transport_;
 };
 
 class NoAgentProcessAttachment : public ProcessAttachment {
@@ -251,6 +260,23 @@ public:
   // is made to do stuff that we know will fail, for testing.
   void set_silence_log(bool value) { silence_log_ = value; }
 
+  // Makes the fake agent exchange bulk payloads with the backend through
+  // shared memory rather than inline in messages.
+  void set_use_shared_memory(bool value) { use_shared_memory_ = value; }
+
+  // Makes the fake agent connect to the backend lazily, on the first call
+  // that needs it, and the launcher not wait for it before the driver runs.
+  void set_lazy_connect(bool value) { lazy_connect_ = value; }
+
+  // Makes the fake agent ask the backend for the protocol extensions that
+  // are off by default: the fast path, numeric selectors, write credits,
+  // streamed writes, utf-8 text and compact values.
+  void set_use_wire_extensions(bool value) { use_wire_extensions_ = value; }
+
+  // Makes the launcher serve the agent on the given event loop instead of
+  // the manager running the agent monitor on a thread of its own.
+  void set_event_loop(AgentEventLoop *loop) { loop_ = loop; }
+
   Launcher *operator->() { return launcher(); }
 
   // Sets the backend to eventually pass to the launcher once it's been created.
@@ -269,6 +295,10 @@ private:
   bool has_started_agent_monitor_;
 
   bool silence_log_;
+  bool use_shared_memory_;
+  bool lazy_connect_;
+  bool use_wire_extensions_;
+  AgentEventLoop *loop_;
   plankton::rpc::TracingMessageSocketObserver tracer_;
   utf8_t agent_path_;
   utf8_t agent_path();
@@ -282,6 +312,16 @@ private:
   static utf8_t default_agent_path();
 };
 
+// Helper class that takes care of joining drivers if they are started properly.
+class DriverManagerJoiner {
+public:
+  DriverManagerJoiner() : manager_(NULL) { }
+  ~DriverManagerJoiner();
+  void set_driver(DriverManager *manager) { manager_ = manager; }
+private:
+  DriverManager *manager_;
+};
+
 } // namespace conprx
 
 #endif // _CONPRX_DRIVER_MANAGER_HH
@@ -474,12 +474,56 @@ public:
   virtual fat_bool_t uninstall_agent_platform() { return F_TRUE; }
 
   void set_adaptor(ConsoleAdaptor *adaptor) { adaptor_ = adaptor; }
+
+  // Turns on the options for the protocol extensions that are off by default.
+  void enable_wire_extensions();
   virtual ConsoleAdaptor *adaptor() { return adaptor_; }
 
+protected:
+  // Points the adaptor, if there is one, at the owner now that there is a
+  // connection to it.
+  virtual fat_bool_t on_connected();
+
 private:
   ConsoleAdaptor *adaptor_;
+  def_ref_t<ConsoleConnector> connector_;
 };
 
+void FakeConsoleAgent::enable_wire_extensions() {
+  options()->set_fast_path(true);
+  options()->set_numeric_selectors(true);
+  options()->set_write_credits(true);
+  options()->set_stream_chunk_bytes(65536);
+  options()->set_utf8_wire(true);
+  options()->set_compact_values(true);
+}
+
+fat_bool_t FakeConsoleAgent::on_connected() {
+  if (adaptor_ == NULL)
+    return F_TRUE;
+  PrpcConsoleConnector *prpc = new (kDefaultAlloc) PrpcConsoleConnector(
+      owner()->socket(), owner()->input());
+  prpc->share_socket(owner_mutex());
+  prpc->set_transport(transport());
+  if (use_fast_path())
+    prpc->enable_fast_path();
+  if (use_numeric_selectors())
+    prpc->enable_numeric_selectors();
+  if (write_credits() > 0)
+    prpc->enable_write_credits(write_credits());
+  if (use_write_streaming())
+    prpc->enable_write_streaming(options()->stream_chunk_bytes());
+  if (use_utf8_wire())
+    prpc->enable_utf8_wire();
+  if (use_compact_values())
+    prpc->enable_compact_values();
+  connector_ = prpc;
+  adaptor_->set_connector(*connector_);
+  if (transport() != NULL)
+    adaptor_->set_state_page(transport()->state_page());
+  return F_TRUE;
+}
+
 // A log that ignores everything.
 class SilentLog : public Log {
 public:
@@ -528,7 +572,20 @@ private:
   // Returns the fake agent channel or NULL if there is none.
   ClientChannel *fake_agent_channel() { return *fake_agent_channel_; }
   bool use_fake_agent() { return !string_is_empty(fake_agent_channel_name_); }
+  // Name and size of the shared memory the fake agent should use for bulk
+  // payloads. Empty if it should send everything through the channel.
+  utf8_t fake_agent_shared_memory_name_;
+  size_t fake_agent_shared_memory_size_;
+  SharedRingTransport fake_agent_transport_;
+  // Should the fake agent put off connecting until it's first needed?
+  bool fake_agent_lazy_;
+  // Should the fake agent ask for the protocol extensions?
+  bool fake_agent_wire_extensions_;
   def_ref_t<FakeConsoleAgent> fake_agent_;
+  // The adaptor the fake agent uses with the simulating frontend. It's created
+  // before the agent is installed and gets its connector once the agent has
+  // connected, which may be later.
+  def_ref_t<ConsoleAdaptor> fake_adaptor_;
   FakeConsoleAgent *fake_agent() { return *fake_agent_; }
   def_ref_t<ConsolePlatform> platform_;
   InMemoryConsolePlatform *fake_platform_;
@@ -540,6 +597,10 @@ ConsoleDriverMain::ConsoleDriverMain()
   , frontend_type_(dfDummy)
   , port_delta_(0)
   , fake_agent_channel_name_(string_empty())
+  , fake_agent_shared_memory_name_(string_empty())
+  , fake_agent_shared_memory_size_(0)
+  , fake_agent_lazy_(false)
+  , fake_agent_wire_extensions_(false)
   , fake_platform_(NULL) { }
 
 fat_bool_t ConsoleDriverMain::parse_args(int argc, const char **argv) {
@@ -564,6 +625,16 @@ fat_bool_t ConsoleDriverMain::parse_args(int argc, const char **argv) {
   if (fake_agent_channel != NULL)
     fake_agent_channel_name_ = new_c_string(fake_agent_channel);
 
+  const char *shared_memory = cmdline->option("fake-agent-shared-memory").string_chars();
+  if (shared_memory != NULL) {
+    fake_agent_shared_memory_name_ = new_c_string(shared_memory);
+    Variant size = cmdline->option("fake-agent-shared-memory-size");
+    fake_agent_shared_memory_size_ = static_cast<size_t>(size.integer_value());
+  }
+
+  fake_agent_lazy_ = cmdline->option("fake-agent-lazy").bool_value(false);
+  fake_agent_wire_extensions_ = cmdline->option("fake-agent-wire-extensions").bool_value(false);
+
   Variant frontend_type = cmdline->option("frontend-type");
   if (frontend_type == Variant::string("native"))
     frontend_type_ = dfNative;
@@ -583,6 +654,18 @@ fat_bool_t ConsoleDriverMain::open_connection() {
     silent_log_.ensure_installed();
   if (use_fake_agent()) {
     fake_agent_ = new (kDefaultAlloc) FakeConsoleAgent();
+    if (!string_is_empty(fake_agent_shared_memory_name_)) {
+      F_TRY(fake_agent_transport_.open(fake_agent_shared_memory_name_.chars,
+          fake_agent_shared_memory_size_));
+      fake_agent()->set_transport(&fake_agent_transport_);
+    }
+    fake_agent()->set_lazy_connect(fake_agent_lazy_);
+    if (fake_agent_wire_extensions_)
+      fake_agent()->enable_wire_extensions();
+    if (frontend_type_ == dfSimulating) {
+      fake_adaptor_ = new (kDefaultAlloc) ConsoleAdaptor(NULL);
+      fake_agent()->set_adaptor(*fake_adaptor_);
+    }
     pass_def_ref_t<InMemoryConsolePlatform> platform = InMemoryConsolePlatform::new_simulating(fake_agent());
     platform_ = platform;
     fake_platform_ = platform.peek();
@@ -613,8 +696,6 @@ fat_bool_t ConsoleDriverMain::run() {
   rpc::StreamServiceConnector connector(channel()->in(), channel()->out());
   connector.set_default_type_registry(ConsoleTypes::registry());
   def_ref_t<ConsoleFrontend> frontend;
-  def_ref_t<ConsoleConnector> conconn;
-  def_ref_t<ConsoleAdaptor> condapt;
   switch (frontend_type_) {
     case dfNative:
       CHECK_TRUE("native frontend not supported", kIsMsvc);
@@ -626,14 +707,11 @@ fat_bool_t ConsoleDriverMain::run() {
     case dfDummy:
       frontend = ConsoleFrontend::new_dummy();
       break;
-    case dfSimulating:
+    case dfSimulating: {
       CHECK_TRUE("fake agent required", use_fake_agent());
-      conconn = PrpcConsoleConnector::create(fake_agent()->owner()->socket(),
-          fake_agent()->owner()->input());
-      condapt = new (kDefaultAlloc) ConsoleAdaptor(*conconn);
-      fake_agent()->set_adaptor(*condapt);
       frontend = ConsoleFrontend::new_simulating(fake_agent(), fake_platform_, port_delta_);
       break;
+    }
   }
   ConsoleFrontendService driver(*frontend, *platform_);
   F_TRY(driver.initialize());
@@ -0,0 +1,37 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "evloop-utils.hh"
+
+using namespace conprx;
+using namespace plankton;
+using namespace tclib;
+
+fat_bool_t FakeAgentAttachment::open() {
+  F_TRY(initialize());
+  F_TRY(up_.open(NativePipe::pfDefault));
+  F_TRY(down_.open(NativePipe::pfDefault));
+  set_backend(&backend_);
+  F_TRY(attach_agent_service());
+  fake_agent_ = new (kDefaultAlloc) rpc::StreamServiceConnector(down_.in(),
+      up_.out());
+  fake_agent_->set_default_type_registry(ConsoleTypes::registry());
+  return fake_agent_->init(empty_callback());
+}
+
+rpc::IncomingResponse FakeAgentAttachment::send_poke(int64_t value) {
+  Variant arg = Variant::integer(value);
+  rpc::OutgoingRequest req(Variant::null(), "poke", 1, &arg);
+  return fake_agent_->socket()->send_request(&req);
+}
+
+rpc::IncomingResponse FakeAgentAttachment::send_is_done() {
+  rpc::OutgoingRequest req(Variant::null(), "is_done");
+  return fake_agent_->socket()->send_request(&req);
+}
+
+fat_bool_t FakeAgentAttachment::await(rpc::IncomingResponse resp) {
+  while (!resp->is_settled())
+    F_TRY(fake_agent_->input()->process_next_instruction(NULL));
+  return F_BOOL(resp->is_fulfilled());
+}
@@ -0,0 +1,49 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#ifndef _CONPRX_EVLOOP_UTILS_HH
+#define _CONPRX_EVLOOP_UTILS_HH
+
+#include "rpc.hh"
+#include "server/evloop.hh"
+#include "server/launch.hh"
+#include "sync/pipe.hh"
+
+namespace conprx {
+
+// An attachment whose agent is faked by a connector in this process that
+// talks to it through a pair of pipes, like the real one would.
+class FakeAgentAttachment : public ProcessAttachment {
+public:
+  FakeAgentAttachment() : ProcessAttachment(NULL, NULL) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  virtual tclib::InStream *owner_in() { return up_.in(); }
+  virtual tclib::OutStream *owner_out() { return down_.out(); }
+
+  // Opens the pipes and connects both ends.
+  fat_bool_t open();
+
+  // Sends a poke from the agent without waiting for the response.
+  plankton::rpc::IncomingResponse send_poke(int64_t value);
+
+  // Tells the owner the agent is done.
+  plankton::rpc::IncomingResponse send_is_done();
+
+  // Processes messages on the agent's side until the response has arrived.
+  fat_bool_t await(plankton::rpc::IncomingResponse resp);
+
+  // Closes the agent's end of the connection as if it had crashed.
+  fat_bool_t hang_up() { return F_BOOL(up_.out()->close()); }
+
+  BasicConsoleBackend *fake_backend() { return &backend_; }
+
+private:
+  tclib::NativePipe up_;
+  tclib::NativePipe down_;
+  BasicConsoleBackend backend_;
+  tclib::def_ref_t<plankton::rpc::StreamServiceConnector> fake_agent_;
+};
+
+} // namespace conprx
+
+#endif // _CONPRX_EVLOOP_UTILS_HH
@@ -7,6 +7,7 @@
 #include "utils/string.hh"
 
 BEGIN_C_INCLUDES
+#include "utils/log.h"
 #include "utils/misc-inl.h"
 #include "utils/strbuf.h"
 #include "utils/string-inl.h"
@@ -20,22 +21,6 @@ using namespace conprx;
 // the simulated one.
 #define AGENT_TEST(NAME) MULTITEST(agent, NAME, bool, use_real, ("real", true), ("simul", false))
 
-// Helper class that takes care of joining drivers if they are started properly.
-class DriverManagerJoiner {
-public:
-  DriverManagerJoiner() : manager_(NULL) { }
-  ~DriverManagerJoiner();
-  void set_driver(DriverManager *manager) { manager_ = manager; }
-private:
-  DriverManager *manager_;
-};
-
-DriverManagerJoiner::~DriverManagerJoiner() {
-  if (manager_ == NULL)
-    return;
-  ASSERT_F_TRUE(manager_->join(NULL));
-}
-
 // Initializes the driver to use for this agent test.
 #define AGENT_TEST_PREAMBLE(BACKEND, USE_REAL)                                 \
     if ((USE_REAL) && !DriverManager::kSupportsRealAgent)                      \
@@ -57,6 +42,7 @@ static void configure_driver(DriverManager *driver, bool use_real) {
   } else {
     driver->set_agent_type(DriverManager::atFake);
     driver->set_frontend_type(dfSimulating);
+    driver->set_use_wire_extensions(true);
   }
 }
 
@@ -122,6 +108,32 @@ TEST(agent, simulate_roundtrip) {
   ASSERT_F_TRUE(driver.join(NULL));
 }
 
+TEST(agent, event_loop) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  // The loop has to outlive the driver since it serves the agent until the
+  // driver is joined.
+  AgentEventLoop loop(1);
+  ASSERT_F_TRUE(loop.start());
+  DriverManager driver;
+  driver.set_agent_type(DriverManager::atFake);
+  driver.set_frontend_type(dfSimulating);
+  driver.set_event_loop(&loop);
+  PokeCounter counter;
+  driver.set_backend(&counter);
+  ASSERT_F_TRUE(driver.start());
+  ASSERT_F_TRUE(driver.connect());
+  ASSERT_EQ(1, loop.source_count());
+
+  DriverRequest poke0 = driver.poke_backend(3423);
+  ASSERT_EQ(3423 + 257, poke0->integer_value());
+  ASSERT_EQ(1, counter.poke_count);
+
+  ASSERT_F_TRUE(driver.join(NULL));
+  loop.wait_idle();
+  ASSERT_EQ(0, loop.failure_count());
+}
+
 class CodePageBackend : public BasicConsoleBackend {
 public:
   virtual response_t<uint32_t> get_console_cp(bool is_output);
@@ -156,6 +168,36 @@ AGENT_TEST(native_get_cp) {
   ASSERT_EQ(123, static_cast<int32_t>(cp2.error().native_as<ConsoleError>()->code()));
 }
 
+// A lazy agent is served by the launcher itself, both if it connects once a
+// call needs the backend and if it never does.
+MULTITEST(agent, lazy_monitor, bool, use_console, ("used", true),
+    ("unused", false)) {
+  CodePageBackend backend;
+  backend.input = response_t<uint32_t>::of(7431);
+  DriverManager driver;
+  driver.set_agent_type(DriverManager::atFake);
+  driver.set_frontend_type(dfSimulating);
+  driver.set_lazy_connect(true);
+  driver.set_backend(&backend);
+  ASSERT_F_TRUE(driver.start());
+  ASSERT_F_TRUE(driver.connect());
+  ASSERT_TRUE(driver->is_monitoring_agent());
+
+  DriverRequest echo0 = driver.echo(8543);
+  ASSERT_EQ(8543, echo0->integer_value());
+  ASSERT_FALSE(driver->attachment()->agent_is_ready());
+  if (use_console) {
+    DriverRequest cp0 = driver.get_console_cp();
+    ASSERT_EQ(7431, cp0->integer_value());
+    ASSERT_TRUE(driver->attachment()->agent_is_ready());
+  }
+
+  // Either way the agent says it's done as the driver exits so the launcher's
+  // monitor winds down.
+  ASSERT_F_TRUE(driver.join(NULL));
+  ASSERT_FALSE(driver->is_monitoring_agent());
+}
+
 AGENT_TEST(native_set_cp) {
   CodePageBackend backend;
   AGENT_TEST_PREAMBLE(&backend, use_real);
@@ -195,7 +237,7 @@ public:
   TitleBackend() : is_unicode(false) { }
   ~TitleBackend();
   virtual response_t<bool_t> set_console_title(tclib::Blob title, bool is_unicode);
-  virtual response_t<uint32_t> get_console_title(tclib::Blob buffer, bool is_unicode,
+  virtual response_t<uint32_t> get_console_title(ResponseBuffer *buffer, bool is_unicode,
       size_t *bytes_written_out);
   void set_title(ansi_cstr_t new_title);
   void set_title(wide_cstr_t new_title);
@@ -234,9 +276,12 @@ response_t<bool_t> TitleBackend::set_console_title(tclib::Blob new_title, bool n
   return response_t<bool_t>::yes();
 }
 
-response_t<uint32_t> TitleBackend::get_console_title(tclib::Blob buffer, bool is_unicode,
+response_t<uint32_t> TitleBackend::get_console_title(ResponseBuffer *output, bool is_unicode,
     size_t *bytes_written_out) {
-  uint32_t len = static_cast<uint32_t>(min_size(buffer.size(), title.size()));
+  uint32_t len = static_cast<uint32_t>(min_size(output->capacity(), title.size()));
+  tclib::Blob buffer;
+  if (!output->reserve(len, &buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
   tclib::Blob data(title.start(), len);
   blob_copy_to(data, buffer);
   *bytes_written_out = len;
@@ -509,6 +554,62 @@ AGENT_TEST(write_console_aw) {
   }
 }
 
+// Backend that just counts and checks what gets written to it.
+class LargeWriteBackend : public BasicConsoleBackend {
+public:
+  LargeWriteBackend() : bytes_written(0), mismatches(0) { }
+  response_t<uint32_t> write_console(Handle output, tclib::Blob data, bool is_unicode);
+  tclib::Blob expected;
+  uint64_t bytes_written;
+  size_t mismatches;
+};
+
+response_t<uint32_t> LargeWriteBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  if (data.size() != expected.size()
+      || memcmp(data.start(), expected.start(), data.size()) != 0)
+    mismatches++;
+  bytes_written += data.size();
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+// Large payloads arrive intact whether they go through the pipe or through
+// shared memory. How fast they get there is measured by the benchmark of the
+// same name.
+MULTITEST(agent, large_writes, bool, use_shared_memory, ("shm", true),
+    ("pipe", false)) {
+  LargeWriteBackend backend;
+  DriverManager driver;
+  DriverManagerJoiner joiner;
+  driver.set_agent_type(DriverManager::atFake);
+  driver.set_frontend_type(dfSimulating);
+  driver.set_use_shared_memory(use_shared_memory);
+  driver.set_use_wire_extensions(true);
+  driver.set_backend(&backend);
+  ASSERT_F_TRUE(driver.start());
+  ASSERT_F_TRUE(driver.connect());
+  joiner.set_driver(&driver);
+
+  DriverRequest gsh0 = driver.get_std_handle(conprx::kStdOutputHandle);
+  Handle output = *gsh0->native_as<Handle>();
+
+  static const size_t kChunkSize = 16384;
+  static const size_t kChunkCount = 4;
+  // Static so it isn't on the stack, and isn't leaked if an assert fails.
+  static ansi_char_t chunk[kChunkSize];
+  for (size_t i = 0; i < kChunkSize; i++)
+    chunk[i] = static_cast<ansi_char_t>('a' + (i % 26));
+  tclib::Blob data(chunk, kChunkSize);
+  backend.expected = data;
+
+  for (size_t i = 0; i < kChunkCount; i++) {
+    DriverRequest wca0 = driver.write_console_a(output, data);
+    ASSERT_EQ(kChunkSize, wca0->integer_value());
+  }
+  ASSERT_EQ(kChunkSize * kChunkCount, backend.bytes_written);
+  ASSERT_EQ(0, backend.mismatches);
+}
+
 class ReadConsoleBackend : public BasicConsoleBackend {
 public:
   ReadConsoleBackend()
@@ -518,7 +619,7 @@ public:
     , control_key_state(0) { }
 
   ~ReadConsoleBackend() { ucs16_default_delete(contents); }
-  response_t<uint32_t> read_console(Handle output, tclib::Blob buffer,
+  response_t<uint32_t> read_console(Handle output, ResponseBuffer *buffer,
       bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control);
 
   void set_contents(const char *str) {
@@ -534,13 +635,16 @@ public:
 };
 
 response_t<uint32_t> ReadConsoleBackend::read_console(Handle output,
-    tclib::Blob buffer, bool is_unicode, size_t *bytes_read_out,
+    ResponseBuffer *buffer, bool is_unicode, size_t *bytes_read_out,
     ReadConsoleControl *input_control) {
-  last_request_size = buffer.size();
+  last_request_size = buffer->capacity();
   last_is_unicode = is_unicode;
   last_control = *input_control;
   input_control->set_control_key_state(control_key_state);
-  size_t read = ucs16_to_blob(contents, buffer, is_unicode);
+  tclib::Blob memory;
+  if (!buffer->reserve(contents.length * StringUtils::char_size(is_unicode), &memory))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  size_t read = ucs16_to_blob(contents, memory, is_unicode);
   *bytes_read_out = read;
   return response_t<uint32_t>::of(static_cast<uint32_t>(read));
 }
@@ -729,12 +833,12 @@ public:
   response_t<int64_t> poke(int64_t value) { return fail<int64_t>(); }
   response_t<uint32_t> get_console_cp(bool is_output) { return fail<uint32_t>(); }
   response_t<bool_t> set_console_cp(uint32_t value, bool is_output) { return fail<bool_t>(); }
-  response_t<uint32_t> get_console_title(tclib::Blob buffer, bool is_unicode, size_t *bytes_written_out) { return fail<uint32_t>(); }
+  response_t<uint32_t> get_console_title(ResponseBuffer *buffer, bool is_unicode, size_t *bytes_written_out) { return fail<uint32_t>(); }
   response_t<bool_t> set_console_title(tclib::Blob title, bool is_unicode) { return fail<bool_t>(); }
   response_t<bool_t> set_console_mode(Handle handle, uint32_t mode) { return fail<bool_t>(); }
   response_t<bool_t> get_console_screen_buffer_info(Handle buffer, ScreenBufferInfo *info_out) { return fail<bool_t>(); }
   response_t<uint32_t> write_console(Handle output, tclib::Blob data, bool is_unicode) { return fail<uint32_t>(); }
-  response_t<uint32_t> read_console(Handle output, tclib::Blob buffer, bool is_unicode, size_t *bytes_read, ReadConsoleControl *input_control) { return fail<uint32_t>(); }
+  response_t<uint32_t> read_console(Handle output, ResponseBuffer *buffer, bool is_unicode, size_t *bytes_read, ReadConsoleControl *input_control) { return fail<uint32_t>(); }
   response_t<bool_t> set_console_cursor_position(Handle output, coord_t position) { return fail<bool_t>(); }
   response_t<bool_t> create_process(NativeProcessHandle *process, ConsoleBackendContext *context) { return fail<bool_t>(); }
 
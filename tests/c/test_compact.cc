@@ -0,0 +1,238 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/compact.hh"
+#include "test/asserts.hh"
+#include "test/unittest.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/string-inl.h"
+END_C_INCLUDES
+
+using namespace conprx;
+using namespace plankton;
+
+// Encodes the given value and decodes it again into value_out. Returns the
+// size of the encoding, or 0 if anything went wrong. The buffer is static so
+// decoded log entries that point into it stay valid after returning.
+template <typename T>
+static size_t round_trip(T *value, T *value_out) {
+  static uint8_t buffer[128];
+  size_t size = CompactCodec::size(value);
+  if (size > sizeof(buffer) || CompactCodec::encode(value, buffer) != size)
+    return 0;
+  bool decoded = CompactCodec::decode(Variant::blob(buffer,
+      static_cast<uint32_t>(size)), value_out);
+  return decoded ? size : 0;
+}
+
+TEST(compact, handle) {
+  Handle in(0x1234567890ABLL);
+  Handle out;
+  ASSERT_EQ(9, round_trip(&in, &out));
+  ASSERT_EQ(0x1234567890ABLL, out.id());
+  Handle invalid = Handle::invalid();
+  ASSERT_EQ(9, round_trip(&invalid, &out));
+  ASSERT_FALSE(out.is_valid());
+}
+
+TEST(compact, coord_and_rect) {
+  coord_t coord = coord_new(-3, 0x7FFF);
+  coord_t coord_out = coord_new(0, 0);
+  ASSERT_EQ(5, round_trip(&coord, &coord_out));
+  ASSERT_EQ(-3, coord_out.X);
+  ASSERT_EQ(0x7FFF, coord_out.Y);
+
+  small_rect_t rect = small_rect_new(1, -2, 300, -400);
+  small_rect_t rect_out = small_rect_new(0, 0, 0, 0);
+  ASSERT_EQ(9, round_trip(&rect, &rect_out));
+  ASSERT_EQ(1, rect_out.Left);
+  ASSERT_EQ(-2, rect_out.Top);
+  ASSERT_EQ(300, rect_out.Right);
+  ASSERT_EQ(-400, rect_out.Bottom);
+}
+
+TEST(compact, screen_buffer_info) {
+  ScreenBufferInfo info;
+  info.set_size(coord_new(80, 25));
+  info.set_cursor_position(coord_new(4, 5));
+  info.set_attributes(0x1F);
+  info.set_window(small_rect_new(0, 1, 79, 24));
+  info.set_maximum_window_size(coord_new(120, 50));
+  info.set_popup_attributes(0xF5);
+  info.set_fullscreen_supported(true);
+  for (size_t i = 0; i < 16; i++)
+    info.raw()->ColorTable[i] = static_cast<colorref_t>(0x0DECADE0 + i);
+  ScreenBufferInfo out;
+  ASSERT_EQ(1 + 22 + 2 + 1 + 64, round_trip(info.raw(), out.raw()));
+  ASSERT_EQ(0, memcmp(info.raw(), out.raw(), sizeof(*info.raw())));
+
+  // The color table is packed little-endian whatever the host's byte order.
+  uint8_t encoded[128];
+  ASSERT_EQ(90, CompactCodec::encode(info.raw(), encoded));
+  ASSERT_EQ(0xE0, encoded[26]);
+  ASSERT_EQ(0xAD, encoded[27]);
+  ASSERT_EQ(0xEC, encoded[28]);
+  ASSERT_EQ(0x0D, encoded[29]);
+  ASSERT_EQ(0xEF, encoded[86]);
+
+  // The non-extended struct is a prefix of the extended one.
+  console_screen_buffer_info_t plain;
+  ASSERT_EQ(23, round_trip(console_screen_buffer_info_from_ex(info.raw()), &plain));
+  ASSERT_EQ(80, plain.dwSize.X);
+  ASSERT_EQ(5, plain.dwCursorPosition.Y);
+  ASSERT_EQ(0x1F, plain.wAttributes);
+  ASSERT_EQ(24, plain.srWindow.Bottom);
+  ASSERT_EQ(120, plain.dwMaximumWindowSize.X);
+}
+
+TEST(compact, readconsole_control_and_process) {
+  ReadConsoleControl control;
+  control.set_initial_chars(3);
+  control.set_ctrl_wakeup_mask(1 << 9);
+  control.set_control_key_state(0x10);
+  ReadConsoleControl control_out;
+  ASSERT_EQ(13, round_trip(control.raw(), control_out.raw()));
+  ASSERT_EQ(sizeof(*control.raw()), control_out.raw()->nLength);
+  ASSERT_EQ(3, control_out.initial_chars());
+  ASSERT_EQ(1 << 9, control_out.ctrl_wakeup_mask());
+  ASSERT_EQ(0x10, control_out.control_key_state());
+
+  NativeProcessInfo process(4321);
+  NativeProcessInfo process_out(0);
+  ASSERT_EQ(9, round_trip(&process, &process_out));
+  ASSERT_EQ(4321, process_out.id());
+}
+
+TEST(compact, log_entry) {
+  log_entry_t raw;
+  log_entry_default_init(&raw, llWarning, "file.cc", 812, new_c_string("Hey!"),
+      new_c_string("12:34"));
+  LogEntry entry(&raw);
+  LogEntry out;
+  ASSERT_EQ(1 + 8 + 12 + 9 + 10, round_trip(&entry, &out));
+  log_entry_t *decoded = out.as_struct();
+  ASSERT_EQ(llWarning, decoded->level);
+  ASSERT_EQ(812, decoded->line);
+  ASSERT_C_STREQ("file.cc", decoded->file);
+  ASSERT_C_STREQ("Hey!", decoded->message.chars);
+  ASSERT_EQ(4, decoded->message.size);
+  ASSERT_C_STREQ("12:34", decoded->timestamp.chars);
+
+  // Entries don't always have a file.
+  log_entry_default_init(&raw, llInfo, NULL, 0, new_c_string("x"),
+      new_c_string(""));
+  LogEntry anonymous(&raw);
+  ASSERT_EQ(1 + 8 + 4 + 6 + 5, round_trip(&anonymous, &out));
+  ASSERT_TRUE(out.as_struct()->file == NULL);
+  ASSERT_C_STREQ("x", out.as_struct()->message.chars);
+}
+
+TEST(compact, log_batch) {
+  CompactLogBatch::entry_t in[2] = {
+    {llWarning, 812, 1234567890123456789ULL, "file.cc", "Hey!", 4},
+    {llInfo, 0, 0, NULL, "", 0}
+  };
+  uint8_t buffer[128];
+  size_t size = CompactLogBatch::kHeaderSize
+      + CompactLogBatch::entry_size(&in[0]) + CompactLogBatch::entry_size(&in[1]);
+  ASSERT_EQ(13 + (16 + 12 + 9) + (16 + 4 + 5), size);
+  ASSERT_EQ(CompactLogBatch::kMinEntrySize, CompactLogBatch::entry_size(&in[1]));
+  CompactWriter writer(buffer);
+  CompactLogBatch::write_header(2, 17, &writer);
+  CompactLogBatch::write_entry(&in[0], &writer);
+  CompactLogBatch::write_entry(&in[1], &writer);
+  ASSERT_EQ(size, writer.size());
+
+  CompactReader reader(buffer, size);
+  uint32_t entry_count = 0;
+  uint64_t dropped_count = 0;
+  ASSERT_TRUE(CompactLogBatch::read_header(&reader, &entry_count, &dropped_count));
+  ASSERT_EQ(2, entry_count);
+  ASSERT_EQ(17, dropped_count);
+  CompactLogBatch::entry_t out;
+  CompactLogBatch::read_entry(&reader, &out);
+  ASSERT_EQ(llWarning, out.level);
+  ASSERT_EQ(812, out.line);
+  ASSERT_EQ(1234567890123456789ULL, out.timestamp_nanos);
+  ASSERT_C_STREQ("file.cc", out.file);
+  ASSERT_C_STREQ("Hey!", out.message);
+  ASSERT_EQ(4, out.message_size);
+  CompactLogBatch::read_entry(&reader, &out);
+  ASSERT_TRUE(out.file == NULL);
+  ASSERT_EQ(0, out.message_size);
+  ASSERT_TRUE(reader.is_complete());
+
+  // Single values aren't batches.
+  buffer[0] = ctLogEntry;
+  CompactReader other(buffer, size);
+  ASSERT_FALSE(CompactLogBatch::read_header(&other, &entry_count, &dropped_count));
+
+  char timestamp[CompactLogBatch::kMaxTimestampSize];
+  CompactLogBatch::format_timestamp(1234567890123456789ULL, timestamp,
+      sizeof(timestamp));
+  ASSERT_C_STREQ("2009-02-13 23:31:30.123456", timestamp);
+}
+
+TEST(compact, seed_fallback) {
+  // Values that arrive as seeds decode the same way as compact ones.
+  coord_t coord = coord_new(7, 8);
+  coord_t coord_out = coord_new(0, 0);
+  ASSERT_TRUE(CompactCodec::decode(NativeVariant(&coord), &coord_out));
+  ASSERT_EQ(7, coord_out.X);
+  ASSERT_EQ(8, coord_out.Y);
+
+  Handle handle(0x1b);
+  WireValue<Handle> seed(&handle, false);
+  ASSERT_FALSE(seed.variant().is_blob());
+  WireValue<Handle> compact(&handle, true);
+  ASSERT_TRUE(compact.variant().is_blob());
+  ASSERT_EQ(9, compact.variant().blob_size());
+  Handle from_seed;
+  Handle from_compact;
+  ASSERT_TRUE(CompactCodec::decode(seed.variant(), &from_seed));
+  ASSERT_TRUE(CompactCodec::decode(compact.variant(), &from_compact));
+  ASSERT_EQ(0x1b, from_seed.id());
+  ASSERT_EQ(0x1b, from_compact.id());
+
+  // Anything else is rejected.
+  ASSERT_FALSE(CompactCodec::decode(Variant::integer(0x1b), &from_seed));
+  ASSERT_FALSE(CompactCodec::decode(Variant::null(), &from_seed));
+}
+
+TEST(compact, invalid) {
+  Handle handle(0x1b);
+  uint8_t buffer[16];
+  size_t size = CompactCodec::encode(&handle, buffer);
+  Handle out;
+  coord_t coord;
+  // The wrong tag.
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(buffer,
+      static_cast<uint32_t>(size)), &coord));
+  // Too short and too long.
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(buffer,
+      static_cast<uint32_t>(size - 1)), &out));
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(buffer,
+      static_cast<uint32_t>(size + 1)), &out));
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(buffer, 0), &out));
+
+  // A log entry whose string lengths don't match the data.
+  log_entry_t raw;
+  log_entry_default_init(&raw, llInfo, "a.cc", 1, new_c_string("bc"),
+      new_c_string("d"));
+  LogEntry entry(&raw);
+  uint8_t log_buffer[64];
+  size_t log_size = CompactCodec::encode(&entry, log_buffer);
+  LogEntry log_out;
+  // The file's length is right after the tag, level, and line.
+  log_buffer[9] = 200;
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(log_buffer,
+      static_cast<uint32_t>(log_size)), &log_out));
+  log_buffer[9] = 3;
+  ASSERT_FALSE(CompactCodec::decode(Variant::blob(log_buffer,
+      static_cast<uint32_t>(log_size)), &log_out));
+  log_buffer[9] = 4;
+  ASSERT_TRUE(CompactCodec::decode(Variant::blob(log_buffer,
+      static_cast<uint32_t>(log_size)), &log_out));
+}
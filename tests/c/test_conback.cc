@@ -7,6 +7,7 @@
 #include "conback-utils.hh"
 
 BEGIN_C_INCLUDES
+#include "utils/log.h"
 #include "utils/string-inl.h"
 #include "utils/strbuf.h"
 END_C_INCLUDES
@@ -224,3 +225,1282 @@ CONBACK_TEST(conback, title_aw_complete) {
   for (size_t i = 0; i < 256; i++)
     ASSERT_EQ(all_chars[i], ansi_chars[i]);
 }
+
+// Backend that keeps track of the writes it receives.
+class WriteRecordingBackend : public BasicConsoleBackend {
+public:
+  WriteRecordingBackend() : write_count_(0), last_size_(0), last_is_unicode_(false) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  size_t write_count_;
+  size_t last_size_;
+  bool last_is_unicode_;
+};
+
+response_t<uint32_t> WriteRecordingBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  write_count_++;
+  last_size_ = data.size();
+  last_is_unicode_ = is_unicode;
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+TEST(conback, coalesce_writes) {
+  WriteRecordingBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_write_coalescing(16, 0));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+  handle_t error = frontend.platform()->get_std_handle(kStdErrorHandle);
+
+  // Small writes to the same handle are held back and merged.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_TRUE(frontend->write_console_a(output, "defg", 4, &written, NULL));
+  ASSERT_EQ(4, written);
+  ASSERT_EQ(0, backend.write_count_);
+
+  // Any other call flushes the pending writes first.
+  ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+  ASSERT_EQ(1, backend.write_count_);
+  ASSERT_EQ(7, backend.last_size_);
+
+  // Changing handle or encoding flushes.
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_a(error, "abc", 3, &written, NULL));
+  ASSERT_EQ(2, backend.write_count_);
+  ASSERT_EQ(3, backend.last_size_);
+  const wide_char_t wide[3] = {'x', 'y', 0};
+  ASSERT_TRUE(frontend->write_console_w(error, wide, 2, &written, NULL));
+  ASSERT_EQ(2, written);
+  ASSERT_EQ(3, backend.write_count_);
+  ASSERT_FALSE(backend.last_is_unicode_);
+
+  // Filling the buffer flushes immediately.
+  ASSERT_TRUE(frontend->write_console_w(error, wide, 2, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_w(error, wide, 2, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_w(error, wide, 2, &written, NULL));
+  ASSERT_EQ(4, backend.write_count_);
+  ASSERT_EQ(16, backend.last_size_);
+  ASSERT_TRUE(backend.last_is_unicode_);
+
+  // Writes too large to buffer go straight through.
+  const char *large = "0123456789abcdefghij";
+  ASSERT_TRUE(frontend->write_console_a(output, large, 20, &written, NULL));
+  ASSERT_EQ(20, written);
+  ASSERT_EQ(5, backend.write_count_);
+  ASSERT_EQ(20, backend.last_size_);
+
+  // An explicit flush sends what's left.
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_EQ(5, backend.write_count_);
+  ASSERT_FALSE(frontend.connector()->flush().has_error());
+  ASSERT_EQ(6, backend.write_count_);
+}
+
+TEST(conback, coalesce_deadline) {
+  WriteRecordingBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_write_coalescing(16, 50));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  // Held back writes are sent once the deadline set by the first of them has
+  // passed, without any further calls.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_a(output, "de", 2, &written, NULL));
+  ASSERT_EQ(0, backend.write_count_);
+  NativeThread::sleep(Duration::millis(250));
+  ASSERT_FALSE(frontend.connector()->has_pending_requests());
+  ASSERT_EQ(1, backend.write_count_);
+  ASSERT_EQ(5, backend.last_size_);
+}
+
+// Backend whose writes fail while fail_writes_ is set.
+class FailingWriteBackend : public WriteRecordingBackend {
+public:
+  FailingWriteBackend() : fail_writes_(false) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  bool fail_writes_;
+};
+
+response_t<uint32_t> FailingWriteBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  response_t<uint32_t> result = WriteRecordingBackend::write_console(output,
+      data, is_unicode);
+  return fail_writes_
+      ? response_t<uint32_t>::error(CONPRX_ERROR_WRITE_FAILED)
+      : result;
+}
+
+TEST(conback, coalesce_deferred_error) {
+  FailingWriteBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_write_coalescing(16, 0));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+  handle_t error = frontend.platform()->get_std_handle(kStdErrorHandle);
+
+  // The held back write fails when it's flushed by a write to another handle.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  backend.fail_writes_ = true;
+  ASSERT_TRUE(frontend->write_console_a(error, "xyz", 3, &written, NULL));
+  ASSERT_EQ(1, backend.write_count_);
+  backend.fail_writes_ = false;
+
+  // The next write to the same handle reports the error but its data isn't
+  // lost, it's held back like any other write.
+  ASSERT_FALSE(frontend->write_console_a(output, "defg", 4, &written, NULL));
+  ASSERT_EQ(2, backend.write_count_);
+  ASSERT_FALSE(frontend.connector()->flush().has_error());
+  ASSERT_EQ(3, backend.write_count_);
+  ASSERT_EQ(4, backend.last_size_);
+}
+
+// Backend whose cursor positioning always fails.
+class FailingPositionBackend : public WriteRecordingBackend {
+public:
+  FailingPositionBackend() : position_count_(0) { }
+  virtual response_t<bool_t> set_console_cursor_position(Handle output,
+      coord_t position);
+  size_t position_count_;
+};
+
+response_t<bool_t> FailingPositionBackend::set_console_cursor_position(
+    Handle output, coord_t position) {
+  position_count_++;
+  return response_t<bool_t>::error(CONPRX_ERROR_INVALID_ARGUMENT);
+}
+
+TEST(conback, pipelined) {
+  FailingPositionBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_pipelining(2));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+  handle_t error = frontend.platform()->get_std_handle(kStdErrorHandle);
+
+  // Pipelined calls succeed immediately, the backend doesn't see them yet.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->set_console_cursor_position(output, coord_new(1, 1)));
+  ASSERT_TRUE(frontend->write_console_a(error, "abc", 3, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_EQ(0, backend.position_count_);
+  ASSERT_EQ(0, backend.write_count_);
+
+  // A synchronous call waits for everything in flight and reports the error.
+  ASSERT_EQ(0, frontend->get_console_cp());
+  ASSERT_EQ(1, backend.position_count_);
+  ASSERT_EQ(1, backend.write_count_);
+  ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+
+  // When the pipeline is full the oldest response is processed to make room;
+  // its error is reported by the next call to the same handle but doesn't
+  // affect calls to other handles. The call that reports it still gets sent.
+  ASSERT_TRUE(frontend->set_console_cursor_position(output, coord_new(1, 1)));
+  ASSERT_TRUE(frontend->write_console_a(error, "abc", 3, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_a(error, "abc", 3, &written, NULL));
+  ASSERT_EQ(2, backend.position_count_);
+  ASSERT_FALSE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_FALSE(frontend.connector()->flush().has_error());
+  ASSERT_EQ(5, backend.write_count_);
+}
+
+TEST(conback, write_credits) {
+  WriteRecordingBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_pipelining(8));
+  ASSERT_F_TRUE(frontend.connector()->enable_write_credits(8));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  // Writes are pipelined as long as there are credits for them.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_TRUE(frontend->write_console_a(output, "def", 3, &written, NULL));
+  ASSERT_EQ(0, backend.write_count_);
+  ASSERT_EQ(0, frontend.connector()->credits()->throttle_count());
+
+  // The next one doesn't fit so the agent has to wait for the backend to
+  // process some of the earlier ones, even though the pipeline has room.
+  ASSERT_TRUE(frontend->write_console_a(output, "ghi", 3, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_TRUE(backend.write_count_ >= 1);
+  ASSERT_EQ(1, frontend.connector()->credits()->throttle_count());
+
+  // A single write larger than the limit still goes through once nothing
+  // else is outstanding.
+  const char *large = "0123456789";
+  ASSERT_TRUE(frontend->write_console_a(output, large, 10, &written, NULL));
+  ASSERT_EQ(10, written);
+  ASSERT_FALSE(frontend.connector()->flush().has_error());
+  ASSERT_EQ(4, backend.write_count_);
+  ASSERT_EQ(2, frontend.connector()->credits()->throttle_count());
+
+  // The backend sees everything and how often the agent was held back.
+  ASSERT_EQ(19, frontend.service()->write_bytes_received());
+  ASSERT_EQ(2, frontend.service()->agent_throttle_count());
+}
+
+// Backend that records the writes it receives and only ever writes part of
+// those beyond a certain total.
+class StreamRecordingBackend : public WriteRecordingBackend {
+public:
+  StreamRecordingBackend() : total_(0), capacity_(0) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  size_t total_;
+  size_t capacity_;
+};
+
+response_t<uint32_t> StreamRecordingBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  WriteRecordingBackend::write_console(output, data, is_unicode);
+  size_t room = capacity_ - total_;
+  size_t size = (data.size() < room) ? data.size() : room;
+  total_ += size;
+  return response_t<uint32_t>::of(static_cast<uint32_t>(size));
+}
+
+TEST(conback, streamed_writes) {
+  StreamRecordingBackend backend;
+  backend.capacity_ = 1024;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  frontend.connector()->enable_write_streaming(8);
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  // Small writes go through in one piece.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_EQ(1, backend.write_count_);
+
+  // Large ones are written by the backend a chunk at a time and the total
+  // comes back with the last one.
+  const char *large = "0123456789abcdefghij";
+  ASSERT_TRUE(frontend->write_console_a(output, large, 20, &written, NULL));
+  ASSERT_EQ(20, written);
+  ASSERT_EQ(4, backend.write_count_);
+  ASSERT_EQ(4, backend.last_size_);
+
+  // Wide chunks are kept whole characters.
+  wide_char_t wide[10];
+  for (size_t i = 0; i < 10; i++)
+    wide[i] = static_cast<wide_char_t>('a' + i);
+  ASSERT_TRUE(frontend->write_console_w(output, wide, 10, &written, NULL));
+  ASSERT_EQ(10, written);
+  ASSERT_EQ(7, backend.write_count_);
+  ASSERT_TRUE(backend.last_is_unicode_);
+
+  // A short write in the middle ends the stream early.
+  backend.capacity_ = backend.total_ + 10;
+  ASSERT_TRUE(frontend->write_console_a(output, large, 20, &written, NULL));
+  ASSERT_EQ(10, written);
+  ASSERT_EQ(9, backend.write_count_);
+}
+
+// Backend that answers the calls that have a fast encoding without doing any
+// real work.
+class FastPathBackend : public WriteRecordingBackend {
+public:
+  FastPathBackend() : info_count_(0) { }
+  virtual response_t<bool_t> set_console_cursor_position(Handle output,
+      coord_t position);
+  virtual response_t<bool_t> get_console_screen_buffer_info(Handle buffer,
+      ScreenBufferInfo *info_out);
+  coord_t last_position_;
+  size_t info_count_;
+};
+
+response_t<bool_t> FastPathBackend::set_console_cursor_position(Handle output,
+    coord_t position) {
+  last_position_ = position;
+  return response_t<bool_t>::yes();
+}
+
+response_t<bool_t> FastPathBackend::get_console_screen_buffer_info(Handle buffer,
+    ScreenBufferInfo *info_out) {
+  info_count_++;
+  info_out->set_size(coord_new(80, 25));
+  info_out->set_cursor_position(last_position_);
+  info_out->set_attributes(0x1F);
+  return response_t<bool_t>::yes();
+}
+
+// The calls that have a fast encoding behave the same through it as through
+// the general one.
+MULTITEST(conback, fast_path, bool, use_fast_path, ("fast", true),
+    ("general", false)) {
+  FastPathBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_fast_path)
+    frontend.connector()->enable_fast_path();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(output, "abc", 3, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_EQ(1, backend.write_count_);
+  ASSERT_EQ(3, backend.last_size_);
+  ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+  ASSERT_TRUE(frontend->set_console_cursor_position(output, coord_new(4, 5)));
+  console_screen_buffer_info_t info;
+  ASSERT_TRUE(frontend->get_console_screen_buffer_info(output, &info));
+  ASSERT_EQ(80, info.dwSize.X);
+  ASSERT_EQ(25, info.dwSize.Y);
+  ASSERT_EQ(4, info.dwCursorPosition.X);
+  ASSERT_EQ(5, info.dwCursorPosition.Y);
+  ASSERT_EQ(0x1F, info.wAttributes);
+  ASSERT_EQ(1, backend.info_count_);
+}
+
+// Calls behave the same through numeric and named selectors. Pokes don't have
+// an api number so they always use the name, whichever selectors the other
+// calls use.
+MULTITEST(conback, numeric_selectors, bool, use_numeric_selectors,
+    ("numeric", true), ("named", false)) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_numeric_selectors)
+    frontend.connector()->enable_numeric_selectors();
+
+  ASSERT_TRUE(frontend->set_console_cp(cpUsAscii));
+  ASSERT_EQ(cpUsAscii, frontend->get_console_cp());
+  ASSERT_EQ(cpUtf8, frontend->get_console_output_cp());
+  ASSERT_TRUE(frontend->set_console_title_a("Numbers"));
+  char title[16];
+  ASSERT_EQ(7, frontend->get_console_title_a(title, 16));
+  ASSERT_C_STREQ("Numbers", title);
+  ASSERT_EQ(0, frontend->poke_backend(8));
+  ASSERT_EQ(8, frontend->poke_backend(9));
+}
+
+// Backend that counts the queries that reach it and describes its screen buffer
+// in its published state.
+class StatePageBackend : public FastPathBackend {
+public:
+  StatePageBackend() : cp_count_(0), title_count_(0), last_parts_(0) { }
+  virtual response_t<uint32_t> get_console_cp(bool is_output);
+  virtual response_t<uint32_t> get_console_title(ResponseBuffer *buffer,
+      bool is_unicode, size_t *bytes_written_out);
+  virtual response_t<bool_t> get_console_state(console_state_t *state,
+      uint32_t parts);
+  size_t cp_count_;
+  size_t title_count_;
+  uint32_t last_parts_;
+};
+
+response_t<uint32_t> StatePageBackend::get_console_cp(bool is_output) {
+  cp_count_++;
+  return BasicConsoleBackend::get_console_cp(is_output);
+}
+
+response_t<uint32_t> StatePageBackend::get_console_title(ResponseBuffer *buffer,
+    bool is_unicode, size_t *bytes_written_out) {
+  title_count_++;
+  return BasicConsoleBackend::get_console_title(buffer, is_unicode,
+      bytes_written_out);
+}
+
+response_t<bool_t> StatePageBackend::get_console_state(console_state_t *state,
+    uint32_t parts) {
+  last_parts_ = parts;
+  BasicConsoleBackend::get_console_state(state, parts);
+  console_handle_state_t *output = &state->handles[1];
+  output->has_screen_buffer_info = 1;
+  output->screen_buffer_info.dwSize = coord_new(80, 25);
+  output->screen_buffer_info.dwCursorPosition = last_position_;
+  output->screen_buffer_info.wAttributes = 0x1F;
+  return response_t<bool_t>::yes();
+}
+
+TEST(conback, state_page) {
+  StatePageBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  uint64_t memory[ConsoleStatePage::kSize / sizeof(uint64_t)];
+  ConsoleStatePage page;
+  page.initialize(tclib::Blob(memory, sizeof(memory)), true);
+  frontend.set_state_page(&page);
+  ConsolePlatform *platform = frontend.platform();
+  handle_t output = platform->get_std_handle(kStdOutputHandle);
+  backend.connect(platform->get_std_handle(kStdInputHandle), output,
+      platform->get_std_handle(kStdErrorHandle));
+
+  // Until something has been published queries go to the backend.
+  ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+  ASSERT_EQ(1, backend.cp_count_);
+
+  // Setting publishes the state so from then on the agent answers locally.
+  // The first time all of it is published, after that only what changed.
+  ASSERT_TRUE(frontend->set_console_cp(cpUsAscii));
+  ASSERT_EQ(spAll, backend.last_parts_);
+  for (size_t i = 0; i < 10; i++) {
+    ASSERT_EQ(cpUsAscii, frontend->get_console_cp());
+    ASSERT_EQ(cpUtf8, frontend->get_console_output_cp());
+  }
+  ASSERT_EQ(1, backend.cp_count_);
+
+  ASSERT_TRUE(frontend->set_console_cursor_position(output, coord_new(7, 8)));
+  ASSERT_EQ(spScreenBuffers, backend.last_parts_);
+  console_screen_buffer_info_t info;
+  ASSERT_TRUE(frontend->get_console_screen_buffer_info(output, &info));
+  ASSERT_EQ(80, info.dwSize.X);
+  ASSERT_EQ(7, info.dwCursorPosition.X);
+  ASSERT_EQ(8, info.dwCursorPosition.Y);
+  ASSERT_EQ(0, backend.info_count_);
+
+  // Length probes are answered locally, reading the title itself isn't.
+  ASSERT_TRUE(frontend->set_console_title_a("Local"));
+  ASSERT_EQ(spTitle, backend.last_parts_);
+  char title[16];
+  ASSERT_EQ(0, frontend->get_console_title_a(title, 0));
+  ASSERT_EQ(0, frontend->get_console_title_a(title, 3));
+  ASSERT_EQ(0, backend.title_count_);
+  ASSERT_EQ(5, frontend->get_console_title_a(title, 16));
+  ASSERT_C_STREQ("Local", title);
+  ASSERT_EQ(1, backend.title_count_);
+
+  // Once the page is invalid the backend gets asked again.
+  page.invalidate();
+  ASSERT_EQ(cpUsAscii, frontend->get_console_cp());
+  ASSERT_EQ(2, backend.cp_count_);
+}
+
+// A thread that makes a series of calls through a shared frontend.
+class MultiplexedCaller : public tclib::DefaultDestructable {
+public:
+  MultiplexedCaller(ConsoleFrontend *frontend, handle_t output, size_t count)
+    : failure_count_(0)
+    , frontend_(frontend)
+    , output_(output)
+    , count_(count)
+    , thread_(new_callback(&MultiplexedCaller::run, this)) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  opaque_t run();
+  NativeThread *thread() { return &thread_; }
+  size_t failure_count_;
+
+private:
+  ConsoleFrontend *frontend_;
+  handle_t output_;
+  size_t count_;
+  NativeThread thread_;
+};
+
+opaque_t MultiplexedCaller::run() {
+  for (size_t i = 0; i < count_; i++) {
+    dword_t written = 0;
+    if (!frontend_->write_console_a(output_, "abc", 3, &written, NULL) || written != 3)
+      failure_count_++;
+    if (frontend_->get_console_cp() != cpUtf8)
+      failure_count_++;
+  }
+  return o0();
+}
+
+TEST(conback, multiplexed_stress) {
+  WriteRecordingBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  ASSERT_F_TRUE(frontend.connector()->enable_multiplexing());
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kThreadCount = 4;
+  static const size_t kCallCount = 1000;
+  def_ref_t<MultiplexedCaller> callers[kThreadCount];
+  for (size_t i = 0; i < kThreadCount; i++)
+    callers[i] = new (kDefaultAlloc) MultiplexedCaller(frontend.frontend(),
+        output, kCallCount);
+  for (size_t i = 0; i < kThreadCount; i++)
+    ASSERT_TRUE(callers[i]->thread()->start());
+  for (size_t i = 0; i < kThreadCount; i++) {
+    opaque_t result = o0();
+    ASSERT_TRUE(callers[i]->thread()->join(&result));
+    ASSERT_EQ(0, callers[i]->failure_count_);
+  }
+  // The backend is only ever called from the demux thread so its counts are
+  // exact.
+  ASSERT_EQ(kThreadCount * kCallCount, backend.write_count_);
+}
+
+TEST(conback, scratch_pool) {
+  ScratchPool pool;
+  tclib::Blob first;
+  ASSERT_TRUE(pool.acquire(100, &first));
+  ASSERT_EQ(100, first.size());
+  ASSERT_EQ(1, pool.allocation_count());
+  pool.release(first);
+  // Anything in the same size class reuses the buffer.
+  tclib::Blob second;
+  ASSERT_TRUE(pool.acquire(ScratchPool::kMinClassSize, &second));
+  ASSERT_TRUE(first.start() == second.start());
+  ASSERT_EQ(1, pool.allocation_count());
+  ASSERT_EQ(1, pool.reuse_count());
+  // A larger size needs a new one.
+  tclib::Blob third;
+  ASSERT_TRUE(pool.acquire(ScratchPool::kMinClassSize + 1, &third));
+  ASSERT_EQ(2, pool.allocation_count());
+  pool.release(second);
+  pool.release(third);
+  tclib::Blob huge;
+  ASSERT_FALSE(pool.acquire(ScratchPool::kMinClassSize << ScratchPool::kClassCount, &huge));
+  ASSERT_EQ(1, pool.oversize_count());
+}
+
+TEST(conback, scratch_steady_state) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  backend.set_title("Steady");
+  ScratchPool *pool = frontend.service()->scratch_pool();
+  char title[64];
+  ASSERT_EQ(6, frontend->get_console_title_a(title, 64));
+  uint64_t allocated = pool->allocation_count();
+  ASSERT_TRUE(allocated > 0);
+  // Once the buffers have been allocated the same ones keep being reused.
+  for (size_t i = 0; i < 100; i++) {
+    ASSERT_EQ(6, frontend->get_console_title_a(title, 64));
+    ASSERT_C_STREQ("Steady", title);
+  }
+  ASSERT_EQ(allocated, pool->allocation_count());
+  ASSERT_TRUE(pool->reuse_count() >= 100);
+}
+
+// Backend whose input is always the same short line.
+class ShortReadBackend : public BasicConsoleBackend {
+public:
+  ShortReadBackend() : last_capacity_(0) { }
+  virtual response_t<uint32_t> read_console(Handle input, ResponseBuffer *buffer,
+      bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control);
+  size_t last_capacity_;
+};
+
+response_t<uint32_t> ShortReadBackend::read_console(Handle input,
+    ResponseBuffer *output, bool is_unicode, size_t *bytes_read_out,
+    ReadConsoleControl *input_control) {
+  last_capacity_ = output->capacity();
+  tclib::Blob buffer;
+  if (!output->reserve(3, &buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  memcpy(buffer.start(), "abc", 3);
+  *bytes_read_out = 3;
+  return response_t<uint32_t>::of(3);
+}
+
+TEST(conback, right_sized_read) {
+  ShortReadBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  handle_t input = frontend.platform()->get_std_handle(kStdInputHandle);
+  ScratchPool *pool = frontend.service()->scratch_pool();
+  // A buffer far larger than the largest scratch size class, only the bytes
+  // actually read should be allocated.
+  static const size_t kBufferSize = 256 * 1024;
+  tclib::Blob buffer = allocator_default_malloc(kBufferSize);
+  dword_t chars_read = 0;
+  ASSERT_TRUE(frontend->read_console_a(input, buffer.start(),
+      static_cast<dword_t>(kBufferSize), &chars_read, NULL));
+  ASSERT_EQ(3, chars_read);
+  ASSERT_EQ(0, memcmp("abc", buffer.start(), 3));
+  ASSERT_EQ(kBufferSize, backend.last_capacity_);
+  ASSERT_EQ(0, pool->oversize_count());
+  ASSERT_EQ(1, pool->allocation_count());
+  allocator_default_free(buffer);
+}
+
+// Backend that keeps the wide text written to it and always reads the same
+// wide line.
+class WideTextBackend : public BasicConsoleBackend {
+public:
+  WideTextBackend() : wide_bytes_(0), utf8_bytes_(0), mismatch_count_(0),
+    expected_(NULL) { }
+  virtual response_t<uint32_t> write_console(Handle output, tclib::Blob data,
+      bool is_unicode);
+  virtual response_t<uint32_t> read_console(Handle input, ResponseBuffer *buffer,
+      bool is_unicode, size_t *bytes_read_out, ReadConsoleControl *input_control);
+  size_t wide_bytes_;
+  size_t utf8_bytes_;
+  size_t mismatch_count_;
+  // If set, what the next wide write is expected to be.
+  const wide_char_t *expected_;
+};
+
+response_t<uint32_t> WideTextBackend::write_console(Handle output,
+    tclib::Blob data, bool is_unicode) {
+  wide_bytes_ += data.size();
+  if (expected_ != NULL && memcmp(expected_, data.start(), data.size()) != 0)
+    mismatch_count_++;
+  return response_t<uint32_t>::of(static_cast<uint32_t>(data.size()));
+}
+
+static const wide_char_t kWideLine[6] = {'l', 0x00e6, 's', 0x2500, 0xd83d, 0xde00};
+
+response_t<uint32_t> WideTextBackend::read_console(Handle input,
+    ResponseBuffer *output, bool is_unicode, size_t *bytes_read_out,
+    ReadConsoleControl *input_control) {
+  tclib::Blob buffer;
+  if (!output->reserve(sizeof(kWideLine), &buffer))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  memcpy(buffer.start(), kWideLine, sizeof(kWideLine));
+  *bytes_read_out = sizeof(kWideLine);
+  return response_t<uint32_t>::of(sizeof(kWideLine));
+}
+
+// Backend whose output takes utf-8 as it is.
+class ByteOrientedBackend : public WideTextBackend {
+public:
+  virtual response_t<uint32_t> write_console_utf8(Handle output, tclib::Blob data);
+};
+
+response_t<uint32_t> ByteOrientedBackend::write_console_utf8(Handle output,
+    tclib::Blob data) {
+  // Only take the first 4 bytes such that the service has to find out how
+  // many characters that is.
+  size_t size = (data.size() < 4) ? data.size() : 4;
+  utf8_bytes_ += size;
+  size_t length = Utf8Codec::decoded_length(static_cast<uint8_t*>(data.start()), size);
+  return response_t<uint32_t>::of(static_cast<uint32_t>(length * sizeof(wide_char_t)));
+}
+
+// Writes a corpus of typical log lines as wide text with and without utf-8 and
+// checks that the backend sees the same text and how many bytes cross the
+// wire.
+MULTITEST(conback, utf8_wire, bool, use_utf8, ("utf8", true), ("utf16", false)) {
+  static const char *const kCorpus[4] = {
+    "2016-03-14 09:26:53.589 [INFO] worker-3: processed 1024 records in 12ms\r\n",
+    "2016-03-14 09:26:53.601 [WARN] cache: evicting 17 entries (size 65536)\r\n",
+    "  at org.example.Scheduler.run(Scheduler.java:142)\r\n",
+    "Build succeeded: 0 errors, 3 warnings -- caf\xc3\xa9 \xe2\x94\x80\xe2\x94\x80\r\n"
+  };
+  wide_char_t lines[4][128];
+  size_t lengths[4];
+  for (size_t i = 0; i < 4; i++) {
+    size_t size = strlen(kCorpus[i]);
+    lengths[i] = Utf8Codec::decode(reinterpret_cast<const uint8_t*>(kCorpus[i]),
+        size, lines[i], 128);
+  }
+
+  WideTextBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_utf8)
+    frontend.connector()->enable_utf8_wire();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  static const size_t kIterations = 8;
+  size_t wide_bytes = 0;
+  dword_t written = 0;
+  for (size_t i = 0; i < kIterations; i++) {
+    size_t line = i % 4;
+    backend.expected_ = lines[line];
+    ASSERT_TRUE(frontend->write_console_w(output, lines[line],
+        static_cast<dword_t>(lengths[line]), &written, NULL));
+    ASSERT_EQ(lengths[line], written);
+    wide_bytes += lengths[line] * sizeof(wide_char_t);
+  }
+  // Whatever the encoding, the backend sees the same wide text.
+  ASSERT_EQ(0, backend.mismatch_count_);
+  ASSERT_EQ(wide_bytes, backend.wide_bytes_);
+  uint64_t wire_bytes = frontend.service()->write_bytes_received();
+  if (use_utf8) {
+    ASSERT_TRUE(wire_bytes < wide_bytes * 6 / 10);
+  } else {
+    ASSERT_EQ(wide_bytes, wire_bytes);
+  }
+}
+
+TEST(conback, utf8_wire_byte_oriented) {
+  ByteOrientedBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  frontend.connector()->enable_utf8_wire();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+  handle_t input = frontend.platform()->get_std_handle(kStdInputHandle);
+
+  // The backend takes the utf-8 without it being widened; 4 bytes is the
+  // first 3 characters.
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_w(output, kWideLine, 6, &written, NULL));
+  ASSERT_EQ(3, written);
+  ASSERT_EQ(4, backend.utf8_bytes_);
+  ASSERT_EQ(0, backend.wide_bytes_);
+
+  // Reads come back as utf-8 and are widened again by the agent.
+  wide_char_t buffer[16];
+  dword_t chars_read = 0;
+  ASSERT_TRUE(frontend->read_console_w(input, buffer, 16, &chars_read, NULL));
+  ASSERT_EQ(6, chars_read);
+  ASSERT_EQ(0, memcmp(kWideLine, buffer, sizeof(kWideLine)));
+}
+
+// Runs calls whose arguments are handles and coordinates with the arguments
+// sent compactly and as seeds, which the backend must understand either way.
+MULTITEST(conback, compact_values, bool, use_compact, ("compact", true),
+    ("seed", false)) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  if (use_compact)
+    frontend.connector()->enable_compact_values();
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  console_screen_buffer_info_t info;
+  for (int16_t column = 0; column < 80; column += 7) {
+    ASSERT_TRUE(frontend->set_console_cursor_position(output, coord_new(column, 3)));
+    ASSERT_TRUE(frontend->get_console_screen_buffer_info(output, &info));
+    ASSERT_EQ(column, info.dwCursorPosition.X);
+    ASSERT_EQ(3, info.dwCursorPosition.Y);
+  }
+}
+
+// Wty whose input is typed by the test; until it is reads would have to wait.
+class TypedInputWty : public WinTty {
+public:
+  TypedInputWty() : input_(NULL), read_count_(0) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  virtual response_t<bool_t> get_screen_buffer_info(bool is_error,
+      ScreenBufferInfo *info_out) {
+    return response_t<bool_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
+  virtual response_t<uint32_t> read(ResponseBuffer *buffer, bool is_unicode,
+      ReadConsoleControl *input_control);
+  virtual response_t<uint32_t> write(tclib::Blob blob, bool is_unicode, bool is_error) {
+    return response_t<uint32_t>::of(static_cast<uint32_t>(blob.size()));
+  }
+  virtual response_t<bool_t> set_cursor_position(coord_t position, bool is_error) {
+    return response_t<bool_t>::yes();
+  }
+  bool has_input() { return input_ != NULL; }
+
+  // Makes the given line the input for the next read.
+  void type(const char *line) { input_ = line; }
+
+  const char *input_;
+  size_t read_count_;
+};
+
+response_t<uint32_t> TypedInputWty::read(ResponseBuffer *buffer, bool is_unicode,
+    ReadConsoleControl *input_control) {
+  // Reading without input would block which the backend mustn't do.
+  if (input_ == NULL)
+    return response_t<uint32_t>::error(CONPRX_ERROR_INVALID_ARGUMENT);
+  read_count_++;
+  tclib::Blob memory;
+  size_t size = strlen(input_);
+  if (!buffer->reserve(size, &memory))
+    return response_t<uint32_t>::error(CONPRX_ERROR_SYSTEM);
+  memcpy(memory.start(), input_, memory.size());
+  input_ = NULL;
+  return response_t<uint32_t>::of(static_cast<uint32_t>(memory.size()));
+}
+
+// Backend that keeps reads until its wty has input, the way a backend whose
+// input arrives while it's handling other requests would.
+class ParkingBackend : public BasicConsoleBackend {
+public:
+  ParkingBackend(TypedInputWty *wty) : wty_(wty) { set_wty(wty); }
+  virtual ~ParkingBackend();
+  virtual void begin_read_console(PendingRead *read);
+
+  // Completes the parked reads, oldest first, for as long as there is input.
+  void input_available();
+
+  std::vector<PendingRead*> parked_;
+
+private:
+  TypedInputWty *wty_;
+};
+
+ParkingBackend::~ParkingBackend() {
+  for (size_t i = 0; i < parked_.size(); i++)
+    parked_[i]->abandon();
+}
+
+void ParkingBackend::begin_read_console(PendingRead *read) {
+  // Reads that come in while others are waiting have to wait their turn even
+  // if there is input by now.
+  if (parked_.empty() && wty_->has_input()) {
+    BasicConsoleBackend::begin_read_console(read);
+  } else {
+    parked_.push_back(read);
+  }
+}
+
+void ParkingBackend::input_available() {
+  while (!parked_.empty() && wty_->has_input()) {
+    PendingRead *read = parked_.front();
+    parked_.erase(parked_.begin());
+    BasicConsoleBackend::begin_read_console(read);
+  }
+}
+
+// Sends a read request without waiting for it to complete.
+static rpc::IncomingResponse send_read(SimulatedFrontendAdaptor *frontend,
+    Handle *input, ReadConsoleControl *control) {
+  NativeVariant input_var(input);
+  NativeVariant control_var(control->raw());
+  Variant args[4] = {input_var, 32, Variant::boolean(false), control_var};
+  rpc::OutgoingRequest req(Variant::null(), "read_console", 4, args);
+  return frontend->streams()->socket()->send_request(&req);
+}
+
+// Processes messages until the given response has arrived.
+static void await_response(SimulatedFrontendAdaptor *frontend,
+    rpc::IncomingResponse resp) {
+  while (!resp->is_settled())
+    ASSERT_TRUE(frontend->streams()->input()->process_next_instruction(NULL));
+}
+
+TEST(conback, parked_reads) {
+  TypedInputWty wty;
+  ParkingBackend backend(&wty);
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  Handle input(frontend.platform()->get_std_handle(kStdInputHandle));
+  ReadConsoleControl control;
+
+  // There's no input so the reads are parked and other requests are handled
+  // while they wait.
+  rpc::IncomingResponse first = send_read(&frontend, &input, &control);
+  rpc::IncomingResponse second = send_read(&frontend, &input, &control);
+  Variant poke_arg = Variant::integer(32);
+  rpc::OutgoingRequest poke_req(Variant::null(), "poke", 1, &poke_arg);
+  rpc::IncomingResponse poke = frontend.streams()->socket()->send_request(&poke_req);
+  await_response(&frontend, poke);
+  ASSERT_EQ(32, backend.last_poke());
+  ASSERT_FALSE(first->is_settled());
+  ASSERT_FALSE(second->is_settled());
+  ASSERT_EQ(2, backend.parked_.size());
+  ASSERT_EQ(0, wty.read_count_);
+  dword_t written = 0;
+  ASSERT_TRUE(frontend->write_console_a(
+      frontend.platform()->get_std_handle(kStdOutputHandle), "abc", 3, &written,
+      NULL));
+  ASSERT_EQ(3, written);
+
+  // Input completes the oldest read first.
+  wty.type("first");
+  backend.input_available();
+  ASSERT_EQ(1, backend.parked_.size());
+  await_response(&frontend, first);
+  ASSERT_FALSE(second->is_settled());
+  Map result = first->peek_value(Variant::null());
+  ASSERT_EQ(5, result["result"].integer_value());
+  ASSERT_EQ(5, result["data"].blob_size());
+  ASSERT_EQ(0, memcmp("first", result["data"].blob_data(), 5));
+
+  wty.type("2nd");
+  backend.input_available();
+  ASSERT_EQ(0, backend.parked_.size());
+  await_response(&frontend, second);
+  Map second_result = second->peek_value(Variant::null());
+  ASSERT_EQ(3, second_result["result"].integer_value());
+  ASSERT_EQ(0, memcmp("2nd", second_result["data"].blob_data(), 3));
+
+  // With input there already the read completes right away.
+  wty.type("now");
+  char buffer[16];
+  dword_t chars_read = 0;
+  ASSERT_TRUE(frontend->read_console_a(input.ptr(), buffer, 16, &chars_read,
+      NULL));
+  ASSERT_EQ(3, chars_read);
+  ASSERT_EQ(3, wty.read_count_);
+}
+
+TEST(conback, response_buffer_growth) {
+  uint8_t memory[16];
+  FixedResponseBuffer fixed(tclib::Blob(memory, sizeof(memory)));
+  tclib::Blob reserved;
+  ASSERT_TRUE(fixed.reserve(4, &reserved));
+  ASSERT_EQ(4, reserved.size());
+  // Asking for more than the capacity gets the capacity.
+  ASSERT_TRUE(fixed.reserve(100, &reserved));
+  ASSERT_EQ(16, reserved.size());
+  ASSERT_TRUE(reserved.start() == memory);
+}
+
+// Interactive calls made while another thread saturates the connection with
+// bulk writes get through, and splitting the bulk writes doesn't change what
+// the backend sees. How long the interactive calls wait is measured by the
+// benchmark of the same name.
+MULTITEST(conback, priority_lanes, bool, use_lanes, ("lanes", true),
+    ("single", false)) {
+  SlowWriteBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  // The in-memory stream is small so the frames have to be too.
+  ASSERT_F_TRUE(frontend.connector()->enable_multiplexing(use_lanes ? 128 : 0));
+  handle_t output = frontend.platform()->get_std_handle(kStdOutputHandle);
+
+  SaturatingWriter writer(frontend.frontend(), output);
+  ASSERT_TRUE(writer.thread()->start());
+  while (!writer.is_done_)
+    ASSERT_EQ(cpUtf8, frontend->get_console_cp());
+  opaque_t result = o0();
+  ASSERT_TRUE(writer.thread()->join(&result));
+
+  // Splitting must not change what the backend ends up seeing.
+  size_t total = SaturatingWriter::kBlockSize * SaturatingWriter::kBlockCount;
+  ASSERT_EQ(total, writer.bytes_written_);
+  ASSERT_EQ(total, backend.bytes_written_);
+  if (use_lanes)
+    ASSERT_EQ(total / 128, backend.write_count_);
+}
+
+// Wty that writes to stderr slowly, like a terminal that is busy rendering,
+// and to stdout right away. Writes for one handle never happen concurrently
+// so each handle's counts are only changed by one thread at a time.
+class SlowErrorWty : public WinTty {
+public:
+  SlowErrorWty() : error_count_(0), output_count_(0) { }
+  virtual void default_destroy() { tclib::default_delete_concrete(this); }
+  virtual response_t<bool_t> get_screen_buffer_info(bool is_error,
+      ScreenBufferInfo *info_out) {
+    return response_t<bool_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
+  virtual response_t<uint32_t> read(ResponseBuffer *buffer, bool is_unicode,
+      ReadConsoleControl *input_control) {
+    return response_t<uint32_t>::error(CONPRX_ERROR_NOT_IMPLEMENTED);
+  }
+  virtual response_t<uint32_t> write(tclib::Blob blob, bool is_unicode, bool is_error);
+  virtual response_t<bool_t> set_cursor_position(coord_t position, bool is_error) {
+    return response_t<bool_t>::yes();
+  }
+
+  static const size_t kMaxRecorded = 16;
+  static const uint64_t kErrorDelayMs = 25;
+  volatile size_t error_count_;
+  volatile size_t output_count_;
+  // The first character of each write to stderr, in the order they were made.
+  char error_order_[kMaxRecorded];
+};
+
+response_t<uint32_t> SlowErrorWty::write(tclib::Blob blob, bool is_unicode,
+    bool is_error) {
+  if (is_error) {
+    NativeThread::sleep(Duration::millis(kErrorDelayMs));
+    if (error_count_ < kMaxRecorded && blob.size() > 0)
+      error_order_[error_count_] = *static_cast<char*>(blob.start());
+    error_count_++;
+  } else {
+    output_count_++;
+  }
+  return response_t<uint32_t>::of(static_cast<uint32_t>(blob.size()));
+}
+
+// Sends a write request without waiting for it to complete.
+static rpc::IncomingResponse send_write(SimulatedFrontendAdaptor *frontend,
+    Handle *output, const char *chars) {
+  // The in-memory stream is small so the handle is sent in its compact form.
+  WireValue<Handle> output_wire(output, true);
+  Variant args[3] = {output_wire.variant(),
+      Variant::blob(chars, static_cast<uint32_t>(strlen(chars))),
+      Variant::boolean(false)};
+  rpc::OutgoingRequest req(Variant::null(), "write_console", 3, args);
+  return frontend->streams()->socket()->send_request(&req);
+}
+
+MULTITEST(conback, executor, bool, use_executor, ("pool", true),
+    ("inline", false)) {
+  SlowErrorWty wty;
+  BasicConsoleBackend backend;
+  backend.set_wty(&wty);
+  SimulatedFrontendAdaptor frontend(&backend);
+  // Declared after the frontend so it's stopped before the service goes away.
+  HandlerExecutor executor(2, 16);
+  if (use_executor) {
+    ASSERT_F_TRUE(executor.start());
+    ASSERT_F_TRUE(frontend.service()->set_executor(&executor));
+  }
+  ASSERT_TRUE(frontend.initialize());
+  Handle output(frontend.platform()->get_std_handle(kStdOutputHandle));
+  Handle error(frontend.platform()->get_std_handle(kStdErrorHandle));
+
+  // The slow writes are sent first so without an executor everything after
+  // them has to wait.
+  static const size_t kCount = 4;
+  static const char *const kErrorText[kCount] = {"0", "1", "2", "3"};
+  std::vector<rpc::IncomingResponse> errors;
+  std::vector<rpc::IncomingResponse> outputs;
+  for (size_t i = 0; i < kCount; i++)
+    errors.push_back(send_write(&frontend, &error, kErrorText[i]));
+  for (size_t i = 0; i < kCount; i++)
+    outputs.push_back(send_write(&frontend, &output, "out"));
+  for (size_t i = 0; i < kCount; i++)
+    await_response(&frontend, outputs[i]);
+  size_t errors_before_output = wty.error_count_;
+  for (size_t i = 0; i < kCount; i++)
+    await_response(&frontend, errors[i]);
+
+  for (size_t i = 0; i < kCount; i++) {
+    ASSERT_EQ(3, outputs[i]->peek_value(Variant::null()).integer_value());
+    ASSERT_EQ(1, errors[i]->peek_value(Variant::null()).integer_value());
+  }
+  ASSERT_EQ(kCount, wty.output_count_);
+  // Writes to the slow handle still happened in the order they were sent.
+  ASSERT_EQ(kCount, wty.error_count_);
+  ASSERT_EQ(0, memcmp("0123", wty.error_order_, kCount));
+  if (use_executor) {
+    // The fast handle didn't have to wait for the slow one.
+    ASSERT_TRUE(errors_before_output < kCount);
+    // Jobs are counted after they've responded so stop to make sure they're
+    // all done.
+    executor.stop();
+    ASSERT_EQ(2 * kCount, executor.completed_count());
+  } else {
+    ASSERT_EQ(kCount, errors_before_output);
+  }
+}
+
+TEST(conback, write_credits_enforced) {
+  SlowErrorWty wty;
+  BasicConsoleBackend backend;
+  backend.set_wty(&wty);
+  SimulatedFrontendAdaptor frontend(&backend);
+  HandlerExecutor executor(1, 16);
+  ASSERT_F_TRUE(executor.start());
+  ASSERT_F_TRUE(frontend.service()->set_executor(&executor));
+  frontend.service()->set_write_credit_limit(4);
+  ASSERT_TRUE(frontend.initialize());
+  Handle output(frontend.platform()->get_std_handle(kStdOutputHandle));
+  Handle error(frontend.platform()->get_std_handle(kStdErrorHandle));
+  NativeVariant output_var(&output);
+  NativeVariant error_var(&error);
+  rpc::OutgoingRequest ready(Variant::null(), "is_ready");
+  ready.set_argument("stdin", output_var);
+  ready.set_argument("stdout", output_var);
+  ready.set_argument("stderr", error_var);
+  ready.set_argument("write_credits", Variant::yes());
+  rpc::IncomingResponse features = frontend.streams()->socket()->send_request(&ready);
+  await_response(&frontend, features);
+  Map granted = features->peek_value(Variant::null());
+  ASSERT_EQ(4, granted["write_credits"].integer_value());
+
+  // An agent that ignores its credits gets its third write rejected while
+  // the first two are still being processed, without the service having to
+  // stop reading from it.
+  rpc::IncomingResponse writes[3];
+  for (size_t i = 0; i < 3; i++)
+    writes[i] = send_write(&frontend, &error, "ab");
+  await_response(&frontend, writes[2]);
+  ASSERT_TRUE(writes[2]->is_rejected());
+  ASSERT_EQ(CONPRX_ERROR_OUT_OF_CREDITS,
+      writes[2]->peek_error(Variant::null()).integer_value());
+  for (size_t i = 0; i < 2; i++) {
+    await_response(&frontend, writes[i]);
+    ASSERT_EQ(2, writes[i]->peek_value(Variant::null()).integer_value());
+  }
+  ASSERT_EQ(1, frontend.service()->credit_overrun_count());
+  ASSERT_EQ(2, wty.error_count_);
+
+  // Once they have completed it can be sent again.
+  rpc::IncomingResponse retry = send_write(&frontend, &error, "ab");
+  await_response(&frontend, retry);
+  ASSERT_EQ(2, retry->peek_value(Variant::null()).integer_value());
+  ASSERT_EQ(3, wty.error_count_);
+  executor.stop();
+}
+
+// A thread that changes the title and looks up handles over and over.
+class TitleSetter {
+public:
+  TitleSetter(BasicConsoleBackend *backend, size_t count)
+    : backend_(backend)
+    , count_(count)
+    , thread_(new_callback(&TitleSetter::run, this)) { }
+  opaque_t run();
+  NativeThread *thread() { return &thread_; }
+
+private:
+  BasicConsoleBackend *backend_;
+  size_t count_;
+  NativeThread thread_;
+};
+
+opaque_t TitleSetter::run() {
+  for (size_t i = 0; i < count_; i++) {
+    backend_->set_title(((i % 2) == 0) ? "Even" : "Oddity");
+    backend_->get_handle_shadow(Handle(static_cast<int64_t>(i)));
+  }
+  return o0();
+}
+
+TEST(conback, concurrent_calls) {
+  BasicConsoleBackend backend;
+  ASSERT_F_TRUE(backend.enable_concurrent_calls());
+  backend.set_title("Even");
+  static const size_t kCount = 10000;
+  TitleSetter setter(&backend, kCount);
+  ASSERT_TRUE(setter.thread()->start());
+  // Reading the state while the title changes and new handles are added to
+  // the shadows sees one title or the other, never a freed one.
+  for (size_t i = 0; i < kCount; i++) {
+    console_state_t state;
+    ASSERT_FALSE(backend.get_console_state(&state, spAll).has_error());
+    ASSERT_TRUE(state.title_length == 4 || state.title_length == 6);
+    ASSERT_FALSE(backend.set_console_mode(Handle(static_cast<int64_t>(i)), 1).has_error());
+  }
+  opaque_t result = o0();
+  ASSERT_TRUE(setter.thread()->join(&result));
+  ASSERT_EQ(1, backend.get_handle_shadow(Handle(static_cast<int64_t>(7))).mode());
+}
+
+// A backend that records the handles it's given by the calls that concern
+// handles.
+class HandleRecordingBackend : public BasicConsoleBackend {
+public:
+  HandleRecordingBackend() : stream_connect_count_(0) { }
+  virtual response_t<bool_t> connect_stream(Handle stdin_handle,
+      Handle stdout_handle, Handle stderr_handle);
+  virtual response_t<bool_t> set_console_mode(Handle handle, uint32_t mode);
+  size_t stream_connect_count_;
+  Handle last_stdout_;
+  Handle last_mode_handle_;
+};
+
+response_t<bool_t> HandleRecordingBackend::connect_stream(Handle stdin_handle,
+    Handle stdout_handle, Handle stderr_handle) {
+  stream_connect_count_++;
+  last_stdout_ = stdout_handle;
+  return BasicConsoleBackend::connect_stream(stdin_handle, stdout_handle,
+      stderr_handle);
+}
+
+response_t<bool_t> HandleRecordingBackend::set_console_mode(Handle handle,
+    uint32_t mode) {
+  last_mode_handle_ = handle;
+  return BasicConsoleBackend::set_console_mode(handle, mode);
+}
+
+// Sends the given request tagged with the given stream and waits for it.
+static rpc::IncomingResponse send_on_stream(SimulatedFrontendAdaptor *frontend,
+    rpc::OutgoingRequest *req, uint32_t stream_id) {
+  req->set_argument("stream", Variant::integer(stream_id));
+  rpc::IncomingResponse resp = frontend->streams()->socket()->send_request(req);
+  await_response(frontend, resp);
+  return resp;
+}
+
+TEST(conback, streams) {
+  HandleRecordingBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+  PrpcConsoleConnector *parent = frontend.connector();
+
+  // Two children get streams on the parent's channel.
+  response_t<uint32_t> first = parent->open_stream();
+  ASSERT_FALSE(first.has_error());
+  response_t<uint32_t> second = parent->open_stream();
+  ASSERT_FALSE(second.has_error());
+  ASSERT_TRUE(first.value() != second.value());
+  ASSERT_EQ(2, frontend.service()->open_stream_count());
+
+  // A child says it's ready on its stream which registers its handles in a
+  // namespace of its own.
+  Handle std_handle(0x47);
+  NativeVariant std_var(&std_handle);
+  rpc::OutgoingRequest ready(Variant::null(), "is_ready");
+  ready.set_argument("stdin", std_var);
+  ready.set_argument("stdout", std_var);
+  ready.set_argument("stderr", std_var);
+  ASSERT_TRUE(send_on_stream(&frontend, &ready, first.value())->is_fulfilled());
+  ASSERT_EQ(1, backend.stream_connect_count_);
+  ASSERT_TRUE(backend.last_stdout_.id() != std_handle.id());
+  ASSERT_FALSE(frontend.service()->agent_is_ready());
+
+  // The same handle value from different streams reaches the backend as
+  // different handles, and unchanged from the channel's own agent.
+  PrpcConsoleConnector first_child(frontend.streams()->socket(),
+      frontend.streams()->input());
+  first_child.set_stream_id(first.value());
+  PrpcConsoleConnector second_child(frontend.streams()->socket(),
+      frontend.streams()->input());
+  second_child.set_stream_id(second.value());
+  ASSERT_FALSE(parent->set_console_mode(std_handle, 1).has_error());
+  ASSERT_EQ(std_handle.id(), backend.last_mode_handle_.id());
+  ASSERT_FALSE(first_child.set_console_mode(std_handle, 1).has_error());
+  int64_t first_id = backend.last_mode_handle_.id();
+  ASSERT_EQ(backend.last_stdout_.id(), first_id);
+  ASSERT_FALSE(second_child.set_console_mode(std_handle, 1).has_error());
+  int64_t second_id = backend.last_mode_handle_.id();
+  ASSERT_TRUE(second_id != first_id);
+  ASSERT_TRUE(second_id != std_handle.id());
+
+  // Pseudo handles reach the backend unchanged from any stream.
+  Handle std_output(kStdOutputHandle);
+  ASSERT_FALSE(second_child.set_console_mode(std_output, 1).has_error());
+  ASSERT_EQ(kStdOutputHandle, backend.last_mode_handle_.id());
+  Handle invalid;
+  ASSERT_FALSE(second_child.set_console_mode(invalid, 1).has_error());
+  ASSERT_EQ(invalid.id(), backend.last_mode_handle_.id());
+
+  // A child being done closes its stream but leaves the channel open, and
+  // the stream can't be used after that. The backend forgets the closed
+  // stream's handles but not the others'.
+  ASSERT_EQ(1, backend.get_handle_shadow(Handle(first_id)).mode());
+  rpc::OutgoingRequest done(Variant::null(), "is_done");
+  ASSERT_TRUE(send_on_stream(&frontend, &done, first.value())->is_fulfilled());
+  ASSERT_EQ(1, frontend.service()->open_stream_count());
+  ASSERT_FALSE(frontend.service()->agent_is_done());
+  ASSERT_EQ(0, backend.get_handle_shadow(Handle(first_id)).mode());
+  ASSERT_EQ(1, backend.get_handle_shadow(Handle(second_id)).mode());
+  ASSERT_EQ(1, backend.get_handle_shadow(std_handle).mode());
+  response_t<bool_t> stale = first_child.set_console_mode(std_handle, 1);
+  ASSERT_TRUE(stale.has_error());
+  ASSERT_EQ(CONPRX_ERROR_UNKNOWN_STREAM, stale.error_code());
+  ASSERT_FALSE(parent->poke(2).has_error());
+}
+
+TEST(conback, log_batch) {
+  BasicConsoleBackend backend;
+  SimulatedFrontendAdaptor frontend(&backend);
+  ASSERT_TRUE(frontend.initialize());
+
+  // A batch as the agent's log sends it: the entries it could hold and the
+  // number it had to drop.
+  LogBuffer buffer;
+  log_entry_t raw;
+  log_entry_default_init(&raw, llInfo, __FILE__, __LINE__,
+      new_c_string("shipped"), string_empty());
+  for (size_t i = 0; i < LogBuffer::kCapacity + 3; i++)
+    buffer.append(&raw, LogBuffer::now_nanos());
+  ASSERT_TRUE(buffer.try_begin_drain());
+  size_t count = buffer.ready_count();
+  ASSERT_EQ(LogBuffer::kCapacity, count);
+  uint8_t encoded[LogBuffer::kCapacity * 128];
+  CompactWriter writer(encoded);
+  CompactLogBatch::write_header(static_cast<uint32_t>(count),
+      buffer.take_dropped_count(), &writer);
+  for (size_t i = 0; i < count; i++) {
+    CompactLogBatch::entry_t entry;
+    buffer.peek(i, &entry);
+    CompactLogBatch::write_entry(&entry, &writer);
+  }
+  buffer.release(count);
+  buffer.end_drain();
+
+  Variant batch = Variant::blob(encoded, static_cast<uint32_t>(writer.size()));
+  rpc::OutgoingRequest req(Variant::null(), "log_batch", 1, &batch);
+  log_o *old_log = silence_global_log();
+  rpc::IncomingResponse resp = frontend.streams()->socket()->send_request(&req);
+  await_response(&frontend, resp);
+  set_global_log(old_log);
+  ASSERT_TRUE(resp->is_fulfilled());
+  ASSERT_EQ(3, frontend.service()->dropped_log_entry_count());
+
+  // Garbage is rejected rather than logged.
+  Variant garbage = Variant::blob(encoded, 5);
+  rpc::OutgoingRequest bad(Variant::null(), "log_batch", 1, &garbage);
+  resp = frontend.streams()->socket()->send_request(&bad);
+  await_response(&frontend, resp);
+  ASSERT_TRUE(resp->is_rejected());
+}
@@ -0,0 +1,118 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "daemon-utils.hh"
+#include "test.hh"
+
+#ifndef IS_MSVC
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+// Stores the console title as seen by the given client in the buffer,
+// terminated, or the empty string if getting it fails.
+static void get_title(DaemonClient *client, char *buf, size_t size) {
+  response_t<uint32_t> length = client->connector()->get_console_title(
+      tclib::Blob(buf, size - 1), false);
+  buf[length.has_error() ? 0 : length.value()] = '\0';
+}
+
+TEST(daemon, sessions) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  char address[LocalSocket::kMaxAddressLength];
+#ifndef IS_MSVC
+  snprintf(address, sizeof(address), "/tmp/conprx-daemon-test-%i",
+      static_cast<int>(getpid()));
+#endif
+
+  ConsoleDaemon daemon;
+  ASSERT_F_TRUE(daemon.listen(address));
+  DaemonRunner runner(&daemon);
+  ASSERT_TRUE(runner.thread()->start());
+
+  DaemonClient first;
+  ASSERT_F_TRUE(first.connect(address, 1));
+  ASSERT_EQ(0, first.connector()->poke(5).value());
+
+  DaemonClient second;
+  ASSERT_F_TRUE(second.connect(address, 1));
+  DaemonClient other;
+  ASSERT_F_TRUE(other.connect(address, 2));
+
+  // Clients in the same session share the console's state, clients in
+  // different sessions don't.
+  ASSERT_FALSE(first.connector()->set_console_title(
+      tclib::Blob("shared", 6), false).has_error());
+  char title[256];
+  get_title(&second, title, sizeof(title));
+  ASSERT_C_STREQ("shared", title);
+  get_title(&other, title, sizeof(title));
+  ASSERT_C_STREQ("", title);
+  ASSERT_FALSE(other.connector()->set_console_title(
+      tclib::Blob("apart", 5), false).has_error());
+  get_title(&first, title, sizeof(title));
+  ASSERT_C_STREQ("shared", title);
+  ASSERT_EQ(5, second.connector()->poke(6).value());
+
+  ASSERT_F_TRUE(first.send_is_done());
+  ASSERT_F_TRUE(second.send_is_done());
+  ASSERT_F_TRUE(other.send_is_done());
+
+  daemon.stop();
+  opaque_t result = o0();
+  ASSERT_TRUE(runner.thread()->join(&result));
+  ASSERT_EQ(2, daemon.session_count());
+  ASSERT_EQ(3, daemon.agent_count());
+}
+
+TEST(daemon, bad_hello) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  char address[LocalSocket::kMaxAddressLength];
+#ifndef IS_MSVC
+  snprintf(address, sizeof(address), "/tmp/conprx-daemon-hello-test-%i",
+      static_cast<int>(getpid()));
+#endif
+
+  ConsoleDaemon daemon;
+  ASSERT_F_TRUE(daemon.listen(address));
+  DaemonRunner runner(&daemon);
+  ASSERT_TRUE(runner.thread()->start());
+
+  // A client that only sends part of its hello doesn't hold up the others,
+  // and neither does one that sends the wrong one.
+  def_ref_t<InOutStream> partial;
+  int32_t magic = daemon_hello_t::kMagic;
+  ASSERT_F_TRUE(LocalSocket::connect(address, tclib::Blob(&magic, sizeof(magic)),
+      &partial));
+  daemon_hello_t wrong;
+  struct_zero_fill(wrong);
+  wrong.magic = 0x0BADCAFE;
+  def_ref_t<InOutStream> invalid;
+  ASSERT_F_TRUE(LocalSocket::connect(address, tclib::Blob(&wrong, sizeof(wrong)),
+      &invalid));
+  DaemonClient good;
+  ASSERT_F_TRUE(good.connect(address, 1));
+  ASSERT_EQ(0, good.connector()->poke(3).value());
+  ASSERT_F_TRUE(good.send_is_done());
+  ASSERT_TRUE(partial->close());
+
+  // Once they're all done the next agent to connect has the daemon dispose
+  // of them.
+  NativeThread::sleep(Duration::millis(100));
+  DaemonClient last;
+  ASSERT_F_TRUE(last.connect(address, 1));
+  ASSERT_EQ(3, last.connector()->poke(4).value());
+  ASSERT_EQ(1, daemon.live_agent_count());
+  ASSERT_F_TRUE(last.send_is_done());
+
+  daemon.stop();
+  opaque_t result = o0();
+  ASSERT_TRUE(runner.thread()->join(&result));
+  ASSERT_EQ(4, daemon.agent_count());
+}
@@ -0,0 +1,153 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "evloop-utils.hh"
+#include "test.hh"
+
+using namespace tclib;
+using namespace plankton;
+using namespace conprx;
+
+TEST(evloop, many_agents) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  static const size_t kAgentCount = 128;
+  static const size_t kWorkerCount = 4;
+  static const size_t kRoundCount = 4;
+
+  AgentEventLoop loop(kWorkerCount);
+  ASSERT_F_TRUE(loop.start());
+  def_ref_t<FakeAgentAttachment> agents[kAgentCount];
+  for (size_t i = 0; i < kAgentCount; i++) {
+    agents[i] = new (kDefaultAlloc) FakeAgentAttachment();
+    ASSERT_F_TRUE(agents[i]->open());
+    agents[i]->agent_monitor_done()->raise();
+    ASSERT_F_TRUE(loop.add(*agents[i]));
+  }
+  ASSERT_EQ(kAgentCount, loop.source_count());
+
+  // Every agent has a request in flight at once and they're all served by a
+  // handful of workers.
+  for (size_t round = 1; round <= kRoundCount; round++) {
+    rpc::IncomingResponse resps[kAgentCount];
+    for (size_t i = 0; i < kAgentCount; i++)
+      resps[i] = agents[i]->send_poke(round * kAgentCount + i);
+    for (size_t i = 0; i < kAgentCount; i++)
+      ASSERT_F_TRUE(agents[i]->await(resps[i]));
+  }
+
+  for (size_t i = 0; i < kAgentCount; i++) {
+    ASSERT_EQ(static_cast<int64_t>(kRoundCount * kAgentCount + i),
+        agents[i]->fake_backend()->last_poke());
+    ASSERT_F_TRUE(agents[i]->await(agents[i]->send_is_done()));
+  }
+  loop.wait_idle();
+  ASSERT_EQ(0, loop.source_count());
+  ASSERT_EQ(0, loop.failure_count());
+  ASSERT_TRUE(loop.event_count() >= kAgentCount * (kRoundCount + 1));
+  for (size_t i = 0; i < kAgentCount; i++)
+    ASSERT_TRUE(agents[i]->agent_monitor_done()->pass(Duration::instant()));
+  loop.stop();
+}
+
+TEST(evloop, broken_agent) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  AgentEventLoop loop(1);
+  ASSERT_F_TRUE(loop.start());
+  FakeAgentAttachment agent;
+  ASSERT_F_TRUE(agent.open());
+  agent.agent_monitor_done()->raise();
+  ASSERT_F_TRUE(loop.add(&agent));
+  // An agent that goes away without saying it's done gets removed as failed.
+  ASSERT_F_TRUE(agent.hang_up());
+  loop.wait_idle();
+  ASSERT_EQ(1, loop.failure_count());
+  ASSERT_TRUE(agent.agent_monitor_done()->pass(Duration::instant()));
+}
+
+TEST(evloop, pipelined) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  static const size_t kCallCount = 64;
+  AgentEventLoop loop(1);
+  ASSERT_F_TRUE(loop.start());
+  FakeAgentAttachment agent;
+  ASSERT_F_TRUE(agent.open());
+  agent.agent_monitor_done()->raise();
+  ASSERT_F_TRUE(loop.add(&agent));
+  // All the calls are in flight before the first one is processed so most of
+  // them have to be drained from the handle after processing the one before.
+  rpc::IncomingResponse resps[kCallCount];
+  for (size_t i = 0; i < kCallCount; i++)
+    resps[i] = agent.send_poke(i);
+  for (size_t i = 0; i < kCallCount; i++)
+    ASSERT_F_TRUE(agent.await(resps[i]));
+  ASSERT_EQ(static_cast<int64_t>(kCallCount - 1),
+      agent.fake_backend()->last_poke());
+  ASSERT_F_TRUE(agent.await(agent.send_is_done()));
+  loop.wait_idle();
+  ASSERT_EQ(0, loop.failure_count());
+  ASSERT_EQ(kCallCount + 1, loop.event_count());
+}
+
+// An attachment whose first message blocks the worker processing it until
+// it's released, like a message that has only partly arrived.
+class StallingAgentAttachment : public FakeAgentAttachment {
+public:
+  StallingAgentAttachment()
+    : stalled_(Drawbridge::dsRaised)
+    , released_(Drawbridge::dsRaised) { }
+  virtual void default_destroy() { default_delete_concrete(this); }
+  virtual fat_bool_t initialize();
+  virtual fat_bool_t on_event(bool *is_done_out);
+  Drawbridge *stalled() { return &stalled_; }
+  Drawbridge *released() { return &released_; }
+
+private:
+  Drawbridge stalled_;
+  Drawbridge released_;
+};
+
+fat_bool_t StallingAgentAttachment::initialize() {
+  F_TRY(F_BOOL(stalled_.initialize()));
+  F_TRY(F_BOOL(released_.initialize()));
+  return FakeAgentAttachment::initialize();
+}
+
+fat_bool_t StallingAgentAttachment::on_event(bool *is_done_out) {
+  stalled_.lower();
+  F_TRY(F_BOOL(released_.pass()));
+  return FakeAgentAttachment::on_event(is_done_out);
+}
+
+TEST(evloop, stalled_agent) {
+  if (kIsMsvc)
+    SKIP_TEST("posix only");
+  AgentEventLoop loop(1);
+  ASSERT_F_TRUE(loop.start());
+  StallingAgentAttachment stalling;
+  ASSERT_F_TRUE(stalling.open());
+  stalling.agent_monitor_done()->raise();
+  ASSERT_F_TRUE(loop.add(&stalling));
+  FakeAgentAttachment agent;
+  ASSERT_F_TRUE(agent.open());
+  agent.agent_monitor_done()->raise();
+  ASSERT_F_TRUE(loop.add(&agent));
+
+  // The only worker gets stuck on the stalling agent but the other one still
+  // gets served, by a spare.
+  rpc::IncomingResponse stalled = stalling.send_poke(8);
+  ASSERT_TRUE(stalling.stalled()->pass());
+  ASSERT_F_TRUE(agent.await(agent.send_poke(9)));
+  ASSERT_EQ(9, agent.fake_backend()->last_poke());
+  ASSERT_EQ(2, loop.worker_count());
+
+  stalling.released()->lower();
+  ASSERT_F_TRUE(stalling.await(stalled));
+  ASSERT_EQ(8, stalling.fake_backend()->last_poke());
+  ASSERT_F_TRUE(stalling.await(stalling.send_is_done()));
+  ASSERT_F_TRUE(agent.await(agent.send_is_done()));
+  loop.wait_idle();
+  ASSERT_EQ(0, loop.failure_count());
+}
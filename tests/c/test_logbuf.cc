@@ -0,0 +1,158 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "agent/logbuf.hh"
+#include "sync/thread.hh"
+#include "test.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+#include "utils/string-inl.h"
+END_C_INCLUDES
+
+#include <string.h>
+
+using namespace conprx;
+using namespace tclib;
+
+// Appends an info entry with the given file, line, and message.
+static bool append(LogBuffer *buffer, const char *file, uint32_t line,
+    const char *message) {
+  log_entry_t entry;
+  log_entry_default_init(&entry, llInfo, file, line, new_c_string(message),
+      string_empty());
+  return buffer->append(&entry, line * 1000);
+}
+
+TEST(logbuf, simple) {
+  LogBuffer buffer;
+  ASSERT_TRUE(buffer.try_begin_drain());
+  ASSERT_EQ(0, buffer.ready_count());
+  ASSERT_TRUE(append(&buffer, "a.cc", 1, "first"));
+  ASSERT_TRUE(append(&buffer, "b.cc", 2, "second"));
+  ASSERT_EQ(2, buffer.pending_count());
+  ASSERT_EQ(2, buffer.ready_count());
+
+  CompactLogBatch::entry_t entry;
+  buffer.peek(0, &entry);
+  ASSERT_EQ(llInfo, entry.level);
+  ASSERT_C_STREQ("a.cc", entry.file);
+  ASSERT_EQ(1, entry.line);
+  ASSERT_EQ(1000, entry.timestamp_nanos);
+  ASSERT_C_STREQ("first", entry.message);
+  ASSERT_EQ(5, entry.message_size);
+  buffer.peek(1, &entry);
+  ASSERT_C_STREQ("second", entry.message);
+  buffer.release(2);
+  ASSERT_EQ(0, buffer.ready_count());
+  ASSERT_EQ(0, buffer.pending_count());
+
+  // Long messages are cut off rather than overflow the slot.
+  char message[LogBuffer::kMaxMessageSize + 10];
+  memset(message, 'x', sizeof(message) - 1);
+  message[sizeof(message) - 1] = '\0';
+  ASSERT_TRUE(append(&buffer, "c.cc", 3, message));
+  buffer.peek(0, &entry);
+  ASSERT_EQ(LogBuffer::kMaxMessageSize - 1, entry.message_size);
+  buffer.release(1);
+
+  // Only one thread drains at a time.
+  ASSERT_FALSE(buffer.try_begin_drain());
+  buffer.end_drain();
+  ASSERT_TRUE(buffer.try_begin_drain());
+  buffer.end_drain();
+}
+
+TEST(logbuf, overflow) {
+  LogBuffer buffer;
+  ASSERT_TRUE(buffer.try_begin_drain());
+  for (size_t i = 0; i < LogBuffer::kCapacity; i++)
+    ASSERT_TRUE(append(&buffer, "a.cc", static_cast<uint32_t>(i), "x"));
+  // A full buffer drops new entries and counts them.
+  ASSERT_FALSE(append(&buffer, "a.cc", 1000, "y"));
+  ASSERT_FALSE(append(&buffer, "a.cc", 1001, "y"));
+  ASSERT_EQ(2, buffer.take_dropped_count());
+  ASSERT_EQ(0, buffer.take_dropped_count());
+
+  // Releasing the oldest makes room for new ones in the same slots.
+  ASSERT_EQ(LogBuffer::kCapacity, buffer.ready_count());
+  buffer.release(3);
+  for (size_t i = 0; i < 3; i++)
+    ASSERT_TRUE(append(&buffer, "a.cc", static_cast<uint32_t>(2000 + i), "z"));
+  ASSERT_FALSE(append(&buffer, "a.cc", 3000, "y"));
+  ASSERT_EQ(LogBuffer::kCapacity, buffer.ready_count());
+  CompactLogBatch::entry_t entry;
+  buffer.peek(0, &entry);
+  ASSERT_EQ(3, entry.line);
+  buffer.peek(LogBuffer::kCapacity - 1, &entry);
+  ASSERT_EQ(2002, entry.line);
+  ASSERT_C_STREQ("z", entry.message);
+  buffer.end_drain();
+}
+
+// Appends a number of entries from a thread of its own, with increasing line
+// numbers and the file identifying the thread.
+class LogProducer {
+public:
+  LogProducer(LogBuffer *buffer, const char *name, size_t count)
+    : buffer_(buffer)
+    , name_(name)
+    , count_(count)
+    , thread_(new_callback(&LogProducer::run, this)) { }
+  NativeThread *thread() { return &thread_; }
+
+private:
+  opaque_t run() {
+    for (size_t i = 0; i < count_; i++)
+      append(buffer_, name_, static_cast<uint32_t>(i), "producing");
+    return o0();
+  }
+
+  LogBuffer *buffer_;
+  const char *name_;
+  size_t count_;
+  NativeThread thread_;
+};
+
+TEST(logbuf, concurrent) {
+  static const size_t kThreadCount = 4;
+  static const size_t kEntryCount = 20000;
+  static const char *kNames[kThreadCount] = {"p0", "p1", "p2", "p3"};
+  LogBuffer buffer;
+  LogProducer *producers[kThreadCount];
+  for (size_t i = 0; i < kThreadCount; i++)
+    producers[i] = new (kDefaultAlloc) LogProducer(&buffer, kNames[i], kEntryCount);
+  for (size_t i = 0; i < kThreadCount; i++)
+    ASSERT_TRUE(producers[i]->thread()->start());
+
+  // Drain while the producers append, checking that each producer's entries
+  // come out in the order they went in. Every entry is either taken or
+  // counted as dropped.
+  int64_t last_line[kThreadCount] = {-1, -1, -1, -1};
+  uint64_t taken = 0;
+  uint64_t dropped = 0;
+  ASSERT_TRUE(buffer.try_begin_drain());
+  while (taken + dropped < kThreadCount * kEntryCount) {
+    size_t count = buffer.ready_count();
+    for (size_t i = 0; i < count; i++) {
+      CompactLogBatch::entry_t entry;
+      buffer.peek(i, &entry);
+      size_t producer = static_cast<size_t>(entry.file[1] - '0');
+      ASSERT_TRUE(producer < kThreadCount);
+      ASSERT_TRUE(static_cast<int64_t>(entry.line) > last_line[producer]);
+      last_line[producer] = entry.line;
+      ASSERT_C_STREQ("producing", entry.message);
+    }
+    buffer.release(count);
+    taken += count;
+    dropped += buffer.take_dropped_count();
+  }
+  buffer.end_drain();
+
+  for (size_t i = 0; i < kThreadCount; i++) {
+    opaque_t result = o0();
+    ASSERT_TRUE(producers[i]->thread()->join(&result));
+    default_delete_concrete(producers[i]);
+  }
+  ASSERT_EQ(0, buffer.pending_count());
+}
@@ -3,8 +3,16 @@
 
 #include "test.hh"
 #include "agent/lpc.hh"
+#include "conback-utils.hh"
+#include "sync/mutex.hh"
+#include "sync/thread.hh"
+
+BEGIN_C_INCLUDES
+#include "utils/log.h"
+END_C_INCLUDES
 
 using namespace lpc;
+using namespace tclib;
 
 int fun_three(Vector<void*> trace, fat_bool_t *trace_result) {
   *trace_result = PatchingInterceptor::capture_stacktrace(trace);
@@ -58,3 +66,241 @@ TEST(lpc, offsets) {
   ASSERT_EQ(IF_32_BIT(44, 68), FOFF(get_console_cp.is_output));
   ASSERT_EQ(IF_32_BIT(44, 72), FOFF(set_console_title.title));
 }
+
+// An agent that counts the messages that make it through the interceptor to
+// its adaptor.
+class CountingAgent : public conprx::SimulatedAgent {
+public:
+  CountingAgent()
+    : conprx::SimulatedAgent(NULL)
+    , adaptor_count_(0)
+    , flags_read_count_(0)
+    , wanted_unknown_messages_(false) { }
+  bool initialize() { return mutex_.initialize(); }
+  virtual conprx::ConsoleAdaptor *adaptor();
+  size_t adaptor_count() { return adaptor_count_; }
+  size_t flags_read_count() { return flags_read_count_; }
+  bool wanted_unknown_messages() { return wanted_unknown_messages_; }
+
+protected:
+  virtual void on_lpc_flags_read();
+
+private:
+  tclib::NativeMutex mutex_;
+  size_t adaptor_count_;
+  size_t flags_read_count_;
+  bool wanted_unknown_messages_;
+};
+
+void CountingAgent::on_lpc_flags_read() {
+  flags_read_count_++;
+  wanted_unknown_messages_ = wants_unknown_messages();
+}
+
+conprx::ConsoleAdaptor *CountingAgent::adaptor() {
+  mutex_.lock();
+  adaptor_count_++;
+  mutex_.unlock();
+  return conprx::SimulatedAgent::adaptor();
+}
+
+// Gets the mode of a handle through a frontend a number of times from a thread
+// of its own, optionally with interception disabled on that thread. Failures
+// are counted rather than asserted since they happen off the test's thread.
+class ModeGetter {
+public:
+  ModeGetter(conprx::ConsoleFrontend *frontend, handle_t handle,
+      uint32_t expected, bool disable, size_t count)
+    : frontend_(frontend)
+    , handle_(handle)
+    , expected_(expected)
+    , disable_(disable)
+    , count_(count)
+    , failure_count_(0)
+    , thread_(tclib::new_callback(&ModeGetter::run, this)) { }
+  tclib::NativeThread *thread() { return &thread_; }
+  size_t failure_count() { return failure_count_; }
+
+private:
+  opaque_t run();
+  void get_all();
+
+  conprx::ConsoleFrontend *frontend_;
+  handle_t handle_;
+  uint32_t expected_;
+  bool disable_;
+  size_t count_;
+  size_t failure_count_;
+  tclib::NativeThread thread_;
+};
+
+opaque_t ModeGetter::run() {
+  Interceptor *interceptor = frontend_->interceptor();
+  if (disable_) {
+    Interceptor::Disable disable(interceptor);
+    get_all();
+  } else {
+    get_all();
+  }
+  // The disable is gone and it was only ever this thread's.
+  if (!interceptor->is_enabled())
+    failure_count_++;
+  return o0();
+}
+
+void ModeGetter::get_all() {
+  Interceptor *interceptor = frontend_->interceptor();
+  for (size_t i = 0; i < count_; i++) {
+    if (interceptor->is_enabled() == disable_)
+      failure_count_++;
+    dword_t mode = 0;
+    if (!frontend_->get_console_mode(handle_, &mode) || mode != expected_)
+      failure_count_++;
+  }
+}
+
+TEST(lpc, thread_local_disable) {
+  static const size_t kThreadCount = 8;
+  static const size_t kCallCount = 1000;
+  static const uint32_t kMode = 0x1F7;
+  CountingAgent agent;
+  ASSERT_TRUE(agent.initialize());
+  tclib::def_ref_t<conprx::InMemoryConsolePlatform> platform
+      = conprx::InMemoryConsolePlatform::new_simulating(&agent);
+  tclib::def_ref_t<conprx::ConsoleFrontend> frontend
+      = conprx::ConsoleFrontend::new_simulating(&agent, *platform);
+  Interceptor *interceptor = frontend->interceptor();
+  handle_t handle = reinterpret_cast<handle_t>(static_cast<address_arith_t>(0x3C));
+  platform->set_console_mode(handle, kMode);
+
+  // Every other thread disables interception for the whole run while the
+  // rest call through the same interceptor.
+  ModeGetter *getters[kThreadCount];
+  for (size_t i = 0; i < kThreadCount; i++)
+    getters[i] = new (kDefaultAlloc) ModeGetter(*frontend, handle, kMode,
+        (i % 2) == 1, kCallCount);
+  for (size_t i = 0; i < kThreadCount; i++)
+    ASSERT_TRUE(getters[i]->thread()->start());
+  for (size_t i = 0; i < kThreadCount; i++) {
+    opaque_t result = o0();
+    ASSERT_TRUE(getters[i]->thread()->join(&result));
+    ASSERT_EQ(0, getters[i]->failure_count());
+    tclib::default_delete_concrete(getters[i]);
+  }
+
+  // Only the enabled threads' calls reached the agent's adaptor.
+  ASSERT_EQ(kThreadCount / 2 * kCallCount, agent.adaptor_count());
+  ASSERT_TRUE(interceptor->is_enabled());
+
+  // Disables nest and only affect the interceptor they're for.
+  tclib::def_ref_t<conprx::ConsoleFrontend> other
+      = conprx::ConsoleFrontend::new_simulating(&agent, *platform);
+  {
+    Interceptor::Disable outer(interceptor);
+    ASSERT_FALSE(interceptor->is_enabled());
+    ASSERT_TRUE(other->interceptor()->is_enabled());
+    {
+      Interceptor::Disable inner(other->interceptor());
+      ASSERT_FALSE(interceptor->is_enabled());
+      ASSERT_FALSE(other->interceptor()->is_enabled());
+    }
+    ASSERT_FALSE(interceptor->is_enabled());
+    ASSERT_TRUE(other->interceptor()->is_enabled());
+  }
+  ASSERT_TRUE(interceptor->is_enabled());
+}
+
+TEST(lpc, intercepted_apis) {
+#define __CHECK_INTERCEPTED__(Name, name, NUM, FLAGS)                          \
+  ASSERT_TRUE(InterceptedApis::contains(NUM));
+  FOR_EACH_LPC_TO_INTERCEPT(__CHECK_INTERCEPTED__)
+#undef __CHECK_INTERCEPTED__
+#define __CHECK_NOT_INTERCEPTED__(Name, name, NUM, FLAGS)                      \
+  ASSERT_FALSE(InterceptedApis::contains(NUM));
+  FOR_EACH_OTHER_KNOWN_LPC(__CHECK_NOT_INTERCEPTED__)
+#undef __CHECK_NOT_INTERCEPTED__
+  // The calibration messages and numbers outside the bitmap.
+  ASSERT_FALSE(InterceptedApis::contains(0x1000D));
+  ASSERT_FALSE(InterceptedApis::contains(0xDECADE));
+  ASSERT_FALSE(InterceptedApis::contains(0x2003C));
+  ASSERT_FALSE(InterceptedApis::contains(0x0803C));
+  ASSERT_FALSE(InterceptedApis::contains(0xFFFFFFFF));
+
+  // Nothing else is in the set.
+  size_t count = 0;
+  for (uint32_t server = 0; server < InterceptedApis::kServerCount; server++) {
+    for (uint32_t index = 0; index < InterceptedApis::kIndexCount; index++) {
+      if (InterceptedApis::contains((server << 16) | index))
+        count++;
+    }
+  }
+#define __ADD_ONE__(Name, name, NUM, FLAGS) + 1
+  ASSERT_EQ(0 FOR_EACH_LPC_TO_INTERCEPT(__ADD_ONE__), count);
+#undef __ADD_ONE__
+}
+
+// A get_console_mode message to send straight to an agent's message handler.
+class GetModeMessage {
+public:
+  GetModeMessage(Interceptor *interceptor, handle_t handle);
+  ConsoleMessage *operator->() { return &message_; }
+  ConsoleMessage *operator*() { return &message_; }
+  uint32_t mode() { return data_.payload.get_console_mode.mode; }
+private:
+  console_message_t data_;
+  ConsoleMessage message_;
+};
+
+GetModeMessage::GetModeMessage(Interceptor *interceptor, handle_t handle)
+  : message_(NULL, &data_, &data_, interceptor, AddressXform(),
+      Message::mdConsole) {
+  struct_zero_fill(data_);
+  data_.relevant.api_number = conprx::ConsoleAgent::lmGetConsoleMode;
+  size_t data_length = message_data_length_from_payload_length(
+      sizeof(get_console_mode_m));
+  data_.relevant.generic.u1.s1.data_length = static_cast<uint16_t>(data_length);
+  size_t total_length = total_message_length_from_data_length(data_length);
+  data_.relevant.generic.u1.s1.total_length = static_cast<uint16_t>(total_length);
+  data_.payload.get_console_mode.handle = handle;
+}
+
+TEST(lpc, runtime_flags) {
+  static const uint32_t kMode = 0x2A;
+  ASSERT_TRUE(conprx::ConsoleAgent::liCount <= 32);
+  CountingAgent agent;
+  ASSERT_TRUE(agent.initialize());
+  tclib::def_ref_t<conprx::InMemoryConsolePlatform> platform
+      = conprx::InMemoryConsolePlatform::new_simulating(&agent);
+  tclib::def_ref_t<conprx::ConsoleFrontend> frontend
+      = conprx::ConsoleFrontend::new_simulating(&agent, *platform);
+  handle_t handle = reinterpret_cast<handle_t>(static_cast<address_arith_t>(0x3C));
+  platform->set_console_mode(handle, kMode);
+  GetModeMessage message(frontend->interceptor(), handle);
+
+  // By default the message goes to the adaptor.
+  ASSERT_TRUE(agent.on_message(*message).is_success());
+  ASSERT_EQ(kMode, message.mode());
+  ASSERT_EQ(1, agent.adaptor_count());
+
+  // Delegating it makes it go straight to the native backend.
+  agent.options()->set_delegate_lpcs(1 << conprx::ConsoleAgent::liGetConsoleMode);
+  agent.read_lpc_flags();
+  ASSERT_TRUE(agent.on_message(*message).is_success());
+  ASSERT_EQ(kMode, message.mode());
+  ASSERT_EQ(1, agent.adaptor_count());
+
+  // Delegating other messages doesn't affect it.
+  agent.options()->set_delegate_lpcs(1 << conprx::ConsoleAgent::liSetConsoleMode);
+  agent.read_lpc_flags();
+  ASSERT_TRUE(agent.on_message(*message).is_success());
+  ASSERT_EQ(2, agent.adaptor_count());
+
+  ASSERT_FALSE(agent.wants_unknown_messages());
+  ASSERT_FALSE(agent.wanted_unknown_messages());
+  agent.options()->set_dump_unknown_lpcs(true);
+  agent.read_lpc_flags();
+  ASSERT_TRUE(agent.wants_unknown_messages());
+  // The platform sees every re-read, not just the one at install time.
+  ASSERT_EQ(3, agent.flags_read_count());
+  ASSERT_TRUE(agent.wanted_unknown_messages());
+}
@@ -0,0 +1,154 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+#include "share/shmring.hh"
+#include "test/asserts.hh"
+#include "test/unittest.hh"
+
+using namespace conprx;
+using namespace tclib;
+
+// Returns a blob over the given array.
+template <typename T, size_t N>
+static Blob blob_of(T (&array)[N]) {
+  return Blob(array, sizeof(array));
+}
+
+TEST(shmring, simple) {
+  uint8_t memory[sizeof(shared_ring_header_t) + 16];
+  SharedRing ring;
+  ring.initialize(blob_of(memory), true);
+  ASSERT_EQ(16, ring.capacity());
+
+  uint8_t data[6] = {1, 2, 3, 4, 5, 6};
+  RingSlice first;
+  ASSERT_TRUE(ring.write(Blob(data, 6), &first));
+  ASSERT_EQ(0, first.offset());
+  ASSERT_EQ(6, first.size());
+  RingSlice second;
+  ASSERT_TRUE(ring.write(Blob(data, 6), &second));
+  ASSERT_EQ(6, second.offset());
+
+  // There are only 4 bytes before the end of the memory so a 6-byte payload
+  // has to skip to the start which isn't free yet.
+  RingSlice third;
+  ASSERT_FALSE(ring.write(Blob(data, 6), &third));
+
+  Blob view;
+  ASSERT_TRUE(ring.read(&first, &view));
+  ASSERT_BLOBEQ(Blob(data, 6), view);
+  ring.release(&first);
+
+  // Now the start is free so the payload fits there.
+  ASSERT_TRUE(ring.write(Blob(data + 1, 5), &third));
+  ASSERT_EQ(16, third.offset());
+  ASSERT_TRUE(ring.read(&third, &view));
+  ASSERT_BLOBEQ(Blob(data + 1, 5), view);
+
+  // Releasing the last slice releases the one before it too.
+  ring.release(&third);
+  ASSERT_FALSE(ring.read(&second, &view));
+  RingSlice fourth;
+  ASSERT_TRUE(ring.write(Blob(data, 6), &fourth));
+}
+
+TEST(shmring, invalid_slices) {
+  uint8_t memory[sizeof(shared_ring_header_t) + 16];
+  SharedRing ring;
+  ring.initialize(blob_of(memory), true);
+  uint8_t data[4] = {1, 2, 3, 4};
+  RingSlice slice;
+  ASSERT_TRUE(ring.write(Blob(data, 4), &slice));
+  Blob view;
+  // Past what's been written.
+  RingSlice beyond(2, 4);
+  ASSERT_FALSE(ring.read(&beyond, &view));
+  // Wraps around the end.
+  RingSlice wrapping(14, 4);
+  ASSERT_FALSE(ring.read(&wrapping, &view));
+  // Too big to ever fit.
+  uint8_t big[17];
+  ASSERT_FALSE(ring.write(blob_of(big), &slice));
+}
+
+TEST(shmring, reserve_commit) {
+  uint8_t memory[sizeof(shared_ring_header_t) + 16];
+  SharedRing ring;
+  ring.initialize(blob_of(memory), true);
+  Blob space;
+  ASSERT_TRUE(ring.reserve(10, &space));
+  ASSERT_EQ(10, space.size());
+  static_cast<uint8_t*>(space.start())[0] = 7;
+  static_cast<uint8_t*>(space.start())[1] = 8;
+  // Only what's committed becomes visible and takes up room.
+  RingSlice slice;
+  ring.commit(2, &slice);
+  ASSERT_EQ(0, slice.offset());
+  ASSERT_EQ(2, slice.size());
+  Blob view;
+  ASSERT_TRUE(ring.read(&slice, &view));
+  ASSERT_EQ(7, static_cast<uint8_t*>(view.start())[0]);
+  ASSERT_EQ(8, static_cast<uint8_t*>(view.start())[1]);
+  ASSERT_TRUE(ring.reserve(14, &space));
+  ASSERT_FALSE(ring.reserve(15, &space));
+  // A reservation that isn't committed can just be abandoned.
+  RingSlice next;
+  ASSERT_TRUE(ring.reserve(3, &space));
+  ring.commit(3, &next);
+  ASSERT_EQ(2, next.offset());
+}
+
+TEST(shmring, transport) {
+  SharedRingTransport owner;
+  ASSERT_F_TRUE(owner.create(4096));
+  SharedRingTransport agent;
+  ASSERT_F_TRUE(agent.open(owner.memory()->name(), 4096));
+
+  uint8_t data[300];
+  for (size_t i = 0; i < 300; i++)
+    data[i] = static_cast<uint8_t>(i);
+
+  // Agent to owner.
+  RingSlice up;
+  ASSERT_TRUE(agent.up()->write(blob_of(data), &up));
+  Blob view;
+  ASSERT_TRUE(owner.up()->read(&up, &view));
+  ASSERT_BLOBEQ(blob_of(data), view);
+  owner.up()->release(&up);
+
+  // Owner to agent.
+  RingSlice down;
+  ASSERT_TRUE(owner.down()->write(Blob(data, 100), &down));
+  ASSERT_TRUE(agent.down()->read(&down, &view));
+  ASSERT_BLOBEQ(Blob(data, 100), view);
+  agent.down()->release(&down);
+}
+
+TEST(shmring, state_page) {
+  uint64_t memory[ConsoleStatePage::kSize / sizeof(uint64_t)];
+  ConsoleStatePage page;
+  page.initialize(Blob(memory, sizeof(memory)), true);
+  console_state_t state;
+  // Nothing has been published yet.
+  ASSERT_FALSE(page.read(&state));
+
+  console_state_t published;
+  memset(&published, 0, sizeof(published));
+  published.input_codepage = 437;
+  published.output_codepage = 65001;
+  published.handles[1].handle = 0x1b;
+  published.handles[1].mode = 3;
+  page.publish(&published);
+  ASSERT_TRUE(page.read(&state));
+  ASSERT_EQ(437, state.input_codepage);
+  ASSERT_EQ(65001, state.output_codepage);
+  console_handle_state_t *output = ConsoleStatePage::find_handle(&state, Handle(0x1b));
+  ASSERT_TRUE(output != NULL);
+  ASSERT_EQ(3, output->mode);
+  ASSERT_TRUE(ConsoleStatePage::find_handle(&state, Handle(0x1f)) == NULL);
+
+  page.invalidate();
+  ASSERT_FALSE(page.read(&state));
+  page.publish(&published);
+  ASSERT_TRUE(page.read(&state));
+}
@@ -28,3 +28,57 @@ TEST(string, msdos_codec) {
     }
   }
 }
+
+// Encodes the given wide characters as utf-8, checks that they encode to the
+// expected bytes, and that they decode back to what they were.
+static void check_utf8(const wide_char_t *chars, size_t length,
+    const uint8_t *expected, size_t expected_size) {
+  uint8_t bytes[64];
+  size_t size = Utf8Codec::encode(chars, length, bytes);
+  ASSERT_EQ(expected_size, size);
+  ASSERT_EQ(0, memcmp(expected, bytes, size));
+  ASSERT_EQ(expected_size, Utf8Codec::encoded_size(chars, length));
+  ASSERT_EQ(length, Utf8Codec::decoded_length(bytes, size));
+  wide_char_t decoded[32];
+  ASSERT_EQ(length, Utf8Codec::decode(bytes, size, decoded, 32));
+  ASSERT_EQ(0, memcmp(chars, decoded, length * sizeof(wide_char_t)));
+}
+
+TEST(string, utf8_codec) {
+  // Long enough to go through the word-at-a-time ascii path.
+  const wide_char_t ascii[11] = {'H', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l'};
+  const uint8_t ascii_bytes[11] = {'H', 'e', 'l', 'l', 'o', ',', ' ', 'w', 'o', 'r', 'l'};
+  check_utf8(ascii, 11, ascii_bytes, 11);
+  // Two and three byte characters mixed with ascii.
+  const wide_char_t mixed[4] = {'a', 0x00e6, 0x2500, 'b'};
+  const uint8_t mixed_bytes[7] = {'a', 0xc3, 0xa6, 0xe2, 0x94, 0x80, 'b'};
+  check_utf8(mixed, 4, mixed_bytes, 7);
+  // A surrogate pair becomes a single four byte character.
+  const wide_char_t pair[2] = {0xd83d, 0xde00};
+  const uint8_t pair_bytes[4] = {0xf0, 0x9f, 0x98, 0x80};
+  check_utf8(pair, 2, pair_bytes, 4);
+  // Unpaired surrogates are kept as they are.
+  const wide_char_t lone[3] = {0xde00, 'x', 0xd83d};
+  const uint8_t lone_bytes[7] = {0xed, 0xb8, 0x80, 'x', 0xed, 0xa0, 0xbd};
+  check_utf8(lone, 3, lone_bytes, 7);
+}
+
+TEST(string, utf8_decode_limits) {
+  // Decoding stops before a character that doesn't fit, including both
+  // halves of a pair.
+  const uint8_t bytes[9] = {'a', 'b', 0xf0, 0x9f, 0x98, 0x80, 'c', 0xff, 'd'};
+  wide_char_t decoded[8];
+  ASSERT_EQ(2, Utf8Codec::decode(bytes, 9, decoded, 3));
+  ASSERT_EQ(4, Utf8Codec::decode(bytes, 9, decoded, 4));
+  ASSERT_EQ(0xd83d, decoded[2]);
+  ASSERT_EQ(0xde00, decoded[3]);
+  // Malformed bytes decode as the replacement character, as does each byte of
+  // a character that is cut off.
+  ASSERT_EQ(7, Utf8Codec::decode(bytes, 9, decoded, 8));
+  ASSERT_EQ(0xfffd, decoded[5]);
+  ASSERT_EQ('d', decoded[6]);
+  ASSERT_EQ(7, Utf8Codec::decoded_length(bytes, 9));
+  ASSERT_EQ(4, Utf8Codec::decode(bytes, 4, decoded, 8));
+  ASSERT_EQ(0xfffd, decoded[2]);
+  ASSERT_EQ(0xfffd, decoded[3]);
+}
@@ -0,0 +1,72 @@
+//- Copyright 2016 the Neutrino authors (see AUTHORS).
+//- Licensed under the Apache License, Version 2.0 (see LICENSE).
+
+// Wall-clock timing for the benchmarks that compare the performance of
+// different ways of doing the same thing. The numbers just get logged, they
+// don't fail if they look bad since the test machines are too noisy for that.
+
+#ifndef _CONPRX_TIMER_HH
+#define _CONPRX_TIMER_HH
+
+#include "c/stdc.h"
+
+#ifndef IS_MSVC
+#include <time.h>
+#endif
+
+namespace conprx {
+
+// Measures elapsed wall-clock time from when it was created or last reset.
+class WallClockTimer {
+public:
+  WallClockTimer() { reset(); }
+
+  // Starts measuring from now.
+  void reset() { start_ = now_nanos(); }
+
+  // Returns the number of nanoseconds since the timer was last reset.
+  uint64_t elapsed_nanos() { return now_nanos() - start_; }
+
+  // Returns the number of microseconds since the timer was last reset.
+  uint64_t elapsed_micros() { return elapsed_nanos() / 1000; }
+
+  // Returns the throughput in megabytes per second of processing the given
+  // number of bytes in the time since the timer was reset.
+  double megabytes_per_second(uint64_t bytes) {
+    uint64_t nanos = elapsed_nanos();
+    if (nanos == 0)
+      return 0;
+    return (static_cast<double>(bytes) / (1024.0 * 1024.0))
+        / (static_cast<double>(nanos) / 1000000000.0);
+  }
+
+  // Returns the current time of a monotonic clock in nanoseconds.
+  static uint64_t now_nanos();
+
+private:
+  uint64_t start_;
+};
+
+#ifdef IS_MSVC
+
+inline uint64_t WallClockTimer::now_nanos() {
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return static_cast<uint64_t>(counter.QuadPart * 1000000000.0 / frequency.QuadPart);
+}
+
+#else
+
+inline uint64_t WallClockTimer::now_nanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+#endif
+
+} // namespace conprx
+
+#endif // _CONPRX_TIMER_HH